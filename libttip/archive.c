@@ -0,0 +1,571 @@
+/*
+ * Copyright (C) 2012 Dmitry Marakasov
+ *
+ * This file is part of libttip.
+ *
+ * libttip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libttip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libttip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_MMAP
+#	define _POSIX_C_SOURCE 200809L /* for mmap() */
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_MMAP
+#	include <fcntl.h>
+#	include <sys/mman.h>
+#	include <sys/stat.h>
+#	include <unistd.h>
+#endif
+
+#include <ttip_int.h>
+
+/*
+ * Tile archive layout, all numbers are little endian:
+ *
+ *   header     "TTIPARC1", 8 reserved bytes
+ *   tiles      encoded tiles, back to back
+ *   directory  24 byte entries sorted by (zoom, x, y):
+ *              zoom, x, y, size as uint32, offset as uint64
+ *   footer     directory offset and number of entries as uint64,
+ *              "TTIPDIR1"
+ */
+
+#define HEADER_MAGIC "TTIPARC1"
+#define FOOTER_MAGIC "TTIPDIR1"
+
+#define HEADER_SIZE 16
+#define ENTRY_SIZE 24
+#define FOOTER_SIZE 24
+
+/* initial size of hash of unique tile contents */
+#define DEDUP_MIN_BUCKETS 1024
+
+/* contents of small blobs, and of ones seen repeated, are kept in
+ * memory up to total size, so duplicates are compared without
+ * reading them back */
+#define DEDUP_KEEP_SMALL 1024
+#define DEDUP_KEEP_BYTES (16 << 20)
+
+struct ttip_archive {
+	const unsigned char* data;
+	size_t size;
+	int mapped;
+
+	const unsigned char* directory;
+	size_t nentries;
+	uint64_t tiles_end;       /* tiles must not extend into directory */
+};
+
+/* tile added to writer, in order of addition */
+struct writer_entry {
+	uint32_t zoom, x, y, size;
+	uint64_t offset;
+	size_t seq;
+};
+
+/* unique tile content which was written */
+struct writer_blob {
+	uint64_t hash;
+	uint64_t offset;
+	uint32_t size;
+	unsigned char* data;      /* kept copy, NULL if it's only in file */
+};
+
+struct ttip_archive_writer {
+	FILE* file;
+	char* filename;
+	char* tmpfilename;
+	uint64_t offset;          /* end of written data */
+	int error;                /* first write error, archive is not finished after it */
+
+	struct writer_entry* entries;
+	size_t nentries;
+	size_t entries_capacity;
+
+	/* open addressing hash of unique contents */
+	struct writer_blob* blobs;
+	size_t nblobs;
+	size_t nbuckets;
+
+	ttip_buffer_t verify;     /* data read back to compare with duplicate */
+	size_t kept;              /* bytes of kept blob copies */
+
+	ttip_archive_stats_t stats;
+};
+
+static uint32_t get_u32(const unsigned char* p) {
+	return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t get_u64(const unsigned char* p) {
+	return (uint64_t)get_u32(p) | (uint64_t)get_u32(p + 4) << 32;
+}
+
+static void put_u32(unsigned char* p, uint32_t value) {
+	p[0] = value;
+	p[1] = value >> 8;
+	p[2] = value >> 16;
+	p[3] = value >> 24;
+}
+
+static void put_u64(unsigned char* p, uint64_t value) {
+	put_u32(p, value);
+	put_u32(p + 4, value >> 32);
+}
+
+/* reader */
+static int compare_key(const unsigned char* entry, uint32_t zoom, uint32_t x, uint32_t y) {
+	uint32_t ezoom = get_u32(entry), ex = get_u32(entry + 4), ey = get_u32(entry + 8);
+	if (ezoom != zoom)
+		return ezoom < zoom ? -1 : 1;
+	if (ex != x)
+		return ex < x ? -1 : 1;
+	if (ey != y)
+		return ey < y ? -1 : 1;
+	return 0;
+}
+
+/* index of the first entry not less than given tile */
+static size_t lower_bound(struct ttip_archive* archive, uint32_t zoom, uint32_t x, uint32_t y) {
+	size_t lo = 0, hi = archive->nentries;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (compare_key(archive->directory + mid * ENTRY_SIZE, zoom, x, y) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static ttip_result_t load_file(struct ttip_archive* archive, const char* filename) {
+#ifdef HAVE_MMAP
+	int fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return errno;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		int ret = errno;
+		close(fd);
+		return ret;
+	}
+
+	archive->size = st.st_size;
+	if (archive->size >= HEADER_SIZE + FOOTER_SIZE) {
+		void* data = mmap(NULL, archive->size, PROT_READ, MAP_SHARED, fd, 0);
+		if (data == MAP_FAILED) {
+			int ret = errno;
+			close(fd);
+			return ret;
+		}
+		archive->data = data;
+		archive->mapped = 1;
+	}
+
+	close(fd);
+
+	return TTIP_OK;
+#else
+	/* read whole file where it can't be mapped */
+	FILE* f = fopen(filename, "rb");
+	if (f == NULL)
+		return errno;
+
+	ttip_buffer_t buffer;
+	ttip_buffer_init(&buffer);
+
+	ttip_result_t ret = TTIP_OK;
+	size_t nread;
+	do {
+		if ((ret = ttip_buffer_reserve(&buffer, buffer.size + 65536)) != TTIP_OK)
+			break;
+		nread = fread(buffer.data + buffer.size, 1, buffer.capacity - buffer.size, f);
+		buffer.size += nread;
+	} while (nread > 0);
+
+	if (ret == TTIP_OK && ferror(f))
+		ret = EIO;
+	fclose(f);
+
+	if (ret != TTIP_OK) {
+		ttip_buffer_free(&buffer);
+		return ret;
+	}
+
+	archive->data = buffer.data;
+	archive->size = buffer.size;
+
+	return TTIP_OK;
+#endif
+}
+
+void ttip_archive_close(ttip_archive_t* archive) {
+	if (*archive == NULL)
+		return;
+
+#ifdef HAVE_MMAP
+	if ((*archive)->mapped)
+		munmap((void*)(*archive)->data, (*archive)->size);
+#else
+	free((void*)(*archive)->data);
+#endif
+
+	free(*archive);
+	*archive = NULL;
+}
+
+ttip_result_t ttip_archive_open(ttip_archive_t* output, const char* filename) {
+	struct ttip_archive* archive = calloc(1, sizeof(struct ttip_archive));
+	if (archive == NULL)
+		return errno;
+
+	ttip_result_t ret;
+	if ((ret = load_file(archive, filename)) != TTIP_OK) {
+		free(archive);
+		return ret;
+	}
+
+	/* check that header, directory and footer are in place */
+	ret = TTIP_BAD_ARCHIVE;
+	if (archive->data == NULL || archive->size < HEADER_SIZE + FOOTER_SIZE)
+		goto fail;
+
+	const unsigned char* footer = archive->data + archive->size - FOOTER_SIZE;
+	if (memcmp(archive->data, HEADER_MAGIC, 8) != 0 || memcmp(footer + 16, FOOTER_MAGIC, 8) != 0)
+		goto fail;
+
+	uint64_t diroffset = get_u64(footer);
+	uint64_t nentries = get_u64(footer + 8);
+	if (diroffset < HEADER_SIZE || diroffset > archive->size - FOOTER_SIZE ||
+			nentries != (archive->size - FOOTER_SIZE - diroffset) / ENTRY_SIZE ||
+			(archive->size - FOOTER_SIZE - diroffset) % ENTRY_SIZE != 0)
+		goto fail;
+
+	archive->directory = archive->data + diroffset;
+	archive->nentries = nentries;
+	archive->tiles_end = diroffset;
+
+	*output = archive;
+	return TTIP_OK;
+
+fail:
+	ttip_archive_close(&archive);
+	return ret;
+}
+
+ttip_result_t ttip_archive_get(ttip_archive_t archive, int zoom, int x, int y, const unsigned char** data, size_t* size) {
+	if (zoom < 0 || x < 0 || y < 0)
+		return ENOENT;
+
+	size_t pos = lower_bound(archive, zoom, x, y);
+	if (pos == archive->nentries)
+		return ENOENT;
+
+	const unsigned char* entry = archive->directory + pos * ENTRY_SIZE;
+	if (compare_key(entry, zoom, x, y) != 0)
+		return ENOENT;
+
+	/* directory is only checked for tiles which are used */
+	uint64_t tilesize = get_u32(entry + 12);
+	uint64_t offset = get_u64(entry + 16);
+	if (offset < HEADER_SIZE || offset > archive->tiles_end || tilesize > archive->tiles_end - offset)
+		return TTIP_BAD_ARCHIVE;
+
+	*data = archive->data + offset;
+	*size = tilesize;
+
+	return TTIP_OK;
+}
+
+ttip_result_t ttip_archive_list(ttip_archive_t archive, int zoom, void (*callback)(int x, int y, void* arg), void* arg) {
+	if (zoom < 0)
+		return TTIP_BAD_ARGUMENT;
+
+	for (size_t pos = lower_bound(archive, zoom, 0, 0); pos < archive->nentries; pos++) {
+		const unsigned char* entry = archive->directory + pos * ENTRY_SIZE;
+		if (get_u32(entry) != (uint32_t)zoom)
+			break;
+
+		callback(get_u32(entry + 4), get_u32(entry + 8), arg);
+	}
+
+	return TTIP_OK;
+}
+
+/* writer */
+static int write_data(struct ttip_archive_writer* writer, const void* data, size_t size) {
+	if (size > 0 && fwrite(data, size, 1, writer->file) != 1)
+		return errno ? errno : EIO;
+
+	writer->offset += size;
+	return 0;
+}
+
+static struct writer_blob* find_blob(struct ttip_archive_writer* writer, uint64_t hash) {
+	for (size_t i = hash & (writer->nbuckets - 1); ; i = (i + 1) & (writer->nbuckets - 1))
+		if (writer->blobs[i].size == 0 || writer->blobs[i].hash == hash)
+			return &writer->blobs[i];
+}
+
+static ttip_result_t grow_blobs(struct ttip_archive_writer* writer) {
+	struct writer_blob* old = writer->blobs;
+	size_t noldbuckets = writer->nbuckets;
+
+	size_t nbuckets = noldbuckets ? noldbuckets * 2 : DEDUP_MIN_BUCKETS;
+	if ((writer->blobs = calloc(nbuckets, sizeof(struct writer_blob))) == NULL) {
+		writer->blobs = old;
+		return errno;
+	}
+	writer->nbuckets = nbuckets;
+
+	for (size_t i = 0; i < noldbuckets; i++)
+		if (old[i].size != 0)
+			*find_blob(writer, old[i].hash) = old[i];
+
+	free(old);
+	return TTIP_OK;
+}
+
+static void keep_blob(struct ttip_archive_writer* writer, struct writer_blob* blob, const void* data) {
+	if (writer->kept + blob->size > DEDUP_KEEP_BYTES || (blob->data = malloc(blob->size)) == NULL)
+		return;
+
+	memcpy(blob->data, data, blob->size);
+	writer->kept += blob->size;
+}
+
+/* check that blob has the same data, as hashes may collide */
+static int is_same_blob(struct ttip_archive_writer* writer, struct writer_blob* blob, const void* data, size_t size) {
+	if (blob->size != size)
+		return 0;
+
+	if (blob->data != NULL)
+		return memcmp(blob->data, data, size) == 0;
+
+	if (ttip_buffer_reserve(&writer->verify, size) != TTIP_OK)
+		return 0;
+
+	int same = fflush(writer->file) == 0 &&
+		fseek(writer->file, blob->offset, SEEK_SET) == 0 &&
+		fread(writer->verify.data, size, 1, writer->file) == 1 &&
+		memcmp(writer->verify.data, data, size) == 0;
+
+	/* position is restored even if comparison failed */
+	if (fseek(writer->file, writer->offset, SEEK_SET) != 0 && writer->error == 0)
+		writer->error = errno ? errno : EIO;
+
+	/* repeated content is likely to repeat again */
+	if (same)
+		keep_blob(writer, blob, data);
+
+	return same;
+}
+
+void ttip_archive_writer_destroy(ttip_archive_writer_t* writer) {
+	if (*writer == NULL)
+		return;
+
+	if ((*writer)->file != NULL) {
+		fclose((*writer)->file);
+		remove((*writer)->tmpfilename);
+	}
+
+	free((*writer)->filename);
+	free((*writer)->tmpfilename);
+	free((*writer)->entries);
+	if ((*writer)->blobs != NULL)
+		for (size_t i = 0; i < (*writer)->nbuckets; i++)
+			free((*writer)->blobs[i].data);
+	free((*writer)->blobs);
+	ttip_buffer_free(&(*writer)->verify);
+	free(*writer);
+	*writer = NULL;
+}
+
+ttip_result_t ttip_archive_writer_create(ttip_archive_writer_t* output, const char* filename) {
+	struct ttip_archive_writer* writer = calloc(1, sizeof(struct ttip_archive_writer));
+	if (writer == NULL)
+		return errno;
+
+	ttip_result_t ret;
+	size_t len = strlen(filename);
+	if ((writer->filename = malloc(len + 1)) == NULL || (writer->tmpfilename = malloc(len + 5)) == NULL) {
+		ret = errno;
+		goto fail;
+	}
+	memcpy(writer->filename, filename, len + 1);
+	memcpy(writer->tmpfilename, filename, len);
+	memcpy(writer->tmpfilename + len, ".tmp", 5);
+
+	if ((ret = grow_blobs(writer)) != TTIP_OK)
+		goto fail;
+
+	/* archive replaces target only when it's complete */
+	if ((writer->file = fopen(writer->tmpfilename, "w+b")) == NULL) {
+		ret = errno;
+		goto fail;
+	}
+
+	unsigned char header[HEADER_SIZE] = { 0 };
+	memcpy(header, HEADER_MAGIC, 8);
+	if ((ret = write_data(writer, header, sizeof(header))) != 0)
+		goto fail;
+
+	*output = writer;
+	return TTIP_OK;
+
+fail:
+	ttip_archive_writer_destroy(&writer);
+	return ret;
+}
+
+ttip_result_t ttip_archive_writer_add(ttip_archive_writer_t writer, int zoom, int x, int y, const void* data, size_t size) {
+	if (zoom < 0 || x < 0 || y < 0 || size == 0 || size > UINT32_MAX)
+		return TTIP_BAD_ARGUMENT;
+
+	if (writer->error != 0)
+		return writer->error;
+
+	if (writer->nentries == writer->entries_capacity) {
+		size_t capacity = writer->entries_capacity ? writer->entries_capacity * 2 : 1024;
+		struct writer_entry* entries = realloc(writer->entries, capacity * sizeof(struct writer_entry));
+		if (entries == NULL)
+			return errno;
+		writer->entries = entries;
+		writer->entries_capacity = capacity;
+	}
+
+	/* identical tiles (sea, land) are stored once */
+	uint64_t hash = ttip_hash_finish(ttip_hash_update(ttip_hash_init(), data, size));
+	struct writer_blob* blob = find_blob(writer, hash);
+
+	uint64_t offset;
+	if (blob->size != 0 && is_same_blob(writer, blob, data, size)) {
+		offset = blob->offset;
+	} else {
+		offset = writer->offset;
+
+		int ret;
+		if ((ret = write_data(writer, data, size)) != 0)
+			return writer->error = ret;
+
+		/* hash is kept at most half full, so lookups terminate; if it
+		 * can't grow, new contents are just not deduplicated */
+		if (blob->size == 0 && (writer->nblobs + 1) * 2 > writer->nbuckets)
+			blob = grow_blobs(writer) == TTIP_OK ? find_blob(writer, hash) : NULL;
+
+		/* colliding blob is kept, new content is just not deduplicated */
+		if (blob != NULL && blob->size == 0) {
+			blob->hash = hash;
+			blob->offset = offset;
+			blob->size = size;
+
+			if (size <= DEDUP_KEEP_SMALL)
+				keep_blob(writer, blob, data);
+
+			writer->nblobs++;
+		}
+
+		writer->stats.unique++;
+		writer->stats.bytes += size;
+	}
+
+	struct writer_entry* entry = &writer->entries[writer->nentries];
+	entry->zoom = zoom;
+	entry->x = x;
+	entry->y = y;
+	entry->size = size;
+	entry->offset = offset;
+	entry->seq = writer->nentries++;
+
+	writer->stats.tiles++;
+
+	return TTIP_OK;
+}
+
+static int compare_entries(const void* a, const void* b) {
+	const struct writer_entry* ea = a;
+	const struct writer_entry* eb = b;
+
+	if (ea->zoom != eb->zoom)
+		return ea->zoom < eb->zoom ? -1 : 1;
+	if (ea->x != eb->x)
+		return ea->x < eb->x ? -1 : 1;
+	if (ea->y != eb->y)
+		return ea->y < eb->y ? -1 : 1;
+	return ea->seq < eb->seq ? -1 : ea->seq > eb->seq;
+}
+
+static int is_same_tile(const struct writer_entry* a, const struct writer_entry* b) {
+	return a->zoom == b->zoom && a->x == b->x && a->y == b->y;
+}
+
+ttip_result_t ttip_archive_writer_finish(ttip_archive_writer_t* writer) {
+	struct ttip_archive_writer* w = *writer;
+	ttip_result_t ret = w->error;
+
+	if (w->nentries > 0)
+		qsort(w->entries, w->nentries, sizeof(struct writer_entry), compare_entries);
+
+	/* tile added more than once is replaced by the last one */
+	size_t nunique = 0;
+	for (size_t i = 0; i < w->nentries; i++) {
+		if (nunique > 0 && is_same_tile(&w->entries[i], &w->entries[nunique - 1]))
+			nunique--;
+		w->entries[nunique++] = w->entries[i];
+	}
+
+	uint64_t diroffset = w->offset;
+	for (size_t i = 0; i < nunique && ret == 0; i++) {
+		unsigned char entry[ENTRY_SIZE];
+		put_u32(entry, w->entries[i].zoom);
+		put_u32(entry + 4, w->entries[i].x);
+		put_u32(entry + 8, w->entries[i].y);
+		put_u32(entry + 12, w->entries[i].size);
+		put_u64(entry + 16, w->entries[i].offset);
+		ret = write_data(w, entry, sizeof(entry));
+	}
+
+	if (ret == 0) {
+		unsigned char footer[FOOTER_SIZE];
+		put_u64(footer, diroffset);
+		put_u64(footer + 8, nunique);
+		memcpy(footer + 16, FOOTER_MAGIC, 8);
+		ret = write_data(w, footer, sizeof(footer));
+	}
+
+	if (fclose(w->file) != 0 && ret == 0)
+		ret = errno;
+	w->file = NULL;
+
+	if (ret == 0 && rename(w->tmpfilename, w->filename) != 0)
+		ret = errno;
+
+	if (ret != 0)
+		remove(w->tmpfilename);
+
+	ttip_archive_writer_destroy(writer);
+
+	return ret;
+}
+
+void ttip_archive_writer_getstats(ttip_archive_writer_t writer, ttip_archive_stats_t* stats) {
+	*stats = writer->stats;
+}
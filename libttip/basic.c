@@ -23,44 +23,119 @@
 
 #include <ttip_int.h>
 
-ttip_result_t ttip_create(ttip_image_t* output, int width, int height, ttip_format_t format) {
-	if (width <= 0)
-		return TTIP_BAD_DIMENSIONS;
-
-	if (height <= 0)
-		return TTIP_BAD_DIMENSIONS;
-
-	if (ttip_getbpp(format) == 0)
-		return TTIP_BAD_PIXEL_FORMAT;
+struct ttip_image* ttip_alloc_image(int width, int height, ttip_format_t format, int alignment) {
+	size_t stridesize = ttip_alignsize(width * ttip_getbpp(format), alignment);
 
-	size_t stridesize = ttip_alignstride(width * ttip_getbpp(format));
-
-	struct ttip_image* newtile = malloc(sizeof(struct ttip_image));
+	/* header and pixel data are allocated in a single block, with
+	 * extra space to align pixel data as malloc() doesn't */
+	size_t allocsize = sizeof(struct ttip_image) + alignment - 1 + stridesize * height;
+	struct ttip_image* newtile = malloc(allocsize);
 	if (newtile == NULL)
-		return errno;
-
-	unsigned char* data = malloc(stridesize * height);
-	if (data == NULL) {
-		int saved_errno = errno;
-		free(newtile);
-		return saved_errno;
-	}
+		return NULL;
 
 	newtile->width = width;
 	newtile->height = height;
 	newtile->stride = stridesize;
 	newtile->format = format;
-	newtile->data = data;
+	newtile->data = (unsigned char*)ttip_alignsize((size_t)(newtile + 1), alignment);
+
+	newtile->alignment = alignment;
+	newtile->allocformat = format;
+	newtile->allocsize = allocsize;
+	newtile->pool = NULL;
+	newtile->next = NULL;
+
+	newtile->uniform = 0;
+	newtile->color = 0;
+	newtile->extdata = NULL;
+
+	return newtile;
+}
+
+void ttip_setuniform(struct ttip_image* image, ttip_color_t color) {
+	int bpp = ttip_getbpp(image->format);
+	int x;
+
+	for (x = 0; x < image->width; x++)
+		ttip_writepixel(image->data + x * bpp, color, image->format);
+
+	/* drop bits not used by format */
+	image->color = ttip_readpixel(image->data, image->format);
+}
+
+ttip_result_t ttip_materialize(struct ttip_image* image) {
+	if (!image->uniform)
+		return TTIP_OK;
+
+	/* extra space to align pixel data, as in ttip_alloc_image() */
+	unsigned char* extdata = malloc((size_t)image->stride * image->height + image->alignment - 1);
+	if (extdata == NULL)
+		return errno;
+
+	unsigned char* data = (unsigned char*)ttip_alignsize((size_t)extdata, image->alignment);
+
+	int y;
+	for (y = 0; y < image->height; y++)
+		memcpy(data + (size_t)image->stride * y, image->data, image->width * ttip_getbpp(image->format));
 
-	*output = newtile;
+	image->data = data;
+	image->extdata = extdata;
+	image->uniform = 0;
 
 	return TTIP_OK;
 }
 
+int ttip_isuniform(ttip_image_t image, ttip_color_t* color) {
+	if (image->uniform && color != NULL)
+		*color = image->color;
+
+	return image->uniform;
+}
+
+ttip_result_t ttip_detect_uniform(ttip_image_t* image) {
+	struct ttip_image* source = *image;
+	int bpp = ttip_getbpp(source->format);
+	int x, y;
+
+	if (source->uniform)
+		return TTIP_OK;
+
+	/* first row should consist of the first pixel, and all other rows be the same as the first */
+	for (x = 1; x < source->width; x++)
+		if (memcmp(source->data + x * bpp, source->data, bpp) != 0)
+			return TTIP_OK;
+
+	for (y = 1; y < source->height; y++)
+		if (memcmp(source->data + (size_t)source->stride * y, source->data, source->width * bpp) != 0)
+			return TTIP_OK;
+
+	int ret;
+	struct ttip_image* uniform;
+	if ((ret = ttip_create_uniform(&uniform, source->width, source->height, source->format, ttip_readpixel(source->data, source->format), source->pool)) != TTIP_OK)
+		return ret;
+
+	ttip_destroy(image);
+	*image = uniform;
+
+	return TTIP_OK;
+}
+
+ttip_result_t ttip_create(ttip_image_t* output, int width, int height, ttip_format_t format) {
+	return ttip_create_ex(output, width, height, format, 0, NULL);
+}
+
+ttip_result_t ttip_create_pooled(ttip_image_t* output, int width, int height, ttip_format_t format, ttip_pool_t pool) {
+	return ttip_create_ex(output, width, height, format, 0, pool);
+}
+
 void ttip_destroy(ttip_image_t* tile) {
 	if (*tile != NULL) {
-		free((*tile)->data);
-		free(*tile);
+		if ((*tile)->pool != NULL) {
+			ttip_pool_release(*tile);
+		} else {
+			free((*tile)->extdata);
+			free(*tile);
+		}
 		*tile = NULL;
 	}
 }
@@ -87,6 +162,14 @@ const char* ttip_strerror(ttip_result_t error) {
 		return "Even dimensions required";
 	case TTIP_IMAGE_DIMENSIONS_MISMATCH:
 		return "Image dimensions mismatch";
+	case TTIP_INPLACE_NOT_POSSIBLE:
+		return "Operation cannot be done in place";
+	case TTIP_BAD_ALIGNMENT:
+		return "Bad alignment";
+	case TTIP_BAD_ARGUMENT:
+		return "Bad argument";
+	case TTIP_BAD_ARCHIVE:
+		return "Bad tile archive";
 	default:
 		return strerror(error);
 	}
@@ -100,6 +183,10 @@ int ttip_getheight(ttip_image_t tile) {
 	return tile->height;
 }
 
+int ttip_getstride(ttip_image_t tile) {
+	return tile->stride;
+}
+
 ttip_format_t ttip_getformat(ttip_image_t tile) {
 	return tile->format;
 }
@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2012 Dmitry Marakasov
+ *
+ * This file is part of libttip.
+ *
+ * libttip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libttip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libttip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ttip_int.h>
+
+/* initial capacity, enough for most compressed tiles */
+#define BUFFER_MIN_CAPACITY 65536
+
+void ttip_buffer_init(ttip_buffer_t* buffer) {
+	memset(buffer, 0, sizeof(ttip_buffer_t));
+}
+
+void ttip_buffer_free(ttip_buffer_t* buffer) {
+	free(buffer->data);
+	memset(buffer, 0, sizeof(ttip_buffer_t));
+}
+
+ttip_result_t ttip_buffer_reserve(ttip_buffer_t* buffer, size_t size) {
+	if (size <= buffer->capacity)
+		return TTIP_OK;
+
+	/* grow geometrically to keep appends amortized O(1) */
+	size_t capacity = buffer->capacity > 0 ? buffer->capacity : BUFFER_MIN_CAPACITY;
+	while (capacity < size)
+		capacity *= 2;
+
+	unsigned char* data;
+	if ((data = realloc(buffer->data, capacity)) == NULL)
+		return errno;
+
+	buffer->data = data;
+	buffer->capacity = capacity;
+
+	return TTIP_OK;
+}
@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2012 Dmitry Marakasov
+ *
+ * This file is part of libttip.
+ *
+ * libttip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libttip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libttip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <ttip_int.h>
+#include <ttip_simd.h>
+
+/* -1 means not yet initialized */
+static int g_detected_simd = -1;
+static int g_max_simd = -1;
+
+static ttip_simd_t ttip_detectsimd() {
+#if defined(TTIP_X86_SIMD)
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2"))
+		return TTIP_SIMD_AVX2;
+	if (__builtin_cpu_supports("ssse3"))
+		return TTIP_SIMD_SSSE3;
+	if (__builtin_cpu_supports("sse2"))
+		return TTIP_SIMD_SSE2;
+#endif
+	return TTIP_SIMD_NONE;
+}
+
+/* TTIP_FORCE_SCALAR=1 disables all vector kernels, while
+ * TTIP_SIMD=<none|sse2|ssse3|avx2> limits instruction set used */
+static ttip_simd_t ttip_getenvsimd() {
+	const char* env;
+
+	if ((env = getenv("TTIP_FORCE_SCALAR")) != NULL && *env != '\0' && strcmp(env, "0") != 0)
+		return TTIP_SIMD_NONE;
+
+	if ((env = getenv("TTIP_SIMD")) != NULL) {
+		if (strcmp(env, "none") == 0 || strcmp(env, "scalar") == 0)
+			return TTIP_SIMD_NONE;
+		if (strcmp(env, "sse2") == 0)
+			return TTIP_SIMD_SSE2;
+		if (strcmp(env, "ssse3") == 0)
+			return TTIP_SIMD_SSSE3;
+	}
+
+	return TTIP_SIMD_AVX2;
+}
+
+ttip_simd_t ttip_getsimd() {
+	if (g_detected_simd < 0)
+		g_detected_simd = ttip_detectsimd();
+
+	if (g_max_simd < 0)
+		g_max_simd = ttip_getenvsimd();
+
+	return (g_max_simd < g_detected_simd) ? g_max_simd : g_detected_simd;
+}
+
+void ttip_setsimd(ttip_simd_t max) {
+	g_max_simd = max;
+}
@@ -22,6 +22,11 @@
 #include <ttip_int.h>
 
 ttip_result_t ttip_clear(ttip_image_t target) {
+	if (target->uniform) {
+		ttip_setuniform(target, 0);
+		return TTIP_OK;
+	}
+
 	memset(target->data, 0, target->stride * target->height);
 
 	return TTIP_OK;
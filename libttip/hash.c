@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2012 Dmitry Marakasov
+ *
+ * This file is part of libttip.
+ *
+ * libttip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libttip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libttip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include <ttip_int.h>
+
+/*
+ * Fast non-cryptographic hash for finding duplicate images
+ *
+ * Single lane of xxHash64 round function over 8 byte words, which
+ * runs at several GB/s and has good enough distribution for telling
+ * apart millions of tiles.
+ */
+
+#define HASH_PRIME1 0x9E3779B185EBCA87ULL
+#define HASH_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define HASH_PRIME3 0x165667B19E3779F9ULL
+#define HASH_PRIME4 0x85EBCA77C2B2AE63ULL
+
+static inline uint64_t hash_rotl(uint64_t value, int bits) {
+	return (value << bits) | (value >> (64 - bits));
+}
+
+static inline uint64_t hash_round(uint64_t state, uint64_t word) {
+	word *= HASH_PRIME2;
+	word = hash_rotl(word, 31);
+	word *= HASH_PRIME1;
+	state ^= word;
+	return hash_rotl(state, 27) * HASH_PRIME1 + HASH_PRIME4;
+}
+
+uint64_t ttip_hash_init() {
+	return HASH_PRIME3;
+}
+
+uint64_t ttip_hash_update(uint64_t state, const void* data, size_t size) {
+	const unsigned char* ptr = data;
+	const unsigned char* end = ptr + size;
+	uint64_t word;
+
+	for (; ptr + 8 <= end; ptr += 8) {
+		memcpy(&word, ptr, 8);
+		state = hash_round(state, word);
+	}
+
+	if (ptr < end) {
+		word = 0;
+		memcpy(&word, ptr, end - ptr);
+		state = hash_round(state, word ^ (uint64_t)(end - ptr) << 56);
+	}
+
+	return state;
+}
+
+uint64_t ttip_hash_finish(uint64_t state) {
+	state ^= state >> 33;
+	state *= HASH_PRIME2;
+	state ^= state >> 29;
+	state *= HASH_PRIME3;
+	state ^= state >> 32;
+	return state;
+}
@@ -0,0 +1,152 @@
+/*
+ * Copyright (C) 2012 Dmitry Marakasov
+ *
+ * This file is part of libttip.
+ *
+ * libttip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libttip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libttip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include <ttip_int.h>
+
+static inline unsigned int ttip_palette_hash(ttip_color_t color) {
+	return (color * 2654435761u) >> (32 - TTIP_PALETTE_HASH_BITS);
+}
+
+/* return slot of color in hash table; empty slot if color is not there */
+static inline unsigned int ttip_palette_slot(const struct ttip_palette* palette, ttip_color_t color) {
+	unsigned int slot = ttip_palette_hash(color);
+	while (palette->indexes[slot] >= 0 && palette->keys[slot] != color)
+		slot = (slot + 1) & (TTIP_PALETTE_HASH_SIZE - 1);
+	return slot;
+}
+
+static inline ttip_color_t ttip_palette_alpha(ttip_color_t color, ttip_format_t format) {
+	switch (format) {
+	case TTIP_GRAY_ALPHA: return (color >> 8) & 0xff;
+	case TTIP_RGB_ALPHA: return color >> 24;
+	default: return 0xff;
+	}
+}
+
+void ttip_palette_reset(struct ttip_palette* palette) {
+	palette->ncolors = 0;
+	palette->ntrans = 0;
+	memset(palette->indexes, 0xff, sizeof(palette->indexes));
+}
+
+int ttip_palette_addrow(struct ttip_palette* palette, const unsigned char* row, int width, ttip_format_t format) {
+	int bpp = ttip_getbpp(format);
+	const unsigned char* end = row + width * bpp;
+
+	ttip_color_t prev = 0;
+	int haveprev = 0;
+
+	for (; row < end; row += bpp) {
+		ttip_color_t color = ttip_readpixel((unsigned char*)row, format);
+
+		/* runs of same color are very common in map tiles */
+		if (haveprev && color == prev)
+			continue;
+
+		prev = color;
+		haveprev = 1;
+
+		unsigned int slot = ttip_palette_slot(palette, color);
+		if (palette->indexes[slot] >= 0)
+			continue;
+
+		if (palette->ncolors == TTIP_PALETTE_MAX_COLORS)
+			return 0;
+
+		palette->keys[slot] = color;
+		palette->indexes[slot] = palette->ncolors;
+		palette->colors[palette->ncolors++] = color;
+	}
+
+	return 1;
+}
+
+void ttip_palette_finish(struct ttip_palette* palette, ttip_format_t format) {
+	ttip_color_t sorted[TTIP_PALETTE_MAX_COLORS];
+	int i, n = 0;
+
+	/* place translucent colors first, so tRNS chunk may be shorter */
+	for (i = 0; i < palette->ncolors; i++)
+		if (ttip_palette_alpha(palette->colors[i], format) != 0xff)
+			sorted[n++] = palette->colors[i];
+
+	palette->ntrans = n;
+
+	for (i = 0; i < palette->ncolors; i++)
+		if (ttip_palette_alpha(palette->colors[i], format) == 0xff)
+			sorted[n++] = palette->colors[i];
+
+	for (i = 0; i < palette->ncolors; i++) {
+		palette->colors[i] = sorted[i];
+		palette->indexes[ttip_palette_slot(palette, sorted[i])] = i;
+	}
+}
+
+int ttip_palette_bitdepth(const struct ttip_palette* palette) {
+	if (palette->ncolors <= 2)
+		return 1;
+	if (palette->ncolors <= 4)
+		return 2;
+	if (palette->ncolors <= 16)
+		return 4;
+	return 8;
+}
+
+void ttip_palette_maprow(const struct ttip_palette* palette, unsigned char* dst, const unsigned char* row, int width, ttip_format_t format, int bitdepth) {
+	int bpp = ttip_getbpp(format);
+	int perbyte = 8 / bitdepth;
+	int x;
+
+	ttip_color_t prev = ttip_readpixel((unsigned char*)row, format);
+	int index = palette->indexes[ttip_palette_slot(palette, prev)];
+
+	memset(dst, 0, (width * bitdepth + 7) / 8);
+
+	for (x = 0; x < width; x++, row += bpp) {
+		ttip_color_t color = ttip_readpixel((unsigned char*)row, format);
+		if (color != prev) {
+			index = palette->indexes[ttip_palette_slot(palette, color)];
+			prev = color;
+		}
+
+		/* pack pixels starting from most significant bits */
+		dst[x / perbyte] |= index << ((perbyte - 1 - x % perbyte) * bitdepth);
+	}
+}
+
+void ttip_palette_getentry(const struct ttip_palette* palette, int index, ttip_format_t format, unsigned char rgba[4]) {
+	ttip_color_t color = palette->colors[index];
+
+	switch (format) {
+	case TTIP_GRAY:
+	case TTIP_GRAY_ALPHA:
+		rgba[0] = rgba[1] = rgba[2] = color & 0xff;
+		break;
+	case TTIP_RGB:
+	case TTIP_RGB_ALPHA:
+		rgba[0] = (color >> 16) & 0xff;
+		rgba[1] = (color >> 8) & 0xff;
+		rgba[2] = color & 0xff;
+		break;
+	}
+
+	rgba[3] = ttip_palette_alpha(color, format);
+}
@@ -23,6 +23,9 @@ void ttip_setpixel(ttip_image_t tile, int x, int y, ttip_color_t color) {
 	if (x < 0 || x >= tile->width || y < 0 || y >= tile->height)
 		return;
 
+	if (tile->uniform && ttip_materialize(tile) != TTIP_OK)
+		return;
+
 	ttip_writepixel(tile->data + tile->stride * y + ttip_getbpp(tile->format) * x, color, tile->format);
 }
 
@@ -30,5 +33,5 @@ ttip_color_t ttip_getpixel(ttip_image_t tile, int x, int y) {
 	if (x < 0 || x >= tile->width || y < 0 || y >= tile->height)
 		return 0;
 
-	return ttip_readpixel(tile->data + tile->stride * y + ttip_getbpp(tile->format) * x, tile->format);
+	return ttip_readpixel(tile->data + ttip_rowstep(tile) * y + ttip_getbpp(tile->format) * x, tile->format);
 }
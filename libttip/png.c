@@ -23,116 +23,740 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <zlib.h>
 
 #include <ttip_int.h>
 
-ttip_result_t ttip_savepng(ttip_image_t source, const char* filename, int level) {
 #if defined(WITH_PNG)
-	FILE* f;
-	png_structp png_ptr;
-	png_infop info_ptr;
+/* provides pointer to pixel data of given row of the image being written */
+typedef const unsigned char* (*png_row_source)(void* data, int y);
 
-	/* generate temporary filename */
-	char tmpfilename[strlen(filename) + 4 + 1];
-	strcpy(tmpfilename, filename);
-	strcat(tmpfilename, ".tmp");
+/* where png writer puts its output: either a file or a memory buffer */
+struct png_target {
+	const char* filename;
+	ttip_buffer_t* buffer;
+	ttip_hash_t* hash;      /* only hash the image, don't encode it */
+};
 
-	/* open file and init png writing */
-	if ((f = fopen(tmpfilename, "wb")) == NULL)
-		return errno;
+/* source of png reader when reading from memory */
+struct png_memsource {
+	const unsigned char* data;
+	size_t size;
+	size_t offset;
+};
 
-	if ((png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL)) == NULL) {
-		fclose(f);
-		unlink(tmpfilename);
-		return TTIP_LIBPNG_INIT_FAILED;
+/* number of freed libpng/zlib allocations kept for reuse */
+#define PNG_ALLOCATOR_MAX_CACHED 32
+
+/* header of memory block allocated for libpng; padded to keep payload aligned */
+struct png_block {
+	size_t size;
+	struct png_block* next;
+};
+
+#define PNG_BLOCK_HEADER_SIZE ttip_alignsize(sizeof(struct png_block), 16)
+
+/* keeps memory freed by libpng and zlib to reuse it for the next
+ * image, so their large state is not reallocated for every tile */
+struct png_allocator {
+	struct png_block* free;
+	int nfree;
+};
+
+/* encoded single color image; tilesets have lots of the same ones
+ * (sea, land, empty tile), which are only compressed once */
+struct png_uniform_entry {
+	int width;
+	int height;
+	ttip_format_t format;  /* of encoded rows */
+	ttip_color_t color;
+	ttip_buffer_t png;     /* empty if entry is unused */
+};
+
+#define PNG_UNIFORM_CACHE_SIZE 4
+
+struct ttip_png_encoder {
+	struct png_allocator allocator;
+	int level;
+	ttip_png_tuning_t tuning;
+	struct ttip_image* rows;  /* row buffers for fused output */
+
+	/* write paletted image when it has few enough colors */
+	int indexed;
+	struct ttip_palette palette;
+
+	/* or reduce colors to a palette if that's precise enough */
+	int minpsnr;
+	struct ttip_quantizer quantizer;
+	int quantized;  /* current image is mapped through quantizer */
+
+	/* recently encoded uniform images, for current settings */
+	struct png_uniform_entry uniform[PNG_UNIFORM_CACHE_SIZE];
+	int nextuniform;
+
+	/* settings for current image, -1 means libpng default */
+	int filters;
+	int strategy;
+	int rowfilters;  /* pick filter for each row with png_row_filter */
+	int bitdepth;  /* of palette indexes, 0 if image is not paletted */
+};
+
+struct ttip_png_decoder {
+	struct png_allocator allocator;
+};
+
+static png_voidp png_allocator_malloc(png_structp png_ptr, png_alloc_size_t size) {
+	struct png_allocator* allocator = png_get_mem_ptr(png_ptr);
+	struct png_block** prev;
+	struct png_block* block;
+
+	/* blocks are mostly requested with the same sizes for each image */
+	for (prev = &allocator->free; (block = *prev) != NULL; prev = &block->next) {
+		if (block->size == size) {
+			*prev = block->next;
+			allocator->nfree--;
+			return (unsigned char*)block + PNG_BLOCK_HEADER_SIZE;
+		}
 	}
 
+	if ((block = malloc(PNG_BLOCK_HEADER_SIZE + size)) == NULL)
+		return NULL;
+
+	block->size = size;
+
+	return (unsigned char*)block + PNG_BLOCK_HEADER_SIZE;
+}
+
+static void png_allocator_free(png_structp png_ptr, png_voidp ptr) {
+	struct png_allocator* allocator = png_get_mem_ptr(png_ptr);
+	struct png_block* block = (struct png_block*)((unsigned char*)ptr - PNG_BLOCK_HEADER_SIZE);
+
+	block->next = allocator->free;
+	allocator->free = block;
+
+	/* drop least recently freed block if there are too many */
+	if (++allocator->nfree > PNG_ALLOCATOR_MAX_CACHED) {
+		struct png_block* last = allocator->free;
+		while (last->next->next != NULL)
+			last = last->next;
+		free(last->next);
+		last->next = NULL;
+		allocator->nfree--;
+	}
+}
+
+static void png_allocator_clear(struct png_allocator* allocator) {
+	struct png_block* block;
+	while ((block = allocator->free) != NULL) {
+		allocator->free = block->next;
+		free(block);
+	}
+	allocator->nfree = 0;
+}
+
+static void png_buffer_write(png_structp png_ptr, png_bytep data, png_size_t length) {
+	ttip_buffer_t* buffer = png_get_io_ptr(png_ptr);
+
+	if (ttip_buffer_reserve(buffer, buffer->size + length) != TTIP_OK)
+		png_error(png_ptr, "cannot grow output buffer");
+
+	memcpy(buffer->data + buffer->size, data, length);
+	buffer->size += length;
+}
+
+static void png_buffer_flush(png_structp png_ptr) {
+	(void)png_ptr; /* nothing to do */
+}
+
+static void png_memsource_read(png_structp png_ptr, png_bytep data, png_size_t length) {
+	struct png_memsource* source = png_get_io_ptr(png_ptr);
+
+	if (length > source->size - source->offset)
+		png_error(png_ptr, "unexpected end of data");
+
+	memcpy(data, source->data + source->offset, length);
+	source->offset += length;
+}
+
+/* filters libpng chooses from for rows that are worth filtering */
+#define PNG_ROW_FILTERS (PNG_FILTER_SUB | PNG_FILTER_UP | PNG_FILTER_PAETH)
+
+/* neighbour difference up to this is a smooth step rather than an edge */
+#define PNG_SMALL_STEP 2
+
+/* filters for a row of direct color pixels
+ *
+ * Rows of flat fills, lines and text compress best unfiltered, as their
+ * pixels repeat along long deflate matches. Rows which mostly step
+ * smoothly between colors (gradients, shading, blended edges) are left
+ * to libpng's per-row selection, which turns such steps into runs of
+ * small residuals.
+ */
+static int png_row_filter(const unsigned char* row, int width, int bpp) {
+	const unsigned char* pixel = row + bpp;
+	const unsigned char* end = row + width * bpp;
+	int changed = 0, edges = 0;
+	int i;
+
+	for (; pixel < end; pixel += bpp) {
+		int maxdiff = 0;
+		for (i = 0; i < bpp; i++) {
+			int diff = abs(pixel[i] - pixel[i - bpp]);
+			if (diff > maxdiff)
+				maxdiff = diff;
+		}
+		changed += maxdiff > 0;
+		edges += maxdiff > PNG_SMALL_STEP;
+	}
+
+	return edges * 2 < changed ? PNG_ROW_FILTERS : PNG_FILTER_NONE;
+}
+
+/* write png to either file f or memory buffer */
+static ttip_result_t png_write_image_rows(ttip_png_encoder_t encoder, FILE* f, ttip_buffer_t* buffer, int width, int height, ttip_format_t format, png_row_source source, void* data) {
+	png_structp png_ptr;
+	png_infop info_ptr;
+
+	/* init png writing */
+	if ((png_ptr = png_create_write_struct_2(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL, &encoder->allocator, png_allocator_malloc, png_allocator_free)) == NULL)
+		return TTIP_LIBPNG_INIT_FAILED;
+
 	if ((info_ptr = png_create_info_struct(png_ptr)) == NULL) {
 		png_destroy_write_struct(&png_ptr, NULL);
-		fclose(f);
-		unlink(tmpfilename);
 		return TTIP_LIBPNG_INIT_FAILED;
 	}
 
 	if (setjmp(png_jmpbuf(png_ptr))) {
 		/* we get here from libpng errors */
 		png_destroy_write_struct(&png_ptr, &info_ptr);
-		fclose(f);
-		unlink(tmpfilename);
 		return TTIP_LIBPNG_ERROR;
 	}
 
-	png_init_io(png_ptr, f);
-	png_set_compression_level(png_ptr, level);
+	if (f)
+		png_init_io(png_ptr, f);
+	else
+		png_set_write_fn(png_ptr, buffer, png_buffer_write, png_buffer_flush);
+
+	png_set_compression_level(png_ptr, encoder->level);
+
+	if (encoder->filters >= 0)
+		png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, encoder->filters);
+	if (encoder->strategy >= 0)
+		png_set_compression_strategy(png_ptr, encoder->strategy);
 
 	int png_color_type = 0;
-	switch (source->format) {
+	switch (format) {
 	case TTIP_GRAY: png_color_type = PNG_COLOR_TYPE_GRAY; break;
 	case TTIP_GRAY_ALPHA: png_color_type = PNG_COLOR_TYPE_GRAY_ALPHA; break;
 	case TTIP_RGB: png_color_type = PNG_COLOR_TYPE_RGB; break;
 	case TTIP_RGB_ALPHA: png_color_type = PNG_COLOR_TYPE_RGB_ALPHA; break;
 	}
 
-	png_set_IHDR(png_ptr, info_ptr, source->width, source->height, 8, png_color_type, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+	if (encoder->bitdepth > 0) {
+		/* paletted image, rows contain indexes */
+		png_color plte[TTIP_PALETTE_MAX_COLORS];
+		png_byte trns[TTIP_PALETTE_MAX_COLORS];
+		int i;
+
+		for (i = 0; i < encoder->palette.ncolors; i++) {
+			unsigned char rgba[4];
+			ttip_palette_getentry(&encoder->palette, i, format, rgba);
+			plte[i].red = rgba[0];
+			plte[i].green = rgba[1];
+			plte[i].blue = rgba[2];
+			trns[i] = rgba[3];
+		}
+
+		png_set_IHDR(png_ptr, info_ptr, width, height, encoder->bitdepth, PNG_COLOR_TYPE_PALETTE, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+		png_set_PLTE(png_ptr, info_ptr, plte, encoder->palette.ncolors);
+
+		/* always keep alpha channel for rgba images, even if they're opaque */
+		if (format == TTIP_RGB_ALPHA)
+			png_set_tRNS(png_ptr, info_ptr, trns, encoder->palette.ntrans > 0 ? encoder->palette.ntrans : 1, NULL);
+	} else {
+		png_set_IHDR(png_ptr, info_ptr, width, height, 8, png_color_type, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+	}
 
 	png_write_info(png_ptr, info_ptr);
 
 	/* write pixel data */
-	png_bytep row;
-	for (row = source->data; row < source->data + source->stride * source->height; row += source->stride)
-		png_write_row(png_ptr, row);
+	int bpp = ttip_getbpp(format);
+	int y;
+	for (y = 0; y < height; y++) {
+		const unsigned char* row = source(data, y);
+		/* libpng allocates buffers for filters enabled at first row */
+		if (encoder->rowfilters && y > 0)
+			png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, png_row_filter(row, width, bpp));
+		png_write_row(png_ptr, (png_bytep)row);
+	}
 
 	/* cleanup */
 	png_write_end(png_ptr, NULL);
 
 	png_destroy_write_struct(&png_ptr, &info_ptr);
-	fclose(f);
 
-	/* rename temporary file, possibly overwriting old tile */
-	if (rename(tmpfilename, filename) != 0) {
-		int saved_errno = errno;
+	return TTIP_OK;
+}
+
+/* open temporary file next to target file; tmpfilename should have
+ * space for target filename and .tmp suffix */
+static FILE* png_target_open(const struct png_target* target, char* tmpfilename) {
+	strcpy(tmpfilename, target->filename);
+	strcat(tmpfilename, ".tmp");
+
+	return fopen(tmpfilename, "wb");
+}
+
+/* close temporary file and move it in place of target file, possibly
+ * overwriting old tile; or remove it if writing failed */
+static ttip_result_t png_target_close(const struct png_target* target, FILE* f, const char* tmpfilename, ttip_result_t ret) {
+	if (fclose(f) != 0 && ret == TTIP_OK)
+		ret = errno;
+
+	if (ret == TTIP_OK && rename(tmpfilename, target->filename) != 0)
+		ret = errno;
+
+	if (ret != TTIP_OK)
 		unlink(tmpfilename);
-		return saved_errno;
+
+	return ret;
+}
+
+static ttip_result_t ttip_savepng_rows(ttip_png_encoder_t encoder, const struct png_target* target, int width, int height, ttip_format_t format, png_row_source source, void* data) {
+	if (target->filename == NULL) {
+		target->buffer->size = 0;
+		return png_write_image_rows(encoder, NULL, target->buffer, width, height, format, source, data);
 	}
 
-	return TTIP_OK;
-#else
-	return TTIP_NOT_COMPILED_IN;
-#endif
+	FILE* f;
+	char tmpfilename[strlen(target->filename) + 4 + 1];
+
+	/* open file and write png */
+	if ((f = png_target_open(target, tmpfilename)) == NULL)
+		return errno;
+
+	return png_target_close(target, f, tmpfilename, png_write_image_rows(encoder, f, NULL, width, height, format, source, data));
 }
 
-ttip_result_t ttip_loadpng(ttip_image_t* output, const char* filename) {
-#if defined(WITH_PNG)
+/* write already encoded png */
+static ttip_result_t ttip_savepng_bytes(const struct png_target* target, const unsigned char* data, size_t size) {
+	ttip_result_t ret;
+
+	if (target->filename == NULL) {
+		if ((ret = ttip_buffer_reserve(target->buffer, size)) != TTIP_OK)
+			return ret;
+		memcpy(target->buffer->data, data, size);
+		target->buffer->size = size;
+		return TTIP_OK;
+	}
+
 	FILE* f;
+	char tmpfilename[strlen(target->filename) + 4 + 1];
+
+	if ((f = png_target_open(target, tmpfilename)) == NULL)
+		return errno;
+
+	ret = fwrite(data, 1, size, f) == size ? TTIP_OK : errno;
+
+	return png_target_close(target, f, tmpfilename, ret);
+}
+
+/* state of fused downsample/blend pipeline */
+struct png_composite {
+	ttip_image_t source;                 /* source image or NULL if downsampling */
+	ttip_image_t quadrants[4];           /* sources to downsample */
+	downsample_row_func downsample;
+
+	const ttip_image_t* overlays;
+	int noverlays;
+	maskblend_row_func* blend;           /* kernel for each overlay */
+	int* expand;                         /* whether overlay expands gray to rgb */
+
+	int width;
+	int height;
+	int bpp;                             /* of source/quadrants */
+	unsigned char* rows[2];              /* row buffers */
+
+	ttip_png_encoder_t encoder;
+	ttip_format_t format;                /* of resulting rows */
+	unsigned char* indexrow;             /* row buffer for palette indexes */
+
+	int uniform;                         /* all sources are uniform, so are all rows */
+	const unsigned char* uniformrow;     /* once produced */
+};
+
+/* rows sampled for content statistics */
+#define PNG_TUNING_ROW_STEP 8
+
+/* pixels equal to left neighbour, among sampled rows of the image */
+static void png_count_flat(ttip_image_t image, long* flat, long* total) {
+	int bpp = ttip_getbpp(image->format);
+	int y;
+
+	if (image->uniform) {
+		/* every pixel is equal to its neighbour */
+		long sampled = (image->height + PNG_TUNING_ROW_STEP - 1) / PNG_TUNING_ROW_STEP * (long)(image->width - 1);
+		*flat += sampled;
+		*total += sampled;
+		return;
+	}
+
+	for (y = 0; y < image->height; y += PNG_TUNING_ROW_STEP) {
+		const unsigned char* pixel = image->data + image->stride * y + bpp;
+		const unsigned char* end = image->data + image->stride * y + image->width * bpp;
+		for (; pixel < end; pixel += bpp)
+			*flat += memcmp(pixel, pixel - bpp, bpp) == 0;
+		*total += image->width - 1;
+	}
+}
+
+/* choose filters and deflate strategy from content of source images
+ *
+ * Rendered maps consist of flat fills, lines and text with a limited
+ * set of colors. Prediction filters break long matches deflate finds
+ * in such rows, so these are written unfiltered, while rows with
+ * gradients or shading still get filtered; see png_row_filter.
+ * Photo-like content (hillshading, satellite imagery) has few equal
+ * neighbours; there a single sub filter is as good as adaptive per-row
+ * filter selection at fraction of its cost, and run-length only
+ * matching trades some size for much faster encoding at low levels.
+ */
+static void png_choose_tuning(ttip_png_encoder_t encoder, const struct png_composite* c) {
+	long flat = 0, total = 0;
+
+	if (c->source != NULL) {
+		png_count_flat(c->source, &flat, &total);
+	} else {
+		int i;
+		for (i = 0; i < 4; i++)
+			png_count_flat(c->quadrants[i], &flat, &total);
+	}
+
+	if (flat * 4 >= total) {
+		encoder->filters = PNG_FILTER_NONE | PNG_ROW_FILTERS;
+		encoder->strategy = Z_DEFAULT_STRATEGY;
+		encoder->rowfilters = 1;
+	} else {
+		encoder->filters = PNG_FILTER_SUB;
+		encoder->strategy = encoder->level <= 1 ? Z_RLE : Z_DEFAULT_STRATEGY;
+	}
+}
+
+static const unsigned char* png_composite_row(void* data, int y) {
+	struct png_composite* c = data;
+
+	/* all rows of uniform result are the same, and row buffers are
+	 * not touched between calls */
+	if (c->uniformrow != NULL)
+		return c->uniformrow;
+
+	const unsigned char* row;
+	int current = -1; /* row buffer holding current row, -1 if row is in source image */
+
+	if (c->source != NULL) {
+		row = c->source->data + ttip_rowstep(c->source) * y;
+	} else {
+		int bottom = y >= c->height / 2;
+		int srcy = (y - bottom * c->height / 2) * 2;
+		int i;
+
+		for (i = 0; i < 2; i++) {
+			ttip_image_t quadrant = c->quadrants[bottom * 2 + i];
+			unsigned char* dst = c->rows[0] + i * c->width / 2 * c->bpp;
+
+			/* downsampled uniform image has the same color */
+			if (quadrant->uniform)
+				memcpy(dst, quadrant->data, c->width / 2 * c->bpp);
+			else
+				c->downsample(dst, quadrant->data + quadrant->stride * srcy, quadrant->data + quadrant->stride * (srcy + 1), c->width / 2);
+		}
+
+		row = c->rows[0];
+		current = 0;
+	}
+
+	int i;
+	for (i = 0; i < c->noverlays; i++) {
+		/* blend in place unless row is read-only or gets wider */
+		int target = (current == -1) ? 0 : c->expand[i] ? !current : current;
+
+		c->blend[i](c->rows[target], row, c->overlays[i]->data + ttip_rowstep(c->overlays[i]) * y, c->width);
+
+		row = c->rows[target];
+		current = target;
+	}
+
+	if (c->uniform)
+		c->uniformrow = row;
+
+	return row;
+}
+
+static const unsigned char* png_indexed_row(void* data, int y) {
+	struct png_composite* c = data;
+
+	if (c->encoder->quantized)
+		ttip_quantizer_maprow(&c->encoder->quantizer, c->indexrow, png_composite_row(data, y), c->width, c->format, c->encoder->bitdepth);
+	else
+		ttip_palette_maprow(&c->encoder->palette, c->indexrow, png_composite_row(data, y), c->width, c->format, c->encoder->bitdepth);
+
+	return c->indexrow;
+}
+
+/* reduce image with too many colors to a palette, unless that loses
+ * too much; this produces all rows once more */
+static int png_choose_quantized(ttip_png_encoder_t encoder, struct png_composite* c) {
+	struct ttip_quantizer* quantizer = &encoder->quantizer;
+	int y;
+
+	if (ttip_quantizer_init(quantizer, c->width * c->height) != TTIP_OK)
+		return 0; /* just write truecolor image */
+
+	for (y = 0; y < c->height; y++)
+		ttip_quantizer_addrow(quantizer, png_composite_row(c, y), c->width, c->format);
+
+	double mse = ttip_quantizer_build(quantizer, TTIP_PALETTE_MAX_COLORS, c->format, &encoder->palette);
+
+	return encoder->quantized = ttip_quantizer_psnr(mse) >= encoder->minpsnr;
+}
+
+/* check whether image fits in a palette, build it if so; this
+ * produces all rows once more, which is still cheap compared to
+ * compression */
+static void png_choose_palette(ttip_png_encoder_t encoder, struct png_composite* c) {
+	struct ttip_palette* palette = &encoder->palette;
+	int y;
+
+	/* paletted images decode as rgb(a), so gray ones are left as is */
+	if (c->format != TTIP_RGB && c->format != TTIP_RGB_ALPHA)
+		return;
+
+	ttip_palette_reset(palette);
+
+	for (y = 0; y < c->height; y++)
+		if (!ttip_palette_addrow(palette, png_composite_row(c, y), c->width, c->format))
+			break;
+
+	if (y < c->height) {
+		if (encoder->minpsnr <= 0 || !png_choose_quantized(encoder, c))
+			return;
+	} else {
+		ttip_palette_finish(palette, c->format);
+	}
+
+	encoder->bitdepth = ttip_palette_bitdepth(palette);
+
+	/* filtering never helps paletted images */
+	if (encoder->filters >= 0) {
+		encoder->filters = PNG_FILTER_NONE;
+		encoder->strategy = Z_DEFAULT_STRATEGY;
+		encoder->rowfilters = 0;
+	}
+}
+
+/* hash of resulting pixels, along with their layout */
+static ttip_hash_t png_composite_hash(struct png_composite* c) {
+	int header[3] = { c->width, c->height, c->format };
+	int rowsize = c->width * ttip_getbpp(c->format);
+	int y;
+
+	uint64_t state = ttip_hash_update(ttip_hash_init(), header, sizeof(header));
+	for (y = 0; y < c->height; y++)
+		state = ttip_hash_update(state, png_composite_row(c, y), rowsize);
+
+	return ttip_hash_finish(state);
+}
+
+/* forget encoded uniform images when encoder settings change */
+static void png_uniform_clear(ttip_png_encoder_t encoder) {
+	int i;
+	for (i = 0; i < PNG_UNIFORM_CACHE_SIZE; i++)
+		encoder->uniform[i].png.size = 0;
+}
+
+/* encode uniform image once, then reuse the result */
+static ttip_result_t ttip_savepng_uniform(ttip_png_encoder_t encoder, struct png_composite* c, const struct png_target* target) {
+	ttip_color_t color = ttip_readpixel((unsigned char*)png_composite_row(c, 0), c->format);
+	struct png_uniform_entry* entry;
+	int i;
+
+	for (i = 0; i < PNG_UNIFORM_CACHE_SIZE; i++) {
+		entry = &encoder->uniform[i];
+		if (entry->png.size > 0 && entry->width == c->width && entry->height == c->height && entry->format == c->format && entry->color == color)
+			return ttip_savepng_bytes(target, entry->png.data, entry->png.size);
+	}
+
+	/* replace oldest entry */
+	entry = &encoder->uniform[encoder->nextuniform];
+	encoder->nextuniform = (encoder->nextuniform + 1) % PNG_UNIFORM_CACHE_SIZE;
+
+	if (encoder->indexed)
+		png_choose_palette(encoder, c);
+
+	struct png_target memory = { NULL, &entry->png, NULL };
+	ttip_result_t ret;
+	if ((ret = ttip_savepng_rows(encoder, &memory, c->width, c->height, c->format, encoder->bitdepth > 0 ? png_indexed_row : png_composite_row, c)) != TTIP_OK) {
+		entry->png.size = 0;
+		return ret;
+	}
+
+	entry->width = c->width;
+	entry->height = c->height;
+	entry->format = c->format;
+	entry->color = color;
+
+	return ttip_savepng_bytes(target, entry->png.data, entry->png.size);
+}
+
+static ttip_result_t ttip_savepng_composite(ttip_png_encoder_t encoder, struct png_composite* c, ttip_format_t format, const struct png_target* target) {
+	/* select kernels for each overlay */
+	maskblend_row_func blend[c->noverlays > 0 ? c->noverlays : 1];
+	int expand[c->noverlays > 0 ? c->noverlays : 1];
+	int i;
+	ttip_result_t ret;
+
+	for (i = 0; i < c->noverlays; i++) {
+		ttip_image_t overlay = c->overlays[i];
+		if ((ret = ttip_maskblend_check(c->width, c->height, format, overlay)) != TTIP_OK)
+			return ret;
+
+		/* row buffers are always aligned, so only source and overlay matter */
+		int aligned = ttip_isaligned(overlay, 32) && (i > 0 || c->source == NULL || ttip_isaligned(c->source, 32));
+
+		blend[i] = ttip_maskblend_select(format, overlay->format, aligned);
+		expand[i] = ttip_maskblend_format(format, overlay->format) != format;
+		format = ttip_maskblend_format(format, overlay->format);
+	}
+
+	c->blend = blend;
+	c->expand = expand;
+
+	c->encoder = encoder;
+	c->format = format;
+
+	if (c->source != NULL) {
+		c->uniform = c->source->uniform;
+	} else {
+		c->uniform = 1;
+		for (i = 0; i < 4; i++)
+			c->uniform = c->uniform && c->quadrants[i]->uniform && c->quadrants[i]->color == c->quadrants[0]->color;
+	}
+
+	for (i = 0; i < c->noverlays; i++)
+		c->uniform = c->uniform && c->overlays[i]->uniform;
+
+	/* no intermediate rows needed if source is written directly */
+	int direct = c->source != NULL && c->noverlays == 0 && !encoder->indexed && !c->uniform;
+
+	/* rows of widest format kept in encoder: two for blending, one for palette indexes */
+	if (!direct && (encoder->rows == NULL || encoder->rows->width < c->width)) {
+		free(encoder->rows);
+		if ((encoder->rows = ttip_alloc_image(c->width, 3, TTIP_RGB_ALPHA, TTIP_DEFAULT_ALIGNMENT)) == NULL)
+			return errno;
+	}
+
+	if (!direct) {
+		c->rows[0] = encoder->rows->data;
+		c->rows[1] = encoder->rows->data + encoder->rows->stride;
+		c->indexrow = encoder->rows->data + encoder->rows->stride * 2;
+	}
+
+	if (target->hash != NULL) {
+		*target->hash = png_composite_hash(c);
+		return TTIP_OK;
+	}
+
+	encoder->filters = encoder->strategy = -1;
+	encoder->rowfilters = 0;
+	encoder->bitdepth = 0;
+	encoder->quantized = 0;
+	if (encoder->tuning == TTIP_PNG_TUNING_ADAPTIVE)
+		png_choose_tuning(encoder, c);
+
+	if (direct)
+		return ttip_savepng_rows(encoder, target, c->width, c->height, format, png_composite_row, c);
+
+	if (c->uniform)
+		return ttip_savepng_uniform(encoder, c, target);
+
+	if (encoder->indexed)
+		png_choose_palette(encoder, c);
+
+	return ttip_savepng_rows(encoder, target, c->width, c->height, format, encoder->bitdepth > 0 ? png_indexed_row : png_composite_row, c);
+}
+#endif
+
+#if defined(WITH_PNG)
+static ttip_result_t ttip_png_encode_blended_target(ttip_png_encoder_t encoder, ttip_image_t source, const ttip_image_t* overlays, int noverlays, const struct png_target* target) {
+	struct png_composite c;
+	memset(&c, 0, sizeof(c));
+
+	c.source = source;
+	c.overlays = overlays;
+	c.noverlays = noverlays;
+	c.width = source->width;
+	c.height = source->height;
+	c.bpp = ttip_getbpp(source->format);
+
+	return ttip_savepng_composite(encoder, &c, source->format, target);
+}
+
+static ttip_result_t ttip_png_encode_downsampled_target(ttip_png_encoder_t encoder, ttip_image_t topleft, ttip_image_t topright, ttip_image_t bottomleft, ttip_image_t bottomright, const ttip_image_t* overlays, int noverlays, const struct png_target* target) {
+	int ret;
+	if ((ret = ttip_downsample_check(topleft, topright, bottomleft, bottomright)) != TTIP_OK)
+		return ret;
+
+	struct png_composite c;
+	memset(&c, 0, sizeof(c));
+
+	c.quadrants[0] = topleft;
+	c.quadrants[1] = topright;
+	c.quadrants[2] = bottomleft;
+	c.quadrants[3] = bottomright;
+	c.overlays = overlays;
+	c.noverlays = noverlays;
+	c.width = topleft->width;
+	c.height = topleft->height;
+	c.bpp = ttip_getbpp(topleft->format);
+
+	/* row buffer is aligned, so are its halves if their size is a multiple of vector size */
+	int aligned = (c.width / 2 * c.bpp) % 16 == 0;
+	int i;
+	for (i = 0; i < 4; i++)
+		aligned = aligned && ttip_isaligned(c.quadrants[i], 16);
+
+	c.downsample = ttip_downsample_select(c.bpp, aligned);
+
+	return ttip_savepng_composite(encoder, &c, topleft->format, target);
+}
+
+/* read png either from file f or from memory source */
+static ttip_result_t ttip_loadpng_source(ttip_png_decoder_t decoder, ttip_image_t* output, FILE* f, struct png_memsource* source, ttip_pool_t pool) {
 	png_structp png_ptr;
 	png_infop info_ptr;
 	struct ttip_image* destination = NULL;
 
-	/* open file and init png reading */
-	if ((f = fopen(filename, "rb")) == NULL)
-		return errno;
-
-	if ((png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL)) == NULL) {
-		fclose(f);
+	/* init png reading */
+	if ((png_ptr = png_create_read_struct_2(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL, &decoder->allocator, png_allocator_malloc, png_allocator_free)) == NULL)
 		return TTIP_LIBPNG_INIT_FAILED;
-	}
 
 	if ((info_ptr = png_create_info_struct(png_ptr)) == NULL) {
 		png_destroy_read_struct(&png_ptr, NULL, NULL);
-		fclose(f);
 		return TTIP_LIBPNG_INIT_FAILED;
 	}
 
 	if (setjmp(png_jmpbuf(png_ptr))) {
 		/* we get here from libpng errors */
 		png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
-		fclose(f);
 		if (destination != NULL)
 			ttip_destroy(&destination);
 		return TTIP_LIBPNG_ERROR;
 	}
 
-	png_init_io(png_ptr, f);
+	if (f)
+		png_init_io(png_ptr, f);
+	else
+		png_set_read_fn(png_ptr, source, png_memsource_read);
 
 	png_read_info(png_ptr, info_ptr);
 
@@ -155,9 +779,8 @@ ttip_result_t ttip_loadpng(ttip_image_t* output, const char* filename) {
 	case PNG_COLOR_TYPE_RGB_ALPHA: format = TTIP_RGB_ALPHA; break;
 	}
 
-	if (format == 0 || interlace_method != 0 || ttip_create(&destination, width, height, format) != TTIP_OK) {
+	if (format == 0 || interlace_method != 0 || ttip_create_pooled(&destination, width, height, format, pool) != TTIP_OK) {
 		png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
-		fclose(f);
 		return TTIP_IMAGE_FORMAT_NOT_SUPPORTED;
 	}
 
@@ -171,12 +794,243 @@ ttip_result_t ttip_loadpng(ttip_image_t* output, const char* filename) {
 	/* cleanup */
 	png_read_end(png_ptr, NULL);
 	png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
-	fclose(f);
 
 	*output = destination;
 
+	return TTIP_OK;
+}
+
+#endif
+
+/* encoder and decoder */
+ttip_result_t ttip_png_encoder_create(ttip_png_encoder_t* output) {
+#if defined(WITH_PNG)
+	struct ttip_png_encoder* encoder = malloc(sizeof(struct ttip_png_encoder));
+	if (encoder == NULL)
+		return errno;
+
+	memset(encoder, 0, sizeof(struct ttip_png_encoder));
+	encoder->level = 6;
+
+	*output = encoder;
+
+	return TTIP_OK;
+#else
+	return TTIP_NOT_COMPILED_IN;
+#endif
+}
+
+void ttip_png_encoder_destroy(ttip_png_encoder_t* encoder) {
+#if defined(WITH_PNG)
+	int i;
+	if (*encoder != NULL) {
+		png_allocator_clear(&(*encoder)->allocator);
+		ttip_quantizer_free(&(*encoder)->quantizer);
+		for (i = 0; i < PNG_UNIFORM_CACHE_SIZE; i++)
+			ttip_buffer_free(&(*encoder)->uniform[i].png);
+		free((*encoder)->rows);
+		free(*encoder);
+		*encoder = NULL;
+	}
+#endif
+}
+
+void ttip_png_encoder_setlevel(ttip_png_encoder_t encoder, int level) {
+#if defined(WITH_PNG)
+	encoder->level = level;
+	png_uniform_clear(encoder);
+#endif
+}
+
+void ttip_png_encoder_settuning(ttip_png_encoder_t encoder, ttip_png_tuning_t tuning) {
+#if defined(WITH_PNG)
+	encoder->tuning = tuning;
+	png_uniform_clear(encoder);
+#endif
+}
+
+void ttip_png_encoder_setindexed(ttip_png_encoder_t encoder, int indexed) {
+#if defined(WITH_PNG)
+	encoder->indexed = indexed;
+	png_uniform_clear(encoder);
+#endif
+}
+
+void ttip_png_encoder_setquantize(ttip_png_encoder_t encoder, int minpsnr) {
+#if defined(WITH_PNG)
+	encoder->minpsnr = minpsnr;
+	png_uniform_clear(encoder);
+#endif
+}
+
+ttip_result_t ttip_png_decoder_create(ttip_png_decoder_t* output) {
+#if defined(WITH_PNG)
+	struct ttip_png_decoder* decoder = malloc(sizeof(struct ttip_png_decoder));
+	if (decoder == NULL)
+		return errno;
+
+	memset(decoder, 0, sizeof(struct ttip_png_decoder));
+
+	*output = decoder;
+
 	return TTIP_OK;
 #else
 	return TTIP_NOT_COMPILED_IN;
 #endif
 }
+
+void ttip_png_decoder_destroy(ttip_png_decoder_t* decoder) {
+#if defined(WITH_PNG)
+	if (*decoder != NULL) {
+		png_allocator_clear(&(*decoder)->allocator);
+		free(*decoder);
+		*decoder = NULL;
+	}
+#endif
+}
+
+ttip_result_t ttip_png_encode(ttip_png_encoder_t encoder, ttip_image_t source, const char* filename) {
+	return ttip_png_encode_blended(encoder, source, NULL, 0, filename);
+}
+
+ttip_result_t ttip_png_encode_mem(ttip_png_encoder_t encoder, ttip_image_t source, ttip_buffer_t* output) {
+	return ttip_png_encode_blended_mem(encoder, source, NULL, 0, output);
+}
+
+ttip_result_t ttip_png_encode_blended(ttip_png_encoder_t encoder, ttip_image_t source, const ttip_image_t* overlays, int noverlays, const char* filename) {
+#if defined(WITH_PNG)
+	struct png_target target = { filename, NULL, NULL };
+	return ttip_png_encode_blended_target(encoder, source, overlays, noverlays, &target);
+#else
+	return TTIP_NOT_COMPILED_IN;
+#endif
+}
+
+ttip_result_t ttip_png_encode_blended_mem(ttip_png_encoder_t encoder, ttip_image_t source, const ttip_image_t* overlays, int noverlays, ttip_buffer_t* output) {
+#if defined(WITH_PNG)
+	struct png_target target = { NULL, output, NULL };
+	return ttip_png_encode_blended_target(encoder, source, overlays, noverlays, &target);
+#else
+	return TTIP_NOT_COMPILED_IN;
+#endif
+}
+
+ttip_result_t ttip_png_encode_downsampled(ttip_png_encoder_t encoder, ttip_image_t topleft, ttip_image_t topright, ttip_image_t bottomleft, ttip_image_t bottomright, const ttip_image_t* overlays, int noverlays, const char* filename) {
+#if defined(WITH_PNG)
+	struct png_target target = { filename, NULL, NULL };
+	return ttip_png_encode_downsampled_target(encoder, topleft, topright, bottomleft, bottomright, overlays, noverlays, &target);
+#else
+	return TTIP_NOT_COMPILED_IN;
+#endif
+}
+
+ttip_result_t ttip_png_encode_downsampled_mem(ttip_png_encoder_t encoder, ttip_image_t topleft, ttip_image_t topright, ttip_image_t bottomleft, ttip_image_t bottomright, const ttip_image_t* overlays, int noverlays, ttip_buffer_t* output) {
+#if defined(WITH_PNG)
+	struct png_target target = { NULL, output, NULL };
+	return ttip_png_encode_downsampled_target(encoder, topleft, topright, bottomleft, bottomright, overlays, noverlays, &target);
+#else
+	return TTIP_NOT_COMPILED_IN;
+#endif
+}
+
+ttip_result_t ttip_png_hash_blended(ttip_png_encoder_t encoder, ttip_image_t source, const ttip_image_t* overlays, int noverlays, ttip_hash_t* output) {
+#if defined(WITH_PNG)
+	struct png_target target = { NULL, NULL, output };
+	return ttip_png_encode_blended_target(encoder, source, overlays, noverlays, &target);
+#else
+	return TTIP_NOT_COMPILED_IN;
+#endif
+}
+
+ttip_result_t ttip_png_hash_downsampled(ttip_png_encoder_t encoder, ttip_image_t topleft, ttip_image_t topright, ttip_image_t bottomleft, ttip_image_t bottomright, const ttip_image_t* overlays, int noverlays, ttip_hash_t* output) {
+#if defined(WITH_PNG)
+	struct png_target target = { NULL, NULL, output };
+	return ttip_png_encode_downsampled_target(encoder, topleft, topright, bottomleft, bottomright, overlays, noverlays, &target);
+#else
+	return TTIP_NOT_COMPILED_IN;
+#endif
+}
+
+ttip_result_t ttip_png_decode(ttip_png_decoder_t decoder, ttip_image_t* output, const char* filename, ttip_pool_t pool) {
+#if defined(WITH_PNG)
+	FILE* f;
+	if ((f = fopen(filename, "rb")) == NULL)
+		return errno;
+
+	ttip_result_t ret = ttip_loadpng_source(decoder, output, f, NULL, pool);
+
+	fclose(f);
+
+	return ret;
+#else
+	return TTIP_NOT_COMPILED_IN;
+#endif
+}
+
+ttip_result_t ttip_png_decode_mem(ttip_png_decoder_t decoder, ttip_image_t* output, const void* data, size_t size, ttip_pool_t pool) {
+#if defined(WITH_PNG)
+	struct png_memsource source = { data, size, 0 };
+	return ttip_loadpng_source(decoder, output, NULL, &source, pool);
+#else
+	return TTIP_NOT_COMPILED_IN;
+#endif
+}
+
+/* one-shot functions using temporary encoder/decoder */
+ttip_result_t ttip_savepng(ttip_image_t source, const char* filename, int level) {
+	ttip_png_encoder_t encoder = NULL;
+	ttip_result_t ret;
+	if ((ret = ttip_png_encoder_create(&encoder)) != TTIP_OK)
+		return ret;
+
+	ttip_png_encoder_setlevel(encoder, level);
+	ret = ttip_png_encode(encoder, source, filename);
+
+	ttip_png_encoder_destroy(&encoder);
+	return ret;
+}
+
+ttip_result_t ttip_savepng_mem(ttip_image_t source, ttip_buffer_t* output, int level) {
+	ttip_png_encoder_t encoder = NULL;
+	ttip_result_t ret;
+	if ((ret = ttip_png_encoder_create(&encoder)) != TTIP_OK)
+		return ret;
+
+	ttip_png_encoder_setlevel(encoder, level);
+	ret = ttip_png_encode_mem(encoder, source, output);
+
+	ttip_png_encoder_destroy(&encoder);
+	return ret;
+}
+
+ttip_result_t ttip_loadpng(ttip_image_t* output, const char* filename) {
+	return ttip_loadpng_pooled(output, filename, NULL);
+}
+
+ttip_result_t ttip_loadpng_pooled(ttip_image_t* output, const char* filename, ttip_pool_t pool) {
+	ttip_png_decoder_t decoder = NULL;
+	ttip_result_t ret;
+	if ((ret = ttip_png_decoder_create(&decoder)) != TTIP_OK)
+		return ret;
+
+	ret = ttip_png_decode(decoder, output, filename, pool);
+
+	ttip_png_decoder_destroy(&decoder);
+	return ret;
+}
+
+ttip_result_t ttip_loadpng_mem(ttip_image_t* output, const void* data, size_t size) {
+	return ttip_loadpng_mem_pooled(output, data, size, NULL);
+}
+
+ttip_result_t ttip_loadpng_mem_pooled(ttip_image_t* output, const void* data, size_t size, ttip_pool_t pool) {
+	ttip_png_decoder_t decoder = NULL;
+	ttip_result_t ret;
+	if ((ret = ttip_png_decoder_create(&decoder)) != TTIP_OK)
+		return ret;
+
+	ret = ttip_png_decode_mem(decoder, output, data, size, pool);
+
+	ttip_png_decoder_destroy(&decoder);
+	return ret;
+}
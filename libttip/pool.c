@@ -0,0 +1,318 @@
+/*
+ * Copyright (C) 2012 Dmitry Marakasov
+ *
+ * This file is part of libttip.
+ *
+ * libttip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libttip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libttip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef WITH_THREADS
+#	include <pthread.h>
+#endif
+
+#include <ttip_int.h>
+
+/* free images of a single (width, height, format, alignment) class */
+struct ttip_pool_bucket {
+	int width;
+	int height;
+	ttip_format_t format;
+	int alignment;
+
+	struct ttip_image* free;
+	struct ttip_pool_bucket* next;
+};
+
+struct ttip_pool {
+	struct ttip_pool_bucket* buckets;
+
+	int nused;       /* images handed out and not yet returned */
+	int orphaned;    /* pool was destroyed while some images were still in use */
+
+	ttip_pool_stats_t stats;
+
+#ifdef WITH_THREADS
+	int shared;      /* may be used from multiple threads */
+	pthread_mutex_t lock;
+#endif
+};
+
+#ifdef WITH_THREADS
+static void ttip_pool_lock(struct ttip_pool* pool) {
+	if (pool->shared)
+		pthread_mutex_lock(&pool->lock);
+}
+
+static void ttip_pool_unlock(struct ttip_pool* pool) {
+	if (pool->shared)
+		pthread_mutex_unlock(&pool->lock);
+}
+
+static void ttip_pool_free(struct ttip_pool* pool) {
+	if (pool->shared)
+		pthread_mutex_destroy(&pool->lock);
+	free(pool);
+}
+#else
+#	define ttip_pool_lock(pool)
+#	define ttip_pool_unlock(pool)
+#	define ttip_pool_free(pool) free(pool)
+#endif
+
+static struct ttip_pool_bucket* ttip_pool_getbucket(struct ttip_pool* pool, int width, int height, ttip_format_t format, int alignment) {
+	struct ttip_pool_bucket* bucket;
+	for (bucket = pool->buckets; bucket != NULL; bucket = bucket->next)
+		if (bucket->width == width && bucket->height == height && bucket->format == format && bucket->alignment == alignment)
+			return bucket;
+
+	if ((bucket = malloc(sizeof(struct ttip_pool_bucket))) == NULL)
+		return NULL;
+
+	bucket->width = width;
+	bucket->height = height;
+	bucket->format = format;
+	bucket->alignment = alignment;
+	bucket->free = NULL;
+	bucket->next = pool->buckets;
+
+	pool->buckets = bucket;
+
+	return bucket;
+}
+
+static void ttip_pool_freeall(struct ttip_pool* pool) {
+	struct ttip_pool_bucket* bucket;
+	while ((bucket = pool->buckets) != NULL) {
+		struct ttip_image* image;
+		while ((image = bucket->free) != NULL) {
+			bucket->free = image->next;
+			free(image);
+		}
+		pool->buckets = bucket->next;
+		free(bucket);
+	}
+
+	pool->stats.bytes_cached = 0;
+}
+
+ttip_result_t ttip_pool_create(ttip_pool_t* output) {
+	struct ttip_pool* pool = malloc(sizeof(struct ttip_pool));
+	if (pool == NULL)
+		return errno;
+
+	memset(pool, 0, sizeof(struct ttip_pool));
+
+	*output = pool;
+
+	return TTIP_OK;
+}
+
+ttip_result_t ttip_pool_create_shared(ttip_pool_t* output) {
+#ifdef WITH_THREADS
+	ttip_result_t ret;
+	if ((ret = ttip_pool_create(output)) != TTIP_OK)
+		return ret;
+
+	if ((ret = pthread_mutex_init(&(*output)->lock, NULL)) != 0) {
+		free(*output);
+		*output = NULL;
+		return ret;
+	}
+
+	(*output)->shared = 1;
+
+	return TTIP_OK;
+#else
+	(void)output; /* unused */
+	return TTIP_NOT_COMPILED_IN;
+#endif
+}
+
+void ttip_pool_destroy(ttip_pool_t* pool) {
+	if (*pool != NULL) {
+		ttip_pool_lock(*pool);
+		ttip_pool_freeall(*pool);
+
+		/* images still in use will free the pool when last of them is returned */
+		if ((*pool)->nused > 0) {
+			(*pool)->orphaned = 1;
+			ttip_pool_unlock(*pool);
+		} else {
+			ttip_pool_unlock(*pool);
+			ttip_pool_free(*pool);
+		}
+
+		*pool = NULL;
+	}
+}
+
+void ttip_pool_trim(ttip_pool_t pool) {
+	ttip_pool_lock(pool);
+	ttip_pool_freeall(pool);
+	ttip_pool_unlock(pool);
+}
+
+void ttip_pool_getstats(ttip_pool_t pool, ttip_pool_stats_t* stats) {
+	ttip_pool_lock(pool);
+	*stats = pool->stats;
+	ttip_pool_unlock(pool);
+}
+
+ttip_result_t ttip_create_ex(ttip_image_t* output, int width, int height, ttip_format_t format, int alignment, ttip_pool_t pool) {
+	if (width <= 0)
+		return TTIP_BAD_DIMENSIONS;
+
+	if (height <= 0)
+		return TTIP_BAD_DIMENSIONS;
+
+	if (ttip_getbpp(format) == 0)
+		return TTIP_BAD_PIXEL_FORMAT;
+
+	if (alignment == 0)
+		alignment = TTIP_DEFAULT_ALIGNMENT;
+
+	if (alignment < 0 || (alignment & (alignment - 1)) != 0)
+		return TTIP_BAD_ALIGNMENT;
+
+	struct ttip_image* newtile;
+
+	if (pool == NULL) {
+		if ((newtile = ttip_alloc_image(width, height, format, alignment)) == NULL)
+			return errno;
+
+		*output = newtile;
+
+		return TTIP_OK;
+	}
+
+	ttip_pool_lock(pool);
+
+	struct ttip_pool_bucket* bucket = ttip_pool_getbucket(pool, width, height, format, alignment);
+	if (bucket == NULL) {
+		ttip_result_t ret = errno;
+		ttip_pool_unlock(pool);
+		return ret;
+	}
+
+	if ((newtile = bucket->free) != NULL) {
+		/* reuse cached image */
+		bucket->free = newtile->next;
+		newtile->next = NULL;
+
+		/* image may have been narrowed in place */
+		newtile->format = newtile->allocformat;
+
+		pool->stats.hits++;
+		pool->stats.bytes_cached -= newtile->allocsize;
+	} else {
+		/* allocation is not worth holding the lock */
+		ttip_pool_unlock(pool);
+		if ((newtile = ttip_alloc_image(width, height, format, alignment)) == NULL)
+			return errno;
+		ttip_pool_lock(pool);
+
+		newtile->pool = pool;
+
+		pool->stats.misses++;
+	}
+
+	pool->nused++;
+	pool->stats.bytes_used += newtile->allocsize;
+
+	if (pool->stats.bytes_used + pool->stats.bytes_cached > pool->stats.peak_bytes)
+		pool->stats.peak_bytes = pool->stats.bytes_used + pool->stats.bytes_cached;
+
+	ttip_pool_unlock(pool);
+
+	*output = newtile;
+
+	return TTIP_OK;
+}
+
+ttip_result_t ttip_create_uniform(ttip_image_t* output, int width, int height, ttip_format_t format, ttip_color_t color, ttip_pool_t pool) {
+	if (width <= 0)
+		return TTIP_BAD_DIMENSIONS;
+
+	if (height <= 0)
+		return TTIP_BAD_DIMENSIONS;
+
+	if (ttip_getbpp(format) == 0)
+		return TTIP_BAD_PIXEL_FORMAT;
+
+	/* single row is allocated, which is small enough to not be cached
+	 * in the pool; it still counts as used so pool outlives it */
+	struct ttip_image* newtile;
+	if ((newtile = ttip_alloc_image(width, 1, format, TTIP_DEFAULT_ALIGNMENT)) == NULL)
+		return errno;
+
+	newtile->height = height;
+	newtile->uniform = 1;
+	ttip_setuniform(newtile, color);
+
+	if (pool != NULL) {
+		newtile->pool = pool;
+
+		ttip_pool_lock(pool);
+		pool->nused++;
+		pool->stats.bytes_used += newtile->allocsize;
+
+		if (pool->stats.bytes_used + pool->stats.bytes_cached > pool->stats.peak_bytes)
+			pool->stats.peak_bytes = pool->stats.bytes_used + pool->stats.bytes_cached;
+		ttip_pool_unlock(pool);
+	}
+
+	*output = newtile;
+
+	return TTIP_OK;
+}
+
+void ttip_pool_release(struct ttip_image* image) {
+	struct ttip_pool* pool = image->pool;
+
+	ttip_pool_lock(pool);
+
+	pool->nused--;
+	pool->stats.bytes_used -= image->allocsize;
+
+	/* uniform images (even materialized ones) are not cached */
+	if (pool->orphaned || image->uniform || image->extdata != NULL) {
+		int last = pool->orphaned && pool->nused == 0;
+		ttip_pool_unlock(pool);
+
+		free(image->extdata);
+		free(image);
+		if (last)
+			ttip_pool_free(pool);
+		return;
+	}
+
+	struct ttip_pool_bucket* bucket = ttip_pool_getbucket(pool, image->width, image->height, image->allocformat, image->alignment);
+	if (bucket == NULL) {
+		/* cannot cache image, just drop it */
+		ttip_pool_unlock(pool);
+		free(image);
+		return;
+	}
+
+	image->next = bucket->free;
+	bucket->free = image;
+
+	pool->stats.bytes_cached += image->allocsize;
+
+	ttip_pool_unlock(pool);
+}
@@ -21,45 +21,98 @@
 
 #include <ttip_int.h>
 
+/* destination may be the same image as source, as pixels are only moved towards row start */
+static void ttip_desaturate_process(ttip_image_t destination, ttip_image_t source, int srcstep, int dststep) {
+	unsigned char *srcrow, *dstrow, *src, *dst;
+	for (srcrow = source->data, dstrow = destination->data;
+			srcrow < source->data + source->height * source->stride;
+			srcrow += source->stride, dstrow += destination->stride) {
+		for (src = srcrow, dst = dstrow; src < srcrow + source->width * srcstep; src += srcstep, dst += dststep) {
+			unsigned char value = desaturate(src[0], src[1], src[2]);
+			if (dststep == 2)
+				dst[1] = src[3];
+			dst[0] = value;
+		}
+	}
+}
+
+static int ttip_desaturate_format(ttip_format_t format, ttip_format_t* dstformat, int* srcstep, int* dststep) {
+	switch (format) {
+	case TTIP_RGB:
+		*dstformat = TTIP_GRAY;
+		*srcstep = 3;
+		*dststep = 1;
+		return 1;
+	case TTIP_RGB_ALPHA:
+		*dstformat = TTIP_GRAY_ALPHA;
+		*srcstep = 4;
+		*dststep = 2;
+		return 1;
+	default:
+		return 0;
+	}
+}
+
 ttip_result_t ttip_desaturate(ttip_image_t* output, ttip_image_t source) {
 	ttip_format_t dstformat;
 	int srcstep, dststep;
 
-	switch (source->format) {
-	case TTIP_GRAY:
-	case TTIP_GRAY_ALPHA:
+	if (source->format == TTIP_GRAY || source->format == TTIP_GRAY_ALPHA)
 		return ttip_clone(output, source);
-	case TTIP_RGB:
-		dstformat = TTIP_GRAY;
-		srcstep = 3;
-		dststep = 1;
-		break;
-	case TTIP_RGB_ALPHA:
-		dstformat = TTIP_GRAY_ALPHA;
-		srcstep = 4;
-		dststep = 2;
-		break;
-	default:
+
+	if (!ttip_desaturate_format(source->format, &dstformat, &srcstep, &dststep))
 		return TTIP_BAD_PIXEL_FORMAT;
-	}
 
 	/* allocate tile */
 	int ret;
 	struct ttip_image* destination;
-	if ((ret = ttip_create(&destination, source->width, source->height, dstformat)) != TTIP_OK)
+
+	if (source->uniform) {
+		/* only process single row of uniform image */
+		if ((ret = ttip_create_uniform(&destination, source->width, source->height, dstformat, 0, source->pool)) != TTIP_OK)
+			return ret;
+
+		struct ttip_image srcview = ttip_uniform_view(source), dstview = ttip_uniform_view(destination);
+		ttip_desaturate_process(&dstview, &srcview, srcstep, dststep);
+		ttip_uniform_sync(destination);
+
+		*output = destination;
+
+		return TTIP_OK;
+	}
+
+	if ((ret = ttip_create_pooled(&destination, source->width, source->height, dstformat, source->pool)) != TTIP_OK)
 		return ret;
 
 	/* process */
-	unsigned char *srcrow, *dstrow, *src, *dst;
-	for (srcrow = source->data, dstrow = destination->data;
-			srcrow < source->data + source->height * source->stride;
-			srcrow += source->stride, dstrow += destination->stride) {
-		for (src = srcrow, dst = dstrow; src < srcrow + source->width * srcstep; src += srcstep, dst += dststep) {
-			*dst = desaturate(src[0], src[1], src[2]);
-		}
-	}
+	ttip_desaturate_process(destination, source, srcstep, dststep);
 
 	*output = destination;
 
 	return TTIP_OK;
 }
+
+ttip_result_t ttip_desaturate_inplace(ttip_image_t target) {
+	ttip_format_t dstformat;
+	int srcstep, dststep;
+
+	if (target->format == TTIP_GRAY || target->format == TTIP_GRAY_ALPHA)
+		return TTIP_OK;
+
+	if (!ttip_desaturate_format(target->format, &dstformat, &srcstep, &dststep))
+		return TTIP_BAD_PIXEL_FORMAT;
+
+	if (target->uniform) {
+		struct ttip_image view = ttip_uniform_view(target);
+		ttip_desaturate_process(&view, &view, srcstep, dststep);
+	} else {
+		ttip_desaturate_process(target, target, srcstep, dststep);
+	}
+
+	target->format = dstformat;
+
+	if (target->uniform)
+		ttip_uniform_sync(target);
+
+	return TTIP_OK;
+}
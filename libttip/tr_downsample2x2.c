@@ -18,38 +18,261 @@
  */
 
 #include <errno.h>
+#include <string.h>
 
 #include <ttip_int.h>
+#include <ttip_simd.h>
 
-static void ttip_downsample_single(ttip_image_t target, ttip_image_t source, int xoffset, int yoffset) {
-	unsigned char *srcrow1, *srcrow2, *dstrow;
-	unsigned char *src1, *src2, *dst;
+/*
+ * Scalar implementation, specialized for each pixel size
+ */
+static inline void downsample_row_generic(unsigned char* dst, const unsigned char* src1, const unsigned char* src2, int width, int step) {
+	const unsigned char* dstend = dst + width * step;
+	int i;
+	for (; dst < dstend; dst += step, src1 += step * 2, src2 += step * 2) {
+		for (i = 0; i < step; i++) {
+			/* add 2 to round to nearest */
+			dst[i] = ((int)src1[i] + (int)src1[i + step] + (int)src2[i] + (int)src2[i + step] + 2)/4;
+		}
+	}
+}
+
+static void downsample_row_1(unsigned char* dst, const unsigned char* src1, const unsigned char* src2, int width) {
+	downsample_row_generic(dst, src1, src2, width, 1);
+}
+
+static void downsample_row_2(unsigned char* dst, const unsigned char* src1, const unsigned char* src2, int width) {
+	downsample_row_generic(dst, src1, src2, width, 2);
+}
+
+static void downsample_row_3(unsigned char* dst, const unsigned char* src1, const unsigned char* src2, int width) {
+	downsample_row_generic(dst, src1, src2, width, 3);
+}
+
+static void downsample_row_4(unsigned char* dst, const unsigned char* src1, const unsigned char* src2, int width) {
+	downsample_row_generic(dst, src1, src2, width, 4);
+}
+
+#if defined(TTIP_X86_SIMD)
+/*
+ * Vector implementations
+ *
+ * Sums of 4 bytes are calculated in 16 bit lanes, so rounding is the
+ * same as in scalar code. Pixels which don't fill a whole vector are
+ * left to scalar code.
+ */
+
+/* (a + b + c + d + 2) / 4 for 16 bit lanes */
+TTIP_TARGET_INLINE("sse2") __m128i average4_sse2(__m128i a, __m128i b, __m128i c, __m128i d) {
+	__m128i sum = _mm_add_epi16(_mm_add_epi16(a, b), _mm_add_epi16(c, d));
+	return _mm_srli_epi16(_mm_add_epi16(sum, _mm_set1_epi16(2)), 2);
+}
+
+TTIP_TARGET_INLINE("sse2") void downsample_row_1_sse2(unsigned char* dst, const unsigned char* src1, const unsigned char* src2, int width, int aligned) {
+	const __m128i lowmask = _mm_set1_epi16(0xff);
+	int x;
+	for (x = 0; x + 16 <= width; x += 16) {
+		__m128i r;
+		__m128i a1 = ttip_load128(src1 + x * 2, aligned);
+		__m128i b1 = ttip_load128(src1 + x * 2 + 16, aligned);
+		__m128i a2 = ttip_load128(src2 + x * 2, aligned);
+		__m128i b2 = ttip_load128(src2 + x * 2 + 16, aligned);
+
+		/* horizontal neighbours are low and high bytes of 16 bit lanes */
+		__m128i lo = average4_sse2(_mm_and_si128(a1, lowmask), _mm_srli_epi16(a1, 8), _mm_and_si128(a2, lowmask), _mm_srli_epi16(a2, 8));
+		__m128i hi = average4_sse2(_mm_and_si128(b1, lowmask), _mm_srli_epi16(b1, 8), _mm_and_si128(b2, lowmask), _mm_srli_epi16(b2, 8));
+
+		r = _mm_packus_epi16(lo, hi);
+		ttip_store128(dst + x, r, aligned);
+	}
+
+	downsample_row_1(dst + x, src1 + x * 2, src2 + x * 2, width - x);
+}
+
+/* average 4 pixels of 2 bytes each from 16 source bytes of each row,
+ * producing them in low bytes of 32 bit lanes */
+TTIP_TARGET_INLINE("sse2") __m128i downsample4_2_sse2(const unsigned char* src1, const unsigned char* src2, int aligned) {
+	const __m128i mask = _mm_set1_epi32(0x00ff00ff);
+	__m128i v1 = ttip_load128(src1, aligned);
+	__m128i v2 = ttip_load128(src2, aligned);
+
+	/* first and second channels of both pixels of a pair, as 16 bit lanes */
+	__m128i c0 = _mm_add_epi16(_mm_and_si128(v1, mask), _mm_and_si128(v2, mask));
+	__m128i c1 = _mm_add_epi16(_mm_and_si128(_mm_srli_epi16(v1, 8), mask), _mm_and_si128(_mm_srli_epi16(v2, 8), mask));
+
+	/* sum pixels of a pair */
+	c0 = _mm_add_epi16(c0, _mm_srli_epi32(c0, 16));
+	c1 = _mm_add_epi16(c1, _mm_srli_epi32(c1, 16));
+
+	c0 = _mm_srli_epi16(_mm_add_epi16(c0, _mm_set1_epi16(2)), 2);
+	c1 = _mm_srli_epi16(_mm_add_epi16(c1, _mm_set1_epi16(2)), 2);
+
+	__m128i r = _mm_or_si128(_mm_and_si128(c0, _mm_set1_epi32(0xff)), _mm_slli_epi32(_mm_and_si128(c1, _mm_set1_epi32(0xff)), 8));
+
+	/* sign extend so signed saturating pack keeps values intact */
+	return _mm_srai_epi32(_mm_slli_epi32(r, 16), 16);
+}
+
+TTIP_TARGET_INLINE("sse2") void downsample_row_2_sse2(unsigned char* dst, const unsigned char* src1, const unsigned char* src2, int width, int aligned) {
+	int x;
+	for (x = 0; x + 8 <= width; x += 8) {
+		__m128i lo = downsample4_2_sse2(src1 + x * 4, src2 + x * 4, aligned);
+		__m128i hi = downsample4_2_sse2(src1 + x * 4 + 16, src2 + x * 4 + 16, aligned);
+		ttip_store128(dst + x * 2, _mm_packs_epi32(lo, hi), aligned);
+	}
+
+	downsample_row_2(dst + x * 2, src1 + x * 4, src2 + x * 4, width - x);
+}
+
+/* average 2 pixels of 4 bytes each from 16 source bytes of each row,
+ * as 16 bit lanes */
+TTIP_TARGET_INLINE("sse2") __m128i downsample2_4_sse2(const unsigned char* src1, const unsigned char* src2, int aligned) {
+	const __m128i zero = _mm_setzero_si128();
+	__m128i v1 = ttip_load128(src1, aligned);
+	__m128i v2 = ttip_load128(src2, aligned);
+
+	__m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(v1, zero), _mm_unpacklo_epi8(v2, zero));
+	__m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(v1, zero), _mm_unpackhi_epi8(v2, zero));
+
+	/* each of lo, hi holds a pair of pixels in 64 bit halves */
+	__m128i sum = _mm_add_epi16(_mm_unpacklo_epi64(lo, hi), _mm_unpackhi_epi64(lo, hi));
+	return _mm_srli_epi16(_mm_add_epi16(sum, _mm_set1_epi16(2)), 2);
+}
+
+TTIP_TARGET_INLINE("sse2") void downsample_row_4_sse2(unsigned char* dst, const unsigned char* src1, const unsigned char* src2, int width, int aligned) {
+	int x;
+	for (x = 0; x + 4 <= width; x += 4) {
+		__m128i lo = downsample2_4_sse2(src1 + x * 8, src2 + x * 8, aligned);
+		__m128i hi = downsample2_4_sse2(src1 + x * 8 + 16, src2 + x * 8 + 16, aligned);
+		ttip_store128(dst + x * 4, _mm_packus_epi16(lo, hi), aligned);
+	}
+
+	downsample_row_4(dst + x * 4, src1 + x * 8, src2 + x * 8, width - x);
+}
+
+TTIP_TARGET("sse2") static void downsample_row_1_sse2_u(unsigned char* dst, const unsigned char* src1, const unsigned char* src2, int width) {
+	downsample_row_1_sse2(dst, src1, src2, width, 0);
+}
+
+TTIP_TARGET("sse2") static void downsample_row_1_sse2_a(unsigned char* dst, const unsigned char* src1, const unsigned char* src2, int width) {
+	downsample_row_1_sse2(dst, src1, src2, width, 1);
+}
+
+TTIP_TARGET("sse2") static void downsample_row_2_sse2_u(unsigned char* dst, const unsigned char* src1, const unsigned char* src2, int width) {
+	downsample_row_2_sse2(dst, src1, src2, width, 0);
+}
+
+TTIP_TARGET("sse2") static void downsample_row_2_sse2_a(unsigned char* dst, const unsigned char* src1, const unsigned char* src2, int width) {
+	downsample_row_2_sse2(dst, src1, src2, width, 1);
+}
+
+TTIP_TARGET("sse2") static void downsample_row_4_sse2_u(unsigned char* dst, const unsigned char* src1, const unsigned char* src2, int width) {
+	downsample_row_4_sse2(dst, src1, src2, width, 0);
+}
+
+TTIP_TARGET("sse2") static void downsample_row_4_sse2_a(unsigned char* dst, const unsigned char* src1, const unsigned char* src2, int width) {
+	downsample_row_4_sse2(dst, src1, src2, width, 1);
+}
+
+/* 3 byte pixels need byte shuffles to separate even and odd pixels */
+TTIP_TARGET_INLINE("ssse3") void downsample_split_3_ssse3(const unsigned char* src, __m128i* even, __m128i* odd) {
+	/* 8 pixels (24 bytes) as two overlapping loads */
+	__m128i a = _mm_loadu_si128((const __m128i*)src);
+	__m128i b = _mm_loadu_si128((const __m128i*)(src + 8));
+
+	*even = _mm_or_si128(
+			_mm_shuffle_epi8(a, _mm_setr_epi8(0, 1, 2, 6, 7, 8, 12, 13, 14, -1, -1, -1, -1, -1, -1, -1)),
+			_mm_shuffle_epi8(b, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, 10, 11, 12, -1, -1, -1, -1))
+		);
+	*odd = _mm_or_si128(
+			_mm_shuffle_epi8(a, _mm_setr_epi8(3, 4, 5, 9, 10, 11, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+			_mm_shuffle_epi8(b, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 7, 8, 9, 13, 14, 15, -1, -1, -1, -1))
+		);
+}
+
+TTIP_TARGET("ssse3") static void downsample_row_3_ssse3(unsigned char* dst, const unsigned char* src1, const unsigned char* src2, int width) {
+	const __m128i zero = _mm_setzero_si128();
+	int x;
+	for (x = 0; x + 4 <= width; x += 4) {
+		__m128i e1, o1, e2, o2;
+		downsample_split_3_ssse3(src1 + x * 6, &e1, &o1);
+		downsample_split_3_ssse3(src2 + x * 6, &e2, &o2);
+
+		__m128i lo = average4_sse2(_mm_unpacklo_epi8(e1, zero), _mm_unpacklo_epi8(o1, zero), _mm_unpacklo_epi8(e2, zero), _mm_unpacklo_epi8(o2, zero));
+		__m128i hi = average4_sse2(_mm_unpackhi_epi8(e1, zero), _mm_unpackhi_epi8(o1, zero), _mm_unpackhi_epi8(e2, zero), _mm_unpackhi_epi8(o2, zero));
+		__m128i r = _mm_packus_epi16(lo, hi);
+
+		/* store exactly 12 bytes, as next bytes belong to another quadrant */
+		int tail = _mm_cvtsi128_si32(_mm_srli_si128(r, 8));
+		_mm_storel_epi64((__m128i*)(dst + x * 3), r);
+		memcpy(dst + x * 3 + 8, &tail, 4);
+	}
+
+	downsample_row_3(dst + x * 3, src1 + x * 6, src2 + x * 6, width - x);
+}
+#endif
+
+downsample_row_func ttip_downsample_select(int bpp, int aligned) {
+#if defined(TTIP_X86_SIMD)
+	ttip_simd_t simd = ttip_getsimd();
+#else
+	(void)aligned; /* unused */
+#endif
+
+	switch (bpp) {
+	case 1:
+#if defined(TTIP_X86_SIMD)
+		if (simd >= TTIP_SIMD_SSE2)
+			return aligned ? downsample_row_1_sse2_a : downsample_row_1_sse2_u;
+#endif
+		return downsample_row_1;
+	case 2:
+#if defined(TTIP_X86_SIMD)
+		if (simd >= TTIP_SIMD_SSE2)
+			return aligned ? downsample_row_2_sse2_a : downsample_row_2_sse2_u;
+#endif
+		return downsample_row_2;
+	case 3:
+#if defined(TTIP_X86_SIMD)
+		if (simd >= TTIP_SIMD_SSSE3)
+			return downsample_row_3_ssse3;
+#endif
+		return downsample_row_3;
+	case 4:
+#if defined(TTIP_X86_SIMD)
+		if (simd >= TTIP_SIMD_SSE2)
+			return aligned ? downsample_row_4_sse2_a : downsample_row_4_sse2_u;
+#endif
+		return downsample_row_4;
+	}
+
+	return NULL;
+}
+
+static void ttip_downsample_single(ttip_image_t target, ttip_image_t source, int xoffset, int yoffset, downsample_row_func func) {
+	unsigned char *srcrow, *dstrow;
 
 	int step = ttip_getbpp(source->format);
 
-	for (srcrow1 = source->data, dstrow = target->data + target->stride * yoffset;
-			srcrow1 < source->data + source->stride * source->height;
-			srcrow1 += source->stride * 2, dstrow += target->stride) {
-		srcrow2 = srcrow1 + source->stride;
-		int pos = 0;
-		for (src1 = srcrow1, src2 = srcrow2, dst = dstrow + xoffset * step;
-				src1 < srcrow1 + source->width * step;
-				src1++, src2++, dst++) {
+	if (source->uniform) {
+		/* quadrant is uniform as well, so downsample a single row and replicate it */
+		dstrow = target->data + target->stride * yoffset + xoffset * step;
+		func(dstrow, source->data, source->data, source->width / 2);
 
-			/* add 2 to round to nearest */
-			dst[0] = ((int)src1[0] + (int)src1[step] + (int)src2[0] + (int)src2[step] + 2)/4;
+		int y;
+		for (y = 1; y < source->height / 2; y++)
+			memcpy(dstrow + target->stride * y, dstrow, source->width / 2 * step);
+		return;
+	}
 
-			if (++pos == step) {
-				src1 += step;
-				src2 += step;
-				pos = 0;
-			}
-		}
+	for (srcrow = source->data, dstrow = target->data + target->stride * yoffset + xoffset * step;
+			srcrow < source->data + source->stride * source->height;
+			srcrow += source->stride * 2, dstrow += target->stride) {
+		func(dstrow, srcrow, srcrow + source->stride, source->width / 2);
 	}
 }
 
-ttip_result_t ttip_downsample2x2(ttip_image_t* output, ttip_image_t topleft, ttip_image_t topright, ttip_image_t bottomleft, ttip_image_t bottomright) {
-	/* check that all params match */
+ttip_result_t ttip_downsample_check(ttip_image_t topleft, ttip_image_t topright, ttip_image_t bottomleft, ttip_image_t bottomright) {
 	ttip_image_t arr[4] = { topleft, topright, bottomleft, bottomright };
 	int i;
 	for (i = 1; i < 4; ++i) {
@@ -64,17 +287,40 @@ ttip_result_t ttip_downsample2x2(ttip_image_t* output, ttip_image_t topleft, tti
 	if ((topleft->width & 1) || (topleft->height & 1))
 		return TTIP_EVEN_DIMENSIONS_REQUIRED;
 
-	/* allocate tile */
+	return TTIP_OK;
+}
+
+ttip_result_t ttip_downsample2x2(ttip_image_t* output, ttip_image_t topleft, ttip_image_t topright, ttip_image_t bottomleft, ttip_image_t bottomright) {
+	ttip_image_t arr[4] = { topleft, topright, bottomleft, bottomright };
+	int i;
+
+	/* check that all params match */
 	int ret;
+	if ((ret = ttip_downsample_check(topleft, topright, bottomleft, bottomright)) != TTIP_OK)
+		return ret;
+
+	/* four uniform images of the same color produce the same color */
+	if (topleft->uniform && topright->uniform && bottomleft->uniform && bottomright->uniform &&
+			topleft->color == topright->color && topleft->color == bottomleft->color && topleft->color == bottomright->color)
+		return ttip_create_uniform(output, topleft->width, topleft->height, topleft->format, topleft->color, topleft->pool);
+
+	/* allocate tile */
 	struct ttip_image* destination;
-   	if ((ret = ttip_create(&destination, topleft->width, topleft->height, topleft->format)) != TTIP_OK)
+   	if ((ret = ttip_create_pooled(&destination, topleft->width, topleft->height, topleft->format, topleft->pool)) != TTIP_OK)
 		return ret;
 
 	/* process */
-	ttip_downsample_single(destination, topleft, 0, 0);
-	ttip_downsample_single(destination, topright, topleft->width/2, 0);
-	ttip_downsample_single(destination, bottomleft, 0, topleft->height/2);
-	ttip_downsample_single(destination, bottomright, topleft->width/2, topleft->height/2);
+	/* rows of all images and quadrants of destination should be aligned for aligned kernels */
+	int aligned = ttip_isaligned(destination, 16) && (topleft->width / 2 * ttip_getbpp(topleft->format)) % 16 == 0;
+	for (i = 0; i < 4; ++i)
+		aligned = aligned && ttip_isaligned(arr[i], 16);
+
+	downsample_row_func func = ttip_downsample_select(ttip_getbpp(topleft->format), aligned);
+
+	ttip_downsample_single(destination, topleft, 0, 0, func);
+	ttip_downsample_single(destination, topright, topleft->width/2, 0, func);
+	ttip_downsample_single(destination, bottomleft, 0, topleft->height/2, func);
+	ttip_downsample_single(destination, bottomright, topleft->width/2, topleft->height/2, func);
 
 	*output = destination;
 
@@ -19,84 +19,508 @@
 
 #include <errno.h>
 #include <assert.h>
+#include <string.h>
 
 #include <ttip_int.h>
+#include <ttip_simd.h>
 
-ttip_result_t ttip_maskblend(ttip_image_t* output, ttip_image_t background, ttip_image_t overlay) {
-	if (background->width != overlay->width)
+/* background/overlay format combinations */
+enum {
+	MASKBLEND_GRAY_GRAYA,
+	MASKBLEND_GRAY_RGBA,
+	MASKBLEND_RGB_GRAYA,
+	MASKBLEND_RGB_RGBA,
+	MASKBLEND_NCOMBINATIONS,
+};
+
+/*
+ * Scalar implementation
+ */
+static void maskblend_row_gray_graya(unsigned char* dst, const unsigned char* bg, const unsigned char* ovr, int width) {
+	const unsigned char* bgend;
+	for (bgend = bg + width; bg < bgend; bg++, ovr += 2, dst++) {
+		dst[0] = (bg[0] * (255 - ovr[1]) + ovr[0] * ovr[1]) / 255;
+	}
+}
+
+static void maskblend_row_gray_rgba(unsigned char* dst, const unsigned char* bg, const unsigned char* ovr, int width) {
+	const unsigned char* bgend;
+	for (bgend = bg + width; bg < bgend; bg++, ovr += 4, dst += 3) {
+		int background_component = bg[0] * (255 - ovr[3]);
+		dst[0] = (background_component + ovr[0] * ovr[3]) / 255;
+		dst[1] = (background_component + ovr[1] * ovr[3]) / 255;
+		dst[2] = (background_component + ovr[2] * ovr[3]) / 255;
+	}
+}
+
+static void maskblend_row_rgb_graya(unsigned char* dst, const unsigned char* bg, const unsigned char* ovr, int width) {
+	const unsigned char* bgend;
+	for (bgend = bg + width * 3; bg < bgend; bg += 3, ovr += 2, dst += 3) {
+		int overlay_component = ovr[0] * ovr[1];
+		dst[0] = (bg[0] * (255 - ovr[1]) + overlay_component) / 255;
+		dst[1] = (bg[1] * (255 - ovr[1]) + overlay_component) / 255;
+		dst[2] = (bg[2] * (255 - ovr[1]) + overlay_component) / 255;
+	}
+}
+
+static void maskblend_row_rgb_rgba(unsigned char* dst, const unsigned char* bg, const unsigned char* ovr, int width) {
+	const unsigned char* bgend;
+	for (bgend = bg + width * 3; bg < bgend; bg += 3, ovr += 4, dst += 3) {
+		dst[0] = (bg[0] * (255 - ovr[3]) + ovr[0] * ovr[3]) / 255;
+		dst[1] = (bg[1] * (255 - ovr[3]) + ovr[1] * ovr[3]) / 255;
+		dst[2] = (bg[2] * (255 - ovr[3]) + ovr[2] * ovr[3]) / 255;
+	}
+}
+
+static const maskblend_row_func maskblend_row_scalar[MASKBLEND_NCOMBINATIONS] = {
+	maskblend_row_gray_graya,
+	maskblend_row_gray_rgba,
+	maskblend_row_rgb_graya,
+	maskblend_row_rgb_rgba,
+};
+
+#if defined(TTIP_X86_SIMD)
+/*
+ * Vector implementations
+ *
+ * All of these work on 16 bit lanes and replace division by 255 with
+ * (x * 0x8081) >> 23, which is exact for any 16 bit x, so results are
+ * identical to the scalar code. Pixels which don't fill a whole vector
+ * are left to scalar code.
+ *
+ * RGB output is processed in RGBX layout: background and overlay color
+ * are expanded to 4 bytes per pixel, overlay alpha is broadcast to all
+ * 4 bytes, and the unused X byte is dropped on store.
+ */
+
+TTIP_TARGET_INLINE("sse2") __m128i blend16_sse2(__m128i bg, __m128i color, __m128i alpha) {
+	__m128i x = _mm_add_epi16(
+			_mm_mullo_epi16(bg, _mm_sub_epi16(_mm_set1_epi16(255), alpha)),
+			_mm_mullo_epi16(color, alpha)
+		);
+	return _mm_srli_epi16(_mm_mulhi_epu16(x, _mm_set1_epi16((short)0x8081)), 7);
+}
+
+/* blend 4 RGBX pixels given as bytes */
+TTIP_TARGET_INLINE("sse2") __m128i blend4_rgbx_sse2(__m128i bg, __m128i color, __m128i alpha) {
+	const __m128i zero = _mm_setzero_si128();
+	__m128i lo = blend16_sse2(_mm_unpacklo_epi8(bg, zero), _mm_unpacklo_epi8(color, zero), _mm_unpacklo_epi8(alpha, zero));
+	__m128i hi = blend16_sse2(_mm_unpackhi_epi8(bg, zero), _mm_unpackhi_epi8(color, zero), _mm_unpackhi_epi8(alpha, zero));
+	return _mm_packus_epi16(lo, hi);
+}
+
+TTIP_TARGET_INLINE("sse2") void maskblend_row_gray_graya_sse2(unsigned char* dst, const unsigned char* bg, const unsigned char* ovr, int width, int aligned) {
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i lowmask = _mm_set1_epi16(0xff);
+	int x;
+	for (x = 0; x + 8 <= width; x += 8) {
+		__m128i o = ttip_load128(ovr + x * 2, aligned);
+		__m128i b = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(bg + x)), zero);
+		__m128i r = blend16_sse2(b, _mm_and_si128(o, lowmask), _mm_srli_epi16(o, 8));
+		_mm_storel_epi64((__m128i*)(dst + x), _mm_packus_epi16(r, r));
+	}
+
+	maskblend_row_gray_graya(dst + x, bg + x, ovr + x * 2, width - x);
+}
+
+TTIP_TARGET("sse2") static void maskblend_row_gray_graya_sse2_u(unsigned char* dst, const unsigned char* bg, const unsigned char* ovr, int width) {
+	maskblend_row_gray_graya_sse2(dst, bg, ovr, width, 0);
+}
+
+TTIP_TARGET("sse2") static void maskblend_row_gray_graya_sse2_a(unsigned char* dst, const unsigned char* bg, const unsigned char* ovr, int width) {
+	maskblend_row_gray_graya_sse2(dst, bg, ovr, width, 1);
+}
+
+/* SSE2 has no byte shuffles, so 3 byte pixels are moved into
+ * (and out of) 4 byte slots with whole register byte shifts */
+TTIP_TARGET_INLINE("sse2") __m128i load4_rgb_sse2(const unsigned char* src) {
+	int tail;
+	memcpy(&tail, src + 8, 4);
+	__m128i v = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i*)src), _mm_cvtsi32_si128(tail));
+
+	return _mm_or_si128(
+			_mm_or_si128(
+				_mm_and_si128(v, _mm_setr_epi32(0xffffff, 0, 0, 0)),
+				_mm_and_si128(_mm_slli_si128(v, 1), _mm_setr_epi32(0, 0xffffff, 0, 0))
+			),
+			_mm_or_si128(
+				_mm_and_si128(_mm_slli_si128(v, 2), _mm_setr_epi32(0, 0, 0xffffff, 0)),
+				_mm_and_si128(_mm_slli_si128(v, 3), _mm_setr_epi32(0, 0, 0, 0xffffff))
+			)
+		);
+}
+
+TTIP_TARGET_INLINE("sse2") void store4_rgb_sse2(unsigned char* dst, __m128i v) {
+	__m128i r = _mm_or_si128(
+			_mm_or_si128(
+				_mm_and_si128(v, _mm_setr_epi32(0xffffff, 0, 0, 0)),
+				_mm_srli_si128(_mm_and_si128(v, _mm_setr_epi32(0, 0xffffff, 0, 0)), 1)
+			),
+			_mm_or_si128(
+				_mm_srli_si128(_mm_and_si128(v, _mm_setr_epi32(0, 0, 0xffffff, 0)), 2),
+				_mm_srli_si128(_mm_and_si128(v, _mm_setr_epi32(0, 0, 0, 0xffffff)), 3)
+			)
+		);
+
+	int tail = _mm_cvtsi128_si32(_mm_srli_si128(r, 8));
+	_mm_storel_epi64((__m128i*)dst, r);
+	memcpy(dst + 8, &tail, 4);
+}
+
+TTIP_TARGET_INLINE("sse2") __m128i load4_gray_sse2(const unsigned char* src) {
+	int tmp;
+	memcpy(&tmp, src, 4);
+	__m128i v = _mm_cvtsi32_si128(tmp);
+	v = _mm_unpacklo_epi8(v, v);
+	return _mm_unpacklo_epi16(v, v);
+}
+
+TTIP_TARGET_INLINE("sse2") void load4_rgba_sse2(const unsigned char* src, __m128i* color, __m128i* alpha) {
+	__m128i v = _mm_loadu_si128((const __m128i*)src);
+	/* broadcast alpha byte over all bytes of a pixel */
+	__m128i a = _mm_srli_epi32(v, 24);
+	a = _mm_or_si128(a, _mm_slli_epi32(a, 8));
+	*alpha = _mm_or_si128(a, _mm_slli_epi32(a, 16));
+	*color = v;
+}
+
+TTIP_TARGET_INLINE("sse2") void load4_graya_sse2(const unsigned char* src, __m128i* color, __m128i* alpha) {
+	/* 4 pixels as 16 bit (gray | alpha << 8) words, expand to 32 bits */
+	__m128i v = _mm_loadl_epi64((const __m128i*)src);
+	v = _mm_unpacklo_epi16(v, v);
+	__m128i g = _mm_and_si128(v, _mm_set1_epi32(0xff));
+	__m128i a = _mm_srli_epi32(_mm_and_si128(v, _mm_set1_epi32(0xff00)), 8);
+	g = _mm_or_si128(g, _mm_slli_epi32(g, 8));
+	a = _mm_or_si128(a, _mm_slli_epi32(a, 8));
+	*color = _mm_or_si128(g, _mm_slli_epi32(g, 16));
+	*alpha = _mm_or_si128(a, _mm_slli_epi32(a, 16));
+}
+
+TTIP_TARGET_INLINE("sse2") void maskblend_row_rgbx_sse2(unsigned char* dst, const unsigned char* bg, const unsigned char* ovr, int width, int bgbpp, int ovrbpp) {
+	int x;
+	for (x = 0; x + 4 <= width; x += 4) {
+		__m128i b = (bgbpp == 3) ? load4_rgb_sse2(bg + x * 3) : load4_gray_sse2(bg + x);
+		__m128i c, a;
+		if (ovrbpp == 4)
+			load4_rgba_sse2(ovr + x * 4, &c, &a);
+		else
+			load4_graya_sse2(ovr + x * 2, &c, &a);
+		store4_rgb_sse2(dst + x * 3, blend4_rgbx_sse2(b, c, a));
+	}
+
+	maskblend_row_scalar[(bgbpp == 3 ? MASKBLEND_RGB_GRAYA : MASKBLEND_GRAY_GRAYA) + (ovrbpp == 4)](dst + x * 3, bg + x * bgbpp, ovr + x * ovrbpp, width - x);
+}
+
+TTIP_TARGET("sse2") static void maskblend_row_gray_rgba_sse2(unsigned char* dst, const unsigned char* bg, const unsigned char* ovr, int width) {
+	maskblend_row_rgbx_sse2(dst, bg, ovr, width, 1, 4);
+}
+
+TTIP_TARGET("sse2") static void maskblend_row_rgb_graya_sse2(unsigned char* dst, const unsigned char* bg, const unsigned char* ovr, int width) {
+	maskblend_row_rgbx_sse2(dst, bg, ovr, width, 3, 2);
+}
+
+TTIP_TARGET("sse2") static void maskblend_row_rgb_rgba_sse2(unsigned char* dst, const unsigned char* bg, const unsigned char* ovr, int width) {
+	maskblend_row_rgbx_sse2(dst, bg, ovr, width, 3, 4);
+}
+
+/* shuffle masks for SSSE3/AVX2 (the latter uses same mask for both lanes) */
+#define SHUF_RGB_TO_RGBX  0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1
+#define SHUF_RGBX_TO_RGB  0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1
+#define SHUF_GRAY_TO_RGBX 0, 0, 0, -1, 1, 1, 1, -1, 2, 2, 2, -1, 3, 3, 3, -1
+#define SHUF_RGBA_ALPHA   3, 3, 3, 3, 7, 7, 7, 7, 11, 11, 11, 11, 15, 15, 15, 15
+#define SHUF_GRAYA_COLOR  0, 0, 0, -1, 2, 2, 2, -1, 4, 4, 4, -1, 6, 6, 6, -1
+#define SHUF_GRAYA_ALPHA  1, 1, 1, 1, 3, 3, 3, 3, 5, 5, 5, 5, 7, 7, 7, 7
+
+TTIP_TARGET_INLINE("ssse3") void maskblend_row_rgbx_ssse3(unsigned char* dst, const unsigned char* bg, const unsigned char* ovr, int width, int bgbpp, int ovrbpp) {
+	const __m128i rgb_to_rgbx = _mm_setr_epi8(SHUF_RGB_TO_RGBX);
+	const __m128i rgbx_to_rgb = _mm_setr_epi8(SHUF_RGBX_TO_RGB);
+	const __m128i gray_to_rgbx = _mm_setr_epi8(SHUF_GRAY_TO_RGBX);
+	const __m128i rgba_alpha = _mm_setr_epi8(SHUF_RGBA_ALPHA);
+	const __m128i graya_color = _mm_setr_epi8(SHUF_GRAYA_COLOR);
+	const __m128i graya_alpha = _mm_setr_epi8(SHUF_GRAYA_ALPHA);
+
+	int x;
+	/* 16 byte load of RGB background must not cross row end, hence extra 2 pixels */
+	for (x = 0; x + 4 + (bgbpp == 3 ? 2 : 0) <= width; x += 4) {
+		__m128i b, c, a;
+		if (bgbpp == 3) {
+			b = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(bg + x * 3)), rgb_to_rgbx);
+		} else {
+			int tmp;
+			memcpy(&tmp, bg + x, 4);
+			b = _mm_shuffle_epi8(_mm_cvtsi32_si128(tmp), gray_to_rgbx);
+		}
+
+		if (ovrbpp == 4) {
+			c = _mm_loadu_si128((const __m128i*)(ovr + x * 4));
+			a = _mm_shuffle_epi8(c, rgba_alpha);
+		} else {
+			__m128i o = _mm_loadl_epi64((const __m128i*)(ovr + x * 2));
+			c = _mm_shuffle_epi8(o, graya_color);
+			a = _mm_shuffle_epi8(o, graya_alpha);
+		}
+
+		__m128i r = _mm_shuffle_epi8(blend4_rgbx_sse2(b, c, a), rgbx_to_rgb);
+		_mm_storel_epi64((__m128i*)(dst + x * 3), r);
+		int tail = _mm_cvtsi128_si32(_mm_srli_si128(r, 8));
+		memcpy(dst + x * 3 + 8, &tail, 4);
+	}
+
+	maskblend_row_scalar[(bgbpp == 3 ? MASKBLEND_RGB_GRAYA : MASKBLEND_GRAY_GRAYA) + (ovrbpp == 4)](dst + x * 3, bg + x * bgbpp, ovr + x * ovrbpp, width - x);
+}
+
+TTIP_TARGET("ssse3") static void maskblend_row_gray_rgba_ssse3(unsigned char* dst, const unsigned char* bg, const unsigned char* ovr, int width) {
+	maskblend_row_rgbx_ssse3(dst, bg, ovr, width, 1, 4);
+}
+
+TTIP_TARGET("ssse3") static void maskblend_row_rgb_graya_ssse3(unsigned char* dst, const unsigned char* bg, const unsigned char* ovr, int width) {
+	maskblend_row_rgbx_ssse3(dst, bg, ovr, width, 3, 2);
+}
+
+TTIP_TARGET("ssse3") static void maskblend_row_rgb_rgba_ssse3(unsigned char* dst, const unsigned char* bg, const unsigned char* ovr, int width) {
+	maskblend_row_rgbx_ssse3(dst, bg, ovr, width, 3, 4);
+}
+
+TTIP_TARGET_INLINE("avx2") __m256i blend16_avx2(__m256i bg, __m256i color, __m256i alpha) {
+	__m256i x = _mm256_add_epi16(
+			_mm256_mullo_epi16(bg, _mm256_sub_epi16(_mm256_set1_epi16(255), alpha)),
+			_mm256_mullo_epi16(color, alpha)
+		);
+	return _mm256_srli_epi16(_mm256_mulhi_epu16(x, _mm256_set1_epi16((short)0x8081)), 7);
+}
+
+/* combine two 128 bit halves into a single 256 bit register */
+TTIP_TARGET_INLINE("avx2") __m256i combine_avx2(__m128i lo, __m128i hi) {
+	return _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+}
+
+TTIP_TARGET_INLINE("avx2") void maskblend_row_gray_graya_avx2(unsigned char* dst, const unsigned char* bg, const unsigned char* ovr, int width, int aligned) {
+	const __m256i lowmask = _mm256_set1_epi16(0xff);
+	int x;
+	for (x = 0; x + 16 <= width; x += 16) {
+		__m256i o = ttip_load256(ovr + x * 2, aligned);
+		__m256i b = _mm256_cvtepu8_epi16(ttip_load128(bg + x, aligned));
+		__m256i r = blend16_avx2(b, _mm256_and_si256(o, lowmask), _mm256_srli_epi16(o, 8));
+		/* packus works per 128 bit lane, so gather both results into low half */
+		r = _mm256_permute4x64_epi64(_mm256_packus_epi16(r, r), 0x08);
+		ttip_store128(dst + x, _mm256_castsi256_si128(r), aligned);
+	}
+
+	maskblend_row_gray_graya_sse2(dst + x, bg + x, ovr + x * 2, width - x, aligned);
+}
+
+TTIP_TARGET("avx2") static void maskblend_row_gray_graya_avx2_u(unsigned char* dst, const unsigned char* bg, const unsigned char* ovr, int width) {
+	maskblend_row_gray_graya_avx2(dst, bg, ovr, width, 0);
+}
+
+TTIP_TARGET("avx2") static void maskblend_row_gray_graya_avx2_a(unsigned char* dst, const unsigned char* bg, const unsigned char* ovr, int width) {
+	maskblend_row_gray_graya_avx2(dst, bg, ovr, width, 1);
+}
+
+TTIP_TARGET_INLINE("avx2") void maskblend_row_rgbx_avx2(unsigned char* dst, const unsigned char* bg, const unsigned char* ovr, int width, int bgbpp, int ovrbpp) {
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i rgb_to_rgbx = _mm256_setr_epi8(SHUF_RGB_TO_RGBX, SHUF_RGB_TO_RGBX);
+	const __m256i rgbx_to_rgb = _mm256_setr_epi8(SHUF_RGBX_TO_RGB, SHUF_RGBX_TO_RGB);
+	const __m256i gray_to_rgbx = _mm256_setr_epi8(SHUF_GRAY_TO_RGBX, SHUF_GRAY_TO_RGBX);
+	const __m256i rgba_alpha = _mm256_setr_epi8(SHUF_RGBA_ALPHA, SHUF_RGBA_ALPHA);
+	const __m256i graya_color = _mm256_setr_epi8(SHUF_GRAYA_COLOR, SHUF_GRAYA_COLOR);
+	const __m256i graya_alpha = _mm256_setr_epi8(SHUF_GRAYA_ALPHA, SHUF_GRAYA_ALPHA);
+
+	int x;
+	/* each 128 bit lane holds 4 pixels; second 16 byte load of RGB
+	 * background reads up to 28 bytes, hence extra 2 pixels */
+	for (x = 0; x + 8 + (bgbpp == 3 ? 2 : 0) <= width; x += 8) {
+		__m256i b, c, a;
+		if (bgbpp == 3) {
+			const unsigned char* p = bg + x * 3;
+			b = combine_avx2(_mm_loadu_si128((const __m128i*)p), _mm_loadu_si128((const __m128i*)(p + 12)));
+			b = _mm256_shuffle_epi8(b, rgb_to_rgbx);
+		} else {
+			int lo, hi;
+			memcpy(&lo, bg + x, 4);
+			memcpy(&hi, bg + x + 4, 4);
+			b = _mm256_shuffle_epi8(combine_avx2(_mm_cvtsi32_si128(lo), _mm_cvtsi32_si128(hi)), gray_to_rgbx);
+		}
+
+		if (ovrbpp == 4) {
+			c = _mm256_loadu_si256((const __m256i*)(ovr + x * 4));
+			a = _mm256_shuffle_epi8(c, rgba_alpha);
+		} else {
+			const unsigned char* p = ovr + x * 2;
+			__m256i o = combine_avx2(_mm_loadl_epi64((const __m128i*)p), _mm_loadl_epi64((const __m128i*)(p + 8)));
+			c = _mm256_shuffle_epi8(o, graya_color);
+			a = _mm256_shuffle_epi8(o, graya_alpha);
+		}
+
+		__m256i lo = blend16_avx2(_mm256_unpacklo_epi8(b, zero), _mm256_unpacklo_epi8(c, zero), _mm256_unpacklo_epi8(a, zero));
+		__m256i hi = blend16_avx2(_mm256_unpackhi_epi8(b, zero), _mm256_unpackhi_epi8(c, zero), _mm256_unpackhi_epi8(a, zero));
+		__m256i r = _mm256_shuffle_epi8(_mm256_packus_epi16(lo, hi), rgbx_to_rgb);
+
+		/* store 12 bytes from each lane */
+		__m128i r0 = _mm256_castsi256_si128(r);
+		__m128i r1 = _mm256_extracti128_si256(r, 1);
+		int tail0 = _mm_cvtsi128_si32(_mm_srli_si128(r0, 8));
+		int tail1 = _mm_cvtsi128_si32(_mm_srli_si128(r1, 8));
+		_mm_storel_epi64((__m128i*)(dst + x * 3), r0);
+		memcpy(dst + x * 3 + 8, &tail0, 4);
+		_mm_storel_epi64((__m128i*)(dst + x * 3 + 12), r1);
+		memcpy(dst + x * 3 + 20, &tail1, 4);
+	}
+
+	maskblend_row_scalar[(bgbpp == 3 ? MASKBLEND_RGB_GRAYA : MASKBLEND_GRAY_GRAYA) + (ovrbpp == 4)](dst + x * 3, bg + x * bgbpp, ovr + x * ovrbpp, width - x);
+}
+
+TTIP_TARGET("avx2") static void maskblend_row_gray_rgba_avx2(unsigned char* dst, const unsigned char* bg, const unsigned char* ovr, int width) {
+	maskblend_row_rgbx_avx2(dst, bg, ovr, width, 1, 4);
+}
+
+TTIP_TARGET("avx2") static void maskblend_row_rgb_graya_avx2(unsigned char* dst, const unsigned char* bg, const unsigned char* ovr, int width) {
+	maskblend_row_rgbx_avx2(dst, bg, ovr, width, 3, 2);
+}
+
+TTIP_TARGET("avx2") static void maskblend_row_rgb_rgba_avx2(unsigned char* dst, const unsigned char* bg, const unsigned char* ovr, int width) {
+	maskblend_row_rgbx_avx2(dst, bg, ovr, width, 3, 4);
+}
+
+static const maskblend_row_func maskblend_row_sse2[MASKBLEND_NCOMBINATIONS] = {
+	maskblend_row_gray_graya_sse2_u,
+	maskblend_row_gray_rgba_sse2,
+	maskblend_row_rgb_graya_sse2,
+	maskblend_row_rgb_rgba_sse2,
+};
+
+static const maskblend_row_func maskblend_row_ssse3[MASKBLEND_NCOMBINATIONS] = {
+	maskblend_row_gray_graya_sse2_u,
+	maskblend_row_gray_rgba_ssse3,
+	maskblend_row_rgb_graya_ssse3,
+	maskblend_row_rgb_rgba_ssse3,
+};
+
+static const maskblend_row_func maskblend_row_avx2[MASKBLEND_NCOMBINATIONS] = {
+	maskblend_row_gray_graya_avx2_u,
+	maskblend_row_gray_rgba_avx2,
+	maskblend_row_rgb_graya_avx2,
+	maskblend_row_rgb_rgba_avx2,
+};
+#endif
+
+maskblend_row_func ttip_maskblend_select(ttip_format_t bgformat, ttip_format_t ovrformat, int aligned) {
+	int combination = (bgformat == TTIP_RGB ? MASKBLEND_RGB_GRAYA : MASKBLEND_GRAY_GRAYA) + (ovrformat == TTIP_RGB_ALPHA);
+
+#if !defined(TTIP_X86_SIMD)
+	(void)aligned; /* unused */
+#endif
+
+	switch (ttip_getsimd()) {
+#if defined(TTIP_X86_SIMD)
+	case TTIP_SIMD_AVX2:
+		if (aligned && combination == MASKBLEND_GRAY_GRAYA)
+			return maskblend_row_gray_graya_avx2_a;
+		return maskblend_row_avx2[combination];
+	case TTIP_SIMD_SSSE3:
+		if (aligned && combination == MASKBLEND_GRAY_GRAYA)
+			return maskblend_row_gray_graya_sse2_a;
+		return maskblend_row_ssse3[combination];
+	case TTIP_SIMD_SSE2:
+		if (aligned && combination == MASKBLEND_GRAY_GRAYA)
+			return maskblend_row_gray_graya_sse2_a;
+		return maskblend_row_sse2[combination];
+#endif
+	default: return maskblend_row_scalar[combination];
+	}
+}
+
+/* destination may be the same image as background */
+static void ttip_maskblend_process(ttip_image_t destination, ttip_image_t background, ttip_image_t overlay) {
+	/* 3 byte pixels are never aligned, so only gray kernels have aligned variants */
+	int aligned = ttip_isaligned(destination, 32) && ttip_isaligned(background, 32) && ttip_isaligned(overlay, 32);
+	maskblend_row_func func = ttip_maskblend_select(background->format, overlay->format, aligned);
+
+	/* uniform sources have the same row repeated */
+	int bgstep = ttip_rowstep(background), ovrstep = ttip_rowstep(overlay);
+
+	unsigned char *bgrow, *ovrrow, *dstrow;
+	int y;
+	for (y = 0, bgrow = background->data, ovrrow = overlay->data, dstrow = destination->data;
+			y < background->height;
+			y++, bgrow += bgstep, ovrrow += ovrstep, dstrow += destination->stride) {
+		func(dstrow, bgrow, ovrrow, background->width);
+	}
+}
+
+ttip_result_t ttip_maskblend_check(int width, int height, ttip_format_t bgformat, ttip_image_t overlay) {
+	if (width != overlay->width)
 		return TTIP_IMAGE_DIMENSIONS_MISMATCH;
 
-	if (background->height != overlay->height)
+	if (height != overlay->height)
 		return TTIP_IMAGE_DIMENSIONS_MISMATCH;
 
-	if (background->format != TTIP_GRAY && background->format != TTIP_RGB)
+	if (bgformat != TTIP_GRAY && bgformat != TTIP_RGB)
 		return TTIP_BAD_PIXEL_FORMAT;
 
 	if (overlay->format != TTIP_GRAY_ALPHA && overlay->format != TTIP_RGB_ALPHA)
 		return TTIP_BAD_PIXEL_FORMAT;
 
-	/* allocate tile */
+	return TTIP_OK;
+}
+
+ttip_format_t ttip_maskblend_format(ttip_format_t bgformat, ttip_format_t ovrformat) {
+	return (bgformat == TTIP_GRAY && ovrformat == TTIP_GRAY_ALPHA) ? TTIP_GRAY : TTIP_RGB;
+}
+ttip_result_t ttip_maskblend(ttip_image_t* output, ttip_image_t background, ttip_image_t overlay) {
 	int ret;
+	if ((ret = ttip_maskblend_check(background->width, background->height, background->format, overlay)) != TTIP_OK)
+		return ret;
+
+	/* allocate tile */
 	struct ttip_image* destination;
-	int output_format = (background->format == TTIP_GRAY && overlay->format == TTIP_GRAY_ALPHA) ? TTIP_GRAY : TTIP_RGB;
-	if ((ret = ttip_create(&destination, background->width, background->height, output_format)) != TTIP_OK)
+
+	if (background->uniform && overlay->uniform) {
+		/* result is uniform too, only blend single row */
+		if ((ret = ttip_create_uniform(&destination, background->width, background->height, ttip_maskblend_format(background->format, overlay->format), 0, background->pool)) != TTIP_OK)
+			return ret;
+
+		struct ttip_image bgview = ttip_uniform_view(background), ovrview = ttip_uniform_view(overlay), dstview = ttip_uniform_view(destination);
+		ttip_maskblend_process(&dstview, &bgview, &ovrview);
+		ttip_uniform_sync(destination);
+
+		*output = destination;
+
+		return TTIP_OK;
+	}
+
+	if ((ret = ttip_create_pooled(&destination, background->width, background->height, ttip_maskblend_format(background->format, overlay->format), background->pool)) != TTIP_OK)
 		return ret;
 
 	/* process */
-	unsigned char *bgrow, *ovrrow, *dstrow, *bg, *ovr, *dst;
-	if (background->format == TTIP_GRAY && overlay->format == TTIP_GRAY_ALPHA) {
-		for (bgrow = background->data, ovrrow = overlay->data, dstrow = destination->data;
-				bgrow < background->data + background->height * background->stride;
-				bgrow += background->stride, ovrrow += overlay->stride, dstrow += destination->stride) {
-			for (bg = bgrow, ovr = ovrrow, dst = dstrow;
-					bg < bgrow + background->width;
-					bg++, ovr += 2, dst++) {
-				dst[0] = (bg[0] * (255 - ovr[1]) + ovr[0] * ovr[1]) / 255;
-			}
-		}
-	} else if (background->format == TTIP_GRAY && overlay->format == TTIP_RGB_ALPHA) {
-		for (bgrow = background->data, ovrrow = overlay->data, dstrow = destination->data;
-				bgrow < background->data + background->height * background->stride;
-				bgrow += background->stride, ovrrow += overlay->stride, dstrow += destination->stride) {
-			for (bg = bgrow, ovr = ovrrow, dst = dstrow;
-					bg < bgrow + background->width;
-					bg ++, ovr += 4, dst += 3) {
-				int background_component = bg[0] * (255 - ovr[3]);
-				dst[0] = (background_component + ovr[0] * ovr[3]) / 255;
-				dst[1] = (background_component + ovr[1] * ovr[3]) / 255;
-				dst[2] = (background_component + ovr[2] * ovr[3]) / 255;
-			}
-		}
-	} else if (background->format == TTIP_RGB && overlay->format == TTIP_GRAY_ALPHA) {
-		for (bgrow = background->data, ovrrow = overlay->data, dstrow = destination->data;
-				bgrow < background->data + background->height * background->stride;
-				bgrow += background->stride, ovrrow += overlay->stride, dstrow += destination->stride) {
-			for (bg = bgrow, ovr = ovrrow, dst = dstrow;
-					bg < bgrow + background->width * 3;
-					bg += 3, ovr += 2, dst += 3) {
-				int overlay_component = ovr[0] * ovr[1];
-				dst[0] = (bg[0] * (255 - ovr[1]) + overlay_component) / 255;
-				dst[1] = (bg[1] * (255 - ovr[1]) + overlay_component) / 255;
-				dst[2] = (bg[2] * (255 - ovr[1]) + overlay_component) / 255;
-			}
-		}
-	} else if (background->format == TTIP_RGB && overlay->format == TTIP_RGB_ALPHA) {
-		for (bgrow = background->data, ovrrow = overlay->data, dstrow = destination->data;
-				bgrow < background->data + background->height * background->stride;
-				bgrow += background->stride, ovrrow += overlay->stride, dstrow += destination->stride) {
-			for (bg = bgrow, ovr = ovrrow, dst = dstrow;
-					bg < bgrow + background->width * 3;
-					bg += 3, ovr += 4, dst += 3) {
-				dst[0] = (bg[0] * (255 - ovr[3]) + ovr[0] * ovr[3]) / 255;
-				dst[1] = (bg[1] * (255 - ovr[3]) + ovr[1] * ovr[3]) / 255;
-				dst[2] = (bg[2] * (255 - ovr[3]) + ovr[2] * ovr[3]) / 255;
-			}
-		}
-	} else {
-		assert(0);
-	}
+	ttip_maskblend_process(destination, background, overlay);
 
 	*output = destination;
 
 	return TTIP_OK;
 }
+
+ttip_result_t ttip_maskblend_inplace(ttip_image_t background, ttip_image_t overlay) {
+	int ret;
+	if ((ret = ttip_maskblend_check(background->width, background->height, background->format, overlay)) != TTIP_OK)
+		return ret;
+
+	/* gray background would need to be expanded to rgb */
+	if (background->format == TTIP_GRAY && overlay->format == TTIP_RGB_ALPHA)
+		return TTIP_INPLACE_NOT_POSSIBLE;
+
+	if (background->uniform && overlay->uniform) {
+		struct ttip_image bgview = ttip_uniform_view(background), ovrview = ttip_uniform_view(overlay);
+		ttip_maskblend_process(&bgview, &bgview, &ovrview);
+		ttip_uniform_sync(background);
+		return TTIP_OK;
+	}
+
+	/* result is not uniform, so background needs all its pixels */
+	if ((ret = ttip_materialize(background)) != TTIP_OK)
+		return ret;
+
+	ttip_maskblend_process(background, background, overlay);
+
+	return TTIP_OK;
+}
@@ -22,10 +22,13 @@
 #include <ttip_int.h>
 
 ttip_result_t ttip_clone(ttip_image_t* output, ttip_image_t source) {
+	if (source->uniform)
+		return ttip_create_uniform(output, source->width, source->height, source->format, source->color, source->pool);
+
 	/* allocate tile */
 	int ret;
 	struct ttip_image* destination;
-   	if ((ret = ttip_create(&destination, source->width, source->height, source->format)) != TTIP_OK)
+   	if ((ret = ttip_create_pooled(&destination, source->width, source->height, source->format, source->pool)) != TTIP_OK)
 		return ret;
 
 	if (source->stride == destination->stride) {
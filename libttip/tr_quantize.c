@@ -0,0 +1,422 @@
+/*
+ * Copyright (C) 2012 Dmitry Marakasov
+ *
+ * This file is part of libttip.
+ *
+ * libttip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libttip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libttip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ttip_int.h>
+
+/*
+ * Median cut quantizer
+ *
+ * Unique colors of an image are collected in a hash table along with
+ * pixel counts. The color space is then split into boxes, each time
+ * splitting the box with largest (channel range * pixels) along its
+ * widest channel at weighted median, and each box becomes a palette
+ * entry with weighted average color. As every color is mapped to the
+ * entry of its box, no nearest color search is needed.
+ */
+
+/* box of colors; entries in [start, end) range of order array */
+struct quantizer_box {
+	int start;
+	int end;
+	unsigned int count;
+	int channel;  /* widest channel */
+	int range;    /* its range */
+};
+
+static inline int quantizer_nchannels(ttip_format_t format) {
+	return format == TTIP_RGB_ALPHA ? 4 : 3;
+}
+
+static inline int quantizer_channel(ttip_color_t color, int channel) {
+	/* r, g, b, a */
+	static const int shifts[4] = { 16, 8, 0, 24 };
+	return (color >> shifts[channel]) & 0xff;
+}
+
+static inline unsigned int quantizer_hash(ttip_color_t color, int bits) {
+	return (color * 2654435761u) >> (32 - bits);
+}
+
+static inline int quantizer_slot(const struct ttip_quantizer* quantizer, ttip_color_t color) {
+	int slot = quantizer_hash(color, quantizer->bits);
+	while (quantizer->counts[slot] != 0 && quantizer->keys[slot] != color)
+		slot = (slot + 1) & ((1 << quantizer->bits) - 1);
+	return slot;
+}
+
+/* fully transparent pixels are all the same */
+static inline ttip_color_t quantizer_normalize(ttip_color_t color, ttip_format_t format) {
+	return (format == TTIP_RGB_ALPHA && (color >> 24) == 0) ? 0 : color;
+}
+
+ttip_result_t ttip_quantizer_init(struct ttip_quantizer* quantizer, int npixels) {
+	int bits = 10;
+
+	/* keep load factor under 1/2 even if all pixels are unique */
+	while ((1 << bits) < npixels * 2)
+		bits++;
+
+	if (quantizer->bits < bits) {
+		ttip_quantizer_free(quantizer);
+
+		int size = 1 << bits;
+		quantizer->keys = malloc(sizeof(ttip_color_t) * size);
+		quantizer->counts = malloc(sizeof(unsigned int) * size);
+		quantizer->indexes = malloc(sizeof(unsigned char) * size);
+		quantizer->order = malloc(sizeof(int) * size / 2);
+		quantizer->sorted = malloc(sizeof(int) * size / 2);
+
+		if (quantizer->keys == NULL || quantizer->counts == NULL || quantizer->indexes == NULL || quantizer->order == NULL || quantizer->sorted == NULL) {
+			int saved_errno = errno;
+			ttip_quantizer_free(quantizer);
+			return saved_errno;
+		}
+
+		quantizer->bits = bits;
+	}
+
+	memset(quantizer->counts, 0, sizeof(unsigned int) * (1 << quantizer->bits));
+	quantizer->nentries = 0;
+	quantizer->npixels = 0;
+
+	return TTIP_OK;
+}
+
+void ttip_quantizer_free(struct ttip_quantizer* quantizer) {
+	free(quantizer->keys);
+	free(quantizer->counts);
+	free(quantizer->indexes);
+	free(quantizer->order);
+	free(quantizer->sorted);
+	memset(quantizer, 0, sizeof(struct ttip_quantizer));
+}
+
+void ttip_quantizer_addrow(struct ttip_quantizer* quantizer, const unsigned char* row, int width, ttip_format_t format) {
+	int bpp = ttip_getbpp(format);
+	const unsigned char* end = row + width * bpp;
+	int slot = -1;
+	ttip_color_t prev = 0;
+
+	for (; row < end; row += bpp) {
+		ttip_color_t color = quantizer_normalize(ttip_readpixel((unsigned char*)row, format), format);
+
+		/* runs of same color are very common in map tiles */
+		if (slot < 0 || color != prev) {
+			slot = quantizer_slot(quantizer, color);
+			if (quantizer->counts[slot] == 0) {
+				quantizer->keys[slot] = color;
+				quantizer->order[quantizer->nentries++] = slot;
+			}
+			prev = color;
+		}
+
+		quantizer->counts[slot]++;
+	}
+
+	quantizer->npixels += width;
+}
+
+static void quantizer_measure(struct ttip_quantizer* quantizer, struct quantizer_box* box, int nchannels) {
+	int min[4] = { 255, 255, 255, 255 }, max[4] = { 0, 0, 0, 0 };
+	int i, c;
+
+	box->count = 0;
+	for (i = box->start; i < box->end; i++) {
+		int slot = quantizer->order[i];
+		box->count += quantizer->counts[slot];
+		for (c = 0; c < nchannels; c++) {
+			int v = quantizer_channel(quantizer->keys[slot], c);
+			if (v < min[c])
+				min[c] = v;
+			if (v > max[c])
+				max[c] = v;
+		}
+	}
+
+	box->channel = 0;
+	box->range = -1;
+	for (c = 0; c < nchannels; c++) {
+		if (max[c] - min[c] > box->range) {
+			box->range = max[c] - min[c];
+			box->channel = c;
+		}
+	}
+}
+
+/* split box in two at weighted median of its widest channel */
+static void quantizer_split(struct ttip_quantizer* quantizer, struct quantizer_box* box, struct quantizer_box* newbox, int nchannels) {
+	unsigned int histogram[256];
+	int positions[256];
+	int i, v;
+
+	/* counting sort of entries by channel value */
+	memset(histogram, 0, sizeof(histogram));
+	for (i = box->start; i < box->end; i++)
+		histogram[quantizer_channel(quantizer->keys[quantizer->order[i]], box->channel)]++;
+
+	positions[0] = box->start;
+	for (v = 1; v < 256; v++)
+		positions[v] = positions[v - 1] + histogram[v - 1];
+
+	for (i = box->start; i < box->end; i++) {
+		int slot = quantizer->order[i];
+		quantizer->sorted[positions[quantizer_channel(quantizer->keys[slot], box->channel)]++] = slot;
+	}
+
+	memcpy(quantizer->order + box->start, quantizer->sorted + box->start, sizeof(int) * (box->end - box->start));
+
+	/* find median by pixel counts, keeping both halves non-empty */
+	unsigned int half = box->count / 2, sum = 0;
+	int split;
+	for (split = box->start; split < box->end - 1; split++) {
+		sum += quantizer->counts[quantizer->order[split]];
+		if (sum >= half)
+			break;
+	}
+	split++;
+
+	/* don't split between entries with same channel value */
+	int median = quantizer_channel(quantizer->keys[quantizer->order[split - 1]], box->channel);
+	while (split < box->end && quantizer_channel(quantizer->keys[quantizer->order[split]], box->channel) == median)
+		split++;
+	if (split == box->end) {
+		split--;
+		while (split > box->start + 1 && quantizer_channel(quantizer->keys[quantizer->order[split - 1]], box->channel) == median)
+			split--;
+	}
+
+	newbox->start = split;
+	newbox->end = box->end;
+	box->end = split;
+
+	quantizer_measure(quantizer, box, nchannels);
+	quantizer_measure(quantizer, newbox, nchannels);
+}
+
+double ttip_quantizer_build(struct ttip_quantizer* quantizer, int ncolors, ttip_format_t format, struct ttip_palette* palette) {
+	struct quantizer_box boxes[TTIP_PALETTE_MAX_COLORS];
+	int nboxes = 1;
+	int nchannels = quantizer_nchannels(format);
+	int i, c;
+
+	if (ncolors > TTIP_PALETTE_MAX_COLORS)
+		ncolors = TTIP_PALETTE_MAX_COLORS;
+
+	boxes[0].start = 0;
+	boxes[0].end = quantizer->nentries;
+	quantizer_measure(quantizer, &boxes[0], nchannels);
+
+	while (nboxes < ncolors) {
+		/* pick box to split */
+		int best = -1;
+		double bestscore = 0;
+		for (i = 0; i < nboxes; i++) {
+			double score = (double)boxes[i].range * boxes[i].count;
+			if (boxes[i].end - boxes[i].start > 1 && boxes[i].range > 0 && score > bestscore) {
+				best = i;
+				bestscore = score;
+			}
+		}
+
+		if (best < 0)
+			break; /* every box has a single color */
+
+		quantizer_split(quantizer, &boxes[best], &boxes[nboxes++], nchannels);
+	}
+
+	/* average colors of boxes and squared error of mapping */
+	ttip_color_t colors[TTIP_PALETTE_MAX_COLORS];
+	double error = 0;
+
+	for (i = 0; i < nboxes; i++) {
+		double sums[4] = { 0, 0, 0, 0 };
+		int j, mean[4] = { 0, 0, 0, 255 };
+
+		for (j = boxes[i].start; j < boxes[i].end; j++) {
+			int slot = quantizer->order[j];
+			for (c = 0; c < nchannels; c++)
+				sums[c] += (double)quantizer_channel(quantizer->keys[slot], c) * quantizer->counts[slot];
+		}
+
+		for (c = 0; c < nchannels; c++)
+			mean[c] = (int)(sums[c] / boxes[i].count + 0.5);
+
+		for (j = boxes[i].start; j < boxes[i].end; j++) {
+			int slot = quantizer->order[j];
+			for (c = 0; c < nchannels; c++) {
+				int d = quantizer_channel(quantizer->keys[slot], c) - mean[c];
+				error += (double)d * d * quantizer->counts[slot];
+			}
+		}
+
+		colors[i] = ((ttip_color_t)mean[3] << 24) | (mean[0] << 16) | (mean[1] << 8) | mean[2];
+	}
+
+	/* translucent entries first, as in exact palette */
+	int n = 0;
+	for (i = 0; i < nboxes; i++) {
+		if (format == TTIP_RGB_ALPHA && (colors[i] >> 24) != 0xff) {
+			int j;
+			for (j = boxes[i].start; j < boxes[i].end; j++)
+				quantizer->indexes[quantizer->order[j]] = n;
+			palette->colors[n++] = colors[i];
+		}
+	}
+
+	palette->ntrans = n;
+
+	for (i = 0; i < nboxes; i++) {
+		if (format != TTIP_RGB_ALPHA || (colors[i] >> 24) == 0xff) {
+			int j;
+			for (j = boxes[i].start; j < boxes[i].end; j++)
+				quantizer->indexes[quantizer->order[j]] = n;
+			palette->colors[n++] = format == TTIP_RGB_ALPHA ? colors[i] : colors[i] & 0xffffff;
+		}
+	}
+
+	palette->ncolors = n;
+
+	/* mean squared error per channel */
+	return quantizer->npixels > 0 ? error / ((double)quantizer->npixels * nchannels) : 0;
+}
+
+int ttip_quantizer_index(const struct ttip_quantizer* quantizer, ttip_color_t color, ttip_format_t format) {
+	return quantizer->indexes[quantizer_slot(quantizer, quantizer_normalize(color, format))];
+}
+
+void ttip_quantizer_maprow(const struct ttip_quantizer* quantizer, unsigned char* dst, const unsigned char* row, int width, ttip_format_t format, int bitdepth) {
+	int bpp = ttip_getbpp(format);
+	int perbyte = 8 / bitdepth;
+	int x, index = 0;
+	ttip_color_t prev = 0;
+
+	memset(dst, 0, (width * bitdepth + 7) / 8);
+
+	for (x = 0; x < width; x++, row += bpp) {
+		ttip_color_t color = ttip_readpixel((unsigned char*)row, format);
+		if (x == 0 || color != prev) {
+			index = ttip_quantizer_index(quantizer, color, format);
+			prev = color;
+		}
+
+		/* pack pixels starting from most significant bits */
+		dst[x / perbyte] |= index << ((perbyte - 1 - x % perbyte) * bitdepth);
+	}
+}
+
+double ttip_quantizer_psnr(double mse) {
+	if (mse <= 0)
+		return 99.0;
+	return 10.0 * log10(255.0 * 255.0 / mse);
+}
+
+/*
+ * Image transform
+ */
+
+/* destination may be the same image as source */
+static ttip_result_t ttip_quantize_process(ttip_image_t destination, ttip_image_t source, int ncolors, double* psnr) {
+	struct ttip_quantizer quantizer;
+	struct ttip_palette palette;
+	unsigned char *srcrow, *dstrow;
+	int ret, x, bpp = ttip_getbpp(source->format);
+
+	memset(&quantizer, 0, sizeof(quantizer));
+	if ((ret = ttip_quantizer_init(&quantizer, source->width * source->height)) != TTIP_OK)
+		return ret;
+
+	for (srcrow = source->data; srcrow < source->data + source->height * source->stride; srcrow += source->stride)
+		ttip_quantizer_addrow(&quantizer, srcrow, source->width, source->format);
+
+	double mse = ttip_quantizer_build(&quantizer, ncolors, source->format, &palette);
+
+	for (srcrow = source->data, dstrow = destination->data;
+			srcrow < source->data + source->height * source->stride;
+			srcrow += source->stride, dstrow += destination->stride) {
+		for (x = 0; x < source->width; x++) {
+			int index = ttip_quantizer_index(&quantizer, ttip_readpixel(srcrow + x * bpp, source->format), source->format);
+			ttip_writepixel(dstrow + x * bpp, palette.colors[index], source->format);
+		}
+	}
+
+	ttip_quantizer_free(&quantizer);
+
+	if (psnr != NULL)
+		*psnr = ttip_quantizer_psnr(mse);
+
+	return TTIP_OK;
+}
+
+static ttip_result_t ttip_quantize_check(ttip_image_t source, int ncolors) {
+	if (source->format != TTIP_RGB && source->format != TTIP_RGB_ALPHA)
+		return TTIP_BAD_PIXEL_FORMAT;
+
+	if (ncolors < 2 || ncolors > TTIP_PALETTE_MAX_COLORS)
+		return TTIP_BAD_ARGUMENT;
+
+	return TTIP_OK;
+}
+
+ttip_result_t ttip_quantize(ttip_image_t* output, ttip_image_t source, int ncolors, double* psnr) {
+	int ret;
+	if ((ret = ttip_quantize_check(source, ncolors)) != TTIP_OK)
+		return ret;
+
+	/* single color is always exact */
+	if (source->uniform) {
+		if (psnr != NULL)
+			*psnr = ttip_quantizer_psnr(0);
+		return ttip_create_uniform(output, source->width, source->height, source->format, quantizer_normalize(source->color, source->format), source->pool);
+	}
+
+	/* allocate tile */
+	struct ttip_image* destination;
+	if ((ret = ttip_create_pooled(&destination, source->width, source->height, source->format, source->pool)) != TTIP_OK)
+		return ret;
+
+	/* process */
+	if ((ret = ttip_quantize_process(destination, source, ncolors, psnr)) != TTIP_OK) {
+		ttip_destroy(&destination);
+		return ret;
+	}
+
+	*output = destination;
+
+	return TTIP_OK;
+}
+
+ttip_result_t ttip_quantize_inplace(ttip_image_t target, int ncolors, double* psnr) {
+	int ret;
+	if ((ret = ttip_quantize_check(target, ncolors)) != TTIP_OK)
+		return ret;
+
+	if (target->uniform) {
+		if (psnr != NULL)
+			*psnr = ttip_quantizer_psnr(0);
+		ttip_setuniform(target, quantizer_normalize(target->color, target->format));
+		return TTIP_OK;
+	}
+
+	return ttip_quantize_process(target, target, ncolors, psnr);
+}
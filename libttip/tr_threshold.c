@@ -21,17 +21,8 @@
 
 #include <ttip_int.h>
 
-ttip_result_t ttip_threshold(ttip_image_t* output, ttip_image_t source, int value) {
-	if (source->format != TTIP_GRAY && source->format != TTIP_RGB)
-		return TTIP_BAD_PIXEL_FORMAT;
-
-	/* allocate tile */
-	int ret;
-	struct ttip_image* destination;
-   	if ((ret = ttip_create(&destination, source->width, source->height, TTIP_GRAY)) != TTIP_OK)
-		return ret;
-
-	/* process */
+/* destination may be the same image as source, as pixels are only moved towards row start */
+static void ttip_threshold_process(ttip_image_t destination, ttip_image_t source, int value) {
 	unsigned char *srcrow, *dstrow, *src, *dst;
 
 	if (source->format == TTIP_GRAY) {
@@ -51,8 +42,56 @@ ttip_result_t ttip_threshold(ttip_image_t* output, ttip_image_t source, int valu
 			}
 		}
 	}
+}
+
+ttip_result_t ttip_threshold(ttip_image_t* output, ttip_image_t source, int value) {
+	if (source->format != TTIP_GRAY && source->format != TTIP_RGB)
+		return TTIP_BAD_PIXEL_FORMAT;
+
+	/* allocate tile */
+	int ret;
+	struct ttip_image* destination;
+
+	if (source->uniform) {
+		/* only process single row of uniform image */
+		if ((ret = ttip_create_uniform(&destination, source->width, source->height, TTIP_GRAY, 0, source->pool)) != TTIP_OK)
+			return ret;
+
+		struct ttip_image srcview = ttip_uniform_view(source), dstview = ttip_uniform_view(destination);
+		ttip_threshold_process(&dstview, &srcview, value);
+		ttip_uniform_sync(destination);
+
+		*output = destination;
+
+		return TTIP_OK;
+	}
+
+   	if ((ret = ttip_create_pooled(&destination, source->width, source->height, TTIP_GRAY, source->pool)) != TTIP_OK)
+		return ret;
+
+	/* process */
+	ttip_threshold_process(destination, source, value);
 
 	*output = destination;
 
 	return TTIP_OK;
 }
+
+ttip_result_t ttip_threshold_inplace(ttip_image_t target, int value) {
+	if (target->format != TTIP_GRAY && target->format != TTIP_RGB)
+		return TTIP_BAD_PIXEL_FORMAT;
+
+	if (target->uniform) {
+		struct ttip_image view = ttip_uniform_view(target);
+		ttip_threshold_process(&view, &view, value);
+	} else {
+		ttip_threshold_process(target, target, value);
+	}
+
+	target->format = TTIP_GRAY;
+
+	if (target->uniform)
+		ttip_uniform_sync(target);
+
+	return TTIP_OK;
+}
@@ -20,6 +20,9 @@
 #ifndef TTIP_H
 #define TTIP_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -49,13 +52,58 @@ typedef enum {
 	TTIP_IMAGE_FORMAT_MISMATCH = -8,
 	TTIP_EVEN_DIMENSIONS_REQUIRED = -9,
 	TTIP_IMAGE_DIMENSIONS_MISMATCH = -10,
+	TTIP_INPLACE_NOT_POSSIBLE = -11,
+	TTIP_BAD_ALIGNMENT = -12,
+	TTIP_BAD_ARGUMENT = -13,
+	TTIP_BAD_ARCHIVE = -14,
 
-	TTIP_LAST_ERROR = -10,
+	TTIP_LAST_ERROR = -14,
 } ttip_result_t;
 
+/* vector instruction sets used by pixel kernels */
+typedef enum {
+	TTIP_SIMD_NONE = 0,
+	TTIP_SIMD_SSE2 = 1,
+	TTIP_SIMD_SSSE3 = 2,
+	TTIP_SIMD_AVX2 = 3,
+} ttip_simd_t;
+
 /* opaque type for single tile */
 typedef struct ttip_image* ttip_image_t;
 
+/* opaque type for image pool */
+typedef struct ttip_pool* ttip_pool_t;
+
+/* opaque types for tile archive reader and writer */
+typedef struct ttip_archive* ttip_archive_t;
+typedef struct ttip_archive_writer* ttip_archive_writer_t;
+
+/* opaque types for reusable png encoder and decoder */
+typedef struct ttip_png_encoder* ttip_png_encoder_t;
+typedef struct ttip_png_decoder* ttip_png_decoder_t;
+
+/* png encoder tuning modes */
+typedef enum {
+	TTIP_PNG_TUNING_DEFAULT,   /* libpng default filters and deflate strategy */
+	TTIP_PNG_TUNING_ADAPTIVE,  /* filters and strategy chosen per image from its content */
+} ttip_png_tuning_t;
+
+/* image pool statistics */
+typedef struct {
+	unsigned long hits;      /* images reused from the pool */
+	unsigned long misses;    /* images which had to be allocated */
+	size_t bytes_used;       /* bytes in images currently in use */
+	size_t bytes_cached;     /* bytes in images waiting for reuse */
+	size_t peak_bytes;       /* maximal bytes_used + bytes_cached */
+} ttip_pool_stats_t;
+
+/* tile archive writer statistics */
+typedef struct {
+	unsigned long tiles;     /* tiles added */
+	unsigned long unique;    /* of these, stored as their content was not seen before */
+	size_t bytes;            /* bytes of stored tile data */
+} ttip_archive_stats_t;
+
 /* color value for manual color operations
  * format is as follows:
  * ttip_color g = 0xGG
@@ -65,16 +113,83 @@ typedef struct ttip_image* ttip_image_t;
  */
 typedef unsigned int ttip_color_t;
 
+/* content hash of an image */
+typedef uint64_t ttip_hash_t;
+
+/* growable memory buffer for encoded images; zero-initialized
+ * structure is an empty buffer, memory is kept between uses */
+typedef struct {
+	unsigned char* data;
+	size_t size;
+	size_t capacity;
+} ttip_buffer_t;
+
 /* tile creation and destruction */
 ttip_result_t ttip_create(ttip_image_t* output, int width, int height, ttip_format_t format);
 void ttip_destroy(ttip_image_t* tile);
 
+/* image pools
+ *
+ * Destroyed pooled images are kept in the pool and reused for subsequent
+ * images of the same dimensions and format. Transformations allocate
+ * output images from the pool of their (first) source image. Pool may
+ * be destroyed while its images are still in use, in which case it's
+ * freed along with the last of them.
+ *
+ * Pools are not thread safe, unless created with ttip_pool_create_shared(),
+ * which returns TTIP_NOT_COMPILED_IN if library was built without threads.
+ */
+ttip_result_t ttip_pool_create(ttip_pool_t* output);
+ttip_result_t ttip_pool_create_shared(ttip_pool_t* output);
+void ttip_pool_destroy(ttip_pool_t* pool);
+void ttip_pool_trim(ttip_pool_t pool);
+void ttip_pool_getstats(ttip_pool_t pool, ttip_pool_stats_t* stats);
+
+ttip_result_t ttip_create_pooled(ttip_image_t* output, int width, int height, ttip_format_t format, ttip_pool_t pool /* = NULL */);
+
+/* create image with both pixel data and row stride aligned to given
+ * power of 2 number of bytes; 0 means default alignment of 64 bytes,
+ * which is used by all other functions */
+ttip_result_t ttip_create_ex(ttip_image_t* output, int width, int height, ttip_format_t format, int alignment /* = 0 */, ttip_pool_t pool /* = NULL */);
+
+/* uniform images
+ *
+ * Image which has all pixels of the same color may be represented just
+ * by that color, without allocating pixel data. Transformations produce
+ * uniform output from uniform sources whenever possible (for instance,
+ * clone of uniform image or downsample of four uniform images of the
+ * same color) and read uniform sources without expanding them. Pixel
+ * data is only allocated if uniform image is modified with
+ * ttip_setpixel() or an inplace transformation which cannot be done on
+ * the color. ttip_detect_uniform() replaces image which happens to be
+ * uniform with uniform representation.
+ */
+ttip_result_t ttip_create_uniform(ttip_image_t* output, int width, int height, ttip_format_t format, ttip_color_t color, ttip_pool_t pool /* = NULL */);
+ttip_result_t ttip_detect_uniform(ttip_image_t* image);
+int ttip_isuniform(ttip_image_t image, ttip_color_t* color /* = NULL */);
+
+/* memory buffers */
+void ttip_buffer_init(ttip_buffer_t* buffer);
+void ttip_buffer_free(ttip_buffer_t* buffer);
+
 /* error handling */
 const char* ttip_strerror(ttip_result_t error);
 
+/* vector kernels selection
+ *
+ * Best instruction set supported by CPU is used by default. It may be
+ * limited with ttip_setsimd() or with TTIP_FORCE_SCALAR and TTIP_SIMD
+ * environment variables. All kernels produce identical results.
+ * Instruction set is detected on first use, so ttip_getsimd() should
+ * be called before the library is used from multiple threads.
+ */
+ttip_simd_t ttip_getsimd();
+void ttip_setsimd(ttip_simd_t max);
+
 /* property inspection */
 int ttip_getwidth(ttip_image_t tile);
 int ttip_getheight(ttip_image_t tile);
+int ttip_getstride(ttip_image_t tile);
 ttip_format_t ttip_getformat(ttip_image_t tile);
 
 /* lowlevel pixel operations */
@@ -86,8 +201,92 @@ ttip_result_t ttip_clear(ttip_image_t target);
 
 /* png input/output */
 ttip_result_t ttip_loadpng(ttip_image_t* output, const char* filename);
+ttip_result_t ttip_loadpng_pooled(ttip_image_t* output, const char* filename, ttip_pool_t pool);
 ttip_result_t ttip_savepng(ttip_image_t source, const char* filename, int level /* = 6 */);
 
+/* png input/output in memory; output buffer is overwritten */
+ttip_result_t ttip_loadpng_mem(ttip_image_t* output, const void* data, size_t size);
+ttip_result_t ttip_loadpng_mem_pooled(ttip_image_t* output, const void* data, size_t size, ttip_pool_t pool);
+ttip_result_t ttip_savepng_mem(ttip_image_t source, ttip_buffer_t* output, int level /* = 6 */);
+
+/* reusable png encoder and decoder
+ *
+ * These keep libpng and zlib state memory between images, saving
+ * setup cost of each load/save. Each object may only be used by
+ * a single thread at a time. Encoder compression level is 6 by
+ * default. Adaptive tuning picks filters and deflate strategy for each
+ * image from cheap statistics of its content; for rendered maps it
+ * usually gives both smaller files and faster encoding. Indexed mode
+ * writes RGB and RGBA images which have no more than 256 colors as
+ * paletted png with smallest possible bit depth; it's lossless, so
+ * images decode to the same pixels in the same format. With quantization
+ * threshold set (in dB, 0 disables it), indexed mode also reduces images
+ * with more colors to a 256 color palette, as ttip_quantize() does, if
+ * PSNR of the result is not below the threshold.
+ *
+ * Blended and downsampled encode functions produce the same file as
+ * encoding source (or ttip_downsample2x2() of four sources) with all
+ * overlays blended over it in turn with ttip_maskblend(), but never
+ * materialize intermediate images: each row is downsampled and
+ * blended in a small row buffer and passed directly to png encoder.
+ * Sources are not modified.
+ */
+ttip_result_t ttip_png_encoder_create(ttip_png_encoder_t* output);
+void ttip_png_encoder_destroy(ttip_png_encoder_t* encoder);
+void ttip_png_encoder_setlevel(ttip_png_encoder_t encoder, int level);
+void ttip_png_encoder_settuning(ttip_png_encoder_t encoder, ttip_png_tuning_t tuning);
+void ttip_png_encoder_setindexed(ttip_png_encoder_t encoder, int indexed);
+void ttip_png_encoder_setquantize(ttip_png_encoder_t encoder, int minpsnr);
+
+ttip_result_t ttip_png_encode(ttip_png_encoder_t encoder, ttip_image_t source, const char* filename);
+ttip_result_t ttip_png_encode_mem(ttip_png_encoder_t encoder, ttip_image_t source, ttip_buffer_t* output);
+ttip_result_t ttip_png_encode_blended(ttip_png_encoder_t encoder, ttip_image_t source, const ttip_image_t* overlays, int noverlays, const char* filename);
+ttip_result_t ttip_png_encode_blended_mem(ttip_png_encoder_t encoder, ttip_image_t source, const ttip_image_t* overlays, int noverlays, ttip_buffer_t* output);
+ttip_result_t ttip_png_encode_downsampled(ttip_png_encoder_t encoder, ttip_image_t topleft, ttip_image_t topright, ttip_image_t bottomleft, ttip_image_t bottomright, const ttip_image_t* overlays, int noverlays, const char* filename);
+ttip_result_t ttip_png_encode_downsampled_mem(ttip_png_encoder_t encoder, ttip_image_t topleft, ttip_image_t topright, ttip_image_t bottomleft, ttip_image_t bottomright, const ttip_image_t* overlays, int noverlays, ttip_buffer_t* output);
+
+/* content hash of the image encode functions with the same arguments
+ * would write, for finding duplicate tiles before spending time on
+ * their compression; covers dimensions, pixel format and all pixels
+ * (but not encoder settings), and is computed in a single pass over
+ * rows without materializing the image as well */
+ttip_result_t ttip_png_hash_blended(ttip_png_encoder_t encoder, ttip_image_t source, const ttip_image_t* overlays, int noverlays, ttip_hash_t* output);
+ttip_result_t ttip_png_hash_downsampled(ttip_png_encoder_t encoder, ttip_image_t topleft, ttip_image_t topright, ttip_image_t bottomleft, ttip_image_t bottomright, const ttip_image_t* overlays, int noverlays, ttip_hash_t* output);
+
+ttip_result_t ttip_png_decoder_create(ttip_png_decoder_t* output);
+void ttip_png_decoder_destroy(ttip_png_decoder_t* decoder);
+
+ttip_result_t ttip_png_decode(ttip_png_decoder_t decoder, ttip_image_t* output, const char* filename, ttip_pool_t pool /* = NULL */);
+ttip_result_t ttip_png_decode_mem(ttip_png_decoder_t decoder, ttip_image_t* output, const void* data, size_t size, ttip_pool_t pool /* = NULL */);
+
+/* tile archives
+ *
+ * Archive is a single file with encoded tiles stored back to back in
+ * the order they were added, so tiles of a subtree processed together
+ * are close to each other, followed by a directory which maps (zoom,
+ * x, y) to offset and size of tile data, sorted by tile. Identical
+ * tiles are stored once. Archive is written to a temporary file, which
+ * replaces the target when the archive is finished; if it's destroyed
+ * instead, nothing is replaced. Writer may only be used by a single
+ * thread at a time.
+ *
+ * Reader maps the whole file into memory, so looking up a tile does no
+ * system calls; returned data points into the mapping and is valid
+ * until the archive is closed. Reader may be used by any number of
+ * threads. Missing tiles are reported as ENOENT. Listing calls
+ * callback for each tile of the zoom, in directory order.
+ */
+ttip_result_t ttip_archive_open(ttip_archive_t* output, const char* filename);
+void ttip_archive_close(ttip_archive_t* archive);
+ttip_result_t ttip_archive_get(ttip_archive_t archive, int zoom, int x, int y, const unsigned char** data, size_t* size);
+ttip_result_t ttip_archive_list(ttip_archive_t archive, int zoom, void (*callback)(int x, int y, void* arg), void* arg);
+
+ttip_result_t ttip_archive_writer_create(ttip_archive_writer_t* output, const char* filename);
+ttip_result_t ttip_archive_writer_add(ttip_archive_writer_t writer, int zoom, int x, int y, const void* data, size_t size);
+ttip_result_t ttip_archive_writer_finish(ttip_archive_writer_t* writer);
+void ttip_archive_writer_destroy(ttip_archive_writer_t* writer);
+void ttip_archive_writer_getstats(ttip_archive_writer_t writer, ttip_archive_stats_t* stats);
+
 /* transformations */
 ttip_result_t ttip_clone(ttip_image_t* output, ttip_image_t source);
 ttip_result_t ttip_desaturate(ttip_image_t* output, ttip_image_t source);
@@ -95,6 +294,23 @@ ttip_result_t ttip_downsample2x2(ttip_image_t* output, ttip_image_t topleft, tti
 ttip_result_t ttip_maskblend(ttip_image_t* output, ttip_image_t background, ttip_image_t overlay);
 ttip_result_t ttip_threshold(ttip_image_t* output, ttip_image_t source, int value);
 
+/* lossy color reduction of RGB and RGBA images to at most ncolors
+ * (2..256) colors with median cut; result has the same format and may
+ * be written as paletted png in indexed mode; quality of approximation
+ * is returned in psnr (dB) unless it's NULL */
+ttip_result_t ttip_quantize(ttip_image_t* output, ttip_image_t source, int ncolors, double* psnr);
+
+/* inplace transformations
+ *
+ * These modify the image they're given. Operations which produce narrower
+ * pixel format (desaturate, threshold) change format of the image, while
+ * ones that would need wider format fail with TTIP_INPLACE_NOT_POSSIBLE.
+ */
+ttip_result_t ttip_desaturate_inplace(ttip_image_t target);
+ttip_result_t ttip_maskblend_inplace(ttip_image_t background, ttip_image_t overlay);
+ttip_result_t ttip_threshold_inplace(ttip_image_t target, int value);
+ttip_result_t ttip_quantize_inplace(ttip_image_t target, int ncolors, double* psnr);
+
 /* path handling */
 //ttip_result_t ttip_path_sprintf(char* buffer, size_t size, int zoom, int x, int y);
 
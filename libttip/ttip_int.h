@@ -20,21 +20,147 @@
 #ifndef TTIP_INT_H
 #define TTIP_INT_H
 
+#include <stdint.h>
 #include <sys/types.h>
 
 #include <ttip.h>
 
-#define TTIP_ALIGN_BITS 2
+/* alignment of pixel data and row stride, should be suitable for any vector loads */
+#define TTIP_DEFAULT_ALIGNMENT 64
 
-/* tile structure */
+/* tile structure; pixel data follows it in the same memory block */
 struct ttip_image {
 	int width;           /* width in pixels */
 	int height;          /* height in pixels */
 	int stride;          /* line stride in bytes */
 	ttip_format_t format;    /* pixel format */
 	unsigned char* data; /* data pointer */
+
+	int alignment;              /* alignment of data pointer and stride */
+	ttip_format_t allocformat;  /* pixel format image was allocated for */
+	size_t allocsize;           /* size of the whole memory block */
+	struct ttip_pool* pool;     /* pool image belongs to, or NULL */
+	struct ttip_image* next;    /* link in pool free list */
+
+	/* uniform image has all pixels of the same color; only a single
+	 * row is allocated for it, which stands for every row */
+	int uniform;
+	ttip_color_t color;
+	unsigned char* extdata;     /* separately allocated pixels of materialized uniform image */
+};
+
+/* allocate image block without any pool bookkeeping */
+struct ttip_image* ttip_alloc_image(int width, int height, ttip_format_t format, int alignment);
+
+/* return pooled image to its pool */
+void ttip_pool_release(struct ttip_image* image);
+
+/* allocate pixels for all rows of uniform image, which is needed
+ * before modifying it; image is no longer uniform after that */
+ttip_result_t ttip_materialize(struct ttip_image* image);
+
+/* set color of uniform image, refilling its row */
+void ttip_setuniform(struct ttip_image* image, ttip_color_t color);
+
+/* make sure buffer may hold at least size bytes */
+ttip_result_t ttip_buffer_reserve(ttip_buffer_t* buffer, size_t size);
+
+/* fast non-cryptographic hash of data fed in pieces */
+uint64_t ttip_hash_init();
+uint64_t ttip_hash_update(uint64_t state, const void* data, size_t size);
+uint64_t ttip_hash_finish(uint64_t state);
+
+/* exact palette of an image, built row by row */
+#define TTIP_PALETTE_MAX_COLORS 256
+#define TTIP_PALETTE_HASH_BITS 10
+#define TTIP_PALETTE_HASH_SIZE (1 << TTIP_PALETTE_HASH_BITS)
+
+struct ttip_palette {
+	int ncolors;
+	int ntrans;                                   /* translucent colors, placed first */
+	ttip_color_t colors[TTIP_PALETTE_MAX_COLORS]; /* in ttip_readpixel() representation */
+
+	/* open addressing hash from color to palette index */
+	ttip_color_t keys[TTIP_PALETTE_HASH_SIZE];
+	short indexes[TTIP_PALETTE_HASH_SIZE];        /* -1 for empty slot */
+};
+
+void ttip_palette_reset(struct ttip_palette* palette);
+
+/* add colors of a row; returns 0 if palette overflows */
+int ttip_palette_addrow(struct ttip_palette* palette, const unsigned char* row, int width, ttip_format_t format);
+
+/* reorder palette once all rows were added */
+void ttip_palette_finish(struct ttip_palette* palette, ttip_format_t format);
+
+/* smallest png bit depth palette indexes fit in */
+int ttip_palette_bitdepth(const struct ttip_palette* palette);
+
+/* convert row of pixels, all of which are in palette, to packed indexes */
+void ttip_palette_maprow(const struct ttip_palette* palette, unsigned char* dst, const unsigned char* row, int width, ttip_format_t format, int bitdepth);
+
+/* get palette entry as rgba */
+void ttip_palette_getentry(const struct ttip_palette* palette, int index, ttip_format_t format, unsigned char rgba[4]);
+
+/* median cut quantizer; zero-initialized structure is empty, its
+ * memory is kept between images */
+struct ttip_quantizer {
+	int bits;                 /* log2 of hash size */
+	int nentries;             /* unique colors */
+	int npixels;
+
+	/* open addressing hash of unique colors */
+	ttip_color_t* keys;
+	unsigned int* counts;     /* pixels of each color, 0 for empty slot */
+	unsigned char* indexes;   /* palette index of each color */
+
+	int* order;               /* slots of unique colors, grouped by box */
+	int* sorted;              /* scratch space for sorting */
 };
 
+/* prepare for image of given number of pixels */
+ttip_result_t ttip_quantizer_init(struct ttip_quantizer* quantizer, int npixels);
+void ttip_quantizer_free(struct ttip_quantizer* quantizer);
+
+/* add colors of a row to histogram */
+void ttip_quantizer_addrow(struct ttip_quantizer* quantizer, const unsigned char* row, int width, ttip_format_t format);
+
+/* build palette of at most ncolors once all rows were added; returns
+ * mean squared error per channel */
+double ttip_quantizer_build(struct ttip_quantizer* quantizer, int ncolors, ttip_format_t format, struct ttip_palette* palette);
+
+/* palette index for a color which was added to histogram */
+int ttip_quantizer_index(const struct ttip_quantizer* quantizer, ttip_color_t color, ttip_format_t format);
+
+/* convert row of pixels, all of which were added to histogram, to packed indexes */
+void ttip_quantizer_maprow(const struct ttip_quantizer* quantizer, unsigned char* dst, const unsigned char* row, int width, ttip_format_t format, int bitdepth);
+
+/* convert mean squared error to psnr in dB */
+double ttip_quantizer_psnr(double mse);
+
+/* row kernels of transforms, for use in fused pipelines */
+
+/* produce width pixels from 2*width pixels of two source rows */
+typedef void (*downsample_row_func)(unsigned char* dst, const unsigned char* src1, const unsigned char* src2, int width);
+
+/* blend single row of width pixels; dst may be the same as bg unless gray bg is expanded to rgb */
+typedef void (*maskblend_row_func)(unsigned char* dst, const unsigned char* bg, const unsigned char* ovr, int width);
+
+/* check that four images may be downsampled into one */
+ttip_result_t ttip_downsample_check(ttip_image_t topleft, ttip_image_t topright, ttip_image_t bottomleft, ttip_image_t bottomright);
+
+/* select best downsample kernel; aligned requires all rows to be 16 byte aligned */
+downsample_row_func ttip_downsample_select(int bpp, int aligned);
+
+/* check that overlay may be blended onto background of given size and format */
+ttip_result_t ttip_maskblend_check(int width, int height, ttip_format_t bgformat, ttip_image_t overlay);
+
+/* pixel format of blending result */
+ttip_format_t ttip_maskblend_format(ttip_format_t bgformat, ttip_format_t ovrformat);
+
+/* select best maskblend kernel; aligned requires all rows to be 32 byte aligned */
+maskblend_row_func ttip_maskblend_select(ttip_format_t bgformat, ttip_format_t ovrformat, int aligned);
+
 /* return number of bytes per pixel for format */
 static inline int ttip_getbpp(ttip_format_t format) {
 	switch (format) {
@@ -85,15 +211,31 @@ static inline ttip_color_t ttip_readpixel(unsigned char* ptr, ttip_format_t form
 	return 0;
 }
 
-/* alight stride */
-static inline size_t ttip_alignstride(size_t stride) {
-	size_t lowbitmask = (1 << TTIP_ALIGN_BITS) - 1;
-	if (stride & lowbitmask) {
-		stride += 1 << TTIP_ALIGN_BITS;
-		stride &= ~lowbitmask;
-	}
+/* distance between rows of image for reading; all rows of uniform image are the same */
+static inline int ttip_rowstep(struct ttip_image* image) {
+	return image->uniform ? 0 : image->stride;
+}
+
+/* single row view of uniform image, for processing it with row kernels */
+static inline struct ttip_image ttip_uniform_view(struct ttip_image* image) {
+	struct ttip_image view = *image;
+	view.height = 1;
+	return view;
+}
+
+/* update color of uniform image after its row was processed */
+static inline void ttip_uniform_sync(struct ttip_image* image) {
+	image->color = ttip_readpixel(image->data, image->format);
+}
+
+/* round size up to alignment, which must be power of 2 */
+static inline size_t ttip_alignsize(size_t size, size_t alignment) {
+	return (size + alignment - 1) & ~(alignment - 1);
+}
 
-	return stride;
+/* check whether all rows of the image start at given alignment */
+static inline int ttip_isaligned(struct ttip_image* image, size_t alignment) {
+	return ((size_t)image->data % alignment) == 0 && (image->stride % alignment) == 0;
 }
 
 static inline unsigned char desaturate(unsigned char r, unsigned char g, unsigned char b) {
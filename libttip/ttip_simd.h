@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2012 Dmitry Marakasov
+ *
+ * This file is part of libttip.
+ *
+ * libttip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libttip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libttip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TTIP_SIMD_H
+#define TTIP_SIMD_H
+
+#include <ttip.h>
+
+/* x86 vector kernels are compiled with per-function target attributes
+ * and selected at runtime, so the library itself doesn't require any
+ * specific instruction set */
+#if defined(WITH_SIMD) && (defined(__x86_64__) || defined(__i386__))
+#	define TTIP_X86_SIMD
+#	include <immintrin.h>
+#	define TTIP_TARGET(isa) __attribute__((target(isa)))
+#	define TTIP_TARGET_INLINE(isa) static inline __attribute__((always_inline, target(isa)))
+
+/* kernels are instantiated for aligned and unaligned rows; aligned
+ * variants are used when all rows are aligned to vector size */
+TTIP_TARGET_INLINE("sse2") __m128i ttip_load128(const void* p, int aligned) {
+	return aligned ? _mm_load_si128((const __m128i*)p) : _mm_loadu_si128((const __m128i*)p);
+}
+
+TTIP_TARGET_INLINE("sse2") void ttip_store128(void* p, __m128i v, int aligned) {
+	if (aligned)
+		_mm_store_si128((__m128i*)p, v);
+	else
+		_mm_storeu_si128((__m128i*)p, v);
+}
+
+TTIP_TARGET_INLINE("avx2") __m256i ttip_load256(const void* p, int aligned) {
+	return aligned ? _mm256_load_si256((const __m256i*)p) : _mm256_loadu_si256((const __m256i*)p);
+}
+#endif
+
+#endif
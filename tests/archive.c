@@ -0,0 +1,169 @@
+/*
+ * Copyright (C) 2012 Dmitry Marakasov
+ *
+ * This file is part of libttip.
+ *
+ * libttip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libttip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libttip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <ttip.h>
+
+#include "testing.h"
+
+#define FILENAME "archive_test.tta"
+
+static int check_tile(ttip_archive_t archive, int zoom, int x, int y, const char* contents) {
+	const unsigned char* data;
+	size_t size;
+	return ttip_archive_get(archive, zoom, x, y, &data, &size) == TTIP_OK &&
+		size == strlen(contents) && memcmp(data, contents, size) == 0;
+}
+
+static void list_tile(int x, int y, void* arg) {
+	int* sum = arg;
+	*sum += x * 100 + y;
+}
+
+static int write_file(const char* contents) {
+	FILE* f = fopen(FILENAME, "wb");
+	if (f == NULL)
+		return 0;
+	fputs(contents, f);
+	return fclose(f) == 0;
+}
+
+BEGIN_TEST()
+	ttip_archive_writer_t writer;
+	ttip_archive_t archive;
+	ttip_archive_stats_t stats;
+	const unsigned char* data1;
+	const unsigned char* data2;
+	size_t size;
+	int sum = 0;
+
+	remove(FILENAME);
+
+	/* unfinished archive is not created */
+	EXPECT_INT(ttip_archive_writer_create(&writer, FILENAME), TTIP_OK);
+	EXPECT_INT(ttip_archive_writer_add(writer, 1, 0, 0, "tile", 4), TTIP_OK);
+	ttip_archive_writer_destroy(&writer);
+	EXPECT_TRUE(writer == NULL);
+	EXPECT_INT(ttip_archive_open(&archive, FILENAME), ENOENT);
+
+	EXPECT_INT(ttip_archive_writer_create(&writer, FILENAME), TTIP_OK);
+	EXPECT_INT(ttip_archive_writer_add(writer, 2, 3, 1, "sea", 3), TTIP_OK);
+	EXPECT_INT(ttip_archive_writer_add(writer, 2, 1, 2, "land", 4), TTIP_OK);
+	EXPECT_INT(ttip_archive_writer_add(writer, 2, 1, 3, "sea", 3), TTIP_OK);
+	EXPECT_INT(ttip_archive_writer_add(writer, 1, 0, 1, "coast", 5), TTIP_OK);
+	EXPECT_INT(ttip_archive_writer_add(writer, 2, 1, 2, "city", 4), TTIP_OK);
+	EXPECT_INT(ttip_archive_writer_add(writer, 2, 0, 0, "", 0), TTIP_BAD_ARGUMENT);
+
+	ttip_archive_writer_getstats(writer, &stats);
+	EXPECT_INT(stats.tiles, 5);
+	EXPECT_INT(stats.unique, 4);
+	EXPECT_INT(stats.bytes, 16);
+
+	EXPECT_INT(ttip_archive_writer_finish(&writer), TTIP_OK);
+	EXPECT_TRUE(writer == NULL);
+
+	EXPECT_INT(ttip_archive_open(&archive, FILENAME), TTIP_OK);
+
+	EXPECT_TRUE(check_tile(archive, 2, 3, 1, "sea"));
+	EXPECT_TRUE(check_tile(archive, 2, 1, 3, "sea"));
+	EXPECT_TRUE(check_tile(archive, 1, 0, 1, "coast"));
+
+	/* later tile replaces earlier one */
+	EXPECT_TRUE(check_tile(archive, 2, 1, 2, "city"));
+
+	/* identical tiles share data */
+	EXPECT_INT(ttip_archive_get(archive, 2, 3, 1, &data1, &size), TTIP_OK);
+	EXPECT_INT(ttip_archive_get(archive, 2, 1, 3, &data2, &size), TTIP_OK);
+	EXPECT_TRUE(data1 == data2);
+
+	EXPECT_INT(ttip_archive_get(archive, 2, 1, 1, &data1, &size), ENOENT);
+	EXPECT_INT(ttip_archive_get(archive, 3, 1, 2, &data1, &size), ENOENT);
+	EXPECT_INT(ttip_archive_get(archive, 0, 0, 0, &data1, &size), ENOENT);
+
+	EXPECT_INT(ttip_archive_list(archive, 2, list_tile, &sum), TTIP_OK);
+	EXPECT_INT(sum, 301 + 102 + 103);
+
+	ttip_archive_close(&archive);
+	EXPECT_TRUE(archive == NULL);
+
+	/* large tiles are compared with data read back from file, until
+	 * they repeat; then with copy kept in memory */
+	static unsigned char large[4000], other[4000];
+	memset(large, 'a', sizeof(large));
+	memset(other, 'a', sizeof(other));
+	other[sizeof(other) - 1] = 'b';
+
+	EXPECT_INT(ttip_archive_writer_create(&writer, FILENAME), TTIP_OK);
+	EXPECT_INT(ttip_archive_writer_add(writer, 3, 0, 0, large, sizeof(large)), TTIP_OK);
+	EXPECT_INT(ttip_archive_writer_add(writer, 3, 0, 1, large, sizeof(large)), TTIP_OK);
+	EXPECT_INT(ttip_archive_writer_add(writer, 3, 0, 2, other, sizeof(other)), TTIP_OK);
+	EXPECT_INT(ttip_archive_writer_add(writer, 3, 0, 3, large, sizeof(large)), TTIP_OK);
+
+	ttip_archive_writer_getstats(writer, &stats);
+	EXPECT_INT(stats.tiles, 4);
+	EXPECT_INT(stats.unique, 2);
+
+	EXPECT_INT(ttip_archive_writer_finish(&writer), TTIP_OK);
+	EXPECT_INT(ttip_archive_open(&archive, FILENAME), TTIP_OK);
+
+	EXPECT_INT(ttip_archive_get(archive, 3, 0, 0, &data1, &size), TTIP_OK);
+	EXPECT_INT(ttip_archive_get(archive, 3, 0, 3, &data2, &size), TTIP_OK);
+	EXPECT_TRUE(data1 == data2 && size == sizeof(large) && memcmp(data2, large, size) == 0);
+	EXPECT_INT(ttip_archive_get(archive, 3, 0, 2, &data2, &size), TTIP_OK);
+	EXPECT_TRUE(data1 != data2 && size == sizeof(other) && memcmp(data2, other, size) == 0);
+
+	ttip_archive_close(&archive);
+
+	/* hash of contents grows past its initial size */
+	char name[16];
+	int i, nfound = 0;
+
+	EXPECT_INT(ttip_archive_writer_create(&writer, FILENAME), TTIP_OK);
+	for (i = 0; i < 3000; i++) {
+		snprintf(name, sizeof(name), "tile%d", i % 1500);
+		EXPECT_INT(ttip_archive_writer_add(writer, 12, i, 0, name, strlen(name)), TTIP_OK);
+	}
+
+	ttip_archive_writer_getstats(writer, &stats);
+	EXPECT_INT(stats.tiles, 3000);
+	EXPECT_INT(stats.unique, 1500);
+
+	EXPECT_INT(ttip_archive_writer_finish(&writer), TTIP_OK);
+	EXPECT_INT(ttip_archive_open(&archive, FILENAME), TTIP_OK);
+
+	for (i = 0; i < 3000; i++) {
+		snprintf(name, sizeof(name), "tile%d", i % 1500);
+		nfound += check_tile(archive, 12, i, 0, name);
+	}
+	EXPECT_INT(nfound, 3000);
+
+	ttip_archive_close(&archive);
+
+	/* not an archive */
+	EXPECT_TRUE(write_file("this is not a tile archive, but it's long enough to be one"));
+	EXPECT_INT(ttip_archive_open(&archive, FILENAME), TTIP_BAD_ARCHIVE);
+
+	EXPECT_TRUE(write_file(""));
+	EXPECT_INT(ttip_archive_open(&archive, FILENAME), TTIP_BAD_ARCHIVE);
+
+	remove(FILENAME);
+END_TEST()
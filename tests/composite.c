@@ -0,0 +1,152 @@
+/*
+ * Copyright (C) 2012 Dmitry Marakasov
+ *
+ * This file is part of libttip.
+ *
+ * libttip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libttip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libttip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <ttip.h>
+
+#include "testing.h"
+
+static ttip_png_encoder_t g_encoder;
+
+static ttip_image_t make_image(int width, int height, ttip_format_t format, unsigned int seed) {
+	ttip_image_t tile;
+	int x, y;
+
+	if (ttip_create(&tile, width, height, format) != TTIP_OK)
+		return NULL;
+
+	for (y = 0; y < height; y++) {
+		for (x = 0; x < width; x++) {
+			seed = seed * 1103515245 + 12345;
+			ttip_setpixel(tile, x, y, seed >> 3);
+		}
+	}
+
+	return tile;
+}
+
+static int compare_files(const char* a, const char* b) {
+	ttip_image_t ia = NULL, ib = NULL;
+	int x, y, equal = 0;
+
+	if (ttip_loadpng(&ia, a) != TTIP_OK || ttip_loadpng(&ib, b) != TTIP_OK)
+		goto out;
+
+	if (ttip_getformat(ia) != ttip_getformat(ib) || ttip_getwidth(ia) != ttip_getwidth(ib) || ttip_getheight(ia) != ttip_getheight(ib))
+		goto out;
+
+	for (y = 0; y < ttip_getheight(ia); y++)
+		for (x = 0; x < ttip_getwidth(ia); x++)
+			if (ttip_getpixel(ia, x, y) != ttip_getpixel(ib, x, y))
+				goto out;
+
+	equal = 1;
+
+out:
+	ttip_destroy(&ia);
+	ttip_destroy(&ib);
+	return equal;
+}
+
+/* reference: materialize every step */
+static int save_reference(ttip_image_t source, ttip_image_t* overlays, int noverlays, const char* filename) {
+	ttip_image_t current, temp;
+	int i;
+
+	if (ttip_clone(&current, source) != TTIP_OK)
+		return 0;
+
+	for (i = 0; i < noverlays; i++) {
+		if (ttip_maskblend(&temp, current, overlays[i]) != TTIP_OK)
+			return 0;
+		ttip_destroy(&current);
+		current = temp;
+	}
+
+	i = ttip_savepng(current, filename, 6) == TTIP_OK;
+	ttip_destroy(&current);
+
+	return i;
+}
+
+static int check_fused(ttip_format_t format, ttip_format_t ovr1format, ttip_format_t ovr2format) {
+	ttip_image_t quadrants[4], overlays[2], downsampled;
+	int i, ok = 1;
+
+	for (i = 0; i < 4; i++)
+		quadrants[i] = make_image(70, 30, format, i + 1);
+	overlays[0] = make_image(70, 30, ovr1format, 5);
+	overlays[1] = make_image(70, 30, ovr2format, 6);
+
+	if (ttip_downsample2x2(&downsampled, quadrants[0], quadrants[1], quadrants[2], quadrants[3]) != TTIP_OK)
+		return 0;
+
+	/* blended source */
+	ok = ok && save_reference(quadrants[0], overlays, 2, "composite_ref.png");
+	ok = ok && ttip_png_encode_blended(g_encoder, quadrants[0], overlays, 2, "composite.png") == TTIP_OK;
+	ok = ok && compare_files("composite_ref.png", "composite.png");
+
+	/* downsampled and blended */
+	ok = ok && save_reference(downsampled, overlays, 2, "composite_ref.png");
+	ok = ok && ttip_png_encode_downsampled(g_encoder, quadrants[0], quadrants[1], quadrants[2], quadrants[3], overlays, 2, "composite.png") == TTIP_OK;
+	ok = ok && compare_files("composite_ref.png", "composite.png");
+
+	/* downsampled only */
+	ok = ok && save_reference(downsampled, overlays, 0, "composite_ref.png");
+	ok = ok && ttip_png_encode_downsampled(g_encoder, quadrants[0], quadrants[1], quadrants[2], quadrants[3], NULL, 0, "composite.png") == TTIP_OK;
+	ok = ok && compare_files("composite_ref.png", "composite.png");
+
+	for (i = 0; i < 4; i++)
+		ttip_destroy(&quadrants[i]);
+	ttip_destroy(&overlays[0]);
+	ttip_destroy(&overlays[1]);
+	ttip_destroy(&downsampled);
+
+	return ok;
+}
+
+BEGIN_TEST()
+	EXPECT_TRUE(ttip_png_encoder_create(&g_encoder) == TTIP_OK);
+
+	/* gray stays gray, gray expanded by first or second overlay, rgb */
+	EXPECT_TRUE(check_fused(TTIP_GRAY, TTIP_GRAY_ALPHA, TTIP_GRAY_ALPHA));
+	EXPECT_TRUE(check_fused(TTIP_GRAY, TTIP_RGB_ALPHA, TTIP_GRAY_ALPHA));
+	EXPECT_TRUE(check_fused(TTIP_GRAY, TTIP_GRAY_ALPHA, TTIP_RGB_ALPHA));
+	EXPECT_TRUE(check_fused(TTIP_RGB, TTIP_RGB_ALPHA, TTIP_GRAY_ALPHA));
+
+	/* same with palette detection, which produces rows twice */
+	ttip_png_encoder_setindexed(g_encoder, 1);
+	EXPECT_TRUE(check_fused(TTIP_GRAY, TTIP_RGB_ALPHA, TTIP_GRAY_ALPHA));
+	EXPECT_TRUE(check_fused(TTIP_RGB, TTIP_RGB_ALPHA, TTIP_GRAY_ALPHA));
+	ttip_png_encoder_setindexed(g_encoder, 0);
+
+	/* sources are checked */
+	ttip_image_t a = make_image(16, 16, TTIP_RGB, 1);
+	ttip_image_t b = make_image(16, 16, TTIP_GRAY, 2);
+	ttip_image_t c = make_image(8, 8, TTIP_RGB_ALPHA, 3);
+
+	EXPECT_TRUE(ttip_png_encode_downsampled(g_encoder, a, a, a, b, NULL, 0, "composite.png") == TTIP_IMAGE_FORMAT_MISMATCH);
+	EXPECT_TRUE(ttip_png_encode_blended(g_encoder, a, &c, 1, "composite.png") == TTIP_IMAGE_DIMENSIONS_MISMATCH);
+	EXPECT_TRUE(ttip_png_encode_blended(g_encoder, a, &a, 1, "composite.png") == TTIP_BAD_PIXEL_FORMAT);
+
+	ttip_destroy(&a);
+	ttip_destroy(&b);
+	ttip_destroy(&c);
+
+	ttip_png_encoder_destroy(&g_encoder);
+END_TEST()
@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2012 Dmitry Marakasov
+ *
+ * This file is part of libttip.
+ *
+ * libttip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libttip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libttip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "copyfile.h"
+
+#include "testing.h"
+
+#define DIR "copyfile_test_files"
+
+static int check_file(const char* path, const char* contents) {
+	char buffer[64];
+	FILE* f = fopen(path, "rb");
+	if (f == NULL)
+		return 0;
+
+	size_t size = fread(buffer, 1, sizeof(buffer), f);
+	fclose(f);
+
+	return size == strlen(contents) && memcmp(buffer, contents, size) == 0;
+}
+
+static int same_inode(const char* a, const char* b) {
+	struct stat sa, sb;
+	return stat(a, &sa) == 0 && stat(b, &sb) == 0 && sa.st_ino == sb.st_ino;
+}
+
+BEGIN_TEST()
+	copyfile_mode_t mode;
+	int linked;
+
+	mkdir(DIR, 0777);
+
+	EXPECT_TRUE(parse_copyfile_mode("copy", &mode) && mode == COPYFILE_COPY);
+	EXPECT_TRUE(parse_copyfile_mode("hardlink", &mode) && mode == COPYFILE_HARDLINK);
+	EXPECT_TRUE(parse_copyfile_mode("reflink", &mode) && mode == COPYFILE_REFLINK);
+	EXPECT_FALSE(parse_copyfile_mode("symlink", &mode));
+
+	EXPECT_INT(write_file(DIR "/a", (const unsigned char*)"source", 6), 0);
+	EXPECT_TRUE(check_file(DIR "/a", "source"));
+
+	/* copy */
+	EXPECT_INT(copy_file(DIR "/a", DIR "/b", COPYFILE_COPY, &linked), 0);
+	EXPECT_FALSE(linked);
+	EXPECT_TRUE(check_file(DIR "/b", "source"));
+	EXPECT_FALSE(same_inode(DIR "/a", DIR "/b"));
+
+	/* existing file is replaced, not written through */
+	EXPECT_INT(copy_file(DIR "/a", DIR "/b", COPYFILE_HARDLINK, &linked), 0);
+	EXPECT_TRUE(linked);
+	EXPECT_TRUE(same_inode(DIR "/a", DIR "/b"));
+
+	EXPECT_INT(write_file(DIR "/b", (const unsigned char*)"other", 5), 0);
+	EXPECT_TRUE(check_file(DIR "/a", "source"));
+	EXPECT_TRUE(check_file(DIR "/b", "other"));
+
+	/* reflink either succeeds or falls back to copy */
+	EXPECT_INT(copy_file(DIR "/a", DIR "/c", COPYFILE_REFLINK, &linked), 0);
+	EXPECT_TRUE(check_file(DIR "/c", "source"));
+	EXPECT_FALSE(same_inode(DIR "/a", DIR "/c"));
+
+	/* errors */
+	EXPECT_INT(copy_file(DIR "/nonexistent", DIR "/d", COPYFILE_COPY, &linked), ENOENT);
+	EXPECT_INT(copy_file(DIR "/a", DIR "/nonexistent/d", COPYFILE_COPY, &linked), ENOENT);
+	EXPECT_TRUE(access(DIR "/d", F_OK) != 0);
+
+	unlink(DIR "/a");
+	unlink(DIR "/b");
+	unlink(DIR "/c");
+	rmdir(DIR);
+END_TEST()
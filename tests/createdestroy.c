@@ -33,4 +33,34 @@ BEGIN_TEST()
 	ttip_destroy(&tile);
 
 	EXPECT_TRUE(tile == NULL);
+
+	/* alignment */
+	EXPECT_TRUE(ttip_create(&tile, 17, 3, TTIP_RGB) == TTIP_OK);
+	EXPECT_TRUE(ttip_getstride(tile) == 64);
+	ttip_destroy(&tile);
+
+	EXPECT_TRUE(ttip_create_ex(&tile, 17, 3, TTIP_RGB, 1, NULL) == TTIP_OK);
+	EXPECT_TRUE(ttip_getstride(tile) == 17 * 3);
+	ttip_destroy(&tile);
+
+	EXPECT_TRUE(ttip_create_ex(&tile, 17, 3, TTIP_RGB, 3, NULL) == TTIP_BAD_ALIGNMENT);
+
+	/* clone between different strides */
+	ttip_image_t clone = NULL;
+	int x, y, nmismatches = 0;
+
+	EXPECT_TRUE(ttip_create_ex(&tile, 17, 3, TTIP_RGB, 1, NULL) == TTIP_OK);
+	for (y = 0; y < 3; y++)
+		for (x = 0; x < 17; x++)
+			ttip_setpixel(tile, x, y, x * 1000 + y);
+
+	EXPECT_TRUE(ttip_clone(&clone, tile) == TTIP_OK);
+	EXPECT_TRUE(ttip_getstride(clone) != ttip_getstride(tile));
+	for (y = 0; y < 3; y++)
+		for (x = 0; x < 17; x++)
+			nmismatches += ttip_getpixel(clone, x, y) != (ttip_color_t)(x * 1000 + y);
+	EXPECT_TRUE(nmismatches == 0);
+
+	ttip_destroy(&clone);
+	ttip_destroy(&tile);
 END_TEST()
@@ -0,0 +1,147 @@
+/*
+ * Copyright (C) 2012 Dmitry Marakasov
+ *
+ * This file is part of libttip.
+ *
+ * libttip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libttip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libttip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "copyfile.h"
+#include "dedup.h"
+
+#include "testing.h"
+
+#define DIR "dedup_test_files"
+
+static int check_file(const char* path, const char* contents) {
+	char buffer[64];
+	FILE* f = fopen(path, "rb");
+	if (f == NULL)
+		return 0;
+
+	size_t size = fread(buffer, 1, sizeof(buffer), f);
+	fclose(f);
+
+	return size == strlen(contents) && memcmp(buffer, contents, size) == 0;
+}
+
+static int same_inode(const char* a, const char* b) {
+	struct stat sa, sb;
+	return stat(a, &sa) == 0 && stat(b, &sb) == 0 && sa.st_ino == sb.st_ino;
+}
+
+BEGIN_TEST()
+	dedup_stats_t stats;
+
+	mkdir(DIR, 0777);
+
+	/* copy mode */
+	init_dedup(DEDUP_COPY, 1024);
+	EXPECT_TRUE(dedup_save(1, DIR "/a") == DEDUP_MISS);
+	EXPECT_INT(dedup_store(1, DIR "/a", (const unsigned char*)"first", 5), 0);
+	EXPECT_TRUE(dedup_save(2, DIR "/b") == DEDUP_MISS);
+	EXPECT_INT(dedup_store(2, DIR "/b", (const unsigned char*)"second", 6), 0);
+	EXPECT_TRUE(dedup_save(1, DIR "/c") == DEDUP_COPIED);
+	EXPECT_TRUE(dedup_save(2, DIR "/d") == DEDUP_COPIED);
+
+	EXPECT_TRUE(check_file(DIR "/a", "first"));
+	EXPECT_TRUE(check_file(DIR "/b", "second"));
+	EXPECT_TRUE(check_file(DIR "/c", "first"));
+	EXPECT_TRUE(check_file(DIR "/d", "second"));
+	EXPECT_FALSE(same_inode(DIR "/a", DIR "/c"));
+
+	dedup_getstats(&stats);
+	EXPECT_INT((int)stats.lookups, 4);
+	EXPECT_INT((int)stats.hits, 2);
+	EXPECT_INT((int)stats.linked, 0);
+	EXPECT_INT((int)stats.bytes_reused, 11);
+
+	/* hardlink mode, replacing existing files */
+	init_dedup(DEDUP_HARDLINK, 1024);
+	EXPECT_TRUE(dedup_save(1, DIR "/c") == DEDUP_MISS);
+	EXPECT_INT(dedup_store(1, DIR "/a", (const unsigned char*)"third", 5), 0);
+	EXPECT_TRUE(dedup_save(1, DIR "/c") == DEDUP_LINKED);
+	EXPECT_TRUE(check_file(DIR "/c", "third"));
+	EXPECT_TRUE(same_inode(DIR "/a", DIR "/c"));
+
+	/* file being written elsewhere is not linked until it's done,
+	 * as it still has old contents */
+	dedup_store_pending(2, DIR "/a", (const unsigned char*)"fourth", 6);
+	EXPECT_TRUE(dedup_save(2, DIR "/d") == DEDUP_COPIED);
+	EXPECT_TRUE(check_file(DIR "/d", "fourth"));
+	EXPECT_FALSE(same_inode(DIR "/a", DIR "/d"));
+
+	EXPECT_INT(write_file(DIR "/a", (const unsigned char*)"fourth", 6), 0);
+	dedup_written(2, DIR "/a");
+	EXPECT_TRUE(dedup_save(2, DIR "/d") == DEDUP_LINKED);
+	EXPECT_TRUE(same_inode(DIR "/a", DIR "/d"));
+
+	/* fetching for writer thread links written file, and returns
+	 * png of pending one */
+	ttip_buffer_t buffer = { NULL, 0, 0 };
+
+	EXPECT_TRUE(dedup_fetch(3, DIR "/b", &buffer) == DEDUP_MISS);
+	dedup_store_pending(3, DIR "/c", (const unsigned char*)"fifth", 5);
+	EXPECT_TRUE(dedup_fetch(3, DIR "/b", &buffer) == DEDUP_FETCHED);
+	EXPECT_TRUE(buffer.size == 5 && memcmp(buffer.data, "fifth", 5) == 0);
+	EXPECT_TRUE(dedup_fetch(2, DIR "/b", &buffer) == DEDUP_LINKED);
+	EXPECT_TRUE(same_inode(DIR "/a", DIR "/b"));
+
+	/* and always returns png in copy mode */
+	init_dedup(DEDUP_COPY, 1024);
+	EXPECT_INT(dedup_store(1, DIR "/a", (const unsigned char*)"first", 5), 0);
+	EXPECT_TRUE(dedup_fetch(1, DIR "/b", &buffer) == DEDUP_FETCHED);
+	EXPECT_TRUE(buffer.size == 5 && memcmp(buffer.data, "first", 5) == 0);
+
+	dedup_getstats(&stats);
+	EXPECT_INT((int)stats.hits, 1);
+	EXPECT_INT((int)stats.bytes_reused, 5);
+
+	free(buffer.data);
+
+	/* reflinked clone is a separate file, so it's reported as copy
+	 * whether or not filesystem supports reflinks */
+	init_dedup(DEDUP_REFLINK, 1024);
+	EXPECT_INT(dedup_store(1, DIR "/a", (const unsigned char*)"third", 5), 0);
+	EXPECT_TRUE(dedup_save(1, DIR "/c") == DEDUP_COPIED);
+	EXPECT_TRUE(check_file(DIR "/c", "third"));
+	EXPECT_FALSE(same_inode(DIR "/a", DIR "/c"));
+
+	/* oldest entries are dropped to fit memory limit */
+	init_dedup(DEDUP_COPY, 10);
+	EXPECT_INT(dedup_store(1, DIR "/a", (const unsigned char*)"first", 5), 0);
+	EXPECT_INT(dedup_store(2, DIR "/b", (const unsigned char*)"second", 6), 0);
+	EXPECT_TRUE(dedup_save(1, DIR "/c") == DEDUP_MISS);
+	EXPECT_TRUE(dedup_save(2, DIR "/c") == DEDUP_COPIED);
+
+	dedup_getstats(&stats);
+	EXPECT_INT((int)stats.evicted, 1);
+
+	/* unwritable path */
+	EXPECT_TRUE(dedup_save(2, DIR "/nonexistent/a") == DEDUP_FAILED);
+
+	cleanup_dedup();
+
+	unlink(DIR "/a");
+	unlink(DIR "/b");
+	unlink(DIR "/c");
+	unlink(DIR "/d");
+	rmdir(DIR);
+END_TEST()
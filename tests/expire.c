@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2012 Dmitry Marakasov
+ *
+ * This file is part of libttip.
+ *
+ * libttip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libttip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libttip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <errno.h>
+#include <stdio.h>
+
+#include "expire.h"
+
+#include "testing.h"
+
+#define FILENAME "expire_test.list"
+
+static int write_list(const char* contents) {
+	FILE* f = fopen(FILENAME, "w");
+	if (f == NULL)
+		return 0;
+	fputs(contents, f);
+	return fclose(f) == 0;
+}
+
+BEGIN_TEST()
+	expire_stats_t stats;
+	int line = 0;
+
+	/* without list, everything is dirty */
+	EXPECT_TRUE(is_tile_dirty(5, 5, 3));
+
+	remove(FILENAME);
+	EXPECT_INT(init_expire(FILENAME, &line), ENOENT);
+
+	EXPECT_TRUE(write_list("3/5/2\n3/5/2\r\n\n5/0/31 \n"));
+	EXPECT_INT(init_expire(FILENAME, &line), 0);
+
+	/* listed tiles */
+	EXPECT_TRUE(is_tile_dirty(5, 2, 3));
+	EXPECT_TRUE(is_tile_dirty(0, 31, 5));
+
+	/* their ancestors */
+	EXPECT_TRUE(is_tile_dirty(2, 1, 2));
+	EXPECT_TRUE(is_tile_dirty(1, 0, 1));
+	EXPECT_TRUE(is_tile_dirty(0, 0, 0));
+	EXPECT_TRUE(is_tile_dirty(0, 15, 4));
+	EXPECT_TRUE(is_tile_dirty(0, 1, 1));
+
+	/* and descendants */
+	EXPECT_TRUE(is_tile_dirty(10, 4, 4));
+	EXPECT_TRUE(is_tile_dirty(11, 5, 4));
+	EXPECT_TRUE(is_tile_dirty(47, 23, 6));
+
+	/* siblings and their subtrees are not */
+	EXPECT_FALSE(is_tile_dirty(4, 2, 3));
+	EXPECT_FALSE(is_tile_dirty(5, 3, 3));
+	EXPECT_FALSE(is_tile_dirty(12, 4, 4));
+	EXPECT_FALSE(is_tile_dirty(1, 31, 5));
+	EXPECT_FALSE(is_tile_dirty(0, 0, 1));
+	EXPECT_FALSE(is_tile_dirty(2, 62, 6));
+	EXPECT_TRUE(is_tile_dirty(1, 63, 6));
+
+	expire_getstats(&stats);
+	EXPECT_INT(stats.listed, 2);
+	EXPECT_INT(stats.dirty, 4 + 6 - 1);
+
+	/* malformed lines */
+	EXPECT_TRUE(write_list("3/5/2\n3/5\n"));
+	EXPECT_INT(init_expire(FILENAME, &line), EINVAL);
+	EXPECT_INT(line, 2);
+
+	EXPECT_TRUE(write_list("3/8/2\n"));
+	EXPECT_INT(init_expire(FILENAME, &line), EINVAL);
+	EXPECT_INT(line, 1);
+
+	EXPECT_TRUE(write_list("3//2\n"));
+	EXPECT_INT(init_expire(FILENAME, &line), EINVAL);
+
+	/* failed load leaves no list */
+	EXPECT_TRUE(is_tile_dirty(4, 2, 3));
+
+	/* empty list leaves nothing dirty */
+	EXPECT_TRUE(write_list(""));
+	EXPECT_INT(init_expire(FILENAME, &line), 0);
+	EXPECT_FALSE(is_tile_dirty(0, 0, 0));
+
+	cleanup_expire();
+	EXPECT_TRUE(is_tile_dirty(0, 0, 0));
+
+	remove(FILENAME);
+END_TEST()
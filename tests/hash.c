@@ -0,0 +1,100 @@
+/*
+ * Copyright (C) 2012 Dmitry Marakasov
+ *
+ * This file is part of libttip.
+ *
+ * libttip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libttip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libttip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <ttip.h>
+
+#include "testing.h"
+
+static ttip_image_t make_image(ttip_format_t format, unsigned int seed) {
+	ttip_image_t tile;
+	int x, y;
+
+	if (ttip_create(&tile, 38, 20, format) != TTIP_OK)
+		return NULL;
+
+	for (y = 0; y < 20; y++) {
+		for (x = 0; x < 38; x++) {
+			seed = seed * 1103515245 + 12345;
+			ttip_setpixel(tile, x, y, seed);
+		}
+	}
+
+	return tile;
+}
+
+static ttip_hash_t hash_image(ttip_png_encoder_t encoder, ttip_image_t image) {
+	ttip_hash_t hash = 0;
+	ttip_png_hash_blended(encoder, image, NULL, 0, &hash);
+	return hash;
+}
+
+BEGIN_TEST()
+	ttip_png_encoder_t encoder;
+	ttip_image_t images[4], overlay, downsampled, blended, copy;
+	ttip_hash_t hash;
+	int i;
+
+	EXPECT_INT(ttip_png_encoder_create(&encoder), TTIP_OK);
+
+	for (i = 0; i < 4; i++)
+		images[i] = make_image(TTIP_RGB, i + 1);
+	overlay = make_image(TTIP_RGBA, 5);
+
+	/* fused pipeline hashes the same pixels it would encode */
+	EXPECT_INT(ttip_downsample2x2(&downsampled, images[0], images[1], images[2], images[3]), TTIP_OK);
+	EXPECT_INT(ttip_maskblend(&blended, downsampled, overlay), TTIP_OK);
+
+	EXPECT_INT(ttip_png_hash_downsampled(encoder, images[0], images[1], images[2], images[3], NULL, 0, &hash), TTIP_OK);
+	EXPECT_TRUE(hash == hash_image(encoder, downsampled));
+	EXPECT_INT(ttip_png_hash_downsampled(encoder, images[0], images[1], images[2], images[3], &overlay, 1, &hash), TTIP_OK);
+	EXPECT_TRUE(hash == hash_image(encoder, blended));
+	EXPECT_INT(ttip_png_hash_blended(encoder, downsampled, &overlay, 1, &hash), TTIP_OK);
+	EXPECT_TRUE(hash == hash_image(encoder, blended));
+
+	/* any change of pixels or layout changes the hash */
+	EXPECT_INT(ttip_clone(&copy, images[0]), TTIP_OK);
+	EXPECT_TRUE(hash_image(encoder, copy) == hash_image(encoder, images[0]));
+	ttip_setpixel(copy, 37, 19, ttip_getpixel(copy, 37, 19) ^ 1);
+	EXPECT_TRUE(hash_image(encoder, copy) != hash_image(encoder, images[0]));
+	EXPECT_TRUE(hash_image(encoder, images[0]) != hash_image(encoder, images[1]));
+	ttip_destroy(&copy);
+
+	ttip_image_t gray, gray2;
+	EXPECT_INT(ttip_create_uniform(&gray, 38, 20, TTIP_GRAY, 0, NULL), TTIP_OK);
+	EXPECT_INT(ttip_create_uniform(&gray2, 20, 38, TTIP_GRAY, 0, NULL), TTIP_OK);
+	EXPECT_TRUE(hash_image(encoder, gray) != hash_image(encoder, gray2));
+	ttip_destroy(&gray2);
+
+	/* uniform and allocated images of the same color are equal */
+	EXPECT_INT(ttip_create(&gray2, 38, 20, TTIP_GRAY), TTIP_OK);
+	EXPECT_INT(ttip_clear(gray2), TTIP_OK);
+	EXPECT_TRUE(hash_image(encoder, gray) == hash_image(encoder, gray2));
+	ttip_destroy(&gray2);
+	ttip_destroy(&gray);
+
+	/* bad arguments are reported as in encoding */
+	EXPECT_INT(ttip_png_hash_blended(encoder, images[0], &images[1], 1, &hash), TTIP_BAD_PIXEL_FORMAT);
+
+	for (i = 0; i < 4; i++)
+		ttip_destroy(&images[i]);
+	ttip_destroy(&overlay);
+	ttip_destroy(&downsampled);
+	ttip_destroy(&blended);
+	ttip_png_encoder_destroy(&encoder);
+END_TEST()
@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2012 Dmitry Marakasov
+ *
+ * This file is part of libttip.
+ *
+ * libttip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libttip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libttip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <ttip.h>
+
+#include "testing.h"
+
+static ttip_image_t make_image(ttip_format_t format, unsigned int seed) {
+	ttip_image_t tile;
+	int x, y;
+
+	if (ttip_create(&tile, 37, 19, format) != TTIP_OK)
+		return NULL;
+
+	for (y = 0; y < 19; y++) {
+		for (x = 0; x < 37; x++) {
+			seed = seed * 1103515245 + 12345;
+			ttip_setpixel(tile, x, y, seed);
+		}
+	}
+
+	return tile;
+}
+
+static int compare_images(ttip_image_t a, ttip_image_t b) {
+	int x, y;
+
+	if (ttip_getformat(a) != ttip_getformat(b))
+		return 0;
+
+	for (y = 0; y < ttip_getheight(a); y++)
+		for (x = 0; x < ttip_getwidth(a); x++)
+			if (ttip_getpixel(a, x, y) != ttip_getpixel(b, x, y))
+				return 0;
+
+	return 1;
+}
+
+BEGIN_TEST()
+	ttip_image_t source, reference, overlay;
+
+	/* desaturate, with narrowing of format */
+	source = make_image(TTIP_RGB, 1);
+	EXPECT_TRUE(ttip_desaturate(&reference, source) == TTIP_OK);
+	EXPECT_TRUE(ttip_desaturate_inplace(source) == TTIP_OK);
+	EXPECT_TRUE(ttip_getformat(source) == TTIP_GRAY);
+	EXPECT_TRUE(compare_images(source, reference));
+	ttip_destroy(&source);
+	ttip_destroy(&reference);
+
+	source = make_image(TTIP_RGBA, 2);
+	EXPECT_TRUE(ttip_desaturate(&reference, source) == TTIP_OK);
+	EXPECT_TRUE(ttip_desaturate_inplace(source) == TTIP_OK);
+	EXPECT_TRUE(ttip_getformat(source) == TTIP_GRAYA);
+	EXPECT_TRUE(compare_images(source, reference));
+	ttip_destroy(&source);
+	ttip_destroy(&reference);
+
+	/* threshold */
+	source = make_image(TTIP_RGB, 3);
+	EXPECT_TRUE(ttip_threshold(&reference, source, 100) == TTIP_OK);
+	EXPECT_TRUE(ttip_threshold_inplace(source, 100) == TTIP_OK);
+	EXPECT_TRUE(ttip_getformat(source) == TTIP_GRAY);
+	EXPECT_TRUE(compare_images(source, reference));
+	ttip_destroy(&source);
+	ttip_destroy(&reference);
+
+	/* maskblend */
+	source = make_image(TTIP_RGB, 4);
+	overlay = make_image(TTIP_RGBA, 5);
+	EXPECT_TRUE(ttip_maskblend(&reference, source, overlay) == TTIP_OK);
+	EXPECT_TRUE(ttip_maskblend_inplace(source, overlay) == TTIP_OK);
+	EXPECT_TRUE(compare_images(source, reference));
+	ttip_destroy(&source);
+	ttip_destroy(&overlay);
+	ttip_destroy(&reference);
+
+	source = make_image(TTIP_RGB, 6);
+	overlay = make_image(TTIP_GRAYA, 7);
+	EXPECT_TRUE(ttip_maskblend(&reference, source, overlay) == TTIP_OK);
+	EXPECT_TRUE(ttip_maskblend_inplace(source, overlay) == TTIP_OK);
+	EXPECT_TRUE(compare_images(source, reference));
+	ttip_destroy(&source);
+	ttip_destroy(&overlay);
+	ttip_destroy(&reference);
+
+	source = make_image(TTIP_GRAY, 8);
+	overlay = make_image(TTIP_GRAYA, 9);
+	EXPECT_TRUE(ttip_maskblend(&reference, source, overlay) == TTIP_OK);
+	EXPECT_TRUE(ttip_maskblend_inplace(source, overlay) == TTIP_OK);
+	EXPECT_TRUE(compare_images(source, reference));
+	ttip_destroy(&source);
+	ttip_destroy(&overlay);
+	ttip_destroy(&reference);
+
+	/* gray background can't hold rgb result */
+	source = make_image(TTIP_GRAY, 10);
+	overlay = make_image(TTIP_RGBA, 11);
+	EXPECT_TRUE(ttip_maskblend_inplace(source, overlay) == TTIP_INPLACE_NOT_POSSIBLE);
+	ttip_destroy(&source);
+	ttip_destroy(&overlay);
+END_TEST()
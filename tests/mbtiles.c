@@ -0,0 +1,126 @@
+/*
+ * Copyright (C) 2012 Dmitry Marakasov
+ *
+ * This file is part of libttip.
+ *
+ * libttip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libttip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libttip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sqlite3.h>
+
+#include "mbtiles.h"
+
+#include "testing.h"
+
+#define FILE "mbtiles_test.mbtiles"
+#define TILESET MBTILES_PREFIX FILE
+
+static int check_buffer(const ttip_buffer_t* buffer, const char* contents) {
+	return buffer->size == strlen(contents) && memcmp(buffer->data, contents, buffer->size) == 0;
+}
+
+static void count_tile(int x, int y, void* arg) {
+	int* count = arg;
+	if (x == 3 && (y == 5 || y == 6))
+		(*count)++;
+	else
+		*count = -100;
+}
+
+/* highest tile row of a column as stored in database */
+static int get_stored_row(int x, int zoom) {
+	sqlite3* db;
+	sqlite3_stmt* stmt;
+	int row = -1;
+
+	if (sqlite3_open_v2(FILE, &db, SQLITE_OPEN_READONLY, NULL) == SQLITE_OK &&
+			sqlite3_prepare_v2(db, "SELECT max(tile_row) FROM tiles WHERE zoom_level = ? AND tile_column = ?", -1, &stmt, NULL) == SQLITE_OK) {
+		sqlite3_bind_int(stmt, 1, zoom);
+		sqlite3_bind_int(stmt, 2, x);
+		if (sqlite3_step(stmt) == SQLITE_ROW)
+			row = sqlite3_column_int(stmt, 0);
+		sqlite3_finalize(stmt);
+	}
+	sqlite3_close(db);
+
+	return row;
+}
+
+BEGIN_TEST()
+	ttip_buffer_t buffer;
+	mbtiles_stats_t stats;
+	int count = 0;
+
+	ttip_buffer_init(&buffer);
+	unlink(FILE);
+
+	EXPECT_TRUE(IS_MBTILES(TILESET));
+	EXPECT_FALSE(IS_MBTILES(FILE));
+
+	EXPECT_INT(init_mbtiles(2), 0);
+
+	/* tileset must be open */
+	EXPECT_INT(mbtiles_read(TILESET, 3, 5, 4, &buffer), EBADF);
+
+	/* missing input */
+	EXPECT_TRUE(mbtiles_open(TILESET, 0) != 0);
+
+	EXPECT_INT(mbtiles_open(TILESET, 1), 0);
+	EXPECT_INT(mbtiles_access(TILESET, 3, 5, 4), ENOENT);
+	EXPECT_INT(mbtiles_read(TILESET, 3, 5, 4, &buffer), ENOENT);
+
+	EXPECT_INT(mbtiles_write(TILESET, 3, 5, 4, (const unsigned char*)"first", 5), 0);
+	EXPECT_INT(mbtiles_write(TILESET, 3, 6, 4, (const unsigned char*)"second", 6), 0);
+	EXPECT_INT(mbtiles_access(TILESET, 3, 5, 4), 0);
+	EXPECT_INT(mbtiles_access(TILESET, 5, 3, 4), ENOENT);
+
+	/* tiles are visible before they are committed */
+	EXPECT_INT(mbtiles_write(TILESET, 3, 5, 4, (const unsigned char*)"replaced", 8), 0);
+	EXPECT_INT(mbtiles_read(TILESET, 3, 5, 4, &buffer), 0);
+	EXPECT_TRUE(check_buffer(&buffer, "replaced"));
+
+	EXPECT_INT(mbtiles_list(TILESET, 4, count_tile, &count), 0);
+	EXPECT_INT(count, 2);
+
+	mbtiles_getstats(&stats);
+	EXPECT_INT(stats.writes, 3);
+	EXPECT_INT(stats.reads, 1);
+	EXPECT_INT(stats.transactions, 1);
+
+	EXPECT_INT(cleanup_mbtiles(), 0);
+
+	mbtiles_getstats(&stats);
+	EXPECT_INT(stats.transactions, 2);
+
+	/* rows are numbered from the bottom */
+	EXPECT_INT(get_stored_row(3, 4), 10);
+
+	/* read back committed tiles */
+	EXPECT_INT(init_mbtiles(2), 0);
+	EXPECT_INT(mbtiles_open(TILESET, 0), 0);
+	EXPECT_INT(mbtiles_read(TILESET, 3, 6, 4, &buffer), 0);
+	EXPECT_TRUE(check_buffer(&buffer, "second"));
+	EXPECT_INT(mbtiles_write(TILESET, 3, 6, 4, (const unsigned char*)"third", 5), EBADF);
+	EXPECT_INT(cleanup_mbtiles(), 0);
+
+	ttip_buffer_free(&buffer);
+
+	unlink(FILE);
+	unlink(FILE "-wal");
+	unlink(FILE "-shm");
+END_TEST()
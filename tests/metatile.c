@@ -0,0 +1,143 @@
+/*
+ * Copyright (C) 2012 Dmitry Marakasov
+ *
+ * This file is part of libttip.
+ *
+ * libttip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libttip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libttip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "metatile.h"
+
+#include "testing.h"
+
+#define DIR "metatile_test_files"
+#define TILESET METATILE_PREFIX DIR
+
+static int check_buffer(const ttip_buffer_t* buffer, const char* contents) {
+	return buffer->size == strlen(contents) && memcmp(buffer->data, contents, buffer->size) == 0;
+}
+
+static int write_tile(int x, int y, int zoom, const char* contents) {
+	return metatile_write(TILESET, x, y, zoom, (const unsigned char*)contents, strlen(contents));
+}
+
+static int exists(const char* path) {
+	struct stat st;
+	return stat(path, &st) == 0;
+}
+
+static void count_tile(int x, int y, void* arg) {
+	int* count = arg;
+	(void)x;
+	(void)y;
+	(*count)++;
+}
+
+/* remove metatile and its hash directories */
+static void remove_metatile(const char* path) {
+	char buffer[FILENAME_MAX];
+	strcpy(buffer, path);
+	unlink(buffer);
+	for (int i = 0; i < 6; i++) {
+		*strrchr(buffer, '/') = '\0';
+		rmdir(buffer);
+	}
+}
+
+BEGIN_TEST()
+	ttip_buffer_t buffer;
+	metatile_stats_t stats;
+	int count;
+
+	ttip_buffer_init(&buffer);
+
+	EXPECT_INT(init_metatile(2), 0);
+
+	EXPECT_INT(metatile_access(TILESET, 1, 1, 1), ENOENT);
+	EXPECT_INT(metatile_read(TILESET, 1, 1, 1, &buffer), ENOENT);
+
+	/* zoom 1 has only 4 tiles, so metatile is written with the last one */
+	EXPECT_INT(write_tile(0, 0, 1, "nw"), 0);
+	EXPECT_INT(write_tile(1, 0, 1, "ne"), 0);
+	EXPECT_INT(write_tile(0, 1, 1, "sw"), 0);
+	EXPECT_FALSE(exists(DIR "/1/0/0/0/0/0.meta"));
+	EXPECT_INT(write_tile(1, 1, 1, "se"), 0);
+	EXPECT_TRUE(exists(DIR "/1/0/0/0/0/0.meta"));
+
+	/* missing file was cached, so it has to be reloaded */
+	EXPECT_INT(init_metatile(2), 0);
+
+	EXPECT_INT(metatile_read(TILESET, 1, 0, 1, &buffer), 0);
+	EXPECT_TRUE(check_buffer(&buffer, "ne"));
+	EXPECT_INT(metatile_read(TILESET, 0, 1, 1, &buffer), 0);
+	EXPECT_TRUE(check_buffer(&buffer, "sw"));
+	EXPECT_INT(metatile_access(TILESET, 1, 1, 1), 0);
+
+	/* tiles of other metatiles */
+	EXPECT_INT(metatile_access(TILESET, 9, 2, 4), ENOENT);
+	EXPECT_INT(metatile_access(TILESET, 1, 2, 4), ENOENT);
+
+	metatile_getstats(&stats);
+	EXPECT_INT(stats.reads, 2);
+	EXPECT_INT(stats.loaded, 1);
+
+	/* incomplete metatile is written on cleanup */
+	EXPECT_INT(write_tile(9, 2, 4, "old"), 0);
+	EXPECT_INT(write_tile(10, 7, 4, "kept"), 0);
+	EXPECT_FALSE(exists(DIR "/4/0/0/0/0/128.meta"));
+	EXPECT_INT(cleanup_metatile(), 0);
+	EXPECT_TRUE(exists(DIR "/4/0/0/0/0/128.meta"));
+
+	/* and merged with existing tiles next time */
+	EXPECT_INT(init_metatile(2), 0);
+	EXPECT_INT(write_tile(9, 2, 4, "new"), 0);
+	EXPECT_INT(write_tile(15, 0, 4, "added"), 0);
+	EXPECT_INT(cleanup_metatile(), 0);
+
+	EXPECT_INT(init_metatile(2), 0);
+	EXPECT_INT(metatile_read(TILESET, 9, 2, 4, &buffer), 0);
+	EXPECT_TRUE(check_buffer(&buffer, "new"));
+	EXPECT_INT(metatile_read(TILESET, 10, 7, 4, &buffer), 0);
+	EXPECT_TRUE(check_buffer(&buffer, "kept"));
+	EXPECT_INT(metatile_read(TILESET, 15, 0, 4, &buffer), 0);
+	EXPECT_TRUE(check_buffer(&buffer, "added"));
+	EXPECT_INT(metatile_access(TILESET, 8, 0, 4), ENOENT);
+
+	/* all tiles of a block are listed */
+	count = 0;
+	EXPECT_INT(metatile_list(TILESET, 4, count_tile, &count), 0);
+	EXPECT_INT(count, 64);
+	count = 0;
+	EXPECT_INT(metatile_list(TILESET, 1, count_tile, &count), 0);
+	EXPECT_INT(count, 4);
+	count = 0;
+	EXPECT_INT(metatile_list(TILESET, 5, count_tile, &count), 0);
+	EXPECT_INT(count, 0);
+
+	metatile_getstats(&stats);
+	EXPECT_INT(stats.loaded, 1);
+
+	EXPECT_INT(cleanup_metatile(), 0);
+
+	ttip_buffer_free(&buffer);
+
+	remove_metatile(DIR "/1/0/0/0/0/0.meta");
+	remove_metatile(DIR "/4/0/0/0/0/128.meta");
+	rmdir(DIR);
+END_TEST()
@@ -17,10 +17,97 @@
  * along with libttip.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <string.h>
+
 #include <ttip.h>
 
 #include "testing.h"
 
+/* encode image with indexed encoder and check that it decodes to the
+ * same pixels; return png color type and bit depth as type * 100 + depth */
+static int check_indexed(ttip_png_encoder_t encoder, ttip_image_t source) {
+	ttip_buffer_t buffer;
+	ttip_image_t decoded;
+	int x, y, result = -1;
+
+	ttip_buffer_init(&buffer);
+
+	if (ttip_png_encode_mem(encoder, source, &buffer) != TTIP_OK || buffer.size < 26)
+		goto out;
+
+	if (ttip_loadpng_mem(&decoded, buffer.data, buffer.size) != TTIP_OK)
+		goto out;
+
+	result = buffer.data[25] * 100 + buffer.data[24];
+
+	if (ttip_getformat(decoded) != ttip_getformat(source))
+		result = -1;
+
+	for (y = 0; y < ttip_getheight(source); y++)
+		for (x = 0; x < ttip_getwidth(source); x++)
+			if (ttip_getpixel(decoded, x, y) != ttip_getpixel(source, x, y))
+				result = -1;
+
+	ttip_destroy(&decoded);
+
+out:
+	ttip_buffer_free(&buffer);
+	return result;
+}
+
+static ttip_image_t make_colors(ttip_format_t format, int ncolors, ttip_color_t base) {
+	ttip_image_t tile;
+	int x, y;
+
+	if (ttip_create(&tile, 37, 19, format) != TTIP_OK)
+		return NULL;
+
+	for (y = 0; y < 19; y++)
+		for (x = 0; x < 37; x++)
+			ttip_setpixel(tile, x, y, base + ((x * 7 + y * 3) % ncolors) * 0x010101);
+
+	return tile;
+}
+
+/* flat fill left of split column, smooth gradient right of it */
+static ttip_image_t make_mixed(int split) {
+	ttip_image_t tile;
+	int x, y;
+
+	if (ttip_create(&tile, 256, 256, TTIP_RGB) != TTIP_OK)
+		return NULL;
+
+	for (y = 0; y < 256; y++)
+		for (x = 0; x < 256; x++)
+			ttip_setpixel(tile, x, y, x < split ? 0xaad3df : ((x * 3 + y) / 4) << 16 | ((x + y * 2) / 3) << 8 | (y / 2 + x / 4));
+
+	return tile;
+}
+
+/* size of adaptively tuned png relative to default one, in percent */
+static int adaptive_ratio(ttip_png_encoder_t encoder, ttip_image_t source, int level) {
+	ttip_buffer_t buffer;
+	size_t size = 0;
+	int result = -1;
+
+	ttip_buffer_init(&buffer);
+	ttip_png_encoder_setlevel(encoder, level);
+
+	ttip_png_encoder_settuning(encoder, TTIP_PNG_TUNING_DEFAULT);
+	if (ttip_png_encode_mem(encoder, source, &buffer) != TTIP_OK)
+		goto out;
+	size = buffer.size;
+
+	ttip_png_encoder_settuning(encoder, TTIP_PNG_TUNING_ADAPTIVE);
+	if (ttip_png_encode_mem(encoder, source, &buffer) != TTIP_OK)
+		goto out;
+	result = buffer.size * 100 / size;
+
+out:
+	ttip_buffer_free(&buffer);
+	return result;
+}
+
 BEGIN_TEST()
 	int x, y;
 	ttip_image_t tile;
@@ -44,5 +131,148 @@ BEGIN_TEST()
 
 	EXPECT_TRUE(nmismatches == 0);
 
+	/* memory roundtrip */
+	ttip_buffer_t buffer;
+	ttip_image_t memtile;
+	ttip_buffer_init(&buffer);
+
+	EXPECT_TRUE(ttip_savepng_mem(tile, &buffer, 6) == TTIP_OK);
+	EXPECT_TRUE(buffer.size > 0 && buffer.size <= buffer.capacity);
+
+	EXPECT_TRUE(ttip_loadpng_mem(&memtile, buffer.data, buffer.size) == TTIP_OK);
+
+	nmismatches = 0;
+	for (y = 0; y < 256; y++)
+		for (x = 0; x < 256; x++)
+			nmismatches += (ttip_getpixel(memtile, x, y) != ttip_getpixel(tile, x, y));
+
+	EXPECT_TRUE(nmismatches == 0);
+
+	ttip_destroy(&memtile);
+
+	/* buffer is reused, not appended to */
+	size_t size = buffer.size;
+	EXPECT_TRUE(ttip_savepng_mem(tile, &buffer, 6) == TTIP_OK);
+	EXPECT_TRUE(buffer.size == size);
+
+	/* truncated data */
+	EXPECT_TRUE(ttip_loadpng_mem(&memtile, buffer.data, buffer.size / 2) == TTIP_LIBPNG_ERROR);
+	EXPECT_TRUE(ttip_loadpng_mem(&memtile, buffer.data, 0) == TTIP_LIBPNG_ERROR);
+
+	/* persistent encoder and decoder produce the same results when reused */
+	ttip_png_encoder_t encoder;
+	ttip_png_decoder_t decoder;
+	ttip_buffer_t encoded;
+	ttip_image_t small;
+	int pass;
+
+	ttip_buffer_init(&encoded);
+
+	EXPECT_TRUE(ttip_png_encoder_create(&encoder) == TTIP_OK);
+	EXPECT_TRUE(ttip_png_decoder_create(&decoder) == TTIP_OK);
+	EXPECT_TRUE(ttip_create(&small, 16, 8, TTIP_GRAY_ALPHA) == TTIP_OK);
+	EXPECT_TRUE(ttip_clear(small) == TTIP_OK);
+
+	nmismatches = 0;
+	for (pass = 0; pass < 4; pass++) {
+		/* alternate image sizes so cached state of different size is around */
+		ttip_image_t source = (pass & 1) ? small : tile;
+
+		if (ttip_png_encode_mem(encoder, source, &encoded) != TTIP_OK || ttip_savepng_mem(source, &buffer, 6) != TTIP_OK) {
+			nmismatches++;
+			continue;
+		}
+
+		nmismatches += encoded.size != buffer.size || memcmp(encoded.data, buffer.data, buffer.size) != 0;
+
+		if (ttip_png_decode_mem(decoder, &memtile, encoded.data, encoded.size, NULL) != TTIP_OK) {
+			nmismatches++;
+			continue;
+		}
+
+		nmismatches += ttip_getwidth(memtile) != ttip_getwidth(source) || ttip_getformat(memtile) != ttip_getformat(source);
+
+		ttip_destroy(&memtile);
+	}
+
+	EXPECT_TRUE(nmismatches == 0);
+
+	/* adaptive tuning is lossless too */
+	ttip_png_encoder_settuning(encoder, TTIP_PNG_TUNING_ADAPTIVE);
+	EXPECT_TRUE(ttip_png_encode_mem(encoder, tile, &encoded) == TTIP_OK);
+	EXPECT_TRUE(ttip_png_decode_mem(decoder, &memtile, encoded.data, encoded.size, NULL) == TTIP_OK);
+
+	nmismatches = 0;
+	for (y = 0; y < 256; y++)
+		for (x = 0; x < 256; x++)
+			nmismatches += (ttip_getpixel(memtile, x, y) != ttip_getpixel(tile, x, y));
+
+	EXPECT_TRUE(nmismatches == 0);
+
+	ttip_destroy(&memtile);
+
+	/* mostly flat tiles with gradients don't lose to default filtering */
+	ttip_image_t mixed;
+	int split;
+
+	for (split = 64; split < 256; split += 64) {
+		mixed = make_mixed(split);
+		EXPECT_TRUE(adaptive_ratio(encoder, mixed, 1) <= 110);
+		EXPECT_TRUE(adaptive_ratio(encoder, mixed, 6) <= 110);
+		ttip_destroy(&mixed);
+	}
+
+	ttip_png_encoder_setlevel(encoder, 6);
+	ttip_png_encoder_settuning(encoder, TTIP_PNG_TUNING_ADAPTIVE);
+
+	/* indexed output */
+	ttip_png_encoder_setindexed(encoder, 1);
+
+	ttip_image_t colors;
+
+	colors = make_colors(TTIP_RGB, 2, 0x102030);
+	EXPECT_INT(check_indexed(encoder, colors), 301);
+	ttip_destroy(&colors);
+
+	colors = make_colors(TTIP_RGB, 200, 0x000000);
+	EXPECT_INT(check_indexed(encoder, colors), 308);
+	ttip_destroy(&colors);
+
+	/* too many colors */
+	colors = make_colors(TTIP_RGB, 300, 0x000000);
+	EXPECT_INT(check_indexed(encoder, colors), 208);
+	ttip_destroy(&colors);
+
+	/* translucent colors need tRNS */
+	colors = make_colors(TTIP_RGB_ALPHA, 11, 0xf0001020);
+	EXPECT_INT(check_indexed(encoder, colors), 304);
+	ttip_destroy(&colors);
+
+	/* opaque rgba stays rgba */
+	colors = make_colors(TTIP_RGB_ALPHA, 3, 0xff001020);
+	EXPECT_INT(check_indexed(encoder, colors), 302);
+	ttip_destroy(&colors);
+
+	/* gray is left as is */
+	colors = make_colors(TTIP_GRAY, 3, 0x10);
+	EXPECT_INT(check_indexed(encoder, colors), 8);
+	ttip_destroy(&colors);
+
+	ttip_png_encoder_setindexed(encoder, 0);
+
+	/* decoder stays usable after error */
+	EXPECT_TRUE(ttip_png_decode_mem(decoder, &memtile, encoded.data, encoded.size / 2, NULL) == TTIP_LIBPNG_ERROR);
+	EXPECT_TRUE(ttip_png_decode_mem(decoder, &memtile, encoded.data, encoded.size, NULL) == TTIP_OK);
+	ttip_destroy(&memtile);
+
+	ttip_destroy(&small);
+	ttip_png_encoder_destroy(&encoder);
+	ttip_png_decoder_destroy(&decoder);
+	EXPECT_TRUE(encoder == NULL && decoder == NULL);
+
+	ttip_buffer_free(&encoded);
+	ttip_buffer_free(&buffer);
+	EXPECT_TRUE(buffer.data == NULL && buffer.size == 0);
+
 	ttip_destroy(&tile);
 END_TEST()
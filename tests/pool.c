@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2012 Dmitry Marakasov
+ *
+ * This file is part of libttip.
+ *
+ * libttip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libttip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libttip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_PTHREAD
+#	include <pthread.h>
+#endif
+
+#include <ttip.h>
+
+#include "testing.h"
+
+#ifdef HAVE_PTHREAD
+static void* thread_main(void* arg) {
+	ttip_pool_t pool = arg;
+	ttip_image_t tiles[4];
+
+	for (int i = 0; i < 1000; i++) {
+		for (int j = 0; j < 4; j++)
+			if (ttip_create_pooled(&tiles[j], 16 + j, 16, TTIP_RGB, pool) != TTIP_OK)
+				return arg;
+		for (int j = 0; j < 4; j++)
+			ttip_destroy(&tiles[j]);
+	}
+
+	return NULL;
+}
+#endif
+
+BEGIN_TEST()
+	ttip_pool_t pool = NULL;
+	ttip_image_t tile = NULL, clone = NULL;
+	ttip_pool_stats_t stats;
+
+	EXPECT_TRUE(ttip_pool_create(&pool) == TTIP_OK);
+
+	/* first image is always allocated */
+	EXPECT_TRUE(ttip_create_pooled(&tile, 256, 256, TTIP_RGB, pool) == TTIP_OK);
+	ttip_destroy(&tile);
+	EXPECT_TRUE(tile == NULL);
+
+	/* same image is reused */
+	EXPECT_TRUE(ttip_create_pooled(&tile, 256, 256, TTIP_RGB, pool) == TTIP_OK);
+
+	/* different format, and transformation output inherit the pool */
+	EXPECT_TRUE(ttip_clone(&clone, tile) == TTIP_OK);
+	ttip_destroy(&clone);
+	EXPECT_TRUE(ttip_desaturate(&clone, tile) == TTIP_OK);
+	EXPECT_TRUE(ttip_getformat(clone) == TTIP_GRAY);
+
+	ttip_pool_getstats(pool, &stats);
+	EXPECT_TRUE(stats.hits == 1);
+	EXPECT_TRUE(stats.misses == 3);
+	EXPECT_TRUE(stats.bytes_used > 256 * 256 * 4);
+	EXPECT_TRUE(stats.peak_bytes >= stats.bytes_used);
+
+	ttip_destroy(&clone);
+
+	ttip_pool_getstats(pool, &stats);
+	EXPECT_TRUE(stats.bytes_cached > 0);
+
+	ttip_pool_trim(pool);
+
+	ttip_pool_getstats(pool, &stats);
+	EXPECT_TRUE(stats.bytes_cached == 0);
+
+	/* pool may be destroyed before its images */
+	ttip_pool_destroy(&pool);
+	EXPECT_TRUE(pool == NULL);
+
+	ttip_destroy(&tile);
+
+#ifdef HAVE_PTHREAD
+	/* shared pool is used by several threads at once */
+	ttip_result_t res = ttip_pool_create_shared(&pool);
+	EXPECT_TRUE(res == TTIP_OK || res == TTIP_NOT_COMPILED_IN);
+	if (res == TTIP_OK) {
+		pthread_t threads[4];
+		void* failed[4];
+		for (int i = 0; i < 4; i++)
+			pthread_create(&threads[i], NULL, thread_main, pool);
+		for (int i = 0; i < 4; i++)
+			pthread_join(threads[i], &failed[i]);
+
+		EXPECT_TRUE(failed[0] == NULL && failed[1] == NULL && failed[2] == NULL && failed[3] == NULL);
+
+		ttip_pool_getstats(pool, &stats);
+		EXPECT_TRUE(stats.hits + stats.misses == 4 * 4 * 1000);
+		EXPECT_TRUE(stats.bytes_used == 0);
+
+		ttip_pool_destroy(&pool);
+	}
+#endif
+END_TEST()
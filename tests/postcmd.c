@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2012 Dmitry Marakasov
+ *
+ * This file is part of libttip.
+ *
+ * libttip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libttip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libttip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "postcmd.h"
+
+#include "testing.h"
+
+#define DIR "postcmd_test_files"
+
+#ifdef HAVE_FORK
+/* command lines are kept out of test expressions, which are printed */
+static const char* args_command = "printf '%s\\n' >>" DIR "/args";
+static const char* stdin_command = "cat >>" DIR "/stdin";
+
+static int count_lines(const char* path) {
+	FILE* f = fopen(path, "r");
+	if (f == NULL)
+		return -1;
+
+	int nlines = 0, ch;
+	while ((ch = fgetc(f)) != EOF)
+		nlines += ch == '\n';
+	fclose(f);
+
+	return nlines;
+}
+#endif
+
+BEGIN_TEST()
+	postcmd_stats_t stats;
+
+	/* failures are reported right away */
+	EXPECT_INT(init_postcmd("true", POSTCMD_EACH, 1, 1), 0);
+	EXPECT_TRUE(postcmd_add("a"));
+	EXPECT_INT(flush_postcmd(), 0);
+
+	EXPECT_INT(init_postcmd("false", POSTCMD_EACH, 1, 1), 0);
+	EXPECT_FALSE(postcmd_add("a"));
+	EXPECT_INT(flush_postcmd(), 0);
+
+#ifdef HAVE_FORK
+	mkdir(DIR, 0777);
+
+	/* tiles are passed as arguments */
+	EXPECT_INT(init_postcmd(args_command, POSTCMD_BATCH, 2, 2), 0);
+	EXPECT_TRUE(postcmd_add("a"));
+	EXPECT_TRUE(postcmd_add("b"));
+	EXPECT_TRUE(postcmd_add("c with spaces"));
+	EXPECT_INT(flush_postcmd(), 0);
+	EXPECT_INT(count_lines(DIR "/args"), 3);
+
+	postcmd_getstats(&stats);
+	EXPECT_INT((int)stats.tiles, 3);
+	EXPECT_INT((int)stats.invocations, 2);
+
+	/* failed batch counts all its tiles */
+	EXPECT_INT(init_postcmd("false", POSTCMD_BATCH, 2, 1), 0);
+	EXPECT_TRUE(postcmd_add("a"));
+	EXPECT_TRUE(postcmd_add("b"));
+	EXPECT_TRUE(postcmd_add("c"));
+	EXPECT_INT(flush_postcmd(), 3);
+
+	/* persistent processes read tiles from stdin */
+	EXPECT_INT(init_postcmd(stdin_command, POSTCMD_STDIN, 1, 2), 0);
+	EXPECT_TRUE(postcmd_add("a"));
+	EXPECT_TRUE(postcmd_add("b"));
+	EXPECT_TRUE(postcmd_add("c"));
+	EXPECT_INT(flush_postcmd(), 0);
+	EXPECT_INT(count_lines(DIR "/stdin"), 3);
+
+	postcmd_getstats(&stats);
+	EXPECT_INT((int)stats.invocations, 2);
+
+	unlink(DIR "/args");
+	unlink(DIR "/stdin");
+	rmdir(DIR);
+#endif
+
+	cleanup_postcmd();
+
+	(void)stats; /* unused without fork */
+END_TEST()
@@ -0,0 +1,140 @@
+/*
+ * Copyright (C) 2012 Dmitry Marakasov
+ *
+ * This file is part of libttip.
+ *
+ * libttip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libttip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libttip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "prefetch.h"
+#include "tileio.h"
+
+#include "testing.h"
+
+#define DIR "prefetch_test_files"
+
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static int walked = 0;
+static int taken = 0;
+
+static void write_tile(const char* path, const char* contents) {
+	FILE* f = fopen(path, "wb");
+	if (f != NULL) {
+		fwrite(contents, 1, strlen(contents), f);
+		fclose(f);
+	}
+}
+
+static void walk() {
+	prefetch_schedule(0, 0, 1);
+	prefetch_schedule(1, 0, 1);
+	prefetch_schedule(0, 1, 1);
+
+	pthread_mutex_lock(&lock);
+	walked = 1;
+	pthread_cond_broadcast(&cond);
+	while (!taken)
+		pthread_cond_wait(&cond, &lock);
+	pthread_mutex_unlock(&lock);
+
+	/* consumer got there first, so this is skipped */
+	prefetch_schedule(1, 1, 1);
+}
+
+static int check_tile(prefetch_tile_t* tile, int input, const char* contents) {
+	return tile->error == 0 && tile->input == input && tile->size == strlen(contents) && memcmp(tile->data, contents, tile->size) == 0;
+}
+#endif
+
+BEGIN_TEST()
+#ifdef HAVE_PTHREAD
+	const char* inputs[] = { DIR "/a", DIR "/b" };
+	prefetch_tile_t tile;
+	prefetch_stats_t stats;
+
+	mkdir(DIR, 0777);
+	mkdir(DIR "/a", 0777);
+	mkdir(DIR "/a/1", 0777);
+	mkdir(DIR "/a/1/0", 0777);
+	mkdir(DIR "/b", 0777);
+	mkdir(DIR "/b/1", 0777);
+	mkdir(DIR "/b/1/0", 0777);
+	mkdir(DIR "/b/1/1", 0777);
+
+	write_tile(DIR "/a/1/0/0.png", "first");
+	write_tile(DIR "/b/1/0/0.png", "shadowed");
+	write_tile(DIR "/b/1/1/0.png", "fallback");
+	write_tile(DIR "/b/1/1/1.png", "direct");
+
+	EXPECT_INT(init_tileio(16), 0);
+	EXPECT_INT(init_prefetch(4, 2, inputs, 2, walk), 0);
+
+	/* wait for walker to schedule everything, so all tiles are taken from read-ahead */
+	pthread_mutex_lock(&lock);
+	while (!walked)
+		pthread_cond_wait(&cond, &lock);
+	pthread_mutex_unlock(&lock);
+
+	/* first input which has the tile is used */
+	EXPECT_TRUE(prefetch_take(0, 0, 1, &tile) && check_tile(&tile, 0, "first"));
+	prefetch_release(&tile);
+
+	EXPECT_TRUE(prefetch_take(1, 0, 1, &tile) && check_tile(&tile, 1, "fallback"));
+	prefetch_release(&tile);
+
+	/* missing tile */
+	EXPECT_TRUE(prefetch_take(0, 1, 1, &tile) && tile.error == ENOENT && tile.data == NULL);
+
+	/* tile not scheduled yet is to be read by caller */
+	EXPECT_FALSE(prefetch_take(1, 1, 1, &tile));
+
+	pthread_mutex_lock(&lock);
+	taken = 1;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+
+	cleanup_prefetch();
+
+	prefetch_getstats(&stats);
+	EXPECT_INT((int)stats.prefetched, 3);
+	EXPECT_INT((int)stats.missed, 1);
+
+	/* may be restarted */
+	EXPECT_INT(init_prefetch(1, 1, inputs, 1, walk), 0);
+	cleanup_prefetch();
+
+	unlink(DIR "/a/1/0/0.png");
+	unlink(DIR "/b/1/0/0.png");
+	unlink(DIR "/b/1/1/0.png");
+	unlink(DIR "/b/1/1/1.png");
+	rmdir(DIR "/a/1/0");
+	rmdir(DIR "/a/1");
+	rmdir(DIR "/a");
+	rmdir(DIR "/b/1/0");
+	rmdir(DIR "/b/1/1");
+	rmdir(DIR "/b/1");
+	rmdir(DIR "/b");
+	rmdir(DIR);
+
+	cleanup_tileio();
+#endif
+END_TEST()
@@ -0,0 +1,142 @@
+/*
+ * Copyright (C) 2012 Dmitry Marakasov
+ *
+ * This file is part of libttip.
+ *
+ * libttip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libttip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libttip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _POSIX_C_SOURCE 200809L /* for utime() */
+
+#include <stdio.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <utime.h>
+
+#include "presence.h"
+
+#include "testing.h"
+
+#define DIR "presence_test_files"
+#define MISSING "presence_test_missing"
+
+static const char* g_tiles[] = { DIR "/3/1/2.png", DIR "/3/5/7.png", DIR "/4/2/4.png" };
+static const char* g_columns[] = { DIR "/3/1", DIR "/3/5", DIR "/4/2" };
+
+static int create_file(const char* path, const char* contents) {
+	FILE* f = fopen(path, "w");
+	if (f == NULL)
+		return 0;
+	fputs(contents, f);
+	return fclose(f) == 0;
+}
+
+/* pretend columns were modified long before they are indexed */
+static int age_columns() {
+	struct utimbuf times = { time(NULL) - 100, time(NULL) - 100 };
+	for (int i = 0; i < 3; i++)
+		if (utime(g_columns[i], &times) != 0)
+			return 0;
+	return 1;
+}
+
+BEGIN_TEST()
+	const char* inputs[] = { DIR, MISSING };
+	presence_stats_t stats;
+
+	mkdir(DIR, 0777);
+	mkdir(DIR "/3", 0777);
+	mkdir(DIR "/4", 0777);
+	for (int i = 0; i < 3; i++) {
+		mkdir(g_columns[i], 0777);
+		EXPECT_TRUE(create_file(g_tiles[i], "tile"));
+	}
+	EXPECT_TRUE(age_columns());
+
+	/* without index, everything is assumed present */
+	EXPECT_TRUE(presence_has_tile(0, 0, 0, 3));
+	EXPECT_TRUE(presence_has_childs(0, 0, 1));
+
+	EXPECT_INT(init_presence(inputs, 2, 3, 4, 2), 0);
+
+	EXPECT_TRUE(presence_has_tile(0, 1, 2, 3));
+	EXPECT_TRUE(presence_has_tile(0, 5, 7, 3));
+	EXPECT_TRUE(presence_has_tile(0, 2, 4, 4));
+	EXPECT_FALSE(presence_has_tile(0, 1, 3, 3));
+	EXPECT_FALSE(presence_has_tile(0, 2, 4, 3));
+	EXPECT_FALSE(presence_has_tile(1, 1, 2, 3));
+
+	/* zooms out of indexed range */
+	EXPECT_TRUE(presence_has_tile(0, 0, 0, 2));
+	EXPECT_TRUE(presence_has_tile(0, 0, 0, 5));
+
+	EXPECT_TRUE(presence_has_childs(0, 0, 0));
+	EXPECT_TRUE(presence_has_childs(0, 0, 1));
+	EXPECT_TRUE(presence_has_childs(1, 1, 1));
+	EXPECT_FALSE(presence_has_childs(1, 0, 1));
+	EXPECT_TRUE(presence_has_childs(0, 1, 2));
+	EXPECT_FALSE(presence_has_childs(1, 1, 2));
+	EXPECT_TRUE(presence_has_childs(1, 2, 3));
+	EXPECT_FALSE(presence_has_childs(1, 2, 4));
+
+	presence_getstats(&stats);
+	EXPECT_INT(stats.columns, 3);
+	EXPECT_INT(stats.rescanned, 3);
+	EXPECT_INT(stats.tiles, 3);
+
+	EXPECT_INT(save_presence(), 0);
+	EXPECT_INT(access(DIR "/" PRESENCE_INDEX_FILE, R_OK), 0);
+	cleanup_presence();
+
+	/* unmodified columns are taken from saved index */
+	EXPECT_INT(init_presence(inputs, 1, 3, 4, 1), 0);
+	presence_getstats(&stats);
+	EXPECT_INT(stats.columns, 3);
+	EXPECT_INT(stats.rescanned, 0);
+	EXPECT_INT(stats.tiles, 3);
+	EXPECT_TRUE(presence_has_tile(0, 5, 7, 3));
+	EXPECT_FALSE(presence_has_tile(0, 1, 3, 3));
+	cleanup_presence();
+
+	/* modified column is rescanned */
+	EXPECT_TRUE(create_file(DIR "/3/1/3.png", "tile"));
+	EXPECT_INT(init_presence(inputs, 1, 3, 4, 1), 0);
+	presence_getstats(&stats);
+	EXPECT_INT(stats.rescanned, 1);
+	EXPECT_INT(stats.tiles, 4);
+	EXPECT_TRUE(presence_has_tile(0, 1, 3, 3));
+	EXPECT_INT(save_presence(), 0);
+	cleanup_presence();
+
+	/* broken index is ignored */
+	EXPECT_TRUE(create_file(DIR "/" PRESENCE_INDEX_FILE, "garbage"));
+	EXPECT_INT(init_presence(inputs, 1, 3, 4, 1), 0);
+	presence_getstats(&stats);
+	EXPECT_INT(stats.rescanned, 3);
+	EXPECT_INT(stats.tiles, 4);
+	cleanup_presence();
+
+	/* index is not used after cleanup */
+	EXPECT_TRUE(presence_has_tile(0, 0, 0, 3));
+
+	unlink(DIR "/" PRESENCE_INDEX_FILE);
+	unlink(DIR "/3/1/3.png");
+	for (int i = 0; i < 3; i++) {
+		unlink(g_tiles[i]);
+		rmdir(g_columns[i]);
+	}
+	rmdir(DIR "/3");
+	rmdir(DIR "/4");
+	rmdir(DIR);
+END_TEST()
@@ -0,0 +1,156 @@
+/*
+ * Copyright (C) 2012 Dmitry Marakasov
+ *
+ * This file is part of libttip.
+ *
+ * libttip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libttip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libttip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <ttip.h>
+
+#include "testing.h"
+
+/* smooth gradient with 4096 colors */
+static ttip_image_t make_gradient(ttip_format_t format) {
+	ttip_image_t tile;
+	int x, y;
+
+	if (ttip_create(&tile, 64, 64, format) != TTIP_OK)
+		return NULL;
+
+	for (y = 0; y < 64; y++)
+		for (x = 0; x < 64; x++)
+			ttip_setpixel(tile, x, y, 0xff000000 | (x * 4) << 16 | (y * 4) << 8 | (x + y) * 2);
+
+	return tile;
+}
+
+static int count_colors(ttip_image_t tile) {
+	ttip_color_t colors[257];
+	int x, y, i, ncolors = 0;
+
+	for (y = 0; y < ttip_getheight(tile); y++) {
+		for (x = 0; x < ttip_getwidth(tile); x++) {
+			ttip_color_t color = ttip_getpixel(tile, x, y);
+			for (i = 0; i < ncolors && colors[i] != color; i++) {
+			}
+			if (i == ncolors) {
+				if (ncolors == 256)
+					return 257;
+				colors[ncolors++] = color;
+			}
+		}
+	}
+
+	return ncolors;
+}
+
+static int compare_images(ttip_image_t a, ttip_image_t b) {
+	int x, y;
+
+	if (ttip_getformat(a) != ttip_getformat(b))
+		return 0;
+
+	for (y = 0; y < ttip_getheight(a); y++)
+		for (x = 0; x < ttip_getwidth(a); x++)
+			if (ttip_getpixel(a, x, y) != ttip_getpixel(b, x, y))
+				return 0;
+
+	return 1;
+}
+
+/* encode with encoder, return png color type, check decoded pixels */
+static int check_encoded(ttip_png_encoder_t encoder, ttip_image_t source, ttip_image_t expected) {
+	ttip_buffer_t buffer;
+	ttip_image_t decoded;
+	int result = -1;
+
+	ttip_buffer_init(&buffer);
+
+	if (ttip_png_encode_mem(encoder, source, &buffer) == TTIP_OK && ttip_loadpng_mem(&decoded, buffer.data, buffer.size) == TTIP_OK) {
+		if (compare_images(decoded, expected))
+			result = buffer.data[25];
+		ttip_destroy(&decoded);
+	}
+
+	ttip_buffer_free(&buffer);
+	return result;
+}
+
+BEGIN_TEST()
+	ttip_image_t source, quantized, gray;
+	ttip_png_encoder_t encoder;
+	double psnr;
+
+	/* lossy reduction */
+	source = make_gradient(TTIP_RGB);
+	EXPECT_INT(count_colors(source), 257);
+	EXPECT_INT(ttip_quantize(&quantized, source, 256, &psnr), TTIP_OK);
+	EXPECT_TRUE(ttip_getformat(quantized) == TTIP_RGB);
+	EXPECT_TRUE(count_colors(quantized) <= 256);
+	EXPECT_TRUE(psnr > 35.0 && psnr < 99.0);
+
+	/* encoder produces the same pixels, paletted */
+	EXPECT_INT(ttip_png_encoder_create(&encoder), TTIP_OK);
+	ttip_png_encoder_setindexed(encoder, 1);
+	ttip_png_encoder_setquantize(encoder, 35);
+	EXPECT_INT(check_encoded(encoder, source, quantized), 3);
+
+	/* threshold too strict, image is left as is */
+	ttip_png_encoder_setquantize(encoder, 98);
+	EXPECT_INT(check_encoded(encoder, source, source), 2);
+	ttip_png_encoder_destroy(&encoder);
+
+	/* inplace */
+	EXPECT_INT(ttip_quantize_inplace(source, 256, NULL), TTIP_OK);
+	EXPECT_TRUE(compare_images(source, quantized));
+	ttip_destroy(&quantized);
+
+	/* fewer colors */
+	EXPECT_INT(ttip_quantize(&quantized, source, 16, &psnr), TTIP_OK);
+	EXPECT_TRUE(count_colors(quantized) <= 16);
+	EXPECT_TRUE(psnr > 20.0);
+	ttip_destroy(&quantized);
+
+	/* image which already fits is not changed */
+	EXPECT_INT(ttip_quantize_inplace(source, 16, NULL), TTIP_OK);
+	EXPECT_INT(ttip_quantize(&quantized, source, 16, &psnr), TTIP_OK);
+	EXPECT_TRUE(compare_images(source, quantized));
+	EXPECT_TRUE(psnr >= 99.0);
+	ttip_destroy(&quantized);
+	ttip_destroy(&source);
+
+	/* rgba; fully transparent pixels all become the same */
+	source = make_gradient(TTIP_RGBA);
+	ttip_setpixel(source, 0, 0, 0x00123456);
+	ttip_setpixel(source, 1, 0, 0x00654321);
+	ttip_setpixel(source, 2, 0, 0x80ffffff);
+	EXPECT_INT(ttip_quantize(&quantized, source, 256, NULL), TTIP_OK);
+	EXPECT_TRUE(ttip_getformat(quantized) == TTIP_RGBA);
+	EXPECT_TRUE(count_colors(quantized) <= 256);
+	EXPECT_TRUE(ttip_getpixel(quantized, 0, 0) == 0);
+	EXPECT_TRUE(ttip_getpixel(quantized, 1, 0) == 0);
+	EXPECT_TRUE(ttip_getpixel(quantized, 2, 0) == 0x80ffffff);
+	ttip_destroy(&quantized);
+
+	/* bad arguments */
+	EXPECT_INT(ttip_quantize(&quantized, source, 1, NULL), TTIP_BAD_ARGUMENT);
+	EXPECT_INT(ttip_quantize(&quantized, source, 257, NULL), TTIP_BAD_ARGUMENT);
+	ttip_destroy(&source);
+
+	EXPECT_INT(ttip_create(&gray, 8, 8, TTIP_GRAY), TTIP_OK);
+	EXPECT_INT(ttip_quantize(&quantized, gray, 16, NULL), TTIP_BAD_PIXEL_FORMAT);
+	EXPECT_INT(ttip_quantize_inplace(gray, 16, NULL), TTIP_BAD_PIXEL_FORMAT);
+	ttip_destroy(&gray);
+END_TEST()
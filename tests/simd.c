@@ -0,0 +1,146 @@
+/*
+ * Copyright (C) 2012 Dmitry Marakasov
+ *
+ * This file is part of libttip.
+ *
+ * libttip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libttip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libttip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <ttip.h>
+
+#include "testing.h"
+
+static ttip_image_t make_image(int width, int height, ttip_format_t format, int alignment, unsigned int seed) {
+	ttip_image_t tile;
+	int x, y;
+
+	if (ttip_create_ex(&tile, width, height, format, alignment, NULL) != TTIP_OK)
+		return NULL;
+
+	for (y = 0; y < height; y++) {
+		for (x = 0; x < width; x++) {
+			seed = seed * 1103515245 + 12345;
+			/* make sure extreme alpha values are covered */
+			switch ((seed >> 8) % 4) {
+			case 0: ttip_setpixel(tile, x, y, seed | 0xff000000 | 0xff00); break;
+			case 1: ttip_setpixel(tile, x, y, seed & 0x00ffffff & ~0xff00); break;
+			default: ttip_setpixel(tile, x, y, seed >> 3);
+			}
+		}
+	}
+
+	return tile;
+}
+
+static int compare_images(ttip_image_t a, ttip_image_t b) {
+	int x, y;
+
+	if (ttip_getformat(a) != ttip_getformat(b))
+		return 0;
+
+	for (y = 0; y < ttip_getheight(a); y++)
+		for (x = 0; x < ttip_getwidth(a); x++)
+			if (ttip_getpixel(a, x, y) != ttip_getpixel(b, x, y))
+				return 0;
+
+	return 1;
+}
+
+/* compare result of vector kernels with scalar ones for all
+ * format combinations and lots of widths to cover tail handling;
+ * both aligned (default) and unaligned (alignment = 1) images
+ * are checked, along with mixes of them */
+static int check_maskblend(ttip_format_t bgformat, ttip_format_t ovrformat, ttip_simd_t simd) {
+	int width, failures = 0;
+
+	for (width = 1; width <= 140; width++) {
+		ttip_image_t background = make_image(width, 3, bgformat, (width & 1) ? 0 : 1, width);
+		ttip_image_t overlay = make_image(width, 3, ovrformat, (width & 3) ? 0 : 1, width * 7);
+		ttip_image_t reference, result;
+
+		ttip_setsimd(TTIP_SIMD_NONE);
+		if (ttip_maskblend(&reference, background, overlay) != TTIP_OK)
+			return 1;
+
+		ttip_setsimd(simd);
+		if (ttip_maskblend(&result, background, overlay) != TTIP_OK)
+			return 1;
+
+		failures += !compare_images(reference, result);
+
+		ttip_destroy(&result);
+		ttip_destroy(&reference);
+		ttip_destroy(&overlay);
+		ttip_destroy(&background);
+	}
+
+	return failures;
+}
+
+static int check_downsample(ttip_format_t format, ttip_simd_t simd) {
+	int width, failures = 0;
+
+	for (width = 2; width <= 256; width += 2) {
+		/* aligned kernels need quadrants aligned too, which needs width to be multiple of 32 */
+		int alignment = (width % 32 == 0) ? 0 : 1;
+		ttip_image_t tl = make_image(width, 4, format, alignment, width);
+		ttip_image_t tr = make_image(width, 4, format, alignment, width * 3);
+		ttip_image_t bl = make_image(width, 4, format, alignment, width * 5);
+		ttip_image_t br = make_image(width, 4, format, (width % 6 == 0) ? 0 : alignment, width * 7);
+		ttip_image_t reference, result;
+
+		ttip_setsimd(TTIP_SIMD_NONE);
+		if (ttip_downsample2x2(&reference, tl, tr, bl, br) != TTIP_OK)
+			return 1;
+
+		ttip_setsimd(simd);
+		if (ttip_downsample2x2(&result, tl, tr, bl, br) != TTIP_OK)
+			return 1;
+
+		failures += !compare_images(reference, result);
+
+		ttip_destroy(&result);
+		ttip_destroy(&reference);
+		ttip_destroy(&tl);
+		ttip_destroy(&tr);
+		ttip_destroy(&bl);
+		ttip_destroy(&br);
+	}
+
+	return failures;
+}
+
+BEGIN_TEST()
+	ttip_simd_t detected = ttip_getsimd();
+	ttip_simd_t simd;
+
+	printf("detected simd level: %d\n", detected);
+
+	for (simd = TTIP_SIMD_SSE2; simd <= detected; simd++) {
+		printf("checking simd level %d\n", simd);
+
+		EXPECT_INT(check_maskblend(TTIP_GRAY, TTIP_GRAYA, simd), 0);
+		EXPECT_INT(check_maskblend(TTIP_GRAY, TTIP_RGBA, simd), 0);
+		EXPECT_INT(check_maskblend(TTIP_RGB, TTIP_GRAYA, simd), 0);
+		EXPECT_INT(check_maskblend(TTIP_RGB, TTIP_RGBA, simd), 0);
+
+		EXPECT_INT(check_downsample(TTIP_GRAY, simd), 0);
+		EXPECT_INT(check_downsample(TTIP_GRAYA, simd), 0);
+		EXPECT_INT(check_downsample(TTIP_RGB, simd), 0);
+		EXPECT_INT(check_downsample(TTIP_RGBA, simd), 0);
+	}
+
+	ttip_setsimd(TTIP_SIMD_NONE);
+	EXPECT_TRUE(ttip_getsimd() == TTIP_SIMD_NONE);
+END_TEST()
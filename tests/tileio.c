@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2012 Dmitry Marakasov
+ *
+ * This file is part of libttip.
+ *
+ * libttip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libttip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libttip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "tileio.h"
+
+#include "testing.h"
+
+#define DIR "tileio_test_files"
+
+static int check_buffer(const ttip_buffer_t* buffer, const char* contents) {
+	return buffer->size == strlen(contents) && memcmp(buffer->data, contents, buffer->size) == 0;
+}
+
+static int is_dir(const char* path) {
+	struct stat st;
+	return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+BEGIN_TEST()
+	ttip_buffer_t buffer;
+	tileio_stats_t stats;
+	char path[FILENAME_MAX];
+
+	ttip_buffer_init(&buffer);
+
+	EXPECT_INT(init_tileio(2), 0);
+
+	/* missing tiles and directories */
+	EXPECT_INT(tileio_access(DIR, 3, 5, 4), ENOENT);
+	EXPECT_INT(tileio_read(DIR, 3, 5, 4, &buffer), ENOENT);
+
+	/* directories are created on write, even if known to be missing */
+	EXPECT_INT(tileio_write(DIR, 3, 5, 4, (const unsigned char*)"first", 5), 0);
+	EXPECT_TRUE(is_dir(DIR "/4/3"));
+	EXPECT_INT(tileio_access(DIR, 3, 5, 4), 0);
+	EXPECT_INT(tileio_access(DIR, 3, 6, 4), ENOENT);
+
+	EXPECT_INT(tileio_read(DIR, 3, 5, 4, &buffer), 0);
+	EXPECT_TRUE(check_buffer(&buffer, "first"));
+
+	/* existing tile is replaced */
+	EXPECT_INT(tileio_write(DIR, 3, 5, 4, (const unsigned char*)"second", 6), 0);
+	EXPECT_INT(tileio_read(DIR, 3, 5, 4, &buffer), 0);
+	EXPECT_TRUE(check_buffer(&buffer, "second"));
+
+	/* more directories than are kept open */
+	for (int x = 0; x < 8; x++)
+		EXPECT_INT(tileio_write(DIR, x, 0, 3, (const unsigned char*)"column", 6), 0);
+	for (int x = 0; x < 8; x++)
+		EXPECT_TRUE(tileio_read(DIR, x, 0, 3, &buffer) == 0 && check_buffer(&buffer, "column"));
+
+	EXPECT_INT(tileio_mkdir(DIR, 1, 2), 0);
+	EXPECT_TRUE(is_dir(DIR "/2/1"));
+
+	tileio_getstats(&stats);
+	EXPECT_TRUE(stats.hits > 0);
+	EXPECT_TRUE(stats.misses > 0);
+	EXPECT_TRUE(stats.created >= 10);
+
+	cleanup_tileio();
+	ttip_buffer_free(&buffer);
+
+	unlink(DIR "/4/3/5.png");
+	rmdir(DIR "/4/3");
+	rmdir(DIR "/4");
+	for (int x = 0; x < 8; x++) {
+		snprintf(path, sizeof(path), DIR "/3/%d/0.png", x);
+		unlink(path);
+		snprintf(path, sizeof(path), DIR "/3/%d", x);
+		rmdir(path);
+	}
+	rmdir(DIR "/3");
+	rmdir(DIR "/2/1");
+	rmdir(DIR "/2");
+	rmdir(DIR);
+END_TEST()
@@ -0,0 +1,217 @@
+/*
+ * Copyright (C) 2012 Dmitry Marakasov
+ *
+ * This file is part of libttip.
+ *
+ * libttip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libttip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libttip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include <ttip.h>
+
+#include "testing.h"
+
+/* same image with all pixels allocated */
+static ttip_image_t make_solid(ttip_format_t format, ttip_color_t color) {
+	ttip_image_t tile;
+	int x, y;
+
+	if (ttip_create(&tile, 38, 20, format) != TTIP_OK)
+		return NULL;
+
+	for (y = 0; y < 20; y++)
+		for (x = 0; x < 38; x++)
+			ttip_setpixel(tile, x, y, color);
+
+	return tile;
+}
+
+static ttip_image_t make_uniform(ttip_format_t format, ttip_color_t color) {
+	ttip_image_t tile;
+
+	if (ttip_create_uniform(&tile, 38, 20, format, color, NULL) != TTIP_OK)
+		return NULL;
+
+	return tile;
+}
+
+static int compare_images(ttip_image_t a, ttip_image_t b) {
+	int x, y;
+
+	if (ttip_getformat(a) != ttip_getformat(b))
+		return 0;
+
+	for (y = 0; y < ttip_getheight(a); y++)
+		for (x = 0; x < ttip_getwidth(a); x++)
+			if (ttip_getpixel(a, x, y) != ttip_getpixel(b, x, y))
+				return 0;
+
+	return 1;
+}
+
+static int compare_png(ttip_png_encoder_t encoder, ttip_image_t a, ttip_image_t b) {
+	ttip_buffer_t abuf, bbuf;
+	int result = 0;
+
+	ttip_buffer_init(&abuf);
+	ttip_buffer_init(&bbuf);
+
+	if (ttip_png_encode_mem(encoder, a, &abuf) == TTIP_OK && ttip_png_encode_mem(encoder, b, &bbuf) == TTIP_OK)
+		result = abuf.size == bbuf.size && memcmp(abuf.data, bbuf.data, abuf.size) == 0;
+
+	ttip_buffer_free(&abuf);
+	ttip_buffer_free(&bbuf);
+
+	return result;
+}
+
+BEGIN_TEST()
+	ttip_image_t uniform, solid, output, reference, other;
+	ttip_color_t color;
+
+	/* basic properties; unused bits of color are dropped */
+	uniform = make_uniform(TTIP_RGB, 0xff123456);
+	EXPECT_TRUE(ttip_isuniform(uniform, &color));
+	EXPECT_TRUE(color == 0x123456);
+	EXPECT_TRUE(ttip_getpixel(uniform, 37, 19) == 0x123456);
+	EXPECT_INT(ttip_getwidth(uniform), 38);
+	EXPECT_INT(ttip_getheight(uniform), 20);
+
+	/* clone stays uniform */
+	EXPECT_INT(ttip_clone(&output, uniform), TTIP_OK);
+	EXPECT_TRUE(ttip_isuniform(output, NULL));
+	EXPECT_TRUE(compare_images(output, uniform));
+	ttip_destroy(&output);
+
+	/* detection */
+	solid = make_solid(TTIP_RGB, 0x123456);
+	EXPECT_FALSE(ttip_isuniform(solid, NULL));
+	EXPECT_INT(ttip_detect_uniform(&solid), TTIP_OK);
+	EXPECT_TRUE(ttip_isuniform(solid, NULL));
+	EXPECT_TRUE(compare_images(solid, uniform));
+	ttip_destroy(&solid);
+
+	solid = make_solid(TTIP_RGB, 0x123456);
+	ttip_setpixel(solid, 37, 19, 0);
+	EXPECT_INT(ttip_detect_uniform(&solid), TTIP_OK);
+	EXPECT_FALSE(ttip_isuniform(solid, NULL));
+	ttip_destroy(&solid);
+
+	/* modification allocates pixels */
+	ttip_setpixel(uniform, 1, 1, 0x654321);
+	EXPECT_FALSE(ttip_isuniform(uniform, NULL));
+	EXPECT_TRUE(ttip_getpixel(uniform, 1, 1) == 0x654321);
+	EXPECT_TRUE(ttip_getpixel(uniform, 37, 19) == 0x123456);
+	ttip_destroy(&uniform);
+
+	/* desaturate and threshold */
+	uniform = make_uniform(TTIP_RGB_ALPHA, 0x80c08040);
+	solid = make_solid(TTIP_RGB_ALPHA, 0x80c08040);
+	EXPECT_INT(ttip_desaturate(&output, uniform), TTIP_OK);
+	EXPECT_INT(ttip_desaturate(&reference, solid), TTIP_OK);
+	EXPECT_TRUE(ttip_isuniform(output, NULL));
+	EXPECT_TRUE(compare_images(output, reference));
+	ttip_destroy(&output);
+	EXPECT_INT(ttip_desaturate_inplace(uniform), TTIP_OK);
+	EXPECT_TRUE(ttip_isuniform(uniform, NULL));
+	EXPECT_TRUE(compare_images(uniform, reference));
+	ttip_destroy(&reference);
+	ttip_destroy(&uniform);
+	ttip_destroy(&solid);
+
+	uniform = make_uniform(TTIP_RGB, 0x808080);
+	solid = make_solid(TTIP_RGB, 0x808080);
+	EXPECT_INT(ttip_threshold(&output, uniform, 100), TTIP_OK);
+	EXPECT_INT(ttip_threshold(&reference, solid, 100), TTIP_OK);
+	EXPECT_TRUE(ttip_isuniform(output, NULL));
+	EXPECT_TRUE(compare_images(output, reference));
+	ttip_destroy(&output);
+	EXPECT_INT(ttip_threshold_inplace(uniform, 100), TTIP_OK);
+	EXPECT_TRUE(compare_images(uniform, reference));
+	ttip_destroy(&reference);
+	ttip_destroy(&uniform);
+	ttip_destroy(&solid);
+
+	/* downsample of same colors is uniform, of different colors is not */
+	uniform = make_uniform(TTIP_RGB, 0x102030);
+	solid = make_solid(TTIP_RGB, 0x102030);
+	other = make_uniform(TTIP_RGB, 0x405060);
+	EXPECT_INT(ttip_downsample2x2(&output, uniform, uniform, uniform, uniform), TTIP_OK);
+	EXPECT_TRUE(ttip_isuniform(output, NULL));
+	EXPECT_TRUE(compare_images(output, uniform));
+	ttip_destroy(&output);
+
+	EXPECT_INT(ttip_downsample2x2(&output, uniform, other, solid, uniform), TTIP_OK);
+	EXPECT_FALSE(ttip_isuniform(output, NULL));
+	EXPECT_TRUE(ttip_getpixel(output, 0, 0) == 0x102030);
+	EXPECT_TRUE(ttip_getpixel(output, 37, 0) == 0x405060);
+	EXPECT_TRUE(ttip_getpixel(output, 0, 19) == 0x102030);
+	ttip_destroy(&output);
+	ttip_destroy(&other);
+	ttip_destroy(&solid);
+	ttip_destroy(&uniform);
+
+	/* blending, uniform and not */
+	uniform = make_uniform(TTIP_GRAY, 0x40);
+	solid = make_solid(TTIP_GRAY, 0x40);
+	other = make_uniform(TTIP_RGB_ALPHA, 0x80ff0000);
+	EXPECT_INT(ttip_maskblend(&output, uniform, other), TTIP_OK);
+	EXPECT_INT(ttip_maskblend(&reference, solid, other), TTIP_OK);
+	EXPECT_TRUE(ttip_isuniform(output, NULL));
+	EXPECT_FALSE(ttip_isuniform(reference, NULL));
+	EXPECT_TRUE(compare_images(output, reference));
+	ttip_destroy(&output);
+	ttip_destroy(&reference);
+	ttip_destroy(&other);
+
+	other = make_solid(TTIP_GRAY_ALPHA, 0x8020);
+	ttip_setpixel(other, 5, 5, 0xff00);
+	EXPECT_INT(ttip_maskblend(&output, uniform, other), TTIP_OK);
+	EXPECT_INT(ttip_maskblend(&reference, solid, other), TTIP_OK);
+	EXPECT_TRUE(compare_images(output, reference));
+	ttip_destroy(&output);
+	EXPECT_INT(ttip_maskblend_inplace(uniform, other), TTIP_OK);
+	EXPECT_FALSE(ttip_isuniform(uniform, NULL));
+	EXPECT_TRUE(compare_images(uniform, reference));
+	ttip_destroy(&reference);
+	ttip_destroy(&other);
+	ttip_destroy(&solid);
+	ttip_destroy(&uniform);
+
+	/* encoding gives the same file as for allocated image, also when repeated */
+	ttip_png_encoder_t encoder;
+	EXPECT_INT(ttip_png_encoder_create(&encoder), TTIP_OK);
+	uniform = make_uniform(TTIP_RGB, 0xaad3df);
+	solid = make_solid(TTIP_RGB, 0xaad3df);
+	EXPECT_TRUE(compare_png(encoder, uniform, solid));
+	EXPECT_TRUE(compare_png(encoder, uniform, solid));
+	ttip_png_encoder_setindexed(encoder, 1);
+	EXPECT_TRUE(compare_png(encoder, uniform, solid));
+	ttip_png_encoder_setlevel(encoder, 9);
+	EXPECT_TRUE(compare_png(encoder, solid, uniform));
+	ttip_destroy(&uniform);
+	ttip_destroy(&solid);
+	ttip_png_encoder_destroy(&encoder);
+
+	/* pooled uniform image may outlive its pool */
+	ttip_pool_t pool;
+	EXPECT_INT(ttip_pool_create(&pool), TTIP_OK);
+	EXPECT_INT(ttip_create_uniform(&uniform, 38, 20, TTIP_GRAY, 1, pool), TTIP_OK);
+	EXPECT_INT(ttip_clone(&output, uniform), TTIP_OK);
+	ttip_pool_destroy(&pool);
+	ttip_destroy(&uniform);
+	ttip_setpixel(output, 0, 0, 2);
+	ttip_destroy(&output);
+END_TEST()
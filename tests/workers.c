@@ -0,0 +1,120 @@
+/*
+ * Copyright (C) 2012 Dmitry Marakasov
+ *
+ * This file is part of tiletool.
+ *
+ * tiletool is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * tiletool is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tiletool.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "workers.h"
+
+#include "testing.h"
+
+#ifdef HAVE_PTHREAD
+/* sums numbers in [begin, end) by splitting range into four subtasks,
+ * like quadtree traversal does */
+typedef struct {
+	worker_task_t task;
+	int begin, end;
+	long sum;
+} sum_task_t;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int ncontexts = 0;
+static int badcontexts = 0;
+
+static void* create_context() {
+	int* context = malloc(sizeof(int));
+	*context = 0x5eed;
+
+	pthread_mutex_lock(&lock);
+	ncontexts++;
+	pthread_mutex_unlock(&lock);
+
+	return context;
+}
+
+static void destroy_context(void* context) {
+	pthread_mutex_lock(&lock);
+	ncontexts--;
+	pthread_mutex_unlock(&lock);
+
+	free(context);
+}
+
+static void init_sum(sum_task_t* task, int begin, int end);
+
+static void run_sum(worker_task_t* task, void* context) {
+	sum_task_t* sum = (sum_task_t*)task;
+
+	if (*(int*)context != 0x5eed) {
+		pthread_mutex_lock(&lock);
+		badcontexts++;
+		pthread_mutex_unlock(&lock);
+	}
+
+	sum->sum = 0;
+	if (sum->end - sum->begin < 4) {
+		for (int i = sum->begin; i < sum->end; i++)
+			sum->sum += i;
+		return;
+	}
+
+	sum_task_t subtasks[4];
+	int step = (sum->end - sum->begin) / 4;
+	for (int i = 3; i >= 0; i--) {
+		init_sum(&subtasks[i], sum->begin + step * i, i == 3 ? sum->end : sum->begin + step * (i + 1));
+		spawn_task(&subtasks[i].task);
+	}
+
+	for (int i = 0; i < 4; i++) {
+		join_task(&subtasks[i].task);
+		sum->sum += subtasks[i].sum;
+	}
+}
+
+static void init_sum(sum_task_t* task, int begin, int end) {
+	task->task.run = run_sum;
+	task->begin = begin;
+	task->end = end;
+}
+#endif
+
+BEGIN_TEST()
+#ifdef HAVE_PTHREAD
+	sum_task_t root;
+
+	EXPECT_INT(init_workers(4, create_context, destroy_context), 0);
+
+	init_sum(&root, 0, 100000);
+	run_task(&root.task);
+	EXPECT_TRUE(root.sum == 100000L * 99999 / 2);
+
+	/* pool may be reused */
+	init_sum(&root, 10, 20);
+	run_task(&root.task);
+	EXPECT_INT((int)root.sum, 145);
+
+	cleanup_workers();
+
+	EXPECT_INT(ncontexts, 0);
+	EXPECT_INT(badcontexts, 0);
+
+	/* and restarted */
+	EXPECT_INT(init_workers(1, NULL, NULL), 0);
+	cleanup_workers();
+#endif
+END_TEST()
@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2012 Dmitry Marakasov
+ *
+ * This file is part of libttip.
+ *
+ * libttip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libttip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libttip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "tileio.h"
+#include "writeback.h"
+
+#include "testing.h"
+
+#define DIR "writeback_test_files"
+
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int ndone = 0;
+static int nfailed = 0;
+static ttip_hash_t hashsum = 0;
+
+static void done(const char* path, ttip_hash_t hash, int error) {
+	(void)path; /* unused */
+
+	pthread_mutex_lock(&lock);
+	ndone++;
+	nfailed += error != 0;
+	hashsum += hash;
+	pthread_mutex_unlock(&lock);
+}
+
+static int check_file(const char* path, const char* contents) {
+	char buffer[64];
+	FILE* f = fopen(path, "rb");
+	if (f == NULL)
+		return 0;
+
+	size_t size = fread(buffer, 1, sizeof(buffer), f);
+	fclose(f);
+
+	return size == strlen(contents) && memcmp(buffer, contents, size) == 0;
+}
+
+static int submit(const char* tileset, int x, int y, int zoom, const char* contents, ttip_hash_t hash) {
+	ttip_buffer_t buffer;
+	buffer.size = buffer.capacity = strlen(contents);
+	if ((buffer.data = malloc(buffer.size)) == NULL)
+		return -1;
+	memcpy(buffer.data, contents, buffer.size);
+
+	int ret = writeback_submit(tileset, x, y, zoom, hash, &buffer);
+
+	/* contents are taken over */
+	if (buffer.data != NULL)
+		return -1;
+
+	return ret;
+}
+#endif
+
+BEGIN_TEST()
+#ifdef HAVE_PTHREAD
+	writeback_stats_t stats;
+
+	EXPECT_INT(init_tileio(16), 0);
+	EXPECT_INT(init_writeback(1, 2, done), 0);
+
+	/* directories are created as needed */
+	EXPECT_INT(submit(DIR, 0, 0, 1, "first", 1), 0);
+	EXPECT_INT(submit(DIR, 0, 1, 1, "second", 2), 0);
+	EXPECT_INT(submit(DIR, 1, 0, 1, "third", 4), 0);
+
+	/* queued tiles are written on cleanup */
+	cleanup_writeback();
+
+	EXPECT_TRUE(check_file(DIR "/1/0/0.png", "first"));
+	EXPECT_TRUE(check_file(DIR "/1/0/1.png", "second"));
+	EXPECT_TRUE(check_file(DIR "/1/1/0.png", "third"));
+
+	EXPECT_INT(ndone, 3);
+	EXPECT_INT(nfailed, 0);
+	EXPECT_INT((int)hashsum, 7);
+
+	writeback_getstats(&stats);
+	EXPECT_INT((int)stats.written, 3);
+
+	/* errors are reported */
+	EXPECT_INT(init_writeback(4, 1, done), 0);
+	EXPECT_INT(submit(DIR "/1/0/0.png", 0, 0, 0, "bad", 8), 0);
+	cleanup_writeback();
+
+	EXPECT_INT(nfailed, 1);
+
+	writeback_getstats(&stats);
+	EXPECT_INT((int)stats.failed, 1);
+
+	unlink(DIR "/1/0/0.png");
+	unlink(DIR "/1/0/1.png");
+	unlink(DIR "/1/1/0.png");
+	rmdir(DIR "/1/0");
+	rmdir(DIR "/1/1");
+	rmdir(DIR "/1");
+	rmdir(DIR);
+
+	cleanup_tileio();
+#endif
+END_TEST()
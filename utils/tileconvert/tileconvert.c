@@ -128,6 +128,25 @@ int main(int argc, char **argv) {
 		end_benchmark(&begin, "ttip_loadpng", iterations);
 		gc_tile(source);
 
+		/* same with persistent decoder, when benchmarking */
+		if (iterations > 1) {
+			ttip_png_decoder_t decoder;
+			ttip_image_t decoded;
+
+			if ((ret = ttip_png_decoder_create(&decoder)) != TTIP_OK)
+				errx(1, "ttip_png_decoder_create: %s", ttip_strerror(ret));
+
+			start_benchmark(&begin);
+			for (pass = 1; pass <= iterations; ++pass) {
+				if ((ret = ttip_png_decode(decoder, &decoded, argv[1], NULL)) != TTIP_OK)
+					errx(1, "ttip_png_decode: %s", ttip_strerror(ret));
+				ttip_destroy(&decoded);
+			}
+			end_benchmark(&begin, "ttip_png_decode", iterations);
+
+			ttip_png_decoder_destroy(&decoder);
+		}
+
 		if ((ret = ttip_savepng(source, argv[2], 6)) != TTIP_OK)
 			errx(1, "ttip_savepng: %s", ttip_strerror(ret));
 	} else if (strcmp(argv[0], "savepng") == 0 && argc == 3) {
@@ -143,6 +162,58 @@ int main(int argc, char **argv) {
 				errx(1, "ttip_savepng: %s", ttip_strerror(ret));
 		}
 		end_benchmark(&begin, "ttip_savepng", iterations);
+
+		/* same with persistent encoder, when benchmarking; also
+		 * compare default and adaptive tuning by size */
+		if (iterations > 1) {
+			ttip_png_encoder_t encoder;
+			ttip_buffer_t buffer;
+
+			ttip_buffer_init(&buffer);
+
+			if ((ret = ttip_png_encoder_create(&encoder)) != TTIP_OK)
+				errx(1, "ttip_png_encoder_create: %s", ttip_strerror(ret));
+
+			start_benchmark(&begin);
+			for (pass = 1; pass <= iterations; ++pass) {
+				if ((ret = ttip_png_encode(encoder, source, argv[2])) != TTIP_OK)
+					errx(1, "ttip_png_encode: %s", ttip_strerror(ret));
+			}
+			end_benchmark(&begin, "ttip_png_encode", iterations);
+
+			if ((ret = ttip_png_encode_mem(encoder, source, &buffer)) != TTIP_OK)
+				errx(1, "ttip_png_encode_mem: %s", ttip_strerror(ret));
+			fprintf(stderr, "default tuning: %lu bytes\n", (unsigned long)buffer.size);
+
+			ttip_png_encoder_settuning(encoder, TTIP_PNG_TUNING_ADAPTIVE);
+
+			start_benchmark(&begin);
+			for (pass = 1; pass <= iterations; ++pass) {
+				if ((ret = ttip_png_encode(encoder, source, argv[2])) != TTIP_OK)
+					errx(1, "ttip_png_encode: %s", ttip_strerror(ret));
+			}
+			end_benchmark(&begin, "ttip_png_encode (adaptive)", iterations);
+
+			if ((ret = ttip_png_encode_mem(encoder, source, &buffer)) != TTIP_OK)
+				errx(1, "ttip_png_encode_mem: %s", ttip_strerror(ret));
+			fprintf(stderr, "adaptive tuning: %lu bytes\n", (unsigned long)buffer.size);
+
+			ttip_png_encoder_setindexed(encoder, 1);
+
+			start_benchmark(&begin);
+			for (pass = 1; pass <= iterations; ++pass) {
+				if ((ret = ttip_png_encode(encoder, source, argv[2])) != TTIP_OK)
+					errx(1, "ttip_png_encode: %s", ttip_strerror(ret));
+			}
+			end_benchmark(&begin, "ttip_png_encode (adaptive, indexed)", iterations);
+
+			if ((ret = ttip_png_encode_mem(encoder, source, &buffer)) != TTIP_OK)
+				errx(1, "ttip_png_encode_mem: %s", ttip_strerror(ret));
+			fprintf(stderr, "adaptive tuning, indexed: %lu bytes\n", (unsigned long)buffer.size);
+
+			ttip_png_encoder_destroy(&encoder);
+			ttip_buffer_free(&buffer);
+		}
 	} else if (strcmp(argv[0], "clone") == 0 && argc == 3) {
 		ttip_image_t source, destination;
 
@@ -260,6 +331,39 @@ int main(int argc, char **argv) {
 
 		if ((ret = ttip_savepng(destination, argv[3], 6)) != TTIP_OK)
 			errx(1, "ttip_savepng: %s", ttip_strerror(ret));
+	} else if (strcmp(argv[0], "quantize") == 0 && argc == 4) {
+		int ncolors = strtoul(argv[1], NULL, 10);
+		double psnr;
+
+		ttip_image_t source, destination;
+
+		if ((ret = ttip_loadpng(&source, argv[2])) != TTIP_OK)
+			errx(1, "ttip_loadpng: %s", ttip_strerror(ret));
+		gc_tile(source);
+
+		start_benchmark(&begin);
+		for (pass = 1; pass <= iterations; ++pass) {
+			if ((ret = ttip_quantize(&destination, source, ncolors, &psnr)) != TTIP_OK)
+				errx(1, "ttip_quantize: %s", ttip_strerror(ret));
+			if (pass != iterations)
+				ttip_destroy(&destination);
+		}
+		end_benchmark(&begin, "ttip_quantize", iterations);
+		gc_tile(destination);
+
+		fprintf(stderr, "PSNR: %.2f dB\n", psnr);
+
+		ttip_png_encoder_t encoder;
+		if ((ret = ttip_png_encoder_create(&encoder)) != TTIP_OK)
+			errx(1, "ttip_png_encoder_create: %s", ttip_strerror(ret));
+
+		ttip_png_encoder_settuning(encoder, TTIP_PNG_TUNING_ADAPTIVE);
+		ttip_png_encoder_setindexed(encoder, 1);
+
+		if ((ret = ttip_png_encode(encoder, destination, argv[3])) != TTIP_OK)
+			errx(1, "ttip_png_encode: %s", ttip_strerror(ret));
+
+		ttip_png_encoder_destroy(&encoder);
 	} else {
 		usage(progname);
 		return 1;
@@ -0,0 +1,192 @@
+/*
+ * Copyright (C) 2012 Dmitry Marakasov
+ *
+ * This file is part of tiletool.
+ *
+ * tiletool is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * tiletool is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tiletool.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_PTHREAD
+#	include <pthread.h>
+#endif
+
+#include "archive.h"
+
+struct archive {
+	const char* tileset;
+	ttip_archive_t reader;
+	ttip_archive_writer_t writer;
+
+	struct archive* next;
+};
+
+/* all archives are open before processing starts, so the list is not
+ * modified while it's used by other threads */
+static struct archive* g_archives = NULL;
+
+static archive_stats_t g_stats;
+
+/* readers need no locking, and writes to all archives are serialized */
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+#	define LOCK() pthread_mutex_lock(&g_lock)
+#	define UNLOCK() pthread_mutex_unlock(&g_lock)
+#	define INCREMENT(counter) __atomic_fetch_add(&(counter), 1, __ATOMIC_RELAXED)
+#else
+#	define LOCK()
+#	define UNLOCK()
+#	define INCREMENT(counter) ((counter)++)
+#endif
+
+static struct archive* find_archive(const char* tileset) {
+	for (struct archive* archive = g_archives; archive != NULL; archive = archive->next)
+		if (strcmp(archive->tileset, tileset) == 0)
+			return archive;
+
+	return NULL;
+}
+
+static const char* get_path(const char* tileset) {
+	return tileset + sizeof(ARCHIVE_PREFIX) - 1;
+}
+
+int init_archive() {
+	cleanup_archive();
+
+	memset(&g_stats, 0, sizeof(g_stats));
+
+	return 0;
+}
+
+int cleanup_archive() {
+	int ret = 0;
+	while (g_archives != NULL) {
+		struct archive* archive = g_archives;
+		g_archives = archive->next;
+
+		if (archive->writer != NULL) {
+			ttip_archive_stats_t stats;
+			ttip_archive_writer_getstats(archive->writer, &stats);
+			g_stats.unique += stats.unique;
+			g_stats.bytes += stats.bytes;
+
+			int err = ttip_archive_writer_finish(&archive->writer);
+			if (err != 0 && ret == 0)
+				ret = err;
+		}
+
+		ttip_archive_close(&archive->reader);
+		free(archive);
+	}
+
+	return ret;
+}
+
+int archive_open(const char* tileset, int writable) {
+	struct archive* archive = find_archive(tileset);
+	if (archive != NULL)
+		return (archive->writer != NULL) == !!writable ? 0 : EBUSY;
+
+	if ((archive = calloc(1, sizeof(struct archive))) == NULL)
+		return errno;
+
+	archive->tileset = tileset;
+
+	int ret;
+	if (writable)
+		ret = ttip_archive_writer_create(&archive->writer, get_path(tileset));
+	else
+		ret = ttip_archive_open(&archive->reader, get_path(tileset));
+
+	if (ret != TTIP_OK) {
+		free(archive);
+		return ret;
+	}
+
+	archive->next = g_archives;
+	g_archives = archive;
+
+	return 0;
+}
+
+int archive_access(const char* tileset, int x, int y, int zoom) {
+	const unsigned char* data;
+	size_t size;
+
+	struct archive* archive = find_archive(tileset);
+	if (archive == NULL || archive->reader == NULL)
+		return EBADF;
+
+	return ttip_archive_get(archive->reader, zoom, x, y, &data, &size);
+}
+
+int archive_read(const char* tileset, int x, int y, int zoom, ttip_buffer_t* buffer) {
+	const unsigned char* data;
+	size_t size;
+
+	struct archive* archive = find_archive(tileset);
+	if (archive == NULL || archive->reader == NULL)
+		return EBADF;
+
+	int ret;
+	if ((ret = ttip_archive_get(archive->reader, zoom, x, y, &data, &size)) != TTIP_OK)
+		return ret;
+
+	if (size > buffer->capacity) {
+		unsigned char* newdata = realloc(buffer->data, size);
+		if (newdata == NULL)
+			return errno;
+		buffer->data = newdata;
+		buffer->capacity = size;
+	}
+
+	memcpy(buffer->data, data, size);
+	buffer->size = size;
+
+	INCREMENT(g_stats.reads);
+
+	return 0;
+}
+
+int archive_write(const char* tileset, int x, int y, int zoom, const unsigned char* data, size_t size) {
+	struct archive* archive = find_archive(tileset);
+	if (archive == NULL || archive->writer == NULL)
+		return EBADF;
+
+	LOCK();
+	int ret = ttip_archive_writer_add(archive->writer, zoom, x, y, data, size);
+	if (ret == TTIP_OK)
+		g_stats.writes++;
+	UNLOCK();
+
+	return ret;
+}
+
+int archive_list(const char* tileset, int zoom, void (*callback)(int x, int y, void* arg), void* arg) {
+	struct archive* archive = find_archive(tileset);
+	if (archive == NULL || archive->reader == NULL)
+		return EBADF;
+
+	return ttip_archive_list(archive->reader, zoom, callback, arg);
+}
+
+void archive_getstats(archive_stats_t* stats) {
+	LOCK();
+	*stats = g_stats;
+	UNLOCK();
+}
@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2012 Dmitry Marakasov
+ *
+ * This file is part of tiletool.
+ *
+ * tiletool is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * tiletool is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tiletool.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <stddef.h>
+#include <string.h>
+
+#include <ttip.h>
+
+/* Tilesets named archive:<path> are single file tile archives (see
+ * ttip_archive_open()). Input archives are mapped into memory, so
+ * reading a tile is a lookup and a copy. Output archive gets tiles
+ * appended as they are written, and is finished on cleanup */
+
+#define ARCHIVE_PREFIX "archive:"
+
+#define IS_ARCHIVE(tileset) (strncmp((tileset), ARCHIVE_PREFIX, sizeof(ARCHIVE_PREFIX) - 1) == 0)
+
+typedef struct {
+	unsigned long reads;
+	unsigned long writes;
+	unsigned long unique;      /* written tiles which were stored */
+	size_t bytes;              /* bytes of stored tiles */
+} archive_stats_t;
+
+int init_archive();
+
+/* finish output archives and close all; returns 0 or error of
+ * finishing an archive, in which case it's not created */
+int cleanup_archive();
+
+/* open archive of a tileset for reading or writing; tileset must be
+ * open before it's accessed. Returns 0 or ttip_result_t error */
+int archive_open(const char* tileset, int writable);
+
+/* same as tileio functions; return 0, ENOENT if tile does not exist,
+ * or error */
+int archive_access(const char* tileset, int x, int y, int zoom);
+int archive_read(const char* tileset, int x, int y, int zoom, ttip_buffer_t* buffer);
+int archive_write(const char* tileset, int x, int y, int zoom, const unsigned char* data, size_t size);
+
+/* call callback for each tile of a zoom in input archive */
+int archive_list(const char* tileset, int zoom, void (*callback)(int x, int y, void* arg), void* arg);
+
+void archive_getstats(archive_stats_t* stats);
+
+#endif
@@ -0,0 +1,200 @@
+/*
+ * Copyright (C) 2012 Dmitry Marakasov
+ *
+ * This file is part of tiletool.
+ *
+ * tiletool is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * tiletool is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tiletool.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#if defined(HAVE_COPY_FILE_RANGE)
+#	define _GNU_SOURCE /* for copy_file_range() */
+#elif defined(HAVE_OPENAT)
+#	define _POSIX_C_SOURCE 200809L /* for openat() */
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#	include <sys/ioctl.h>
+#	include <linux/fs.h>
+#endif
+
+#include "copyfile.h"
+
+#define COPY_BUFFER_SIZE 65536
+
+int parse_copyfile_mode(const char* str, copyfile_mode_t* mode) {
+	if (strcmp(str, "copy") == 0)
+		*mode = COPYFILE_COPY;
+	else if (strcmp(str, "hardlink") == 0)
+		*mode = COPYFILE_HARDLINK;
+	else if (strcmp(str, "reflink") == 0)
+		*mode = COPYFILE_REFLINK;
+	else
+		return 0;
+
+	return 1;
+}
+
+static int write_all(int fd, const unsigned char* data, size_t size) {
+	while (size > 0) {
+		ssize_t written = write(fd, data, size);
+		if (written == -1) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+		data += written;
+		size -= written;
+	}
+
+	return 0;
+}
+
+static int copy_data(int srcfd, int dstfd) {
+#ifdef HAVE_COPY_FILE_RANGE
+	/* no data passes through userspace; falls back to read/write
+	 * where kernel or filesystem doesn't support it */
+	ssize_t copied;
+	int first = 1;
+	while ((copied = copy_file_range(srcfd, NULL, dstfd, NULL, COPY_BUFFER_SIZE * 16, 0)) > 0)
+		first = 0;
+
+	if (copied == 0)
+		return 0;
+
+	if (!first || (errno != ENOSYS && errno != EXDEV && errno != EINVAL && errno != EOPNOTSUPP))
+		return errno;
+#endif
+
+	unsigned char buffer[COPY_BUFFER_SIZE];
+	ssize_t nread;
+	int ret;
+	while ((nread = read(srcfd, buffer, sizeof(buffer))) != 0) {
+		if (nread == -1) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+		if ((ret = write_all(dstfd, buffer, nread)) != 0)
+			return ret;
+	}
+
+	return 0;
+}
+
+static void get_tmp_path(char* buffer, const char* path) {
+	strcpy(buffer, path);
+	strcat(buffer, ".tmp");
+}
+
+static int commit_tmp(const char* tmppath, const char* path, int ret) {
+	if (ret == 0 && rename(tmppath, path) != 0)
+		ret = errno;
+
+	if (ret != 0)
+		unlink(tmppath);
+
+	return ret;
+}
+
+int copy_file(const char* src, const char* dst, copyfile_mode_t mode, int* linked) {
+	char tmppath[strlen(dst) + 4 + 1];
+	get_tmp_path(tmppath, dst);
+
+	*linked = 0;
+
+	int srcfd = open(src, O_RDONLY);
+	if (srcfd == -1)
+		return errno;
+
+	if (mode == COPYFILE_HARDLINK) {
+		unlink(tmppath);
+		if (link(src, tmppath) == 0) {
+			close(srcfd);
+			*linked = 1;
+			return commit_tmp(tmppath, dst, 0);
+		}
+		/* else, e.g. link count exceeded or different filesystem, fall back to copy */
+	}
+
+	int dstfd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (dstfd == -1) {
+		int ret = errno;
+		close(srcfd);
+		return ret;
+	}
+
+	int ret = 0;
+
+#ifdef FICLONE
+	/* if not supported by filesystem, falls back to copy */
+	if (mode == COPYFILE_REFLINK)
+		*linked = ioctl(dstfd, FICLONE, srcfd) == 0;
+#endif
+
+	if (!*linked)
+		ret = copy_data(srcfd, dstfd);
+
+	close(srcfd);
+	if (close(dstfd) != 0 && ret == 0)
+		ret = errno;
+
+	return commit_tmp(tmppath, dst, ret);
+}
+
+int write_file(const char* dst, const unsigned char* data, size_t size) {
+	char tmppath[strlen(dst) + 4 + 1];
+	get_tmp_path(tmppath, dst);
+
+	int fd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd == -1)
+		return errno;
+
+	int ret = write_all(fd, data, size);
+
+	if (close(fd) != 0 && ret == 0)
+		ret = errno;
+
+	return commit_tmp(tmppath, dst, ret);
+}
+
+#ifdef HAVE_OPENAT
+int write_file_at(int dirfd, const char* dst, const unsigned char* data, size_t size) {
+	char tmpname[strlen(dst) + 4 + 1];
+	get_tmp_path(tmpname, dst);
+
+	int fd = openat(dirfd, tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd == -1)
+		return errno;
+
+	int ret = write_all(fd, data, size);
+
+	if (close(fd) != 0 && ret == 0)
+		ret = errno;
+
+	if (ret == 0 && renameat(dirfd, tmpname, dirfd, dst) != 0)
+		ret = errno;
+
+	if (ret != 0)
+		unlinkat(dirfd, tmpname, 0);
+
+	return ret;
+}
+#endif
@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2012 Dmitry Marakasov
+ *
+ * This file is part of tiletool.
+ *
+ * tiletool is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * tiletool is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tiletool.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COPYFILE_H
+#define COPYFILE_H
+
+/* how file contents are transferred */
+typedef enum {
+	COPYFILE_COPY,      /* copy data (in kernel where possible) */
+	COPYFILE_HARDLINK,  /* hardlink destination to source */
+	COPYFILE_REFLINK,   /* reflink (copy-on-write clone) source */
+} copyfile_mode_t;
+
+int parse_copyfile_mode(const char* str, copyfile_mode_t* mode);
+
+/* replace dst with contents of src, through a temporary file so
+ * readers never see it incomplete; link modes fall back to copy if
+ * filesystem can't link. Returns 0 or errno, sets *linked if file
+ * was linked instead of being copied */
+int copy_file(const char* src, const char* dst, copyfile_mode_t mode, int* linked);
+
+/* same, but new file is written from memory */
+int write_file(const char* dst, const unsigned char* data, size_t size);
+
+#ifdef HAVE_OPENAT
+/* same, with dst relative to directory fd */
+int write_file_at(int dirfd, const char* dst, const unsigned char* data, size_t size);
+#endif
+
+#endif
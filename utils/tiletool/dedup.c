@@ -0,0 +1,346 @@
+/*
+ * Copyright (C) 2012 Dmitry Marakasov
+ *
+ * This file is part of tiletool.
+ *
+ * tiletool is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * tiletool is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tiletool.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_PTHREAD
+#	include <pthread.h>
+#endif
+
+#include "copyfile.h"
+#include "dedup.h"
+
+/* cached tile; entries are kept in a hash table and in the order of
+ * addition, oldest are dropped when memory limit is reached */
+struct dedup_entry {
+	ttip_hash_t hash;
+	char* path;              /* first file written with this content */
+	unsigned char* data;     /* its png */
+	size_t size;
+	int pending;             /* file is not written yet */
+	int refs;                /* held by table and by lookups writing from it */
+
+	struct dedup_entry* next;   /* in hash chain */
+	struct dedup_entry* newer;  /* in addition order */
+};
+
+static dedup_mode_t g_mode = DEDUP_NONE;
+static size_t g_maxbytes = 0;
+static size_t g_bytes = 0;
+
+static struct dedup_entry** g_buckets = NULL;
+static size_t g_nbuckets = 0;
+static size_t g_nentries = 0;
+
+static struct dedup_entry* g_oldest = NULL;
+static struct dedup_entry* g_newest = NULL;
+
+static dedup_stats_t g_stats;
+
+/* cache is shared by all worker threads */
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+#	define LOCK() pthread_mutex_lock(&g_lock)
+#	define UNLOCK() pthread_mutex_unlock(&g_lock)
+#else
+#	define LOCK()
+#	define UNLOCK()
+#endif
+
+int parse_dedup_mode(const char* str, dedup_mode_t* mode) {
+	if (strcmp(str, "copy") == 0)
+		*mode = DEDUP_COPY;
+	else if (strcmp(str, "hardlink") == 0)
+		*mode = DEDUP_HARDLINK;
+	else if (strcmp(str, "reflink") == 0)
+		*mode = DEDUP_REFLINK;
+	else
+		return 0;
+
+	return 1;
+}
+
+void init_dedup(dedup_mode_t mode, size_t maxbytes) {
+	cleanup_dedup();
+
+	g_mode = mode;
+	g_maxbytes = maxbytes;
+
+	memset(&g_stats, 0, sizeof(g_stats));
+}
+
+/* entry is freed once it's both out of table and not being written from */
+static void dedup_release(struct dedup_entry* entry) {
+	if (--entry->refs > 0)
+		return;
+
+	free(entry->path);
+	free(entry->data);
+	free(entry);
+}
+
+void cleanup_dedup() {
+	struct dedup_entry* entry;
+	while ((entry = g_oldest) != NULL) {
+		g_oldest = entry->newer;
+		dedup_release(entry);
+	}
+
+	free(g_buckets);
+	g_buckets = NULL;
+	g_nbuckets = g_nentries = g_bytes = 0;
+	g_newest = NULL;
+}
+
+static struct dedup_entry* dedup_find(ttip_hash_t hash) {
+	struct dedup_entry* entry;
+
+	if (g_nbuckets == 0)
+		return NULL;
+
+	for (entry = g_buckets[hash & (g_nbuckets - 1)]; entry != NULL; entry = entry->next)
+		if (entry->hash == hash)
+			return entry;
+
+	return NULL;
+}
+
+static void dedup_evict_oldest() {
+	struct dedup_entry* entry = g_oldest;
+	struct dedup_entry** prev;
+
+	for (prev = &g_buckets[entry->hash & (g_nbuckets - 1)]; *prev != entry; prev = &(*prev)->next) {
+		/* empty */
+	}
+	*prev = entry->next;
+
+	g_oldest = entry->newer;
+	if (g_oldest == NULL)
+		g_newest = NULL;
+
+	g_nentries--;
+	g_bytes -= entry->size;
+	g_stats.evicted++;
+
+	dedup_release(entry);
+}
+
+static int dedup_grow() {
+	size_t nbuckets = g_nbuckets ? g_nbuckets * 2 : 1024;
+	struct dedup_entry** buckets = calloc(nbuckets, sizeof(struct dedup_entry*));
+	if (buckets == NULL)
+		return 0;
+
+	struct dedup_entry* entry;
+	for (entry = g_oldest; entry != NULL; entry = entry->newer) {
+		entry->next = buckets[entry->hash & (nbuckets - 1)];
+		buckets[entry->hash & (nbuckets - 1)] = entry;
+	}
+
+	free(g_buckets);
+	g_buckets = buckets;
+	g_nbuckets = nbuckets;
+
+	return 1;
+}
+
+static void dedup_add(ttip_hash_t hash, const char* path, const unsigned char* data, size_t size, int pending) {
+	if (size > g_maxbytes)
+		return;
+
+	while (g_oldest != NULL && g_bytes + size > g_maxbytes)
+		dedup_evict_oldest();
+
+	if (g_nentries >= g_nbuckets && !dedup_grow())
+		return;
+
+	struct dedup_entry* entry = malloc(sizeof(struct dedup_entry));
+	if (entry == NULL)
+		return;
+
+	entry->path = malloc(strlen(path) + 1);
+	entry->data = malloc(size);
+	if (entry->path == NULL || entry->data == NULL) {
+		free(entry->path);
+		free(entry->data);
+		free(entry);
+		return;
+	}
+
+	strcpy(entry->path, path);
+	memcpy(entry->data, data, size);
+	entry->hash = hash;
+	entry->size = size;
+	entry->pending = pending;
+	entry->refs = 1;
+
+	entry->next = g_buckets[hash & (g_nbuckets - 1)];
+	g_buckets[hash & (g_nbuckets - 1)] = entry;
+
+	entry->newer = NULL;
+	if (g_newest != NULL)
+		g_newest->newer = entry;
+	else
+		g_oldest = entry;
+	g_newest = entry;
+
+	g_nentries++;
+	g_bytes += size;
+}
+
+/* create file at path with contents of the cached entry; its path
+ * and png never change, so this is done without lock */
+static int dedup_write(const char* path, const struct dedup_entry* entry, int pending, int* linked) {
+	*linked = 0;
+
+	/* first file may not exist yet, or still have old contents */
+	if (pending)
+		return write_file(path, entry->data, entry->size);
+
+	if (g_mode == DEDUP_HARDLINK)
+		return copy_file(entry->path, path, COPYFILE_HARDLINK, linked);
+	else if (g_mode == DEDUP_REFLINK)
+		return copy_file(entry->path, path, COPYFILE_REFLINK, linked);
+
+	return write_file(path, entry->data, entry->size);
+}
+
+/* find entry for content and reference it, so it's not freed if it's
+ * evicted by other thread while used */
+static struct dedup_entry* dedup_acquire(ttip_hash_t hash, int* pending) {
+	LOCK();
+	g_stats.lookups++;
+
+	struct dedup_entry* entry = dedup_find(hash);
+	if (entry != NULL) {
+		entry->refs++;
+		*pending = entry->pending;
+	}
+	UNLOCK();
+
+	return entry;
+}
+
+/* count reuse of entry, unless it failed, and drop reference to it */
+static void dedup_finish(struct dedup_entry* entry, dedup_result_t result, int linked) {
+	LOCK();
+	if (result != DEDUP_FAILED) {
+		g_stats.hits++;
+		g_stats.bytes_reused += entry->size;
+		g_stats.linked += linked;
+	}
+	dedup_release(entry);
+	UNLOCK();
+}
+
+/* reflinked clone is a separate file, which later changes of the
+ * first one (by postcmd) don't reach, so it's reported as a copy */
+static dedup_result_t dedup_write_result(int ret, int linked) {
+	if (ret != 0)
+		return DEDUP_FAILED;
+
+	return linked && g_mode == DEDUP_HARDLINK ? DEDUP_LINKED : DEDUP_COPIED;
+}
+
+dedup_result_t dedup_save(ttip_hash_t hash, const char* path) {
+	int pending = 0;
+	struct dedup_entry* entry = dedup_acquire(hash, &pending);
+	if (entry == NULL)
+		return DEDUP_MISS;
+
+	int linked, ret = dedup_write(path, entry, pending, &linked);
+	dedup_result_t result = dedup_write_result(ret, linked);
+
+	dedup_finish(entry, result, linked);
+
+	/* set after unlocking, which may clobber it */
+	if (ret != 0)
+		errno = ret;
+
+	return result;
+}
+
+dedup_result_t dedup_fetch(ttip_hash_t hash, const char* path, ttip_buffer_t* buffer) {
+	int pending = 0;
+	struct dedup_entry* entry = dedup_acquire(hash, &pending);
+	if (entry == NULL)
+		return DEDUP_MISS;
+
+	int linked = 0, ret = 0;
+	dedup_result_t result = DEDUP_FETCHED;
+	if (!pending && g_mode != DEDUP_COPY) {
+		ret = dedup_write(path, entry, pending, &linked);
+		result = dedup_write_result(ret, linked);
+	} else if (entry->size > buffer->capacity) {
+		unsigned char* data = realloc(buffer->data, entry->size);
+		if (data == NULL) {
+			ret = errno;
+			result = DEDUP_FAILED;
+		} else {
+			buffer->data = data;
+			buffer->capacity = entry->size;
+		}
+	}
+
+	if (result == DEDUP_FETCHED) {
+		memcpy(buffer->data, entry->data, entry->size);
+		buffer->size = entry->size;
+	}
+
+	dedup_finish(entry, result, linked);
+
+	if (ret != 0)
+		errno = ret;
+
+	return result;
+}
+
+int dedup_store(ttip_hash_t hash, const char* path, const unsigned char* data, size_t size) {
+	int ret;
+	if ((ret = write_file(path, data, size)) != 0)
+		return ret;
+
+	LOCK();
+	dedup_add(hash, path, data, size, 0);
+	UNLOCK();
+
+	return 0;
+}
+
+void dedup_store_pending(ttip_hash_t hash, const char* path, const unsigned char* data, size_t size) {
+	LOCK();
+	dedup_add(hash, path, data, size, 1);
+	UNLOCK();
+}
+
+void dedup_written(ttip_hash_t hash, const char* path) {
+	LOCK();
+	struct dedup_entry* entry = dedup_find(hash);
+	if (entry != NULL && strcmp(entry->path, path) == 0)
+		entry->pending = 0;
+	UNLOCK();
+}
+
+void dedup_getstats(dedup_stats_t* stats) {
+	LOCK();
+	*stats = g_stats;
+	UNLOCK();
+}
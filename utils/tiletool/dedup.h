@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2012 Dmitry Marakasov
+ *
+ * This file is part of tiletool.
+ *
+ * tiletool is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * tiletool is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tiletool.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <stddef.h>
+
+#include <ttip.h>
+
+/* how tiles with already seen content are written */
+typedef enum {
+	DEDUP_NONE,      /* no deduplication */
+	DEDUP_COPY,      /* reuse encoded png, write a separate file */
+	DEDUP_HARDLINK,  /* hardlink to the first file with the same content */
+	DEDUP_REFLINK,   /* reflink (copy-on-write clone) the first file */
+} dedup_mode_t;
+
+typedef enum {
+	DEDUP_MISS,      /* content not seen before */
+	DEDUP_COPIED,    /* tile written from cached png, or reflinked */
+	DEDUP_LINKED,    /* tile hardlinked to the first file */
+	DEDUP_FAILED,    /* writing failed, errno is set */
+	DEDUP_FETCHED,   /* cached png returned for writing elsewhere */
+} dedup_result_t;
+
+typedef struct {
+	unsigned long lookups;
+	unsigned long hits;
+	unsigned long linked;
+	unsigned long evicted;
+	size_t bytes_reused;
+} dedup_stats_t;
+
+int parse_dedup_mode(const char* str, dedup_mode_t* mode);
+
+void init_dedup(dedup_mode_t mode, size_t maxbytes);
+void cleanup_dedup();
+
+/* write tile from cache if its content was seen before */
+dedup_result_t dedup_save(ttip_hash_t hash, const char* path);
+
+/* same, but unless tile can be linked to the first file, cached png
+ * is copied into buffer instead of being written */
+dedup_result_t dedup_fetch(ttip_hash_t hash, const char* path, ttip_buffer_t* buffer);
+
+/* write freshly encoded tile and remember it; returns 0 or errno */
+int dedup_store(ttip_hash_t hash, const char* path, const unsigned char* data, size_t size);
+
+/* remember tile which is written elsewhere; until dedup_written() is
+ * called for it, its duplicates are written from cached png */
+void dedup_store_pending(ttip_hash_t hash, const char* path, const unsigned char* data, size_t size);
+void dedup_written(ttip_hash_t hash, const char* path);
+
+void dedup_getstats(dedup_stats_t* stats);
+
+#endif
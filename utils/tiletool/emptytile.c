@@ -25,18 +25,27 @@
 #include "emptytile.h"
 
 static ttip_image_t g_empty_tile = NULL;
+static const char* g_empty_tile_path = NULL;
 
-void init_empty_tile(const char* path) {
+void init_empty_tile(const char* path, ttip_pool_t pool) {
 	cleanup_empty_tile();
 
 	ttip_result_t ret;
-	if ((ret = ttip_loadpng(&g_empty_tile, path)) != TTIP_OK)
+	if ((ret = ttip_loadpng_pooled(&g_empty_tile, path, pool)) != TTIP_OK)
 		errx(1, "Cannot load empty tile: %s", ttip_strerror(ret));
+
+	/* empty tile is usually a single color, which makes its clones
+	 * and everything produced from them free */
+	if ((ret = ttip_detect_uniform(&g_empty_tile)) != TTIP_OK)
+		errx(1, "Cannot process empty tile: %s", ttip_strerror(ret));
+
+	g_empty_tile_path = path;
 }
 
 void cleanup_empty_tile() {
 	if (g_empty_tile)
 		ttip_destroy(&g_empty_tile);
+	g_empty_tile_path = NULL;
 }
 
 ttip_image_t spawn_empty_tile() {
@@ -52,6 +61,22 @@ ttip_image_t spawn_empty_tile() {
 	return out;
 }
 
+/* shared read-only instance, must not be modified or destroyed */
+ttip_image_t get_empty_tile() {
+	if (!g_empty_tile)
+		errx(1, "No empty tile specified");
+
+	return g_empty_tile;
+}
+
+/* file the empty tile was loaded from, must stay unchanged while in use */
+const char* get_empty_tile_path() {
+	if (!g_empty_tile_path)
+		errx(1, "No empty tile specified");
+
+	return g_empty_tile_path;
+}
+
 int has_empty_tile() {
 	return g_empty_tile != NULL;
 }
@@ -20,10 +20,12 @@
 #ifndef EMPTYTILE_H
 #define EMPTYTILE_H
 
-void init_empty_tile(const char* path);
+void init_empty_tile(const char* path, ttip_pool_t pool);
 void cleanup_empty_tile();
 
 int has_empty_tile();
 ttip_image_t spawn_empty_tile();
+ttip_image_t get_empty_tile();
+const char* get_empty_tile_path();
 
 #endif
@@ -0,0 +1,193 @@
+/*
+ * Copyright (C) 2012 Dmitry Marakasov
+ *
+ * This file is part of tiletool.
+ *
+ * tiletool is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * tiletool is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tiletool.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "parsing.h"
+#include "expire.h"
+
+#define MAX_ZOOM 31
+
+struct tile_set {
+	uint64_t* keys;            /* sorted */
+	size_t nkeys;
+	size_t capacity;
+};
+
+/* listed tiles, and listed tiles with all their ancestors */
+static struct tile_set g_listed[MAX_ZOOM + 1];
+static struct tile_set g_dirty[MAX_ZOOM + 1];
+
+static int g_loaded = 0;
+
+static uint64_t get_key(int x, int y) {
+	return ((uint64_t)x << 32) | (uint32_t)y;
+}
+
+static int compare_keys(const void* a, const void* b) {
+	uint64_t ka = *(const uint64_t*)a, kb = *(const uint64_t*)b;
+	return ka < kb ? -1 : ka > kb;
+}
+
+static int add_key(struct tile_set* set, uint64_t key) {
+	if (set->nkeys == set->capacity) {
+		size_t capacity = set->capacity ? set->capacity * 2 : 64;
+		uint64_t* keys = realloc(set->keys, capacity * sizeof(uint64_t));
+		if (keys == NULL)
+			return errno;
+		set->keys = keys;
+		set->capacity = capacity;
+	}
+
+	set->keys[set->nkeys++] = key;
+	return 0;
+}
+
+static void sort_keys(struct tile_set* set) {
+	if (set->nkeys == 0)
+		return;
+
+	qsort(set->keys, set->nkeys, sizeof(uint64_t), compare_keys);
+
+	size_t nunique = 1;
+	for (size_t i = 1; i < set->nkeys; i++)
+		if (set->keys[i] != set->keys[nunique - 1])
+			set->keys[nunique++] = set->keys[i];
+	set->nkeys = nunique;
+}
+
+static int has_key(const struct tile_set* set, uint64_t key) {
+	return set->nkeys > 0 && bsearch(&key, set->keys, set->nkeys, sizeof(uint64_t), compare_keys) != NULL;
+}
+
+/* parse zoom/x/y with optional trailing whitespace */
+static int parse_tile(char* line, int* x, int* y, int* zoom) {
+	char* end = line + strlen(line);
+	while (end > line && (end[-1] == '\n' || end[-1] == '\r' || end[-1] == ' ' || end[-1] == '\t'))
+		*--end = '\0';
+
+	const char* slashes[2];
+	if (parse_split(line, '/', slashes, 2) != 2)
+		return 0;
+
+	if (slashes[0] == line || slashes[1] == slashes[0] + 1 || end == slashes[1] + 1)
+		return 0;
+
+	if (!parse_unsigned(line, slashes[0], zoom) || !parse_unsigned(slashes[0] + 1, slashes[1], x) || !parse_unsigned(slashes[1] + 1, end, y))
+		return 0;
+
+	return *zoom >= 0 && *zoom <= MAX_ZOOM && *x >= 0 && *y >= 0 && (int64_t)*x < ((int64_t)1 << *zoom) && (int64_t)*y < ((int64_t)1 << *zoom);
+}
+
+int init_expire(const char* path, int* line) {
+	cleanup_expire();
+
+	FILE* file = fopen(path, "r");
+	if (file == NULL)
+		return errno;
+
+	int ret = 0;
+	char buffer[256];
+	*line = 0;
+	while (fgets(buffer, sizeof(buffer), file) != NULL) {
+		++*line;
+
+		if (strchr(buffer, '\n') == NULL && !feof(file)) {
+			ret = EINVAL; /* too long to be a tile */
+			goto out;
+		}
+
+		if (buffer[strspn(buffer, " \t\r\n")] == '\0')
+			continue;
+
+		int x, y, zoom;
+		if (!parse_tile(buffer, &x, &y, &zoom)) {
+			ret = EINVAL;
+			goto out;
+		}
+
+		if ((ret = add_key(&g_listed[zoom], get_key(x, y))) != 0)
+			goto out;
+
+		for (int z = zoom; z >= 0; z--)
+			if ((ret = add_key(&g_dirty[z], get_key(x >> (zoom - z), y >> (zoom - z)))) != 0)
+				goto out;
+	}
+
+	if (ferror(file))
+		ret = EIO;
+
+out:
+	fclose(file);
+
+	if (ret != 0) {
+		cleanup_expire();
+		return ret;
+	}
+
+	for (int zoom = 0; zoom <= MAX_ZOOM; zoom++) {
+		sort_keys(&g_listed[zoom]);
+		sort_keys(&g_dirty[zoom]);
+	}
+
+	g_loaded = 1;
+
+	return 0;
+}
+
+void cleanup_expire() {
+	for (int zoom = 0; zoom <= MAX_ZOOM; zoom++) {
+		free(g_listed[zoom].keys);
+		free(g_dirty[zoom].keys);
+	}
+
+	memset(g_listed, 0, sizeof(g_listed));
+	memset(g_dirty, 0, sizeof(g_dirty));
+
+	g_loaded = 0;
+}
+
+int is_tile_dirty(int x, int y, int zoom) {
+	if (!g_loaded)
+		return 1;
+
+	/* tile is listed or has listed descendants */
+	if (zoom <= MAX_ZOOM && has_key(&g_dirty[zoom], get_key(x, y)))
+		return 1;
+
+	/* one of its ancestors is listed */
+	for (int z = zoom - 1; z >= 0; z--)
+		if (z <= MAX_ZOOM && has_key(&g_listed[z], get_key(x >> (zoom - z), y >> (zoom - z))))
+			return 1;
+
+	return 0;
+}
+
+void expire_getstats(expire_stats_t* stats) {
+	memset(stats, 0, sizeof(*stats));
+
+	for (int zoom = 0; zoom <= MAX_ZOOM; zoom++) {
+		stats->listed += g_listed[zoom].nkeys;
+		stats->dirty += g_dirty[zoom].nkeys;
+	}
+}
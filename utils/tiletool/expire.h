@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2012 Dmitry Marakasov
+ *
+ * This file is part of tiletool.
+ *
+ * tiletool is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * tiletool is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tiletool.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef EXPIRE_H
+#define EXPIRE_H
+
+/* List of tiles which have changed since the previous run, in the
+ * format written by osm2pgsql and read by mod_tile (zoom/x/y, one
+ * tile per line). A tile is dirty if it's listed, or one of its
+ * ancestors or descendants is; subtrees of other tiles are unchanged
+ * and don't need to be processed again */
+
+typedef struct {
+	unsigned long listed;      /* distinct tiles in the list */
+	unsigned long dirty;       /* listed tiles and their ancestors */
+} expire_stats_t;
+
+/* read expire list; returns 0, errno, or EINVAL if the file has a
+ * malformed line, in which case its number is stored in *line */
+int init_expire(const char* path, int* line);
+void cleanup_expire();
+
+/* whether subtree of the tile is affected by the list; all tiles
+ * are if no list is loaded */
+int is_tile_dirty(int x, int y, int zoom);
+
+void expire_getstats(expire_stats_t* stats);
+
+#endif
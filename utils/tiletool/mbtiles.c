@@ -0,0 +1,360 @@
+/*
+ * Copyright (C) 2012 Dmitry Marakasov
+ *
+ * This file is part of tiletool.
+ *
+ * tiletool is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * tiletool is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tiletool.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_SQLITE3
+
+#include <err.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_PTHREAD
+#	include <pthread.h>
+#endif
+
+#include <sqlite3.h>
+
+#include "mbtiles.h"
+
+struct database {
+	const char* tileset;
+	const char* path;
+	sqlite3* db;
+	int writable;
+
+	sqlite3_stmt* select;
+	sqlite3_stmt* exists;
+	sqlite3_stmt* insert;
+
+	int pending;               /* tiles written in open transaction */
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_t lock;      /* connection and statements are used by one thread at a time */
+#endif
+
+	struct database* next;
+};
+
+/* all databases are open before processing starts, so the list
+ * itself is not modified while it's used by other threads */
+static struct database* g_databases = NULL;
+static int g_batchsize = 1;
+
+static mbtiles_stats_t g_stats;
+
+#ifdef HAVE_PTHREAD
+#	define LOCK(database) pthread_mutex_lock(&(database)->lock)
+#	define UNLOCK(database) pthread_mutex_unlock(&(database)->lock)
+#	define INCREMENT(counter) __atomic_fetch_add(&(counter), 1, __ATOMIC_RELAXED)
+#else
+#	define LOCK(database)
+#	define UNLOCK(database)
+#	define INCREMENT(counter) ((counter)++)
+#endif
+
+static const char* g_schema =
+	"PRAGMA journal_mode = WAL;"
+	"PRAGMA synchronous = NORMAL;"
+	"CREATE TABLE IF NOT EXISTS metadata (name text, value text);"
+	"CREATE TABLE IF NOT EXISTS tiles (zoom_level integer, tile_column integer, tile_row integer, tile_data blob);"
+	"CREATE UNIQUE INDEX IF NOT EXISTS tile_index ON tiles (zoom_level, tile_column, tile_row);"
+	"INSERT INTO metadata (name, value) SELECT 'format', 'png' WHERE NOT EXISTS (SELECT 1 FROM metadata WHERE name = 'format');";
+
+static struct database* find_database(const char* tileset) {
+	for (struct database* database = g_databases; database != NULL; database = database->next)
+		if (strcmp(database->tileset, tileset) == 0)
+			return database;
+
+	return NULL;
+}
+
+/* report database error and convert it to errno */
+static int database_error(struct database* database, const char* what) {
+	warnx("%s %s: %s", what, database->path, sqlite3_errmsg(database->db));
+	return EIO;
+}
+
+/* MBTiles rows are numbered from the bottom, as in TMS */
+static int get_row(int y, int zoom) {
+	return (1 << zoom) - 1 - y;
+}
+
+static void bind_tile(sqlite3_stmt* stmt, int x, int y, int zoom) {
+	sqlite3_bind_int(stmt, 1, zoom);
+	sqlite3_bind_int(stmt, 2, x);
+	sqlite3_bind_int(stmt, 3, get_row(y, zoom));
+}
+
+static int commit(struct database* database) {
+	if (database->pending == 0)
+		return 0;
+
+	database->pending = 0;
+	if (sqlite3_exec(database->db, "COMMIT", NULL, NULL, NULL) != SQLITE_OK)
+		return database_error(database, "Cannot commit tiles to");
+
+	INCREMENT(g_stats.transactions);
+
+	return 0;
+}
+
+static int close_database(struct database* database) {
+	int ret = commit(database);
+
+	sqlite3_finalize(database->select);
+	sqlite3_finalize(database->exists);
+	sqlite3_finalize(database->insert);
+	sqlite3_close(database->db);
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_destroy(&database->lock);
+#endif
+
+	free(database);
+
+	return ret;
+}
+
+int init_mbtiles(int batchsize) {
+	cleanup_mbtiles();
+
+	g_batchsize = batchsize > 0 ? batchsize : 1;
+	memset(&g_stats, 0, sizeof(g_stats));
+
+	return 0;
+}
+
+int cleanup_mbtiles() {
+	int ret = 0;
+	while (g_databases != NULL) {
+		struct database* database = g_databases;
+		g_databases = database->next;
+
+		if (close_database(database) != 0)
+			ret = EIO;
+	}
+
+	return ret;
+}
+
+int mbtiles_open(const char* tileset, int writable) {
+	struct database* database = find_database(tileset);
+	if (database != NULL)
+		return database->writable || !writable ? 0 : EBUSY;
+
+	if ((database = calloc(1, sizeof(struct database))) == NULL)
+		return errno;
+
+	database->tileset = tileset;
+	database->path = tileset + sizeof(MBTILES_PREFIX) - 1;
+	database->writable = writable;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_init(&database->lock, NULL);
+#endif
+
+	/* connection is locked by us, so SQLite does not need to */
+	int flags = (writable ? SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE : SQLITE_OPEN_READONLY) | SQLITE_OPEN_NOMUTEX;
+
+	int ret = 0;
+	if (sqlite3_open_v2(database->path, &database->db, flags, NULL) != SQLITE_OK) {
+		ret = database_error(database, "Cannot open");
+		goto fail;
+	}
+
+	if (writable) {
+		char* name = sqlite3_mprintf("INSERT INTO metadata (name, value) SELECT 'name', %Q WHERE NOT EXISTS (SELECT 1 FROM metadata WHERE name = 'name');", database->path);
+		if (name == NULL) {
+			ret = ENOMEM;
+			goto fail;
+		}
+
+		int res = sqlite3_exec(database->db, g_schema, NULL, NULL, NULL);
+		if (res == SQLITE_OK)
+			res = sqlite3_exec(database->db, name, NULL, NULL, NULL);
+		sqlite3_free(name);
+
+		if (res != SQLITE_OK) {
+			ret = database_error(database, "Cannot create tiles in");
+			goto fail;
+		}
+
+		if (sqlite3_prepare_v2(database->db, "INSERT OR REPLACE INTO tiles (zoom_level, tile_column, tile_row, tile_data) VALUES (?, ?, ?, ?)", -1, &database->insert, NULL) != SQLITE_OK) {
+			ret = database_error(database, "Cannot prepare writing to");
+			goto fail;
+		}
+	}
+
+	if (sqlite3_prepare_v2(database->db, "SELECT tile_data FROM tiles WHERE zoom_level = ? AND tile_column = ? AND tile_row = ?", -1, &database->select, NULL) != SQLITE_OK ||
+			sqlite3_prepare_v2(database->db, "SELECT 1 FROM tiles WHERE zoom_level = ? AND tile_column = ? AND tile_row = ?", -1, &database->exists, NULL) != SQLITE_OK) {
+		ret = database_error(database, "Cannot prepare reading from");
+		goto fail;
+	}
+
+	database->next = g_databases;
+	g_databases = database;
+
+	return 0;
+
+fail:
+	close_database(database);
+	return ret;
+}
+
+int mbtiles_access(const char* tileset, int x, int y, int zoom) {
+	struct database* database = find_database(tileset);
+	if (database == NULL)
+		return EBADF;
+
+	LOCK(database);
+	bind_tile(database->exists, x, y, zoom);
+
+	int ret, res = sqlite3_step(database->exists);
+	if (res == SQLITE_ROW)
+		ret = 0;
+	else if (res == SQLITE_DONE)
+		ret = ENOENT;
+	else
+		ret = database_error(database, "Cannot look up tile in");
+
+	sqlite3_reset(database->exists);
+	UNLOCK(database);
+
+	return ret;
+}
+
+int mbtiles_read(const char* tileset, int x, int y, int zoom, ttip_buffer_t* buffer) {
+	struct database* database = find_database(tileset);
+	if (database == NULL)
+		return EBADF;
+
+	LOCK(database);
+	bind_tile(database->select, x, y, zoom);
+
+	int ret = 0, res = sqlite3_step(database->select);
+	if (res == SQLITE_ROW) {
+		const void* data = sqlite3_column_blob(database->select, 0);
+		size_t size = sqlite3_column_bytes(database->select, 0);
+
+		if (size > buffer->capacity) {
+			unsigned char* newdata = realloc(buffer->data, size);
+			if (newdata == NULL) {
+				ret = errno;
+				goto out;
+			}
+			buffer->data = newdata;
+			buffer->capacity = size;
+		}
+
+		if (size > 0)
+			memcpy(buffer->data, data, size);
+		buffer->size = size;
+
+		INCREMENT(g_stats.reads);
+	} else if (res == SQLITE_DONE) {
+		ret = ENOENT;
+	} else {
+		ret = database_error(database, "Cannot read tile from");
+	}
+
+out:
+	sqlite3_reset(database->select);
+	UNLOCK(database);
+
+	return ret;
+}
+
+int mbtiles_write(const char* tileset, int x, int y, int zoom, const unsigned char* data, size_t size) {
+	struct database* database = find_database(tileset);
+	if (database == NULL || !database->writable)
+		return EBADF;
+
+	int ret = 0;
+
+	LOCK(database);
+	if (database->pending == 0 && sqlite3_exec(database->db, "BEGIN", NULL, NULL, NULL) != SQLITE_OK) {
+		ret = database_error(database, "Cannot start transaction in");
+		goto out;
+	}
+
+	/* even failed write is part of the transaction, which has to be committed */
+	database->pending++;
+
+	bind_tile(database->insert, x, y, zoom);
+	sqlite3_bind_blob(database->insert, 4, data, size, SQLITE_STATIC);
+
+	if (sqlite3_step(database->insert) == SQLITE_DONE)
+		INCREMENT(g_stats.writes);
+	else
+		ret = database_error(database, "Cannot write tile to");
+
+	sqlite3_reset(database->insert);
+	sqlite3_clear_bindings(database->insert);
+
+	if (database->pending >= g_batchsize && commit(database) != 0 && ret == 0)
+		ret = EIO;
+
+out:
+	UNLOCK(database);
+
+	return ret;
+}
+
+int mbtiles_list(const char* tileset, int zoom, void (*callback)(int x, int y, void* arg), void* arg) {
+	struct database* database = find_database(tileset);
+	if (database == NULL)
+		return EBADF;
+
+	int ret = 0;
+
+	LOCK(database);
+
+	/* uses the same index as single tile lookups */
+	sqlite3_stmt* stmt;
+	if (sqlite3_prepare_v2(database->db, "SELECT tile_column, tile_row FROM tiles WHERE zoom_level = ?", -1, &stmt, NULL) != SQLITE_OK) {
+		ret = database_error(database, "Cannot list tiles in");
+		goto out;
+	}
+
+	sqlite3_bind_int(stmt, 1, zoom);
+
+	int res;
+	while ((res = sqlite3_step(stmt)) == SQLITE_ROW) {
+		int x = sqlite3_column_int(stmt, 0);
+		int y = get_row(sqlite3_column_int(stmt, 1), zoom);
+
+		if (x >= 0 && y >= 0 && x < (1 << zoom) && y < (1 << zoom))
+			callback(x, y, arg);
+	}
+
+	if (res != SQLITE_DONE)
+		ret = database_error(database, "Cannot list tiles in");
+
+	sqlite3_finalize(stmt);
+
+out:
+	UNLOCK(database);
+
+	return ret;
+}
+
+void mbtiles_getstats(mbtiles_stats_t* stats) {
+	*stats = g_stats;
+}
+
+#endif
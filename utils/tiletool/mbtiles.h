@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2012 Dmitry Marakasov
+ *
+ * This file is part of tiletool.
+ *
+ * tiletool is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * tiletool is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tiletool.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MBTILES_H
+#define MBTILES_H
+
+#include <stddef.h>
+#include <string.h>
+
+#include <ttip.h>
+
+/* Tilesets named mbtiles:<path> are kept in a single SQLite database
+ * in MBTiles format instead of a directory tree. Databases are open
+ * for the whole run, and each tile is read or written with a
+ * prepared statement. Writes are grouped into large transactions,
+ * and output uses WAL journal, so they don't wait for sync */
+
+#define MBTILES_PREFIX "mbtiles:"
+
+#define IS_MBTILES(tileset) (strncmp((tileset), MBTILES_PREFIX, sizeof(MBTILES_PREFIX) - 1) == 0)
+
+typedef struct {
+	unsigned long reads;
+	unsigned long writes;
+	unsigned long transactions;   /* committed */
+} mbtiles_stats_t;
+
+/* batchsize is number of tiles written in a transaction */
+int init_mbtiles(int batchsize);
+
+/* commit pending writes and close all databases; returns 0 or EIO.
+ * Database errors are reported with SQLite messages where they
+ * happen, and returned as EIO */
+int cleanup_mbtiles();
+
+/* open database of a tileset, creating it if writable; tileset
+ * must be open before it's accessed. Returns 0 or errno */
+int mbtiles_open(const char* tileset, int writable);
+
+/* same as tileio functions; return 0, ENOENT if tile does not exist,
+ * or errno */
+int mbtiles_access(const char* tileset, int x, int y, int zoom);
+int mbtiles_read(const char* tileset, int x, int y, int zoom, ttip_buffer_t* buffer);
+int mbtiles_write(const char* tileset, int x, int y, int zoom, const unsigned char* data, size_t size);
+
+/* call callback for each tile of a zoom, with a single query;
+ * returns 0 or errno */
+int mbtiles_list(const char* tileset, int zoom, void (*callback)(int x, int y, void* arg), void* arg);
+
+void mbtiles_getstats(mbtiles_stats_t* stats);
+
+#endif
@@ -0,0 +1,522 @@
+/*
+ * Copyright (C) 2012 Dmitry Marakasov
+ *
+ * This file is part of tiletool.
+ *
+ * tiletool is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * tiletool is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tiletool.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _POSIX_C_SOURCE 200809L /* for readdir() and friends */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef HAVE_PTHREAD
+#	include <pthread.h>
+#endif
+
+#include "copyfile.h"
+#include "paths.h"
+#include "metatile.h"
+
+/* layout of mod_tile metatile: magic, count, x, y and zoom of the
+ * first tile as native ints, followed by offset and size of each
+ * tile (which are relative to the start of file) */
+#define META_MAGIC "META"
+#define META_COUNT (METATILE * METATILE)
+#define META_HEADER_SIZE 20
+#define META_INDEX_SIZE (META_HEADER_SIZE + META_COUNT * 8)
+
+#define META_MASK (METATILE - 1)
+
+/* mod_tile keeps 4 bits of x and y per directory level */
+#define META_HASH_LEVELS 5
+#define META_MAX_ZOOM (META_HASH_LEVELS * 4)
+
+struct cached_metatile {
+	const char* tileset;
+	int zoom, x, y;            /* first tile */
+
+	unsigned char* data;       /* NULL if file does not exist */
+	size_t size;
+
+	unsigned long lastused;    /* 0 if slot is free */
+};
+
+struct pending_metatile {
+	const char* tileset;
+	int zoom, x, y;
+
+	unsigned char* tiles[META_COUNT];
+	size_t sizes[META_COUNT];
+	int ntiles;
+
+	struct pending_metatile* next;
+};
+
+static struct cached_metatile* g_cache = NULL;
+static int g_cachesize = 0;
+static unsigned long g_clock = 0;
+
+static struct pending_metatile* g_pending = NULL;
+
+static metatile_stats_t g_stats;
+
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+#	define LOCK() pthread_mutex_lock(&g_lock)
+#	define UNLOCK() pthread_mutex_unlock(&g_lock)
+#else
+#	define LOCK()
+#	define UNLOCK()
+#endif
+
+static int get_metatile_path(char* buffer, size_t size, const char* tileset, int x, int y, int zoom) {
+	unsigned int hash[META_HASH_LEVELS];
+	for (int i = 0; i < META_HASH_LEVELS; i++) {
+		hash[i] = ((x & 0x0f) << 4) | (y & 0x0f);
+		x >>= 4;
+		y >>= 4;
+	}
+
+	if (snprintf(buffer, size, "%s/%d/%u/%u/%u/%u/%u.meta", tileset + sizeof(METATILE_PREFIX) - 1,
+				zoom, hash[4], hash[3], hash[2], hash[1], hash[0]) >= (int)size)
+		return ENAMETOOLONG;
+
+	return 0;
+}
+
+static int get_int(const unsigned char* data) {
+	int32_t value;
+	memcpy(&value, data, sizeof(value));
+	return value;
+}
+
+static void put_int(unsigned char* data, int value) {
+	int32_t v = value;
+	memcpy(data, &v, sizeof(v));
+}
+
+/* tile of loaded metatile file; ENOENT if it's not stored there */
+static int get_tile(const unsigned char* data, size_t size, int x, int y, const unsigned char** tile, size_t* tilesize) {
+	if (size < META_INDEX_SIZE || memcmp(data, META_MAGIC, 4) != 0 || get_int(data + 4) != META_COUNT)
+		return EIO; /* compressed metatiles are not supported */
+
+	const unsigned char* entry = data + META_HEADER_SIZE + ((x & META_MASK) * METATILE + (y & META_MASK)) * 8;
+	int offset = get_int(entry);
+	int length = get_int(entry + 4);
+
+	if (length == 0)
+		return ENOENT;
+
+	if (offset < 0 || length < 0 || (size_t)offset > size || (size_t)length > size - offset)
+		return EIO;
+
+	*tile = data + offset;
+	*tilesize = length;
+
+	return 0;
+}
+
+static int load_file(const char* path, unsigned char** data, size_t* size) {
+	int fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return errno;
+
+	int ret = 0;
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		ret = errno;
+		goto out;
+	}
+
+	*size = st.st_size;
+	if ((*data = malloc(*size > 0 ? *size : 1)) == NULL) {
+		ret = errno;
+		goto out;
+	}
+
+	size_t done = 0;
+	while (done < *size) {
+		ssize_t nread = read(fd, *data + done, *size - done);
+		if (nread == -1 && errno == EINTR)
+			continue;
+		if (nread == -1 || nread == 0) {
+			ret = nread == 0 ? EIO : errno; /* file was truncated */
+			free(*data);
+			*data = NULL;
+			goto out;
+		}
+		done += nread;
+	}
+
+out:
+	close(fd);
+	return ret;
+}
+
+static struct cached_metatile* find_cached(const char* tileset, int x, int y, int zoom) {
+	for (int i = 0; i < g_cachesize; i++) {
+		struct cached_metatile* cached = &g_cache[i];
+		if (cached->lastused != 0 && cached->x == x && cached->y == y && cached->zoom == zoom && strcmp(cached->tileset, tileset) == 0)
+			return cached;
+	}
+
+	return NULL;
+}
+
+/* free slot, or least recently used one */
+static struct cached_metatile* evict_cached() {
+	struct cached_metatile* victim = &g_cache[0];
+	for (int i = 1; i < g_cachesize && victim->lastused != 0; i++)
+		if (g_cache[i].lastused < victim->lastused)
+			victim = &g_cache[i];
+
+	free(victim->data);
+	victim->data = NULL;
+	victim->lastused = 0;
+
+	return victim;
+}
+
+/* copy tile from cached metatile into buffer, or only check that
+ * it's there if buffer is NULL; must be called under lock */
+static int copy_tile(struct cached_metatile* cached, int x, int y, ttip_buffer_t* buffer) {
+	const unsigned char* data;
+	size_t size;
+
+	cached->lastused = ++g_clock;
+
+	if (cached->data == NULL)
+		return ENOENT;
+
+	int ret;
+	if ((ret = get_tile(cached->data, cached->size, x, y, &data, &size)) != 0 || buffer == NULL)
+		return ret;
+
+	if (size > buffer->capacity) {
+		unsigned char* newdata = realloc(buffer->data, size);
+		if (newdata == NULL)
+			return errno;
+		buffer->data = newdata;
+		buffer->capacity = size;
+	}
+
+	memcpy(buffer->data, data, size);
+	buffer->size = size;
+
+	g_stats.reads++;
+
+	return 0;
+}
+
+static int lookup_tile(const char* tileset, int x, int y, int zoom, ttip_buffer_t* buffer) {
+	int metax = x & ~META_MASK, metay = y & ~META_MASK;
+	int ret;
+
+	LOCK();
+	struct cached_metatile* cached = find_cached(tileset, metax, metay, zoom);
+	if (cached != NULL) {
+		ret = copy_tile(cached, x, y, buffer);
+		UNLOCK();
+		return ret;
+	}
+	UNLOCK();
+
+	/* file is read without lock; if another thread reads the same
+	 * metatile meanwhile, the first one to finish is cached */
+	char path[FILENAME_MAX];
+	if ((ret = get_metatile_path(path, sizeof(path), tileset, metax, metay, zoom)) != 0)
+		return ret;
+
+	unsigned char* data = NULL;
+	size_t size = 0;
+	if ((ret = load_file(path, &data, &size)) != 0 && ret != ENOENT)
+		return ret;
+
+	LOCK();
+	if ((cached = find_cached(tileset, metax, metay, zoom)) == NULL) {
+		cached = evict_cached();
+		cached->tileset = tileset;
+		cached->zoom = zoom;
+		cached->x = metax;
+		cached->y = metay;
+		cached->data = data;
+		cached->size = size;
+		if (data != NULL)
+			g_stats.loaded++;
+	} else {
+		free(data);
+	}
+	ret = copy_tile(cached, x, y, buffer);
+	UNLOCK();
+
+	return ret;
+}
+
+static void free_pending(struct pending_metatile* pending) {
+	for (int i = 0; i < META_COUNT; i++)
+		free(pending->tiles[i]);
+	free(pending);
+}
+
+/* write collected tiles as a metatile; if merge is set, tiles which
+ * were not collected are taken from existing file */
+static int write_pending(struct pending_metatile* pending, int merge) {
+	char path[FILENAME_MAX];
+	int ret;
+	if ((ret = get_metatile_path(path, sizeof(path), pending->tileset, pending->x, pending->y, pending->zoom)) != 0)
+		return ret;
+
+	unsigned char* old = NULL;
+	size_t oldsize = 0;
+	if (merge && (ret = load_file(path, &old, &oldsize)) != 0 && ret != ENOENT)
+		return ret;
+
+	const unsigned char* tiles[META_COUNT];
+	size_t sizes[META_COUNT];
+	size_t total = META_INDEX_SIZE;
+	for (int i = 0; i < META_COUNT; i++) {
+		tiles[i] = pending->tiles[i];
+		sizes[i] = pending->sizes[i];
+		if (tiles[i] == NULL && (old == NULL || get_tile(old, oldsize, i / METATILE, i % METATILE, &tiles[i], &sizes[i]) != 0)) {
+			tiles[i] = NULL;
+			sizes[i] = 0;
+		}
+		total += sizes[i];
+	}
+
+	unsigned char* data = calloc(1, total);
+	if (data == NULL) {
+		ret = errno;
+		goto out;
+	}
+
+	memcpy(data, META_MAGIC, 4);
+	put_int(data + 4, META_COUNT);
+	put_int(data + 8, pending->x);
+	put_int(data + 12, pending->y);
+	put_int(data + 16, pending->zoom);
+
+	size_t offset = META_INDEX_SIZE;
+	for (int i = 0; i < META_COUNT; i++) {
+		if (tiles[i] == NULL)
+			continue;
+		put_int(data + META_HEADER_SIZE + i * 8, offset);
+		put_int(data + META_HEADER_SIZE + i * 8 + 4, sizes[i]);
+		memcpy(data + offset, tiles[i], sizes[i]);
+		offset += sizes[i];
+	}
+
+	if (create_directories(path) != 0)
+		ret = errno;
+	else
+		ret = write_file(path, data, total);
+
+	free(data);
+
+	if (ret == 0) {
+		LOCK();
+		g_stats.written++;
+		UNLOCK();
+	}
+
+out:
+	free(old);
+	return ret;
+}
+
+int init_metatile(int cachesize) {
+	cleanup_metatile();
+
+	if (cachesize < 1)
+		cachesize = 1;
+
+	if ((g_cache = calloc(cachesize, sizeof(struct cached_metatile))) == NULL)
+		return errno;
+
+	g_cachesize = cachesize;
+	memset(&g_stats, 0, sizeof(g_stats));
+
+	return 0;
+}
+
+int cleanup_metatile() {
+	int ret = 0;
+
+	while (g_pending != NULL) {
+		struct pending_metatile* pending = g_pending;
+		g_pending = pending->next;
+
+		int err = write_pending(pending, 1);
+		if (err != 0 && ret == 0)
+			ret = err;
+
+		free_pending(pending);
+	}
+
+	for (int i = 0; i < g_cachesize; i++)
+		free(g_cache[i].data);
+
+	free(g_cache);
+	g_cache = NULL;
+	g_cachesize = 0;
+	g_clock = 0;
+
+	return ret;
+}
+
+int metatile_access(const char* tileset, int x, int y, int zoom) {
+	return lookup_tile(tileset, x, y, zoom, NULL);
+}
+
+int metatile_read(const char* tileset, int x, int y, int zoom, ttip_buffer_t* buffer) {
+	return lookup_tile(tileset, x, y, zoom, buffer);
+}
+
+int metatile_write(const char* tileset, int x, int y, int zoom, const unsigned char* data, size_t size) {
+	int metax = x & ~META_MASK, metay = y & ~META_MASK;
+	int index = (x & META_MASK) * METATILE + (y & META_MASK);
+
+	unsigned char* copy = malloc(size > 0 ? size : 1);
+	if (copy == NULL)
+		return errno;
+	memcpy(copy, data, size);
+
+	LOCK();
+	struct pending_metatile** pprev = &g_pending;
+	while (*pprev != NULL && ((*pprev)->x != metax || (*pprev)->y != metay || (*pprev)->zoom != zoom || strcmp((*pprev)->tileset, tileset) != 0))
+		pprev = &(*pprev)->next;
+
+	struct pending_metatile* pending = *pprev;
+	if (pending == NULL) {
+		if ((pending = calloc(1, sizeof(struct pending_metatile))) == NULL) {
+			int ret = errno;
+			UNLOCK();
+			free(copy);
+			return ret;
+		}
+		pending->tileset = tileset;
+		pending->zoom = zoom;
+		pending->x = metax;
+		pending->y = metay;
+		pending->next = g_pending;
+		g_pending = pending;
+		pprev = &g_pending;
+	}
+
+	if (pending->tiles[index] == NULL)
+		pending->ntiles++;
+	free(pending->tiles[index]);
+	pending->tiles[index] = copy;
+	pending->sizes[index] = size;
+
+	g_stats.writes++;
+
+	/* lower zooms have less than METATILE x METATILE tiles */
+	int side = zoom < 3 ? 1 << zoom : METATILE;
+	int complete = pending->ntiles == side * side;
+	if (complete)
+		*pprev = pending->next;
+	UNLOCK();
+
+	if (!complete)
+		return 0;
+
+	int ret = write_pending(pending, 0);
+	free_pending(pending);
+
+	return ret;
+}
+
+/* walk hashed directories; hash holds path components parsed so far */
+static int list_level(char* path, size_t pathlen, int level, unsigned int* hash, int zoom, void (*callback)(int x, int y, void* arg), void* arg) {
+	DIR* dir = opendir(path);
+	if (dir == NULL)
+		return errno == ENOENT ? 0 : errno;
+
+	int ret = 0;
+	struct dirent* entry;
+	while ((entry = readdir(dir)) != NULL) {
+		char* end;
+		unsigned long value = strtoul(entry->d_name, &end, 10);
+		if (end == entry->d_name || value > 255)
+			continue;
+
+		hash[META_HASH_LEVELS - 1 - level] = value;
+
+		if (level == META_HASH_LEVELS - 1) {
+			if (strcmp(end, ".meta") != 0)
+				continue;
+
+			int x = 0, y = 0;
+			for (int i = META_HASH_LEVELS - 1; i >= 0; i--) {
+				x = (x << 4) | (hash[i] >> 4);
+				y = (y << 4) | (hash[i] & 0x0f);
+			}
+
+			int side = zoom < 3 ? 1 << zoom : METATILE;
+			if ((x & META_MASK) != 0 || (y & META_MASK) != 0 || x >= (1 << zoom) || y >= (1 << zoom))
+				continue;
+
+			for (int dx = 0; dx < side; dx++)
+				for (int dy = 0; dy < side; dy++)
+					callback(x + dx, y + dy, arg);
+		} else if (*end == '\0') {
+			size_t len = strlen(entry->d_name);
+			if (pathlen + len + 2 > FILENAME_MAX) {
+				ret = ENAMETOOLONG;
+				break;
+			}
+
+			path[pathlen] = '/';
+			memcpy(path + pathlen + 1, entry->d_name, len + 1);
+
+			ret = list_level(path, pathlen + len + 1, level + 1, hash, zoom, callback, arg);
+
+			path[pathlen] = '\0';
+
+			if (ret != 0)
+				break;
+		}
+	}
+
+	closedir(dir);
+	return ret;
+}
+
+int metatile_list(const char* tileset, int zoom, void (*callback)(int x, int y, void* arg), void* arg) {
+	if (zoom > META_MAX_ZOOM)
+		return EINVAL;
+
+	char path[FILENAME_MAX];
+	if (snprintf(path, sizeof(path), "%s/%d", tileset + sizeof(METATILE_PREFIX) - 1, zoom) >= (int)sizeof(path))
+		return ENAMETOOLONG;
+
+	unsigned int hash[META_HASH_LEVELS];
+	return list_level(path, strlen(path), 0, hash, zoom, callback, arg);
+}
+
+void metatile_getstats(metatile_stats_t* stats) {
+	LOCK();
+	*stats = g_stats;
+	UNLOCK();
+}
@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2012 Dmitry Marakasov
+ *
+ * This file is part of tiletool.
+ *
+ * tiletool is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * tiletool is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tiletool.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef METATILE_H
+#define METATILE_H
+
+#include <stddef.h>
+#include <string.h>
+
+#include <ttip.h>
+
+/* Tilesets named meta:<path> are mod_tile metatile trees, where each
+ * <path>/<zoom>/<h4>/<h3>/<h2>/<h1>/<h0>.meta file holds a block of
+ * METATILE x METATILE tiles. Input metatiles are read whole and kept
+ * in a small cache, so a single open and read serves all tiles of
+ * a block. Output tiles are collected until their block is complete
+ * and written as a single file; blocks which are not complete when
+ * processing finishes are merged with existing files on cleanup */
+
+#define METATILE_PREFIX "meta:"
+
+#define IS_METATILE(tileset) (strncmp((tileset), METATILE_PREFIX, sizeof(METATILE_PREFIX) - 1) == 0)
+
+#define METATILE 8
+
+typedef struct {
+	unsigned long reads;
+	unsigned long loaded;      /* metatile files read */
+	unsigned long writes;
+	unsigned long written;     /* metatile files written */
+} metatile_stats_t;
+
+/* cachesize is number of input metatiles kept in memory */
+int init_metatile(int cachesize);
+
+/* write incomplete output metatiles and free everything; returns 0
+ * or errno of the first failed write */
+int cleanup_metatile();
+
+/* same as tileio functions; return 0, ENOENT if tile does not exist,
+ * or error */
+int metatile_access(const char* tileset, int x, int y, int zoom);
+int metatile_read(const char* tileset, int x, int y, int zoom, ttip_buffer_t* buffer);
+int metatile_write(const char* tileset, int x, int y, int zoom, const unsigned char* data, size_t size);
+
+/* call callback for each tile of a zoom covered by metatile files;
+ * tiles are taken from file names, so they may still be missing
+ * from the metatile itself */
+int metatile_list(const char* tileset, int zoom, void (*callback)(int x, int y, void* arg), void* arg);
+
+void metatile_getstats(metatile_stats_t* stats);
+
+#endif
@@ -0,0 +1,386 @@
+/*
+ * Copyright (C) 2012 Dmitry Marakasov
+ *
+ * This file is part of tiletool.
+ *
+ * tiletool is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * tiletool is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tiletool.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_FORK
+#	define _POSIX_C_SOURCE 200809L /* for fdopen() and friends */
+#endif
+
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_FORK
+#	include <fcntl.h>
+#	include <signal.h>
+#	include <sys/types.h>
+#	include <sys/wait.h>
+#	include <unistd.h>
+#endif
+
+#ifdef HAVE_PTHREAD
+#	include <pthread.h>
+#endif
+
+#include "postcmd.h"
+
+static const char* g_command = NULL;
+static postcmd_mode_t g_mode = POSTCMD_EACH;
+
+static postcmd_stats_t g_stats;
+static unsigned long g_reported = 0;   /* failures returned by flush_postcmd() */
+
+/* tiles are added by all threads; in background modes, they wait
+ * under the lock for a free process, which gives backpressure */
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+#	define LOCK() pthread_mutex_lock(&g_lock)
+#	define UNLOCK() pthread_mutex_unlock(&g_lock)
+#else
+#	define LOCK()
+#	define UNLOCK()
+#endif
+
+#ifdef HAVE_FORK
+/* running command, for batch mode, or persistent one */
+struct postcmd_job {
+	pid_t pid;
+	int ntiles;          /* tiles command was run on */
+	int fd;              /* stdin of persistent process */
+};
+
+static struct postcmd_job* g_jobs = NULL;
+static int g_njobs = 0;
+static int g_nrunning = 0;
+static int g_oldest = 0;       /* running jobs form a ring */
+
+/* command with arguments appended, and paths of current batch */
+static char* g_script = NULL;
+static char** g_argv = NULL;
+static int g_batchsize = 0;
+static int g_nbatch = 0;
+
+static int g_nextjob = 0;      /* persistent process to get next path */
+
+static int wait_job(struct postcmd_job* job) {
+	int status;
+	while (waitpid(job->pid, &status, 0) == -1) {
+		if (errno != EINTR) {
+			warn("waitpid");
+			return 0;
+		}
+	}
+
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static void job_done(struct postcmd_job* job, int success) {
+	if (success)
+		return;
+
+	if (g_mode == POSTCMD_BATCH)
+		warnx("Postcmd `%s` failed on a batch of %d tiles", g_command, job->ntiles);
+	else
+		warnx("Postcmd `%s` failed after processing %d tiles", g_command, job->ntiles);
+
+	g_stats.failed += g_mode == POSTCMD_BATCH ? job->ntiles : 1;
+}
+
+static pid_t spawn(char** argv, int stdinfd) {
+	pid_t pid = fork();
+	if (pid == 0) {
+		/* only async-signal-safe calls here, as other threads may
+		 * have held locks at the moment of fork */
+		if (stdinfd != -1 && dup2(stdinfd, STDIN_FILENO) == -1)
+			_exit(127);
+		execv("/bin/sh", argv);
+		_exit(127);
+	}
+
+	return pid;
+}
+
+static void reap_oldest() {
+	struct postcmd_job* job = &g_jobs[g_oldest];
+
+	job_done(job, wait_job(job));
+
+	g_oldest = (g_oldest + 1) % g_njobs;
+	g_nrunning--;
+}
+
+/* run command on collected batch, waiting for a free slot first */
+static void start_batch() {
+	while (g_nrunning >= g_njobs)
+		reap_oldest();
+
+	struct postcmd_job* job = &g_jobs[(g_oldest + g_nrunning) % g_njobs];
+	job->ntiles = g_nbatch;
+	job->fd = -1;
+
+	g_argv[4 + g_nbatch] = NULL;
+	if ((job->pid = spawn(g_argv, -1)) == -1) {
+		warn("Cannot run postcmd");
+		g_stats.failed += g_nbatch;
+	} else {
+		g_nrunning++;
+		g_stats.invocations++;
+	}
+
+	for (int i = 0; i < g_nbatch; i++) {
+		free(g_argv[4 + i]);
+		g_argv[4 + i] = NULL;
+	}
+	g_nbatch = 0;
+}
+
+static int start_persistent(struct postcmd_job* job) {
+	int fds[2];
+	if (pipe(fds) != 0)
+		return errno;
+
+	/* other persistent processes must not keep it open */
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
+	char* argv[] = { "sh", "-c", (char*)g_command, NULL };
+	if ((job->pid = spawn(argv, fds[0])) == -1) {
+		int ret = errno;
+		close(fds[0]);
+		close(fds[1]);
+		return ret;
+	}
+
+	close(fds[0]);
+
+	job->fd = fds[1];
+	job->ntiles = 0;
+
+	g_stats.invocations++;
+
+	return 0;
+}
+
+static int write_path(struct postcmd_job* job, const char* path) {
+	size_t len = strlen(path);
+	char line[len + 1];
+	memcpy(line, path, len);
+	line[len] = '\n';
+
+	const char* data = line;
+	size_t size = len + 1;
+	while (size > 0) {
+		ssize_t written = write(job->fd, data, size);
+		if (written == -1) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+		data += written;
+		size -= written;
+	}
+
+	return 0;
+}
+#endif
+
+/* failure which is returned to the caller right away */
+static void immediate_failure() {
+	g_stats.failed++;
+	g_reported++;
+}
+
+static int run_each(const char* path) {
+	char buffer[strlen(g_command) + strlen(path) + 2];
+	strcpy(buffer, g_command);
+	strcat(buffer, " ");
+	strcat(buffer, path);
+	if (system(buffer) != 0) {
+		warnx("Postcmd `%s` failed", buffer);
+		return 0;
+	}
+
+	return 1;
+}
+
+int init_postcmd(const char* command, postcmd_mode_t mode, int batchsize, int njobs) {
+	cleanup_postcmd();
+
+	g_command = command;
+	g_mode = mode;
+	memset(&g_stats, 0, sizeof(g_stats));
+	g_reported = 0;
+
+	if (mode == POSTCMD_EACH)
+		return 0;
+
+#ifdef HAVE_FORK
+	if (njobs < 1)
+		njobs = 1;
+
+	if ((g_jobs = calloc(njobs, sizeof(struct postcmd_job))) == NULL)
+		return errno;
+	g_njobs = njobs;
+
+	if (mode == POSTCMD_BATCH) {
+		if (batchsize < 1)
+			batchsize = 1;
+
+		/* sh -c 'command "$@"' sh path... */
+		if ((g_script = malloc(strlen(command) + 6)) == NULL)
+			return errno;
+		strcpy(g_script, command);
+		strcat(g_script, " \"$@\"");
+
+		if ((g_argv = calloc(batchsize + 5, sizeof(char*))) == NULL)
+			return errno;
+		g_argv[0] = "sh";
+		g_argv[1] = "-c";
+		g_argv[2] = g_script;
+		g_argv[3] = "sh";
+
+		g_batchsize = batchsize;
+	} else {
+		/* persistent process exiting early must not kill us */
+		signal(SIGPIPE, SIG_IGN);
+
+		int ret;
+		for (; g_nrunning < njobs; g_nrunning++)
+			if ((ret = start_persistent(&g_jobs[g_nrunning])) != 0)
+				return ret;
+	}
+
+	return 0;
+#else
+	(void)batchsize; /* unused */
+	(void)njobs; /* unused */
+
+	return ENOSYS;
+#endif
+}
+
+int flush_postcmd() {
+	LOCK();
+#ifdef HAVE_FORK
+	if (g_mode == POSTCMD_BATCH) {
+		if (g_nbatch > 0)
+			start_batch();
+		while (g_nrunning > 0)
+			reap_oldest();
+	} else if (g_mode == POSTCMD_STDIN) {
+		/* end of input makes persistent processes finish; ones
+		 * which stopped early have their tiles counted already */
+		for (int i = 0; i < g_nrunning; i++) {
+			if (g_jobs[i].fd != -1) {
+				close(g_jobs[i].fd);
+				job_done(&g_jobs[i], wait_job(&g_jobs[i]));
+			} else {
+				wait_job(&g_jobs[i]);
+			}
+		}
+		g_nrunning = 0;
+	}
+#endif
+
+	int failed = g_stats.failed - g_reported;
+	g_reported = g_stats.failed;
+	UNLOCK();
+
+	return failed;
+}
+
+void cleanup_postcmd() {
+	flush_postcmd();
+
+#ifdef HAVE_FORK
+	free(g_jobs);
+	g_jobs = NULL;
+	g_njobs = g_oldest = g_nextjob = 0;
+
+	free(g_argv);
+	g_argv = NULL;
+	free(g_script);
+	g_script = NULL;
+	g_batchsize = 0;
+#endif
+}
+
+int postcmd_add(const char* path) {
+	int ret = 1;
+
+	if (g_mode == POSTCMD_EACH) {
+		ret = run_each(path);
+
+		LOCK();
+		g_stats.tiles++;
+		g_stats.invocations++;
+		if (!ret)
+			immediate_failure();
+		UNLOCK();
+
+		return ret;
+	}
+
+#ifdef HAVE_FORK
+	LOCK();
+	g_stats.tiles++;
+	if (g_mode == POSTCMD_BATCH) {
+		if ((g_argv[4 + g_nbatch] = malloc(strlen(path) + 1)) == NULL) {
+			warn("Cannot queue postcmd");
+			ret = 0;
+		} else {
+			strcpy(g_argv[4 + g_nbatch++], path);
+			if (g_nbatch == g_batchsize)
+				start_batch();
+		}
+	} else {
+		/* pass to the next process which is still alive */
+		ret = 0;
+		for (int i = 0; i < g_nrunning && !ret; i++) {
+			struct postcmd_job* job = &g_jobs[g_nextjob];
+			g_nextjob = (g_nextjob + 1) % g_nrunning;
+
+			if (job->fd == -1)
+				continue;
+
+			int error;
+			if ((error = write_path(job, path)) != 0) {
+				warnx("Postcmd `%s` stopped accepting tiles: %s", g_command, strerror(error));
+				close(job->fd);
+				job->fd = -1;
+			} else {
+				job->ntiles++;
+				ret = 1;
+			}
+		}
+	}
+
+	if (!ret)
+		immediate_failure();
+	UNLOCK();
+#endif
+
+	return ret;
+}
+
+void postcmd_getstats(postcmd_stats_t* stats) {
+	LOCK();
+	*stats = g_stats;
+	UNLOCK();
+}
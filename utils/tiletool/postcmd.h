@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2012 Dmitry Marakasov
+ *
+ * This file is part of tiletool.
+ *
+ * tiletool is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * tiletool is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tiletool.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef POSTCMD_H
+#define POSTCMD_H
+
+/* how postcmd is run on saved tiles */
+typedef enum {
+	POSTCMD_EACH,     /* with shell, once per tile, waiting for it */
+	POSTCMD_BATCH,    /* with many tiles as arguments, in background */
+	POSTCMD_STDIN,    /* persistent processes which read paths from stdin */
+} postcmd_mode_t;
+
+typedef struct {
+	unsigned long tiles;
+	unsigned long invocations;
+	unsigned long failed;      /* tiles command failed on */
+} postcmd_stats_t;
+
+/* batchsize is max number of tiles per invocation in batch mode,
+ * njobs is max number of commands running at once; modes other
+ * than POSTCMD_EACH require fork(). Returns 0 or errno */
+int init_postcmd(const char* command, postcmd_mode_t mode, int batchsize, int njobs);
+
+/* run all pending commands, wait for them to finish and return number
+ * of tiles command has failed on since previous call */
+int flush_postcmd();
+void cleanup_postcmd();
+
+/* run command on saved tile, or queue it; returns 0 if command
+ * is known to have failed */
+int postcmd_add(const char* path);
+
+void postcmd_getstats(postcmd_stats_t* stats);
+
+#endif
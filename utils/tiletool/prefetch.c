@@ -0,0 +1,309 @@
+/*
+ * Copyright (C) 2012 Dmitry Marakasov
+ *
+ * This file is part of tiletool.
+ *
+ * tiletool is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * tiletool is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tiletool.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_PTHREAD
+
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "prefetch.h"
+#include "presence.h"
+#include "tileio.h"
+
+enum {
+	ENTRY_QUEUED,   /* waiting for I/O thread */
+	ENTRY_READING,
+	ENTRY_DONE,
+	ENTRY_CLAIMED,  /* consumer got there first, walker should skip it */
+};
+
+struct prefetch_entry {
+	int x, y, zoom;
+	int state;
+
+	prefetch_tile_t tile;
+
+	struct prefetch_entry* next;       /* in hash chain */
+	struct prefetch_entry* nextqueued; /* in I/O queue */
+};
+
+static const char* const* g_inputs = NULL;
+static int g_ninputs = 0;
+
+static pthread_t* g_threads = NULL;
+static int g_nthreads = 0;
+static pthread_t g_walker;
+static int g_walker_started = 0;
+static void (*g_walk)() = NULL;
+
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_queued_cond = PTHREAD_COND_INITIALIZER;  /* for I/O threads */
+static pthread_cond_t g_done_cond = PTHREAD_COND_INITIALIZER;    /* for consumers */
+static pthread_cond_t g_window_cond = PTHREAD_COND_INITIALIZER;  /* for walker */
+
+static struct prefetch_entry** g_buckets = NULL;
+static size_t g_nbuckets = 0;
+
+static struct prefetch_entry* g_queue_head = NULL;
+static struct prefetch_entry* g_queue_tail = NULL;
+
+static int g_window = 0;
+static int g_scheduled = 0;    /* entries scheduled and not taken yet */
+static int g_stopping = 0;
+
+static prefetch_stats_t g_stats;
+
+static size_t get_bucket(int x, int y, int zoom) {
+	return ((size_t)x * 73856093u ^ (size_t)y * 19349663u ^ (size_t)zoom * 83492791u) & (g_nbuckets - 1);
+}
+
+static struct prefetch_entry** find_entry(int x, int y, int zoom) {
+	struct prefetch_entry** entry;
+	for (entry = &g_buckets[get_bucket(x, y, zoom)]; *entry != NULL; entry = &(*entry)->next)
+		if ((*entry)->x == x && (*entry)->y == y && (*entry)->zoom == zoom)
+			break;
+	return entry;
+}
+
+static struct prefetch_entry* add_entry(int x, int y, int zoom, int state) {
+	struct prefetch_entry* entry = calloc(1, sizeof(struct prefetch_entry));
+	if (entry == NULL)
+		err(1, "Cannot schedule tile read");
+
+	entry->x = x;
+	entry->y = y;
+	entry->zoom = zoom;
+	entry->state = state;
+
+	size_t bucket = get_bucket(x, y, zoom);
+	entry->next = g_buckets[bucket];
+	g_buckets[bucket] = entry;
+
+	return entry;
+}
+
+/* read tile from the first input which has it */
+static void read_tile(struct prefetch_entry* entry) {
+	ttip_buffer_t buffer;
+	ttip_buffer_init(&buffer);
+
+	entry->tile.error = ENOENT;
+	for (int i = 0; i < g_ninputs && entry->tile.error == ENOENT; i++) {
+		if (!presence_has_tile(i, entry->x, entry->y, entry->zoom))
+			continue;
+
+		entry->tile.error = tileio_read(g_inputs[i], entry->x, entry->y, entry->zoom, &buffer);
+		entry->tile.input = i;
+	}
+
+	if (entry->tile.error == 0) {
+		entry->tile.data = buffer.data;
+		entry->tile.size = buffer.size;
+	} else {
+		ttip_buffer_free(&buffer);
+	}
+}
+
+static void* io_main(void* arg) {
+	(void)arg; /* unused */
+
+	pthread_mutex_lock(&g_lock);
+	for (;;) {
+		while (g_queue_head == NULL && !g_stopping)
+			pthread_cond_wait(&g_queued_cond, &g_lock);
+
+		struct prefetch_entry* entry = g_queue_head;
+		if (entry == NULL)
+			break;
+
+		if ((g_queue_head = entry->nextqueued) == NULL)
+			g_queue_tail = NULL;
+
+		entry->state = ENTRY_READING;
+
+		pthread_mutex_unlock(&g_lock);
+		read_tile(entry);
+		pthread_mutex_lock(&g_lock);
+
+		entry->state = ENTRY_DONE;
+		pthread_cond_broadcast(&g_done_cond);
+	}
+	pthread_mutex_unlock(&g_lock);
+
+	return NULL;
+}
+
+static void* walker_main(void* arg) {
+	(void)arg; /* unused */
+
+	g_walk();
+
+	return NULL;
+}
+
+int init_prefetch(int window, int nthreads, const char* const* inputs, int ninputs, void (*walk)()) {
+	int ret;
+
+	cleanup_prefetch();
+
+	/* enough for window and some tiles claimed by consumer */
+	for (g_nbuckets = 64; g_nbuckets < (size_t)window * 2; g_nbuckets *= 2) {
+		/* empty */
+	}
+
+	if ((g_buckets = calloc(g_nbuckets, sizeof(struct prefetch_entry*))) == NULL)
+		return errno;
+	if ((g_threads = malloc(nthreads * sizeof(pthread_t))) == NULL)
+		return errno;
+
+	g_inputs = inputs;
+	g_ninputs = ninputs;
+	g_window = window;
+	g_walk = walk;
+	g_stopping = 0;
+	memset(&g_stats, 0, sizeof(g_stats));
+
+	for (g_nthreads = 0; g_nthreads < nthreads; g_nthreads++) {
+		if ((ret = pthread_create(&g_threads[g_nthreads], NULL, io_main, NULL)) != 0) {
+			cleanup_prefetch();
+			return ret;
+		}
+	}
+
+	if ((ret = pthread_create(&g_walker, NULL, walker_main, NULL)) != 0) {
+		cleanup_prefetch();
+		return ret;
+	}
+	g_walker_started = 1;
+
+	return 0;
+}
+
+void cleanup_prefetch() {
+	pthread_mutex_lock(&g_lock);
+	g_stopping = 1;
+	pthread_cond_broadcast(&g_queued_cond);
+	pthread_cond_broadcast(&g_window_cond);
+	pthread_mutex_unlock(&g_lock);
+
+	if (g_walker_started)
+		pthread_join(g_walker, NULL);
+	g_walker_started = 0;
+
+	for (int i = 0; i < g_nthreads; i++)
+		pthread_join(g_threads[i], NULL);
+	free(g_threads);
+	g_threads = NULL;
+	g_nthreads = 0;
+
+	/* tiles never taken */
+	for (size_t i = 0; i < g_nbuckets; i++) {
+		struct prefetch_entry* entry;
+		while ((entry = g_buckets[i]) != NULL) {
+			g_buckets[i] = entry->next;
+			free(entry->tile.data);
+			free(entry);
+		}
+	}
+	free(g_buckets);
+	g_buckets = NULL;
+	g_nbuckets = 0;
+
+	g_queue_head = g_queue_tail = NULL;
+	g_scheduled = 0;
+}
+
+int prefetch_schedule(int x, int y, int zoom) {
+	pthread_mutex_lock(&g_lock);
+	while (g_scheduled >= g_window && !g_stopping)
+		pthread_cond_wait(&g_window_cond, &g_lock);
+
+	struct prefetch_entry** found = find_entry(x, y, zoom);
+	if (*found != NULL) {
+		/* consumer is ahead of us, it has read the tile itself */
+		struct prefetch_entry* entry = *found;
+		*found = entry->next;
+		free(entry);
+	} else if (!g_stopping) {
+		struct prefetch_entry* entry = add_entry(x, y, zoom, ENTRY_QUEUED);
+
+		if (g_queue_tail != NULL)
+			g_queue_tail->nextqueued = entry;
+		else
+			g_queue_head = entry;
+		g_queue_tail = entry;
+
+		g_scheduled++;
+		pthread_cond_signal(&g_queued_cond);
+	}
+
+	int ret = !g_stopping;
+	pthread_mutex_unlock(&g_lock);
+
+	return ret;
+}
+
+int prefetch_take(int x, int y, int zoom, prefetch_tile_t* tile) {
+	pthread_mutex_lock(&g_lock);
+
+	struct prefetch_entry** found = find_entry(x, y, zoom);
+	if (*found == NULL) {
+		/* walker is behind, tell it to skip this tile */
+		add_entry(x, y, zoom, ENTRY_CLAIMED);
+		g_stats.missed++;
+		pthread_mutex_unlock(&g_lock);
+		return 0;
+	}
+
+	struct prefetch_entry* entry = *found;
+	if (entry->state != ENTRY_DONE) {
+		g_stats.waited++;
+		while (entry->state != ENTRY_DONE)
+			pthread_cond_wait(&g_done_cond, &g_lock);
+		found = find_entry(x, y, zoom);
+	}
+
+	*found = entry->next;
+	g_stats.prefetched++;
+	g_scheduled--;
+	pthread_cond_signal(&g_window_cond);
+
+	pthread_mutex_unlock(&g_lock);
+
+	*tile = entry->tile;
+	free(entry);
+
+	return 1;
+}
+
+void prefetch_release(prefetch_tile_t* tile) {
+	free(tile->data);
+	tile->data = NULL;
+}
+
+void prefetch_getstats(prefetch_stats_t* stats) {
+	pthread_mutex_lock(&g_lock);
+	*stats = g_stats;
+	pthread_mutex_unlock(&g_lock);
+}
+
+#endif
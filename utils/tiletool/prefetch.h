@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2012 Dmitry Marakasov
+ *
+ * This file is part of tiletool.
+ *
+ * tiletool is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * tiletool is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tiletool.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#ifdef HAVE_PTHREAD
+
+#include <stddef.h>
+
+/* Input tiles are read ahead by a pool of I/O threads. Tiles to read
+ * are scheduled by a walker, which runs in its own thread and follows
+ * the same order as the consumer, staying at most `window' tiles
+ * ahead of it. Consumer takes tiles by their coordinates; tiles which
+ * the walker has not reached yet are read by the consumer itself, and
+ * skipped by the walker later */
+
+typedef struct {
+	int error;         /* 0 or errno; ENOENT if no input has the tile */
+	int input;         /* index of input the tile was read from */
+	unsigned char* data;
+	size_t size;
+} prefetch_tile_t;
+
+typedef struct {
+	unsigned long prefetched;  /* tiles taken from read-ahead */
+	unsigned long waited;      /* of these, tiles which were still being read */
+	unsigned long missed;      /* tiles consumer had to read itself */
+} prefetch_stats_t;
+
+/* start I/O threads reading tiles from given inputs, and walker thread */
+int init_prefetch(int window, int nthreads, const char* const* inputs, int ninputs, void (*walk)());
+void cleanup_prefetch();
+
+/* from walker: schedule reading of a tile; blocks while window is full,
+ * returns 0 if read-ahead is being stopped */
+int prefetch_schedule(int x, int y, int zoom);
+
+/* from consumer: get read tile, waiting for I/O if it's in progress;
+ * returns 0 if tile was not scheduled and should be read directly;
+ * data must be freed with prefetch_release() */
+int prefetch_take(int x, int y, int zoom, prefetch_tile_t* tile);
+void prefetch_release(prefetch_tile_t* tile);
+
+void prefetch_getstats(prefetch_stats_t* stats);
+
+#endif
+
+#endif
@@ -0,0 +1,712 @@
+/*
+ * Copyright (C) 2012 Dmitry Marakasov
+ *
+ * This file is part of tiletool.
+ *
+ * tiletool is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * tiletool is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tiletool.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _POSIX_C_SOURCE 200809L /* for readdir() and friends */
+
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#ifdef HAVE_PTHREAD
+#	include <pthread.h>
+#endif
+
+#include "archive.h"
+#include "mbtiles.h"
+#include "metatile.h"
+#include "presence.h"
+
+#define MAX_ZOOM 31
+
+#define INDEX_MAGIC "TTIDX001"
+
+/* zoom/x directory, with sorted y of tiles in it */
+struct column {
+	int x;
+	int64_t mtime;
+	int rescan;
+
+	uint32_t* ys;
+	size_t nys;
+};
+
+struct zoom_index {
+	int valid;                 /* columns reflect tileset */
+	int indexed;               /* zoom is indexed in this run */
+
+	struct column* columns;    /* sorted by x */
+	size_t ncolumns;
+
+	uint64_t* keys;            /* sorted morton codes of all tiles, for lookups */
+	size_t nkeys;
+};
+
+struct input_index {
+	const char* path;
+	int64_t scantime;          /* when index file was built */
+	int dirty;                 /* needs to be saved */
+
+	struct zoom_index zooms[MAX_ZOOM + 1];
+};
+
+static struct input_index* g_inputs = NULL;
+static int g_ninputs = 0;
+static int g_minzoom = 0;
+static int g_maxzoom = -1;
+
+static presence_stats_t g_stats;
+
+/* column which needs to be read */
+struct scan_task {
+	const char* path;
+	int zoom;
+	struct zoom_index* zoom_index;
+	struct column* column;
+	int error;
+};
+
+static struct scan_task* g_tasks = NULL;
+static size_t g_ntasks = 0;
+static size_t g_nexttask = 0;
+
+/* interleave bits of x and y, so tiles of a subtree have adjacent codes */
+static uint64_t spread_bits(uint32_t v) {
+	uint64_t x = v;
+	x = (x | x << 16) & 0x0000FFFF0000FFFFull;
+	x = (x | x << 8) & 0x00FF00FF00FF00FFull;
+	x = (x | x << 4) & 0x0F0F0F0F0F0F0F0Full;
+	x = (x | x << 2) & 0x3333333333333333ull;
+	x = (x | x << 1) & 0x5555555555555555ull;
+	return x;
+}
+
+static uint64_t get_key(int x, int y) {
+	return spread_bits(x) | spread_bits(y) << 1;
+}
+
+/* index of first key not less than given */
+static size_t lower_bound(const uint64_t* keys, size_t nkeys, uint64_t key) {
+	size_t lo = 0, hi = nkeys;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (keys[mid] < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static int compare_keys(const void* a, const void* b) {
+	uint64_t ka = *(const uint64_t*)a, kb = *(const uint64_t*)b;
+	return ka < kb ? -1 : ka > kb;
+}
+
+static int compare_ys(const void* a, const void* b) {
+	uint32_t ya = *(const uint32_t*)a, yb = *(const uint32_t*)b;
+	return ya < yb ? -1 : ya > yb;
+}
+
+static int compare_columns(const void* a, const void* b) {
+	return ((const struct column*)a)->x - ((const struct column*)b)->x;
+}
+
+/* parse non-negative number followed by exact suffix */
+static int parse_name(const char* name, const char* suffix, int* output) {
+	long value = 0;
+	const char* c = name;
+	for (; *c >= '0' && *c <= '9'; c++)
+		if ((value = value * 10 + (*c - '0')) > INT32_MAX)
+			return 0;
+
+	if (c == name || strcmp(c, suffix) != 0)
+		return 0;
+
+	*output = value;
+	return 1;
+}
+
+static void free_zoom(struct zoom_index* zoom) {
+	for (size_t i = 0; i < zoom->ncolumns; i++)
+		free(zoom->columns[i].ys);
+	free(zoom->columns);
+	free(zoom->keys);
+	memset(zoom, 0, sizeof(struct zoom_index));
+}
+
+static int read_value(FILE* f, void* value, size_t size) {
+	return fread(value, size, 1, f) == 1;
+}
+
+/* load index saved by previous run; any inconsistency makes whole
+ * file ignored */
+static void load_index(struct input_index* input) {
+	char path[FILENAME_MAX];
+	if (snprintf(path, sizeof(path), "%s/%s", input->path, PRESENCE_INDEX_FILE) >= (int)sizeof(path))
+		return;
+
+	FILE* f = fopen(path, "rb");
+	if (f == NULL)
+		return;
+
+	char magic[sizeof(INDEX_MAGIC) - 1];
+	if (!read_value(f, magic, sizeof(magic)) || memcmp(magic, INDEX_MAGIC, sizeof(magic)) != 0)
+		goto bad;
+
+	if (!read_value(f, &input->scantime, sizeof(input->scantime)))
+		goto bad;
+
+	int32_t zoom;
+	while (read_value(f, &zoom, sizeof(zoom)) && zoom != -1) {
+		if (zoom < 0 || zoom > MAX_ZOOM || input->zooms[zoom].valid)
+			goto bad;
+
+		struct zoom_index* zoom_index = &input->zooms[zoom];
+
+		uint32_t ncolumns;
+		if (!read_value(f, &ncolumns, sizeof(ncolumns)) || ncolumns > (1u << zoom))
+			goto bad;
+
+		if ((zoom_index->columns = calloc(ncolumns > 0 ? ncolumns : 1, sizeof(struct column))) == NULL)
+			goto bad;
+		zoom_index->valid = 1;
+
+		for (; zoom_index->ncolumns < ncolumns; zoom_index->ncolumns++) {
+			struct column* column = &zoom_index->columns[zoom_index->ncolumns];
+
+			int32_t x;
+			uint32_t nys;
+			if (!read_value(f, &x, sizeof(x)) || !read_value(f, &column->mtime, sizeof(column->mtime)) || !read_value(f, &nys, sizeof(nys)))
+				goto bad;
+			if (nys > (1u << zoom))
+				goto bad;
+
+			column->x = x;
+			column->nys = nys;
+			if ((column->ys = malloc((nys > 0 ? nys : 1) * sizeof(uint32_t))) == NULL)
+				goto bad;
+			if (nys > 0 && fread(column->ys, sizeof(uint32_t), nys, f) != nys)
+				goto bad;
+		}
+	}
+
+	if (zoom != -1)
+		goto bad;
+
+	fclose(f);
+	return;
+
+bad:
+	fclose(f);
+	for (int i = 0; i <= MAX_ZOOM; i++)
+		free_zoom(&input->zooms[i]);
+	input->scantime = 0;
+}
+
+/* list columns of a zoom, reusing ones which were not modified since
+ * they were indexed, and adding others to scan tasks */
+static int list_columns(struct input_index* input, int zoom) {
+	struct zoom_index* zoom_index = &input->zooms[zoom];
+	struct column* old = zoom_index->columns;
+	size_t nold = zoom_index->ncolumns;
+	size_t nreused = 0;
+
+	zoom_index->columns = NULL;
+	zoom_index->ncolumns = 0;
+	free(zoom_index->keys);
+	zoom_index->keys = NULL;
+	zoom_index->nkeys = 0;
+
+	char path[FILENAME_MAX];
+	if (snprintf(path, sizeof(path), "%s/%d", input->path, zoom) >= (int)sizeof(path))
+		return ENAMETOOLONG;
+
+	int ret = 0;
+	size_t capacity = 0;
+
+	DIR* dir = opendir(path);
+	if (dir == NULL && errno != ENOENT) {
+		ret = errno;
+		goto out;
+	}
+
+	struct dirent* entry;
+	while (dir != NULL && (entry = readdir(dir)) != NULL) {
+		int x;
+		if (!parse_name(entry->d_name, "", &x))
+			continue;
+
+		char colpath[FILENAME_MAX];
+		struct stat st;
+		if (snprintf(colpath, sizeof(colpath), "%s/%s", path, entry->d_name) >= (int)sizeof(colpath)) {
+			ret = ENAMETOOLONG;
+			break;
+		}
+		if (stat(colpath, &st) != 0) {
+			ret = errno;
+			break;
+		}
+		if (!S_ISDIR(st.st_mode))
+			continue;
+
+		if (zoom_index->ncolumns == capacity) {
+			capacity = capacity ? capacity * 2 : 64;
+			struct column* columns = realloc(zoom_index->columns, capacity * sizeof(struct column));
+			if (columns == NULL) {
+				ret = errno;
+				break;
+			}
+			zoom_index->columns = columns;
+		}
+
+		struct column* column = &zoom_index->columns[zoom_index->ncolumns++];
+		column->x = x;
+		column->mtime = st.st_mtime;
+		column->ys = NULL;
+		column->nys = 0;
+		column->rescan = 1;
+
+		/* column modified in the same second index was built in may
+		 * have changed after it was read */
+		struct column key = { x, 0, 0, NULL, 0 };
+		struct column* found = nold > 0 ? bsearch(&key, old, nold, sizeof(struct column), compare_columns) : NULL;
+		if (found != NULL && found->mtime == column->mtime && column->mtime < input->scantime) {
+			column->ys = found->ys;
+			column->nys = found->nys;
+			column->rescan = 0;
+			found->ys = NULL;
+			nreused++;
+		}
+	}
+
+	if (dir != NULL)
+		closedir(dir);
+
+	if (ret == 0 && zoom_index->ncolumns > 0)
+		qsort(zoom_index->columns, zoom_index->ncolumns, sizeof(struct column), compare_columns);
+
+out:
+	/* removed or changed columns */
+	if (nreused != nold || nreused != zoom_index->ncolumns)
+		input->dirty = 1;
+
+	for (size_t i = 0; i < nold; i++)
+		free(old[i].ys);
+	free(old);
+
+	return ret;
+}
+
+static int scan_column(struct scan_task* task) {
+	char path[FILENAME_MAX];
+	if (snprintf(path, sizeof(path), "%s/%d/%d", task->path, task->zoom, task->column->x) >= (int)sizeof(path))
+		return ENAMETOOLONG;
+
+	DIR* dir = opendir(path);
+	if (dir == NULL)
+		return errno;
+
+	struct column* column = task->column;
+	size_t capacity = 0;
+	int ret = 0;
+
+	struct dirent* entry;
+	while ((entry = readdir(dir)) != NULL) {
+		int y;
+		if (!parse_name(entry->d_name, ".png", &y))
+			continue;
+
+		if (column->nys == capacity) {
+			capacity = capacity ? capacity * 2 : 64;
+			uint32_t* ys = realloc(column->ys, capacity * sizeof(uint32_t));
+			if (ys == NULL) {
+				ret = errno;
+				break;
+			}
+			column->ys = ys;
+		}
+
+		column->ys[column->nys++] = y;
+	}
+
+	closedir(dir);
+
+	if (column->nys > 0)
+		qsort(column->ys, column->nys, sizeof(uint32_t), compare_ys);
+
+	return ret;
+}
+
+static void* scan_main(void* arg) {
+	(void)arg; /* unused */
+
+	for (;;) {
+#ifdef HAVE_PTHREAD
+		size_t i = __atomic_fetch_add(&g_nexttask, 1, __ATOMIC_RELAXED);
+#else
+		size_t i = g_nexttask++;
+#endif
+		if (i >= g_ntasks)
+			break;
+
+		g_tasks[i].error = scan_column(&g_tasks[i]);
+	}
+
+	return NULL;
+}
+
+/* read columns in parallel; calling thread takes part as well */
+static void run_tasks(int nthreads) {
+	g_nexttask = 0;
+
+#ifdef HAVE_PTHREAD
+	pthread_t threads[nthreads > 1 ? nthreads - 1 : 1];
+	int nstarted = 0;
+	for (; nstarted < nthreads - 1 && (size_t)nstarted + 1 < g_ntasks; nstarted++)
+		if (pthread_create(&threads[nstarted], NULL, scan_main, NULL) != 0)
+			break;
+#else
+	(void)nthreads; /* unused */
+#endif
+
+	scan_main(NULL);
+
+#ifdef HAVE_PTHREAD
+	for (int i = 0; i < nstarted; i++)
+		pthread_join(threads[i], NULL);
+#endif
+}
+
+static int add_tasks(struct input_index* input, int zoom) {
+	struct zoom_index* zoom_index = &input->zooms[zoom];
+	for (size_t i = 0; i < zoom_index->ncolumns; i++) {
+		if (!zoom_index->columns[i].rescan)
+			continue;
+
+		struct scan_task* tasks = realloc(g_tasks, (g_ntasks + 1) * sizeof(struct scan_task));
+		if (tasks == NULL)
+			return errno;
+		g_tasks = tasks;
+
+		struct scan_task* task = &g_tasks[g_ntasks++];
+		task->path = input->path;
+		task->zoom = zoom;
+		task->zoom_index = zoom_index;
+		task->column = &zoom_index->columns[i];
+		task->error = 0;
+	}
+
+	return 0;
+}
+
+static int build_keys(struct zoom_index* zoom_index) {
+	size_t nkeys = 0;
+	for (size_t i = 0; i < zoom_index->ncolumns; i++)
+		nkeys += zoom_index->columns[i].nys;
+
+	if ((zoom_index->keys = malloc((nkeys > 0 ? nkeys : 1) * sizeof(uint64_t))) == NULL)
+		return errno;
+
+	for (size_t i = 0; i < zoom_index->ncolumns; i++)
+		for (size_t j = 0; j < zoom_index->columns[i].nys; j++)
+			zoom_index->keys[zoom_index->nkeys++] = get_key(zoom_index->columns[i].x, zoom_index->columns[i].ys[j]);
+
+	qsort(zoom_index->keys, zoom_index->nkeys, sizeof(uint64_t), compare_keys);
+
+	return 0;
+}
+
+/* lists tiles of a zoom in a tileset which is not a directory tree */
+typedef int (*list_func_t)(const char* tileset, int zoom, void (*callback)(int x, int y, void* arg), void* arg);
+
+struct list_context {
+	struct zoom_index* zoom_index;
+	size_t capacity;
+	int error;
+};
+
+static void add_key(int x, int y, void* arg) {
+	struct list_context* ctx = arg;
+	struct zoom_index* zoom_index = ctx->zoom_index;
+
+	if (ctx->error != 0)
+		return;
+
+	if (zoom_index->nkeys == ctx->capacity) {
+		size_t capacity = ctx->capacity ? ctx->capacity * 2 : 64;
+		uint64_t* keys = realloc(zoom_index->keys, capacity * sizeof(uint64_t));
+		if (keys == NULL) {
+			ctx->error = errno;
+			return;
+		}
+		zoom_index->keys = keys;
+		ctx->capacity = capacity;
+	}
+
+	zoom_index->keys[zoom_index->nkeys++] = get_key(x, y);
+}
+
+/* databases, archives and metatile trees have their own index, which is listed
+ * once per zoom; it's not saved */
+static int list_packed(struct input_index* input, int zoom, list_func_t list) {
+	struct zoom_index* zoom_index = &input->zooms[zoom];
+	struct list_context ctx = { zoom_index, 0, 0 };
+
+	int ret = list(input->path, zoom, add_key, &ctx);
+	if (ret == 0)
+		ret = ctx.error;
+
+	if (ret == 0 && zoom_index->keys == NULL && (zoom_index->keys = malloc(sizeof(uint64_t))) == NULL)
+		ret = errno;
+
+	if (ret != 0) {
+		free_zoom(zoom_index);
+		return ret;
+	}
+
+	qsort(zoom_index->keys, zoom_index->nkeys, sizeof(uint64_t), compare_keys);
+	zoom_index->indexed = 1;
+
+	return 0;
+}
+
+int init_presence(const char* const* inputs, int ninputs, int minzoom, int maxzoom, int nthreads) {
+	int ret = 0;
+
+	cleanup_presence();
+
+	if (minzoom < 0 || maxzoom > MAX_ZOOM)
+		return EINVAL;
+
+	if ((g_inputs = calloc(ninputs, sizeof(struct input_index))) == NULL)
+		return errno;
+
+	g_ninputs = ninputs;
+	g_minzoom = minzoom;
+	g_maxzoom = maxzoom;
+	memset(&g_stats, 0, sizeof(g_stats));
+
+	int64_t scantime = time(NULL);
+
+	for (int i = 0; i < ninputs; i++) {
+		struct input_index* input = &g_inputs[i];
+		input->path = inputs[i];
+
+		list_func_t list = NULL;
+		if (IS_ARCHIVE(input->path))
+			list = archive_list;
+		if (IS_METATILE(input->path))
+			list = metatile_list;
+#ifdef HAVE_SQLITE3
+		if (IS_MBTILES(input->path))
+			list = mbtiles_list;
+#endif
+
+		if (list != NULL) {
+			for (int zoom = minzoom; zoom <= maxzoom; zoom++)
+				if ((ret = list_packed(input, zoom, list)) != 0)
+					warnx("Cannot index %s/%d: %s", input->path, zoom, ttip_strerror(ret));
+			ret = 0;
+			continue;
+		}
+
+		load_index(input);
+		if (input->scantime == 0)
+			input->dirty = 1;
+
+		for (int zoom = minzoom; zoom <= maxzoom; zoom++) {
+			struct zoom_index* zoom_index = &input->zooms[zoom];
+
+			if ((ret = list_columns(input, zoom)) != 0) {
+				/* fall back to probing files of this zoom */
+				warnx("Cannot index %s/%d: %s", input->path, zoom, strerror(ret));
+				free_zoom(zoom_index);
+				continue;
+			}
+
+			zoom_index->valid = 1;
+			zoom_index->indexed = 1;
+
+			if ((ret = add_tasks(input, zoom)) != 0)
+				goto out;
+		}
+
+		input->scantime = scantime;
+	}
+
+	run_tasks(nthreads);
+
+	for (size_t i = 0; i < g_ntasks; i++) {
+		if (g_tasks[i].error != 0 && g_tasks[i].zoom_index->valid) {
+			warnx("Cannot index %s/%d/%d: %s", g_tasks[i].path, g_tasks[i].zoom, g_tasks[i].column->x, strerror(g_tasks[i].error));
+			g_tasks[i].zoom_index->valid = g_tasks[i].zoom_index->indexed = 0;
+		}
+	}
+
+	g_stats.rescanned = g_ntasks;
+
+	for (int i = 0; i < ninputs; i++) {
+		for (int zoom = minzoom; zoom <= maxzoom; zoom++) {
+			struct zoom_index* zoom_index = &g_inputs[i].zooms[zoom];
+			if (!zoom_index->indexed) {
+				free_zoom(zoom_index);
+				continue;
+			}
+
+			if (zoom_index->keys == NULL && (ret = build_keys(zoom_index)) != 0)
+				goto out;
+
+			g_stats.columns += zoom_index->ncolumns;
+			g_stats.tiles += zoom_index->nkeys;
+		}
+	}
+
+out:
+	free(g_tasks);
+	g_tasks = NULL;
+	g_ntasks = 0;
+
+	if (ret != 0)
+		cleanup_presence();
+
+	return ret;
+}
+
+void cleanup_presence() {
+	for (int i = 0; i < g_ninputs; i++)
+		for (int zoom = 0; zoom <= MAX_ZOOM; zoom++)
+			free_zoom(&g_inputs[i].zooms[zoom]);
+
+	free(g_inputs);
+	g_inputs = NULL;
+	g_ninputs = 0;
+}
+
+static int write_value(FILE* f, const void* value, size_t size) {
+	return fwrite(value, size, 1, f) == 1;
+}
+
+static int save_index(struct input_index* input) {
+	char path[FILENAME_MAX], tmppath[FILENAME_MAX];
+	if (snprintf(path, sizeof(path), "%s/%s", input->path, PRESENCE_INDEX_FILE) >= (int)sizeof(path))
+		return ENAMETOOLONG;
+	if (snprintf(tmppath, sizeof(tmppath), "%s.tmp", path) >= (int)sizeof(tmppath))
+		return ENAMETOOLONG;
+
+	/* nothing to keep index in for missing tileset */
+	FILE* f = fopen(tmppath, "wb");
+	if (f == NULL)
+		return errno == ENOENT ? 0 : errno;
+
+	int ok = write_value(f, INDEX_MAGIC, sizeof(INDEX_MAGIC) - 1) && write_value(f, &input->scantime, sizeof(input->scantime));
+
+	/* zooms not indexed in this run are kept as loaded */
+	for (int32_t zoom = 0; zoom <= MAX_ZOOM && ok; zoom++) {
+		struct zoom_index* zoom_index = &input->zooms[zoom];
+		if (!zoom_index->valid)
+			continue;
+
+		uint32_t ncolumns = zoom_index->ncolumns;
+		ok = write_value(f, &zoom, sizeof(zoom)) && write_value(f, &ncolumns, sizeof(ncolumns));
+
+		for (size_t i = 0; i < zoom_index->ncolumns && ok; i++) {
+			struct column* column = &zoom_index->columns[i];
+			int32_t x = column->x;
+			uint32_t nys = column->nys;
+			ok = write_value(f, &x, sizeof(x)) && write_value(f, &column->mtime, sizeof(column->mtime)) && write_value(f, &nys, sizeof(nys));
+			if (ok && nys > 0)
+				ok = fwrite(column->ys, sizeof(uint32_t), nys, f) == nys;
+		}
+	}
+
+	int32_t end = -1;
+	ok = ok && write_value(f, &end, sizeof(end));
+
+	int ret = ok ? 0 : errno;
+	if (fclose(f) != 0 && ret == 0)
+		ret = errno;
+
+	if (ret == 0 && rename(tmppath, path) != 0)
+		ret = errno;
+
+	if (ret != 0)
+		remove(tmppath);
+
+	return ret;
+}
+
+int save_presence() {
+	int ret = 0;
+	for (int i = 0; i < g_ninputs; i++) {
+		if (!g_inputs[i].dirty)
+			continue;
+
+		int err = save_index(&g_inputs[i]);
+		if (err == 0)
+			g_inputs[i].dirty = 0;
+		else if (ret == 0)
+			ret = err;
+	}
+
+	return ret;
+}
+
+int presence_has_tile(int input, int x, int y, int zoom) {
+	if (g_inputs == NULL || zoom < g_minzoom || zoom > g_maxzoom || !g_inputs[input].zooms[zoom].indexed)
+		return 1;
+
+	struct zoom_index* zoom_index = &g_inputs[input].zooms[zoom];
+	uint64_t key = get_key(x, y);
+	size_t pos = lower_bound(zoom_index->keys, zoom_index->nkeys, key);
+
+	return pos < zoom_index->nkeys && zoom_index->keys[pos] == key;
+}
+
+int presence_has_childs(int x, int y, int zoom) {
+	if (g_inputs == NULL)
+		return 1;
+
+	for (int childzoom = zoom + 1 > g_minzoom ? zoom + 1 : g_minzoom; childzoom <= g_maxzoom; childzoom++) {
+		int shift = (childzoom - zoom) * 2;
+		uint64_t first = get_key(x, y) << shift;
+		uint64_t last = ((get_key(x, y) + 1) << shift) - 1;
+
+		for (int i = 0; i < g_ninputs; i++) {
+			struct zoom_index* zoom_index = &g_inputs[i].zooms[childzoom];
+			if (!zoom_index->indexed)
+				return 1;
+
+			size_t pos = lower_bound(zoom_index->keys, zoom_index->nkeys, first);
+			if (pos < zoom_index->nkeys && zoom_index->keys[pos] <= last)
+				return 1;
+		}
+	}
+
+	return 0;
+}
+
+void presence_getstats(presence_stats_t* stats) {
+	*stats = g_stats;
+}
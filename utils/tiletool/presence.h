@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2012 Dmitry Marakasov
+ *
+ * This file is part of tiletool.
+ *
+ * tiletool is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * tiletool is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tiletool.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PRESENCE_H
+#define PRESENCE_H
+
+/* Index of tiles present in input tilesets, so missing tiles are
+ * not probed on filesystem, and subtrees which have no input tiles
+ * are not traversed. It is built by scanning tileset directories,
+ * and saved into a file in the tileset, so next runs only rescan
+ * columns (zoom/x directories) which were modified since */
+
+#define PRESENCE_INDEX_FILE ".tiletool-index"
+
+typedef struct {
+	unsigned long columns;     /* zoom/x directories */
+	unsigned long rescanned;   /* of these, read as they were not indexed or changed */
+	unsigned long tiles;
+} presence_stats_t;
+
+/* index given zoom range of inputs, using nthreads threads to scan
+ * directories; returns 0 or errno */
+int init_presence(const char* const* inputs, int ninputs, int minzoom, int maxzoom, int nthreads);
+void cleanup_presence();
+
+/* write index files of inputs which were rescanned; returns 0 or
+ * errno of the first failure */
+int save_presence();
+
+/* whether input has the tile; tiles of zooms not indexed are assumed present */
+int presence_has_tile(int input, int x, int y, int zoom);
+
+/* whether any input has any tile of zoom greater than given under the tile */
+int presence_has_childs(int x, int y, int zoom);
+
+void presence_getstats(presence_stats_t* stats);
+
+#endif
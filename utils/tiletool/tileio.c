@@ -0,0 +1,466 @@
+/*
+ * Copyright (C) 2012 Dmitry Marakasov
+ *
+ * This file is part of tiletool.
+ *
+ * tiletool is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * tiletool is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tiletool.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_OPENAT
+#	define _POSIX_C_SOURCE 200809L /* for openat() */
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef HAVE_PTHREAD
+#	include <pthread.h>
+#endif
+
+#include "archive.h"
+#include "copyfile.h"
+#include "mbtiles.h"
+#include "metatile.h"
+#include "paths.h"
+#include "tileio.h"
+
+#ifndef O_BINARY
+#	define O_BINARY 0
+#endif
+
+static tileio_stats_t g_stats;
+
+/* cache is shared by all threads */
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+#	define LOCK() pthread_mutex_lock(&g_lock)
+#	define UNLOCK() pthread_mutex_unlock(&g_lock)
+#else
+#	define LOCK()
+#	define UNLOCK()
+#endif
+
+/* read whole file into buffer */
+static int read_fd(int fd, ttip_buffer_t* buffer) {
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+		return errno;
+
+	size_t size = st.st_size;
+	if (size > buffer->capacity) {
+		unsigned char* data = realloc(buffer->data, size);
+		if (data == NULL)
+			return errno;
+		buffer->data = data;
+		buffer->capacity = size;
+	}
+
+	buffer->size = 0;
+	while (buffer->size < size) {
+		ssize_t nread = read(fd, buffer->data + buffer->size, size - buffer->size);
+		if (nread == -1 && errno == EINTR)
+			continue;
+		if (nread == -1)
+			return errno;
+		if (nread == 0)
+			return EIO; /* file was truncated */
+		buffer->size += nread;
+	}
+
+	return 0;
+}
+
+#ifdef HAVE_OPENAT
+static void get_tile_name(char* buffer, int y) {
+	sprintf(buffer, "%d.png", y);
+}
+
+/* cached zoom/x directory of a tileset */
+struct dir_entry {
+	const char* tileset;
+	int zoom, x;
+	int fd;                    /* -1 if directory does not exist */
+	int refs;                  /* users of fd, entry is not evicted while it's used */
+
+	struct dir_entry* next;    /* in hash chain */
+	struct dir_entry* newer;   /* in LRU order */
+	struct dir_entry* older;
+};
+
+static struct dir_entry** g_buckets = NULL;
+static size_t g_nbuckets = 0;
+static int g_nentries = 0;
+static int g_maxentries = 0;
+
+static struct dir_entry* g_oldest = NULL;
+static struct dir_entry* g_newest = NULL;
+
+static size_t get_bucket(const char* tileset, int zoom, int x) {
+	size_t hash = 5381;
+	for (const char* c = tileset; *c != '\0'; c++)
+		hash = hash * 33 + (unsigned char)*c;
+	return (hash ^ (size_t)zoom * 83492791u ^ (size_t)x * 73856093u) & (g_nbuckets - 1);
+}
+
+static void lru_unlink(struct dir_entry* entry) {
+	if (entry->older != NULL)
+		entry->older->newer = entry->newer;
+	else
+		g_oldest = entry->newer;
+
+	if (entry->newer != NULL)
+		entry->newer->older = entry->older;
+	else
+		g_newest = entry->older;
+}
+
+static void lru_push(struct dir_entry* entry) {
+	entry->newer = NULL;
+	entry->older = g_newest;
+	if (g_newest != NULL)
+		g_newest->newer = entry;
+	else
+		g_oldest = entry;
+	g_newest = entry;
+}
+
+static void free_entry(struct dir_entry* entry) {
+	struct dir_entry** prev;
+	for (prev = &g_buckets[get_bucket(entry->tileset, entry->zoom, entry->x)]; *prev != entry; prev = &(*prev)->next) {
+		/* empty */
+	}
+	*prev = entry->next;
+
+	lru_unlink(entry);
+
+	if (entry->fd != -1)
+		close(entry->fd);
+	free(entry);
+
+	g_nentries--;
+}
+
+static void evict_unused() {
+	struct dir_entry* entry = g_oldest;
+	while (g_nentries > g_maxentries && entry != NULL) {
+		struct dir_entry* newer = entry->newer;
+		if (entry->refs == 0)
+			free_entry(entry);
+		entry = newer;
+	}
+}
+
+/* open or create zoom/x directory */
+static int open_dir(const char* tileset, int zoom, int x, int create, int* fd) {
+	char path[FILENAME_MAX];
+	if (snprintf(path, sizeof(path), "%s/%d/%d/", tileset, zoom, x) >= (int)sizeof(path))
+		return ENAMETOOLONG;
+
+	path[strlen(path) - 1] = '\0';
+	if ((*fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) != -1)
+		return 0;
+
+	if (errno != ENOENT || !create)
+		return errno;
+
+	/* path with trailing slash makes create_directories() create x itself */
+	path[strlen(path)] = '/';
+	if (create_directories(path) != 0)
+		return errno;
+
+	g_stats.created++;
+
+	path[strlen(path) - 1] = '\0';
+	if ((*fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+		return errno;
+
+	return 0;
+}
+
+/* get directory entry with reference held; ENOENT if directory does
+ * not exist and create is not requested */
+static int acquire_dir(const char* tileset, int zoom, int x, int create, struct dir_entry** output) {
+	int ret = 0;
+
+	LOCK();
+
+	struct dir_entry* entry;
+	for (entry = g_buckets[get_bucket(tileset, zoom, x)]; entry != NULL; entry = entry->next)
+		if (entry->zoom == zoom && entry->x == x && (entry->tileset == tileset || strcmp(entry->tileset, tileset) == 0))
+			break;
+
+	if (entry != NULL) {
+		g_stats.hits++;
+
+		/* missing directory is created when it's written to */
+		if (entry->fd == -1 && create)
+			ret = open_dir(tileset, zoom, x, 1, &entry->fd);
+
+		lru_unlink(entry);
+		lru_push(entry);
+	} else {
+		g_stats.misses++;
+
+		int fd;
+		if ((ret = open_dir(tileset, zoom, x, create, &fd)) == 0 || ret == ENOENT) {
+			if ((entry = malloc(sizeof(struct dir_entry))) == NULL) {
+				ret = errno;
+				if (fd != -1)
+					close(fd);
+				UNLOCK();
+				return ret;
+			}
+
+			entry->tileset = tileset;
+			entry->zoom = zoom;
+			entry->x = x;
+			entry->fd = ret == 0 ? fd : -1;
+			entry->refs = 0;
+
+			size_t bucket = get_bucket(tileset, zoom, x);
+			entry->next = g_buckets[bucket];
+			g_buckets[bucket] = entry;
+
+			lru_push(entry);
+
+			g_nentries++;
+		}
+	}
+
+	if (ret == 0 && entry->fd == -1)
+		ret = ENOENT;
+
+	if (ret == 0) {
+		entry->refs++;
+		*output = entry;
+	}
+
+	/* after the reference is taken, so the entry itself survives */
+	evict_unused();
+
+	UNLOCK();
+
+	return ret;
+}
+
+static void release_dir(struct dir_entry* entry) {
+	LOCK();
+	entry->refs--;
+	evict_unused();
+	UNLOCK();
+}
+
+int init_tileio(int maxdirs) {
+	cleanup_tileio();
+
+	for (g_nbuckets = 64; g_nbuckets < (size_t)maxdirs * 2; g_nbuckets *= 2) {
+		/* empty */
+	}
+
+	if ((g_buckets = calloc(g_nbuckets, sizeof(struct dir_entry*))) == NULL) {
+		g_nbuckets = 0;
+		return errno;
+	}
+
+	g_maxentries = maxdirs;
+	memset(&g_stats, 0, sizeof(g_stats));
+
+	return 0;
+}
+
+void cleanup_tileio() {
+	while (g_oldest != NULL)
+		free_entry(g_oldest);
+
+	free(g_buckets);
+	g_buckets = NULL;
+	g_nbuckets = 0;
+}
+
+static int file_access(const char* tileset, int x, int y, int zoom) {
+	struct dir_entry* dir;
+	int ret;
+	if ((ret = acquire_dir(tileset, zoom, x, 0, &dir)) != 0)
+		return ret;
+
+	char name[16];
+	get_tile_name(name, y);
+
+	ret = faccessat(dir->fd, name, F_OK, 0) == 0 ? 0 : errno;
+
+	release_dir(dir);
+
+	return ret;
+}
+
+static int file_read(const char* tileset, int x, int y, int zoom, ttip_buffer_t* buffer) {
+	struct dir_entry* dir;
+	int ret;
+	if ((ret = acquire_dir(tileset, zoom, x, 0, &dir)) != 0)
+		return ret;
+
+	char name[16];
+	get_tile_name(name, y);
+
+	int fd = openat(dir->fd, name, O_RDONLY | O_CLOEXEC);
+	release_dir(dir);
+
+	if (fd == -1)
+		return errno;
+
+	ret = read_fd(fd, buffer);
+	close(fd);
+
+	return ret;
+}
+
+static int file_write(const char* tileset, int x, int y, int zoom, const unsigned char* data, size_t size) {
+	struct dir_entry* dir;
+	int ret;
+	if ((ret = acquire_dir(tileset, zoom, x, 1, &dir)) != 0)
+		return ret;
+
+	char name[16];
+	get_tile_name(name, y);
+
+	ret = write_file_at(dir->fd, name, data, size);
+
+	release_dir(dir);
+
+	return ret;
+}
+
+static int file_mkdir(const char* tileset, int x, int zoom) {
+	struct dir_entry* dir;
+	int ret;
+	if ((ret = acquire_dir(tileset, zoom, x, 1, &dir)) != 0)
+		return ret;
+
+	release_dir(dir);
+
+	return 0;
+}
+#else
+int init_tileio(int maxdirs) {
+	(void)maxdirs; /* unused */
+
+	memset(&g_stats, 0, sizeof(g_stats));
+
+	return 0;
+}
+
+void cleanup_tileio() {
+}
+
+static int file_access(const char* tileset, int x, int y, int zoom) {
+	char path[FILENAME_MAX];
+	if (get_tile_path_r(path, sizeof(path), tileset, x, y, zoom, ".png") == NULL)
+		return ENAMETOOLONG;
+
+	return access(path, F_OK) == 0 ? 0 : errno;
+}
+
+static int file_read(const char* tileset, int x, int y, int zoom, ttip_buffer_t* buffer) {
+	char path[FILENAME_MAX];
+	if (get_tile_path_r(path, sizeof(path), tileset, x, y, zoom, ".png") == NULL)
+		return ENAMETOOLONG;
+
+	int fd = open(path, O_RDONLY | O_BINARY);
+	if (fd == -1)
+		return errno;
+
+	int ret = read_fd(fd, buffer);
+	close(fd);
+
+	return ret;
+}
+
+static int file_write(const char* tileset, int x, int y, int zoom, const unsigned char* data, size_t size) {
+	char path[FILENAME_MAX];
+	if (get_tile_path_r(path, sizeof(path), tileset, x, y, zoom, ".png") == NULL)
+		return ENAMETOOLONG;
+
+	if (create_directories(path) != 0)
+		return errno;
+
+	return write_file(path, data, size);
+}
+
+static int file_mkdir(const char* tileset, int x, int zoom) {
+	char path[FILENAME_MAX];
+	if (get_tile_path_r(path, sizeof(path), tileset, x, 0, zoom, ".png") == NULL)
+		return ENAMETOOLONG;
+
+	return create_directories(path) == 0 ? 0 : errno;
+}
+#endif
+
+int tileio_access(const char* tileset, int x, int y, int zoom) {
+	if (IS_ARCHIVE(tileset))
+		return archive_access(tileset, x, y, zoom);
+	if (IS_METATILE(tileset))
+		return metatile_access(tileset, x, y, zoom);
+#ifdef HAVE_SQLITE3
+	if (IS_MBTILES(tileset))
+		return mbtiles_access(tileset, x, y, zoom);
+#endif
+	return file_access(tileset, x, y, zoom);
+}
+
+int tileio_read(const char* tileset, int x, int y, int zoom, ttip_buffer_t* buffer) {
+	if (IS_ARCHIVE(tileset))
+		return archive_read(tileset, x, y, zoom, buffer);
+	if (IS_METATILE(tileset))
+		return metatile_read(tileset, x, y, zoom, buffer);
+#ifdef HAVE_SQLITE3
+	if (IS_MBTILES(tileset))
+		return mbtiles_read(tileset, x, y, zoom, buffer);
+#endif
+	return file_read(tileset, x, y, zoom, buffer);
+}
+
+int tileio_write(const char* tileset, int x, int y, int zoom, const unsigned char* data, size_t size) {
+	if (IS_ARCHIVE(tileset))
+		return archive_write(tileset, x, y, zoom, data, size);
+	if (IS_METATILE(tileset))
+		return metatile_write(tileset, x, y, zoom, data, size);
+#ifdef HAVE_SQLITE3
+	if (IS_MBTILES(tileset))
+		return mbtiles_write(tileset, x, y, zoom, data, size);
+#endif
+	return file_write(tileset, x, y, zoom, data, size);
+}
+
+int tileio_mkdir(const char* tileset, int x, int zoom) {
+	if (IS_ARCHIVE(tileset))
+		return 0;
+	if (IS_METATILE(tileset))
+		return 0; /* directories are created with metatiles */
+#ifdef HAVE_SQLITE3
+	if (IS_MBTILES(tileset))
+		return 0; /* no directories in database */
+#endif
+	return file_mkdir(tileset, x, zoom);
+}
+
+void tileio_getstats(tileio_stats_t* stats) {
+	LOCK();
+	*stats = g_stats;
+	UNLOCK();
+}
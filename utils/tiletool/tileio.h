@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2012 Dmitry Marakasov
+ *
+ * This file is part of tiletool.
+ *
+ * tiletool is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * tiletool is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tiletool.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TILEIO_H
+#define TILEIO_H
+
+#include <stddef.h>
+
+#include <ttip.h>
+
+/* Tile files are accessed relative to open descriptors of their
+ * zoom/x directories, which are kept in a cache, so the kernel does
+ * not resolve whole path for each tile, and output directories are
+ * only created once. Missing input directories are remembered as
+ * well. Where openat() is not available, full paths are used.
+ * Tilesets named archive:<path> and mbtiles:<path> are passed to
+ * archive and mbtiles modules */
+
+typedef struct {
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long created;   /* directories created */
+} tileio_stats_t;
+
+/* maxdirs is number of directories to keep open */
+int init_tileio(int maxdirs);
+void cleanup_tileio();
+
+/* all return 0 or errno, which is ENOENT if tile does not exist */
+int tileio_access(const char* tileset, int x, int y, int zoom);
+
+/* read tile file into buffer, reusing its memory */
+int tileio_read(const char* tileset, int x, int y, int zoom, ttip_buffer_t* buffer);
+
+/* replace tile file, creating directories as needed */
+int tileio_write(const char* tileset, int x, int y, int zoom, const unsigned char* data, size_t size);
+
+/* create directories for a tile which is written by other means */
+int tileio_mkdir(const char* tileset, int x, int zoom);
+
+void tileio_getstats(tileio_stats_t* stats);
+
+#endif
@@ -24,18 +24,52 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
 
 #include <ttip.h>
 
+#include "archive.h"
 #include "bounds.h"
+#include "copyfile.h"
+#include "dedup.h"
 #include "parsing.h"
 #include "emptytile.h"
+#include "expire.h"
+#include "mbtiles.h"
+#include "metatile.h"
 #include "process.h"
 #include "paths.h"
+#include "postcmd.h"
+#include "prefetch.h"
+#include "presence.h"
+#include "tileio.h"
+#include "workers.h"
+#include "writeback.h"
 
 #define MAX_INPUTS 128
 #define MAX_OVERLAYS 128
 
+/* memory for encoded tiles kept for deduplication */
+#define DEDUP_MAX_BYTES (64 * 1024 * 1024)
+
+/* threads reading input tiles ahead */
+#define READAHEAD_THREADS 4
+
+/* threads writing encoded tiles */
+#define WRITEBACK_THREADS 2
+
+/* tileset directories kept open */
+#define TILEIO_MAX_DIRS 256
+
+/* threads scanning input directories for index */
+#define PRESENCE_THREADS 4
+
+/* tiles written to MBTiles output in a single transaction */
+#define MBTILES_BATCH 4096
+
+/* input metatiles kept in memory */
+#define METATILE_CACHE 32
+
 /* properties based on options */
 int g_min_input_zoom = -1;
 int g_max_input_zoom = -1;
@@ -43,6 +77,9 @@ int g_min_output_zoom = -1;
 int g_max_output_zoom = -1;
 
 int g_num_jobs = 0;
+int g_readahead = 0;
+int g_writeback = 0;
+int g_index = 0;
 
 Bounds g_input_bounds = BOUNDS_FULL_INITIALIZER;
 Bounds g_output_bounds = BOUNDS_FULL_INITIALIZER;
@@ -54,26 +91,79 @@ const char* g_output = NULL;
 const char* g_overlays[MAX_OVERLAYS];
 unsigned int g_noverlays = 0;
 
+/* with expire list, tiles of unchanged subtrees are taken from cache,
+ * which is either a separate tileset or output itself if its tiles
+ * are the same as ones passed to parent */
+const char* g_expire = NULL;
+const char* g_cache = NULL;
+int g_output_is_cache = 0;
+
 unsigned int g_pngcompression = 2;
+int g_pngadaptive = 0;
+int g_pngindexed = 0;
+int g_pngminpsnr = 0;
+
+dedup_mode_t g_dedup = DEDUP_NONE;
+
+int g_passthrough = 0;
+copyfile_mode_t g_passthrough_mode = COPYFILE_COPY;
 
 const char* g_postcmd = NULL;
+postcmd_mode_t g_postcmd_mode = POSTCMD_EACH;
+int g_postcmd_batch = 1;
+int g_postcmd_jobs = 1;
 
 int g_verbose = 0;
 
+/* pool for all tiles; shared by all threads if there are any */
+ttip_pool_t g_pool = NULL;
+int g_shared_pool = 0;
+
+/* data of a thread which processes tiles, reused for all tiles */
+typedef struct {
+	ttip_png_encoder_t encoder;
+	ttip_png_decoder_t decoder;
+
+	/* lossless encoder for cached tiles, if there's cache */
+	ttip_png_encoder_t cache_encoder;
+
+	/* encoded tile */
+	ttip_buffer_t pngbuffer;
+
+	/* input or overlay tile file being decoded */
+	ttip_buffer_t filebuffer;
+} output_context_t;
+
+/* context of the main thread */
+output_context_t* g_context = NULL;
+
 /* other global data */
 static struct option longopts[] = {
+	{ "adaptive",      no_argument,       NULL, 'a' },
 	{ "intput-bounds", required_argument, NULL, 'b' },
 	{ "output-bounds", required_argument, NULL, 'B' },
 	{ "input-zoom",    required_argument, NULL, 'z' },
 	{ "output-zoom",   required_argument, NULL, 'Z' },
+	{ "dedup",         required_argument, NULL, 'd' },
 	{ "empty-tile",    required_argument, NULL, 'e' },
+	{ "expire",        required_argument, NULL, 'E' },
 	{ "jobs",          required_argument, NULL, 'j' },
 	{ "overlay",       required_argument, NULL, 'l' },
 	{ "postcmd",       required_argument, NULL, 'c' },
+	{ "postcmd-batch", required_argument, NULL, 'C' },
+	{ "postcmd-jobs",  required_argument, NULL, 'J' },
+	{ "postcmd-stdin", no_argument,       NULL, 'S' },
 	{ "input",         required_argument, NULL, 'i' },
+	{ "cache",         required_argument, NULL, 'K' },
 	{ "output",        required_argument, NULL, 'o' },
+	{ "palette",       no_argument,       NULL, 'p' },
+	{ "passthrough",   required_argument, NULL, 't' },
+	{ "quantize",      required_argument, NULL, 'q' },
+	{ "read-ahead",    required_argument, NULL, 'r' },
 	{ "help",          no_argument,       NULL, 'h' },
 	{ "verbose",       no_argument,       NULL, 'v' },
+	{ "write-behind",  required_argument, NULL, 'w' },
+	{ "index",         no_argument,       NULL, 'x' },
 	{ NULL,            0,                 NULL, 0 },
 };
 
@@ -81,66 +171,443 @@ const char* g_progname;
 
 int g_totaltiles = 0;
 int g_errortiles = 0;
+int g_passedtiles = 0;
+int g_reusedtiles = 0;
+int g_redonetiles = 0;
+
+/* counters are updated by all threads */
+#ifdef HAVE_PTHREAD
+#	define INCREMENT(counter) __atomic_fetch_add(&(counter), 1, __ATOMIC_RELAXED)
+#else
+#	define INCREMENT(counter) ((counter)++)
+#endif
 
 /* main code */
-int process_output(int x, int y, int zoom, ttip_image_t tile) {
+
+void* create_output_context() {
+	output_context_t* ctx = malloc(sizeof(output_context_t));
+	if (ctx == NULL)
+		err(1, "Cannot create output context");
+
+	ttip_result_t res;
+	if ((res = ttip_png_encoder_create(&ctx->encoder)) != TTIP_OK || (res = ttip_png_decoder_create(&ctx->decoder)) != TTIP_OK)
+		errx(1, "Cannot create png encoder/decoder: %s", ttip_strerror(res));
+
+	ttip_png_encoder_setlevel(ctx->encoder, g_pngcompression);
+	ttip_png_encoder_settuning(ctx->encoder, g_pngadaptive ? TTIP_PNG_TUNING_ADAPTIVE : TTIP_PNG_TUNING_DEFAULT);
+	ttip_png_encoder_setindexed(ctx->encoder, g_pngindexed);
+	ttip_png_encoder_setquantize(ctx->encoder, g_pngminpsnr);
+
+	ctx->cache_encoder = NULL;
+	if (g_cache != NULL) {
+		if ((res = ttip_png_encoder_create(&ctx->cache_encoder)) != TTIP_OK)
+			errx(1, "Cannot create png encoder: %s", ttip_strerror(res));
+
+		ttip_png_encoder_setlevel(ctx->cache_encoder, g_pngcompression);
+		ttip_png_encoder_settuning(ctx->cache_encoder, g_pngadaptive ? TTIP_PNG_TUNING_ADAPTIVE : TTIP_PNG_TUNING_DEFAULT);
+		ttip_png_encoder_setindexed(ctx->cache_encoder, g_pngindexed);
+	}
+
+	ttip_buffer_init(&ctx->pngbuffer);
+	ttip_buffer_init(&ctx->filebuffer);
+
+	return ctx;
+}
+
+void destroy_output_context(void* context) {
+	output_context_t* ctx = context;
+
+	ttip_buffer_free(&ctx->pngbuffer);
+	ttip_buffer_free(&ctx->filebuffer);
+	ttip_png_encoder_destroy(&ctx->encoder);
+	ttip_png_encoder_destroy(&ctx->cache_encoder);
+	ttip_png_decoder_destroy(&ctx->decoder);
+
+	free(ctx);
+}
+
+#ifdef HAVE_PTHREAD
+/* called by writer thread when queued tile is written */
+void output_written(const char* output_path, ttip_hash_t hash, int error) {
+	if (error != 0) {
+		warnx("Could not save output tile %s: %s", output_path, ttip_strerror(error));
+		INCREMENT(g_errortiles);
+		return;
+	}
+
+	if (g_postcmd)
+		if (!postcmd_add(output_path))
+			INCREMENT(g_errortiles);
+
+	/* duplicates may be linked to the file only after it's processed */
+	if (g_dedup != DEDUP_NONE)
+		dedup_written(hash, output_path);
+}
+#endif
+
+/* save tile, which is either given directly or as four childs to
+ * downsample, with all overlays blended; tile and childs are not
+ * modified and stay owned by the caller */
+int process_output(output_context_t* ctx, int x, int y, int zoom, ttip_image_t tile, ttip_image_t* childs) {
 	/* ensure we have a tile */
-	if (tile == NULL)
-		tile = spawn_empty_tile();
+	if (tile == NULL && childs == NULL)
+		tile = get_empty_tile();
 
 	/* main processing */
 	int had_error = 0;
 	ttip_result_t res;
 
-	/* process overlays */
+	/* load overlays */
+	ttip_image_t overlays[g_noverlays > 0 ? g_noverlays : 1];
+	int noverlays = 0;
 	for (unsigned int i = 0; i < g_noverlays; ++i) {
-		char* overlay_path = get_tile_path(g_overlays[i], x, y, zoom, ".png");
-		ttip_image_t overlay = NULL;
-		if ((res = ttip_loadpng(&overlay, overlay_path)) == TTIP_OK) {
-			ttip_image_t temp;
-			if ((res = ttip_maskblend(&temp, tile, overlay)) == TTIP_OK) {
-				ttip_destroy(&tile);
-				tile = temp;
-			} else {
-				warnx("Could not blend overlay %s: %s", overlay_path, ttip_strerror(res));
-				had_error = 1;
-			}
-			ttip_destroy(&overlay);
-		} else if (res != ENOENT) {
+		if ((res = tileio_read(g_overlays[i], x, y, zoom, &ctx->filebuffer)) == ENOENT)
+			continue; /* overlay tile didn't exist */
+
+		char overlay_path[FILENAME_MAX];
+		if (get_tile_path_r(overlay_path, sizeof(overlay_path), g_overlays[i], x, y, zoom, ".png") == NULL)
+			errx(1, "Path to overlay tile %d/%d/%d is too long", zoom, x, y);
+
+		if (res == 0)
+			res = ttip_png_decode_mem(ctx->decoder, &overlays[noverlays], ctx->filebuffer.data, ctx->filebuffer.size, g_pool);
+
+		if (res == TTIP_OK) {
+			if ((res = ttip_detect_uniform(&overlays[noverlays])) != TTIP_OK)
+				errx(1, "Could not process overlay tile %s: %s", overlay_path, ttip_strerror(res));
+			noverlays++;
+		} else {
 			warnx("Could not open overlay tile %s: %s", overlay_path, ttip_strerror(res));
 			had_error = 1;
 		}
-		/* else -> overlay tile didn't exist */
 	}
 
-	/* save result */
-	char* output_path = get_tile_path(g_output, x, y, zoom, ".png");
+	/* blend overlays and save result in a single pass */
+	char output_path[FILENAME_MAX];
+	if (get_tile_path_r(output_path, sizeof(output_path), g_output, x, y, zoom, ".png") == NULL)
+		errx(1, "Path to output tile %d/%d/%d is too long", zoom, x, y);
+
+	/* duplicates are written by path */
+	if (g_dedup != DEDUP_NONE)
+		tileio_mkdir(g_output, x, zoom);
+
+	dedup_result_t dedup = DEDUP_MISS;
+	ttip_hash_t hash = 0;
+	if (g_dedup != DEDUP_NONE) {
+		/* hashing is much cheaper than compression */
+		if (tile != NULL)
+			res = ttip_png_hash_blended(ctx->encoder, tile, overlays, noverlays, &hash);
+		else
+			res = ttip_png_hash_downsampled(ctx->encoder, childs[0], childs[1], childs[2], childs[3], overlays, noverlays, &hash);
 
-	create_directories(output_path);
+		if (res != TTIP_OK)
+			errx(1, "Could not hash output tile %s: %s", output_path, ttip_strerror(res));
 
-	if ((res = ttip_savepng(tile, output_path, g_pngcompression)) != TTIP_OK) {
-		warnx("Could not save output tile %s: %s", output_path, ttip_strerror(res));
-		had_error = 1;
+#ifdef HAVE_PTHREAD
+		/* duplicate is passed to writer too, unless it's linked */
+		if (g_writeback > 0)
+			dedup = dedup_fetch(hash, output_path, &ctx->pngbuffer);
+		else
+#endif
+		dedup = dedup_save(hash, output_path);
+
+		if (dedup == DEDUP_FAILED) {
+			warnx("Could not save output tile %s: %s", output_path, strerror(errno));
+			had_error = 1;
+		}
 	}
 
-	/* cleanup */
-	ttip_destroy(&tile);
-
-	if (g_postcmd) {
-		char buffer[strlen(g_postcmd) + strlen(output_path) + 2];
-		strcpy(buffer, g_postcmd);
-		strcat(buffer, " ");
-		strcat(buffer, output_path);
-		if (system(buffer) != 0) {
-			warnx("Postcmd `%s` failed", buffer);
+	int queued = 0, pending = 0;
+	if (dedup == DEDUP_MISS) {
+		/* encode to memory, as the result may be kept or passed to writer */
+		if (tile != NULL)
+			res = ttip_png_encode_blended_mem(ctx->encoder, tile, overlays, noverlays, &ctx->pngbuffer);
+		else
+			res = ttip_png_encode_downsampled_mem(ctx->encoder, childs[0], childs[1], childs[2], childs[3], overlays, noverlays, &ctx->pngbuffer);
+
+		if (res == TTIP_OK) {
+#ifdef HAVE_PTHREAD
+			if (g_writeback > 0) {
+				if (g_dedup != DEDUP_NONE)
+					dedup_store_pending(hash, output_path, ctx->pngbuffer.data, ctx->pngbuffer.size);
+				if ((res = writeback_submit(g_output, x, y, zoom, hash, &ctx->pngbuffer)) == 0)
+					queued = 1;
+			} else
+#endif
+			if (g_dedup != DEDUP_NONE && g_postcmd) {
+				/* duplicates are linked to the file only once it's processed */
+				dedup_store_pending(hash, output_path, ctx->pngbuffer.data, ctx->pngbuffer.size);
+				if ((res = tileio_write(g_output, x, y, zoom, ctx->pngbuffer.data, ctx->pngbuffer.size)) == TTIP_OK)
+					pending = 1;
+			} else if (g_dedup != DEDUP_NONE)
+				res = dedup_store(hash, output_path, ctx->pngbuffer.data, ctx->pngbuffer.size);
+			else
+				res = tileio_write(g_output, x, y, zoom, ctx->pngbuffer.data, ctx->pngbuffer.size);
+		}
+
+		if (res != TTIP_OK) {
+			warnx("Could not save output tile %s: %s", output_path, ttip_strerror(res));
+			had_error = 1;
+		}
+	}
+#ifdef HAVE_PTHREAD
+	else if (dedup == DEDUP_FETCHED) {
+		if ((res = writeback_submit(g_output, x, y, zoom, hash, &ctx->pngbuffer)) == 0) {
+			queued = 1;
+		} else {
+			warnx("Could not save output tile %s: %s", output_path, ttip_strerror(res));
 			had_error = 1;
 		}
 	}
+#endif
+
+	/* cleanup */
+	for (int i = 0; i < noverlays; ++i)
+		ttip_destroy(&overlays[i]);
+
+	/* hardlinked file was processed along with the first one, unless
+	 * that is only queued by batched postcmd; queued tile is processed
+	 * by writer */
+	int processed = dedup == DEDUP_LINKED && g_postcmd_mode == POSTCMD_EACH;
+	if (g_postcmd && !processed && !queued)
+		if (!postcmd_add(output_path))
+			had_error = 1;
+
+	if (pending)
+		dedup_written(hash, output_path);
 
 	return !had_error;
 }
 
-ttip_image_t process_tile(int x, int y, int zoom) {
+/* save input tile which needs no processing by copying its file */
+int process_passthrough(int x, int y, int zoom, const char* input_path) {
+	char output_path[FILENAME_MAX];
+	if (get_tile_path_r(output_path, sizeof(output_path), g_output, x, y, zoom, ".png") == NULL)
+		errx(1, "Path to output tile %d/%d/%d is too long", zoom, x, y);
+
+	tileio_mkdir(g_output, x, zoom);
+
+	int linked, ret;
+	if ((ret = copy_file(input_path, output_path, g_passthrough_mode, &linked)) != 0) {
+		warnx("Could not copy %s to output tile %s: %s", input_path, output_path, strerror(ret));
+		return 0;
+	}
+
+	INCREMENT(g_passedtiles);
+
+	if (g_postcmd)
+		return postcmd_add(output_path);
+
+	return 1;
+}
+
+/* determine what is done with a tile which is in input bounds */
+void get_tile_needs(int x, int y, int zoom, int* need_output, int* need_current, int* passthrough) {
+	/* whether we produce output for this tile, and whether parent needs the tile afterwards */
+	*need_output = zoom >= g_min_output_zoom && zoom <= g_max_output_zoom && is_tile_in_bounds(x, y, zoom, &g_output_bounds);
+	*need_current = !*need_output || zoom > g_min_output_zoom;
+
+	/* without overlays, input tile is written as is, so its file may
+	 * be copied instead of being encoded again */
+	*passthrough = g_passthrough && *need_output && g_noverlays == 0;
+}
+
+/* check whether any input may have the tile according to index,
+ * without touching filesystem */
+int may_have_input_tile(int x, int y, int zoom) {
+	for (unsigned int i = 0; i < g_ninputs; ++i)
+		if (presence_has_tile(i, x, y, zoom))
+			return 1;
+
+	return 0;
+}
+
+/* check whether any input has the tile */
+int has_input_tile(int x, int y, int zoom, char* input_path, size_t input_path_size) {
+	for (unsigned int i = 0; i < g_ninputs; ++i) {
+		if (presence_has_tile(i, x, y, zoom) && tileio_access(g_inputs[i], x, y, zoom) == 0) {
+			if (get_tile_path_r(input_path, input_path_size, g_inputs[i], x, y, zoom, ".png") == NULL)
+				errx(1, "Path to source tile %d/%d/%d is too long", zoom, x, y);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+#ifdef HAVE_PTHREAD
+/* walk the tree in the same order as process_tile, scheduling input
+ * tiles it's going to decode for reading; returns 0 when read-ahead
+ * is stopped */
+int walk_tile(int x, int y, int zoom) {
+	if (!is_tile_in_bounds(x, y, zoom, &g_input_bounds))
+		return 1;
+
+	int need_output, need_current, passthrough;
+	get_tile_needs(x, y, zoom, &need_output, &need_current, &passthrough);
+
+	int is_input = g_min_input_zoom <= zoom && zoom <= g_max_input_zoom;
+
+	/* unchanged subtree is not descended into */
+	if (!is_tile_dirty(x, y, zoom)) {
+		if (is_input && zoom > g_min_output_zoom && need_current && may_have_input_tile(x, y, zoom))
+			return prefetch_schedule(x, y, zoom);
+		return 1;
+	}
+
+	if (is_input && !(passthrough && !need_current) && may_have_input_tile(x, y, zoom))
+		if (!prefetch_schedule(x, y, zoom))
+			return 0;
+
+	/* whether there are childs depends on input tile existence, which
+	 * is checked without waiting for the read */
+	if (zoom < g_max_output_zoom) {
+		/* descend anyway */
+	} else if (zoom < g_max_input_zoom) {
+		char input_path[FILENAME_MAX];
+		if (is_input && has_input_tile(x, y, zoom, input_path, sizeof(input_path)))
+			return 1;
+		if (!presence_has_childs(x, y, zoom))
+			return 1;
+	} else {
+		return 1;
+	}
+
+	for (int i = 0; i < 4; ++i)
+		if (!walk_tile(x * 2 + (i & 1), y * 2 + !!(i & 2), zoom + 1))
+			return 0;
+
+	return 1;
+}
+
+void walk_tree() {
+	walk_tile(0, 0, 0);
+}
+#endif
+
+/* walker doesn't descend into unchanged subtrees, so of these only
+ * the topmost tile may be read ahead */
+int is_tile_walked(int x, int y, int zoom) {
+	return zoom == 0 || is_tile_dirty(x / 2, y / 2, zoom - 1);
+}
+
+/* decode input tile, either read ahead or from the first input which has it */
+int load_input_tile(output_context_t* ctx, int x, int y, int zoom, ttip_image_t* current, char* input_path, size_t input_path_size) {
+	ttip_result_t res;
+
+	/* not scheduled for read-ahead either */
+	if (!may_have_input_tile(x, y, zoom))
+		return 0;
+
+#ifdef HAVE_PTHREAD
+	prefetch_tile_t tile;
+	if (g_readahead > 0 && is_tile_walked(x, y, zoom) && prefetch_take(x, y, zoom, &tile)) {
+		if (tile.error == ENOENT)
+			return 0;
+
+		if (get_tile_path_r(input_path, input_path_size, g_inputs[tile.input], x, y, zoom, ".png") == NULL)
+			errx(1, "Path to source tile %d/%d/%d is too long", zoom, x, y);
+
+		if (tile.error != 0)
+			errx(1, "Could not load source tile %s: %s", input_path, strerror(tile.error));
+
+		res = ttip_png_decode_mem(ctx->decoder, current, tile.data, tile.size, g_pool);
+		prefetch_release(&tile);
+
+		if (res != TTIP_OK)
+			errx(1, "Could not load source tile %s: %s", input_path, ttip_strerror(res));
+
+		return 1;
+	}
+#endif
+
+	for (unsigned int i = 0; i < g_ninputs; ++i) {
+		if (!presence_has_tile(i, x, y, zoom))
+			continue;
+
+		if ((res = tileio_read(g_inputs[i], x, y, zoom, &ctx->filebuffer)) == ENOENT)
+			continue;
+
+		if (get_tile_path_r(input_path, input_path_size, g_inputs[i], x, y, zoom, ".png") == NULL)
+			errx(1, "Path to source tile %d/%d/%d is too long", zoom, x, y);
+
+		if (res == 0)
+			res = ttip_png_decode_mem(ctx->decoder, current, ctx->filebuffer.data, ctx->filebuffer.size, g_pool);
+
+		if (res != TTIP_OK)
+			errx(1, "Could not load source tile %s: %s", input_path, ttip_strerror(res));
+
+		return 1;
+	}
+
+	return 0;
+}
+
+/* get tile of unchanged subtree without input for its parent, as it
+ * was generated by previous run; returns 0 if there's none, and it
+ * has to be generated again */
+int load_cached_tile(output_context_t* ctx, int x, int y, int zoom, ttip_image_t* current) {
+	ttip_result_t res;
+
+	const char* cache = g_cache;
+	if (cache == NULL && g_output_is_cache && zoom >= g_min_output_zoom && zoom <= g_max_output_zoom && is_tile_in_bounds(x, y, zoom, &g_output_bounds))
+		cache = g_output;
+
+	if (cache == NULL || (res = tileio_read(cache, x, y, zoom, &ctx->filebuffer)) == ENOENT)
+		return 0;
+
+	char path[FILENAME_MAX];
+	if (get_tile_path_r(path, sizeof(path), cache, x, y, zoom, ".png") == NULL)
+		errx(1, "Path to cached tile %d/%d/%d is too long", zoom, x, y);
+
+	if (res == 0 && (res = ttip_png_decode_mem(ctx->decoder, current, ctx->filebuffer.data, ctx->filebuffer.size, g_pool)) == TTIP_OK)
+		res = ttip_detect_uniform(current);
+
+	if (res != TTIP_OK) {
+		warnx("Could not load cached tile %s, generating it again: %s", path, ttip_strerror(res));
+		ttip_destroy(current);
+		return 0;
+	}
+
+	return 1;
+}
+
+/* keep tile passed to parent, so it's not generated again when
+ * its subtree is unchanged */
+void save_cached_tile(output_context_t* ctx, int x, int y, int zoom, ttip_image_t tile) {
+	ttip_result_t res;
+	if ((res = ttip_png_encode_mem(ctx->cache_encoder, tile, &ctx->pngbuffer)) == TTIP_OK)
+		res = tileio_write(g_cache, x, y, zoom, ctx->pngbuffer.data, ctx->pngbuffer.size);
+
+	if (res != TTIP_OK) {
+		char path[FILENAME_MAX];
+		if (get_tile_path_r(path, sizeof(path), g_cache, x, y, zoom, ".png") == NULL)
+			errx(1, "Path to cached tile %d/%d/%d is too long", zoom, x, y);
+
+		/* next run will only have to generate it again */
+		warnx("Could not save cached tile %s: %s", path, ttip_strerror(res));
+	}
+}
+
+ttip_image_t process_tile(output_context_t* ctx, int x, int y, int zoom);
+
+#ifdef HAVE_PTHREAD
+/* subtree processed as a separate task, so idle threads may steal it */
+typedef struct {
+	worker_task_t task;
+
+	int x, y, zoom;
+	ttip_image_t result;
+} subtree_task_t;
+
+static void run_subtree_task(worker_task_t* task, void* context) {
+	subtree_task_t* subtree = (subtree_task_t*)task;
+	subtree->result = process_tile(context, subtree->x, subtree->y, subtree->zoom);
+}
+#endif
+
+/* process subtree, which may be done by any thread, each with its
+ * own context */
+ttip_image_t process_tile(output_context_t* ctx, int x, int y, int zoom) {
 	if (g_verbose)
 		fprintf(stderr, "Entering %d/%d/%d...\n", zoom, x, y);
 
@@ -156,58 +623,116 @@ ttip_image_t process_tile(int x, int y, int zoom) {
 	if (!is_tile_in_bounds(x, y, zoom, &g_input_bounds))
 		return NULL;
 
+	int need_output, need_current, passthrough;
+	get_tile_needs(x, y, zoom, &need_output, &need_current, &passthrough);
+
+	/* unchanged subtree needs no output, and its tile is only needed
+	 * by parent, which is not generated at minimal output zoom */
+	int dirty = is_tile_dirty(x, y, zoom);
+	if (!dirty && (zoom <= g_min_output_zoom || !need_current))
+		return NULL;
+
 	/* load current tile, if needed and available */
+	char input_path[FILENAME_MAX];
+	int have_input = 0;
 	if (g_min_input_zoom <= zoom && zoom <= g_max_input_zoom) {
-		for (unsigned int i = 0; i < g_ninputs; ++i) {
-			char* input_path = get_tile_path(g_inputs[i], x, y, zoom, ".png");
-			if ((res = ttip_loadpng(&current, input_path)) != TTIP_OK && res != ENOENT)
-				errx(1, "Could not load source tile %s: %s", input_path, ttip_strerror(res));
-			if (res == TTIP_OK)
-				break; /* input found */
+		if (passthrough && !need_current) {
+			/* only the file is needed, don't decode it */
+			have_input = has_input_tile(x, y, zoom, input_path, sizeof(input_path));
+		} else if ((have_input = load_input_tile(ctx, x, y, zoom, &current, input_path, sizeof(input_path)))) {
+			/* single color tiles (sea, land) are common and cheap to process as such */
+			if ((res = ttip_detect_uniform(&current)) != TTIP_OK)
+				errx(1, "Could not process source tile %s: %s", input_path, ttip_strerror(res));
 		}
 	}
 
+	/* tile of unchanged subtree is either input, nothing if there's
+	 * nothing to generate it from, or generated by previous run */
+	if (!dirty) {
+		if (have_input || zoom == g_max_input_zoom || load_cached_tile(ctx, x, y, zoom, &current)) {
+			INCREMENT(g_reusedtiles);
+			return current;
+		}
+
+		INCREMENT(g_redonetiles);
+	}
+
 	/* descend to childs only if we need to do input or output on them */
 	int have_childs = 0;
-	if ((current == NULL && zoom < g_max_input_zoom) || zoom < g_max_output_zoom)
-		for (int i = 0; i < 4; ++i) {
-			childs[i] = process_tile(x * 2 + (i & 1), y * 2 + !!(i & 2), zoom + 1);
+	if ((!have_input && zoom < g_max_input_zoom && presence_has_childs(x, y, zoom)) || zoom < g_max_output_zoom) {
+#ifdef HAVE_PTHREAD
+		if (g_num_jobs > 0) {
+			/* process first child ourselves, and let other threads steal the rest */
+			subtree_task_t subtrees[4];
+			for (int i = 3; i > 0; --i) {
+				subtrees[i].task.run = run_subtree_task;
+				subtrees[i].x = x * 2 + (i & 1);
+				subtrees[i].y = y * 2 + !!(i & 2);
+				subtrees[i].zoom = zoom + 1;
+				spawn_task(&subtrees[i].task);
+			}
+
+			childs[0] = process_tile(ctx, x * 2, y * 2, zoom + 1);
+
+			for (int i = 1; i < 4; ++i) {
+				join_task(&subtrees[i].task);
+				childs[i] = subtrees[i].result;
+			}
+		} else
+#endif
+		for (int i = 0; i < 4; ++i)
+			childs[i] = process_tile(ctx, x * 2 + (i & 1), y * 2 + !!(i & 2), zoom + 1);
+
+		for (int i = 0; i < 4; ++i)
 			have_childs += childs[i] != NULL;
-		}
+	}
 
-	if (current == NULL && have_childs > 0) {
+	if (!have_input && have_childs > 0) {
 		/* if we have partial child data, fill missing tiles */
 		for (int i = 0; i < 4; ++i)
 			if (!childs[i])
 				childs[i] = spawn_empty_tile();
 
-		/* and combine current tile */
-		if ((res = ttip_downsample2x2(&current, childs[0], childs[1], childs[2], childs[3])) != TTIP_OK)
-			errx(1, "Error downsampling tile: %s", ttip_strerror(res));
+		/* and combine current tile; if it's only needed for output,
+		 * downsampling is done on the fly while writing it */
+		if (need_current)
+			if ((res = ttip_downsample2x2(&current, childs[0], childs[1], childs[2], childs[3])) != TTIP_OK)
+				errx(1, "Error downsampling tile: %s", ttip_strerror(res));
+
+		if (g_cache != NULL && need_current && zoom > g_min_output_zoom)
+			save_cached_tile(ctx, x, y, zoom, current);
 	}
 
-	for (int i = 0; i < 4; ++i)
-		ttip_destroy(&childs[i]);
+	if (have_input)
+		for (int i = 0; i < 4; ++i)
+			ttip_destroy(&childs[i]);
 
-	/* if output not needed, just return the tile */
-	if (zoom < g_min_output_zoom || zoom > g_max_output_zoom || !is_tile_in_bounds(x, y, zoom, &g_output_bounds))
+	/* if output not needed, just return the tile; childs were only
+	 * kept for downsampling on output */
+	if (!need_output) {
+		for (int i = 0; i < 4; ++i)
+			ttip_destroy(&childs[i]);
 		return current;
+	}
 
 	/* output processing */
-	g_totaltiles++;
+	INCREMENT(g_totaltiles);
 	if (g_verbose)
 		fprintf(stderr, "Processing %d/%d/%d...\n", zoom, x, y);
-#ifdef HAVE_FORK
-	if (g_num_jobs == 0) {
+	if (passthrough && (have_input || (current == NULL && childs[0] == NULL))) {
+		/* copying is cheap enough to not spawn a child; missing
+		 * tile is written as a copy of the empty tile file */
+		if (!process_passthrough(x, y, zoom, have_input ? input_path : get_empty_tile_path()))
+			INCREMENT(g_errortiles);
+#if !defined(HAVE_PTHREAD) && defined(HAVE_FORK)
+	} else if (g_num_jobs == 0) {
+#else
+	} else {
 #endif
-		/* single process case; since we need unmodified tile here later, clone it */
-		ttip_image_t tmp = NULL;
-		if (current)
-			if ((res = ttip_clone(&tmp, current)) != TTIP_OK)
-				errx(1, "Could not clone tile: %s", ttip_strerror(res));
-		if (!process_output(x, y, zoom, tmp))
-			g_errortiles++;
-#ifdef HAVE_FORK
+		/* output doesn't modify the tile, so no need to clone it */
+		if (!process_output(ctx, x, y, zoom, current, childs[0] ? childs : NULL))
+			INCREMENT(g_errortiles);
+#if !defined(HAVE_PTHREAD) && defined(HAVE_FORK)
 	} else {
 		/* if there are enough jobs running, wait for one to finish */
 		while (get_nchilds() >= g_num_jobs)
@@ -215,13 +740,16 @@ ttip_image_t process_tile(int x, int y, int zoom) {
 
 		/* and run a new job */
 		if (fork_child()) {
-			exit(process_output(x, y, zoom, current) ? 0 : 1);
+			exit(process_output(ctx, x, y, zoom, current, childs[0] ? childs : NULL) ? 0 : 1);
 		}
-	}
 #endif
+	}
+
+	for (int i = 0; i < 4; ++i)
+		ttip_destroy(&childs[i]);
 
 	/* if output is not needed already, destroy data here and pass NULL up */
-	if (zoom <= g_min_output_zoom) {
+	if (!need_current) {
 		ttip_destroy(&current);
 		return NULL;
 	}
@@ -233,6 +761,11 @@ void usage(int ecode) {
 	/*               [ 75 chars ===============================================================] */
 	fprintf(stderr, "usage: %s [options] [-z or -Z] [-i input tile tree] [-o output tile tree]\n\n", g_progname);
 	fprintf(stderr, "    -0..-9               set png compression level\n");
+	fprintf(stderr, "    -a, --adaptive       choose png filters and compression strategy\n");
+	fprintf(stderr, "                         for each tile based on its content\n");
+	fprintf(stderr, "    -p, --palette        write tiles with 256 colors or less as paletted\n");
+	fprintf(stderr, "    -q, --quantize       also reduce tiles with more colors to paletted\n");
+	fprintf(stderr, "                         unless PSNR (dB) drops below given value\n");
 	fprintf(stderr, "    -b, --input-bounds   limit processing with bounding box.\n");
 	fprintf(stderr, "                         Possible formats:\n");
 	fprintf(stderr, "                         zoom/x/y or zoom/minx-maxx/miny-maxy (tile ids)\n");
@@ -241,13 +774,39 @@ void usage(int ecode) {
 	fprintf(stderr, "    -z, --input-zoom     zoom range of input tiles\n");
 	fprintf(stderr, "    -Z, --output-zoom    zoom range of output tiles\n");
 	fprintf(stderr, "    -e, --empty-tile     empty tile filler\n");
-#ifdef HAVE_FORK
+	fprintf(stderr, "    -d, --dedup          encode tiles with the same content once, and\n");
+	fprintf(stderr, "                         copy, hardlink or reflink following ones\n");
+	fprintf(stderr, "    -t, --passthrough    copy, hardlink or reflink input tiles which are\n");
+	fprintf(stderr, "                         also output without overlays instead of\n");
+	fprintf(stderr, "                         encoding them again\n");
+#if defined(HAVE_PTHREAD)
+	fprintf(stderr, "    -j, --jobs           number of threads to process tiles in\n");
+	fprintf(stderr, "    -r, --read-ahead     number of input tiles to read in advance\n");
+	fprintf(stderr, "    -w, --write-behind   number of encoded tiles to queue for writing\n");
+#elif defined(HAVE_FORK)
 	fprintf(stderr, "    -j, --jobs           number of processes to spawn for tile processing\n");
 #endif
 	fprintf(stderr, "    -i, --input          specify input tileset\n");
+	fprintf(stderr, "                         (any tileset may be archive:<path>)\n");
+	fprintf(stderr, "                         (or meta:<path>)\n");
+#ifdef HAVE_SQLITE3
+	fprintf(stderr, "                         (or mbtiles:<path>)\n");
+#endif
+	fprintf(stderr, "    -x, --index          index tiles present in inputs, and keep the\n");
+	fprintf(stderr, "                         index in them for following runs\n");
+	fprintf(stderr, "    -E, --expire         only regenerate tiles affected by tiles listed\n");
+	fprintf(stderr, "                         in given expire file\n");
+	fprintf(stderr, "    -K, --cache          keep tiles of all generated zooms without\n");
+	fprintf(stderr, "                         overlays in given tileset, for use with -E\n");
 	fprintf(stderr, "    -o, --output         specify place for output tileset\n");
 	fprintf(stderr, "    -l, --overlay        add overlay tileset\n");
 	fprintf(stderr, "    -c, --postcmd        add command to postprocess each generated tile\n");
+#ifdef HAVE_FORK
+	fprintf(stderr, "    -C, --postcmd-batch  pass up to given number of tiles to postcmd at once\n");
+	fprintf(stderr, "    -J, --postcmd-jobs   number of postcmd processes to run in parallel\n");
+	fprintf(stderr, "    -S, --postcmd-stdin  run persistent postcmd processes, which read tile\n");
+	fprintf(stderr, "                         paths from stdin\n");
+#endif
 	fprintf(stderr, "    -v, --verbose        increase verbosity\n");
 	fprintf(stderr, "    -h, --help           display this help\n");
 	exit(ecode);
@@ -256,10 +815,24 @@ void usage(int ecode) {
 int main(int argc, char** argv) {
 	g_progname = argv[0];
 
+	ttip_result_t res;
+#ifdef HAVE_PTHREAD
+	if ((res = ttip_pool_create_shared(&g_pool)) == TTIP_OK)
+		g_shared_pool = 1;
+	else if (res == TTIP_NOT_COMPILED_IN)
+#endif
+		res = ttip_pool_create(&g_pool);
+
+	if (res != TTIP_OK)
+		errx(1, "Cannot create image pool: %s", ttip_strerror(res));
+
 	/* parse arguments */
 	int ch;
-	while ((ch = getopt_long(argc, argv, "b:B:z:Z:e:j:i:o:l:c:0123456789hv", longopts, NULL)) != -1) {
+	while ((ch = getopt_long(argc, argv, "ab:B:z:Z:d:e:E:j:i:K:o:l:c:C:J:Spq:r:t:w:x0123456789hv", longopts, NULL)) != -1) {
 		switch (ch) {
+		case 'a':
+			g_pngadaptive = 1;
+			break;
 		case 'b':
 			if (!parse_bounds(optarg, &g_input_bounds)) {
 				warnx("Cannot parse input bounds\n");
@@ -284,17 +857,37 @@ int main(int argc, char** argv) {
 				usage(1);
 			}
 			break;
+		case 'd':
+			if (!parse_dedup_mode(optarg, &g_dedup)) {
+				warnx("Bad deduplication mode\n");
+				usage(1);
+			}
+			break;
 		case 'e':
-			init_empty_tile(optarg);
+			init_empty_tile(optarg, g_pool);
 			atexit(cleanup_empty_tile);
 			break;
-#ifdef HAVE_FORK
+#if defined(HAVE_PTHREAD) || defined(HAVE_FORK)
 		case 'j':
 			if (!parse_unsigned(optarg, optarg + strlen(optarg), &g_num_jobs)) {
 				warnx("Cannot parse number of jobs\n");
 				usage(1);
 			}
 			break;
+#endif
+#ifdef HAVE_PTHREAD
+		case 'r':
+			if (!parse_unsigned(optarg, optarg + strlen(optarg), &g_readahead)) {
+				warnx("Cannot parse read-ahead window\n");
+				usage(1);
+			}
+			break;
+		case 'w':
+			if (!parse_unsigned(optarg, optarg + strlen(optarg), &g_writeback)) {
+				warnx("Cannot parse write-behind queue length\n");
+				usage(1);
+			}
+			break;
 #endif
 		case 'i':
 			if (g_ninputs < MAX_INPUTS) {
@@ -304,6 +897,15 @@ int main(int argc, char** argv) {
 				usage(1);
 			}
 			break;
+		case 'x':
+			g_index = 1;
+			break;
+		case 'E':
+			g_expire = optarg;
+			break;
+		case 'K':
+			g_cache = optarg;
+			break;
 		case 'o':
 			g_output = optarg;
 			break;
@@ -318,6 +920,44 @@ int main(int argc, char** argv) {
 		case 'c':
 			g_postcmd = optarg;
 			break;
+#ifdef HAVE_FORK
+		case 'C':
+			if (!parse_unsigned(optarg, optarg + strlen(optarg), &g_postcmd_batch) || g_postcmd_batch == 0) {
+				warnx("Cannot parse postcmd batch size\n");
+				usage(1);
+			}
+			if (g_postcmd_mode == POSTCMD_EACH)
+				g_postcmd_mode = POSTCMD_BATCH;
+			break;
+		case 'J':
+			if (!parse_unsigned(optarg, optarg + strlen(optarg), &g_postcmd_jobs) || g_postcmd_jobs == 0) {
+				warnx("Cannot parse number of postcmd jobs\n");
+				usage(1);
+			}
+			if (g_postcmd_mode == POSTCMD_EACH)
+				g_postcmd_mode = POSTCMD_BATCH;
+			break;
+		case 'S':
+			g_postcmd_mode = POSTCMD_STDIN;
+			break;
+#endif
+		case 'p':
+			g_pngindexed = 1;
+			break;
+		case 'q':
+			if (!parse_unsigned(optarg, optarg + strlen(optarg), &g_pngminpsnr) || g_pngminpsnr == 0) {
+				warnx("Cannot parse quantization threshold\n");
+				usage(1);
+			}
+			g_pngindexed = 1;
+			break;
+		case 't':
+			if (!parse_copyfile_mode(optarg, &g_passthrough_mode)) {
+				warnx("Bad passthrough mode\n");
+				usage(1);
+			}
+			g_passthrough = 1;
+			break;
 		case '0': case '1': case '2': case '3': case '4':
 		case '5': case '6': case '7': case '8': case '9':
 			g_pngcompression = ch - '0';
@@ -367,6 +1007,174 @@ int main(int argc, char** argv) {
 	if (bad_options)
 		usage(1);
 
+	g_context = create_output_context();
+
+#if !defined(HAVE_PTHREAD) && defined(HAVE_FORK)
+	/* tiles are written by short lived processes, which can't share cache */
+	if (g_dedup != DEDUP_NONE && g_num_jobs > 0) {
+		warnx("Deduplication is not supported with multiple jobs, disabled\n");
+		g_dedup = DEDUP_NONE;
+	}
+#endif
+
+	/* postcmd would modify input tiles through hardlinks */
+	if (g_passthrough && g_passthrough_mode == COPYFILE_HARDLINK && g_postcmd != NULL) {
+		warnx("Hardlinking input tiles is not compatible with postcmd, copying instead\n");
+		g_passthrough_mode = COPYFILE_COPY;
+	}
+
+	/* databases, archives and metatiles have no tile files to copy,
+	 * link or postprocess */
+	int mbtiles_input = 0, mbtiles_overlay = 0, mbtiles_output = IS_MBTILES(g_output);
+	int archive_input = 0, archive_overlay = 0, archive_output = IS_ARCHIVE(g_output);
+	int metatile_input = 0, metatile_overlay = 0, metatile_output = IS_METATILE(g_output);
+	for (unsigned int i = 0; i < g_ninputs; ++i) {
+		mbtiles_input |= IS_MBTILES(g_inputs[i]);
+		archive_input |= IS_ARCHIVE(g_inputs[i]);
+		metatile_input |= IS_METATILE(g_inputs[i]);
+	}
+	for (unsigned int i = 0; i < g_noverlays; ++i) {
+		mbtiles_overlay |= IS_MBTILES(g_overlays[i]);
+		archive_overlay |= IS_ARCHIVE(g_overlays[i]);
+		metatile_overlay |= IS_METATILE(g_overlays[i]);
+	}
+
+	int mbtiles_cache = g_cache != NULL && IS_MBTILES(g_cache);
+	int metatile_cache = g_cache != NULL && IS_METATILE(g_cache);
+
+	int use_mbtiles = mbtiles_input || mbtiles_overlay || mbtiles_output || mbtiles_cache;
+	int use_archive = archive_input || archive_overlay || archive_output;
+	int use_metatile = metatile_input || metatile_overlay || metatile_output || metatile_cache;
+
+	/* archive is written from scratch, and can't be read meanwhile */
+	if (g_expire != NULL && archive_output)
+		errx(1, "Expire list cannot be used with archive output");
+
+	if (g_cache != NULL && IS_ARCHIVE(g_cache))
+		errx(1, "Cache cannot be an archive");
+
+	/* overlays and quantization make output tiles different from
+	 * ones their parents are generated from */
+	g_output_is_cache = g_noverlays == 0 && g_pngminpsnr == 0;
+	if (g_expire != NULL && g_cache == NULL && !g_output_is_cache)
+		warnx("Output tiles with overlays or quantization can't be reused, unchanged tiles will be generated again unless cache is used\n");
+
+	int line;
+	if (g_expire != NULL && (res = init_expire(g_expire, &line)) != 0) {
+		if (res == EINVAL)
+			errx(1, "Cannot parse expire list %s at line %d", g_expire, line);
+		errx(1, "Cannot read expire list %s: %s", g_expire, strerror(res));
+	}
+
+#ifndef HAVE_SQLITE3
+	if (use_mbtiles)
+		errx(1, "MBTiles support is not compiled in");
+#endif
+
+	if (g_passthrough && (mbtiles_input || mbtiles_output || archive_input || archive_output || metatile_input || metatile_output)) {
+		warnx("Passthrough is not supported with MBTiles, archive and metatile tilesets, disabled\n");
+		g_passthrough = 0;
+	}
+
+	/* archive stores identical tiles once by itself */
+	if (g_dedup != DEDUP_NONE && (mbtiles_output || archive_output || metatile_output)) {
+		warnx("Deduplication is not supported with MBTiles, archive and metatile output, disabled\n");
+		g_dedup = DEDUP_NONE;
+	}
+
+	if (g_postcmd != NULL && (mbtiles_output || archive_output || metatile_output))
+		errx(1, "Postcmd cannot be run on MBTiles, archive or metatile output");
+
+#if !defined(HAVE_PTHREAD) && defined(HAVE_FORK)
+	/* database connections, archive being written and metatiles being
+	 * collected can't be used by forked processes */
+	if ((use_mbtiles || archive_output || metatile_output) && g_num_jobs > 0) {
+		warnx("Multiple jobs are not supported with MBTiles tilesets, archive and metatile output, using single process\n");
+		g_num_jobs = 0;
+	}
+#endif
+
+	init_dedup(g_dedup, DEDUP_MAX_BYTES);
+
+#if !defined(HAVE_PTHREAD) && defined(HAVE_FORK)
+	/* postcmd is run by short lived processes as well */
+	if (g_postcmd_mode != POSTCMD_EACH && g_num_jobs > 0) {
+		warnx("Batched postcmd is not supported with multiple jobs, running it for each tile\n");
+		g_postcmd_mode = POSTCMD_EACH;
+	}
+#endif
+
+	if (g_postcmd != NULL && (res = init_postcmd(g_postcmd, g_postcmd_mode, g_postcmd_batch, g_postcmd_jobs)) != 0)
+		errx(1, "Cannot start postcmd: %s", strerror(res));
+
+	if ((res = init_tileio(TILEIO_MAX_DIRS)) != 0)
+		errx(1, "Cannot initialize directory cache: %s", strerror(res));
+
+	/* archives are open for the whole run, before any thread uses them */
+	if (use_archive) {
+		init_archive();
+
+		for (unsigned int i = 0; i < g_ninputs; ++i)
+			if (IS_ARCHIVE(g_inputs[i]) && (res = archive_open(g_inputs[i], 0)) != 0)
+				errx(1, "Cannot open input %s: %s", g_inputs[i], ttip_strerror(res));
+
+		for (unsigned int i = 0; i < g_noverlays; ++i)
+			if (IS_ARCHIVE(g_overlays[i]) && (res = archive_open(g_overlays[i], 0)) != 0)
+				errx(1, "Cannot open overlay %s: %s", g_overlays[i], ttip_strerror(res));
+
+		if (archive_output && (res = archive_open(g_output, 1)) != 0)
+			errx(1, "Cannot create output %s: %s", g_output, ttip_strerror(res));
+	}
+
+	if (use_metatile && (res = init_metatile(METATILE_CACHE)) != 0)
+		errx(1, "Cannot initialize metatile cache: %s", strerror(res));
+
+#ifdef HAVE_SQLITE3
+	/* databases are open for the whole run, before any thread uses them */
+	if (use_mbtiles) {
+		init_mbtiles(MBTILES_BATCH);
+
+		for (unsigned int i = 0; i < g_ninputs; ++i)
+			if (IS_MBTILES(g_inputs[i]) && (res = mbtiles_open(g_inputs[i], 0)) != 0)
+				errx(1, "Cannot open input %s: %s", g_inputs[i], strerror(res));
+
+		for (unsigned int i = 0; i < g_noverlays; ++i)
+			if (IS_MBTILES(g_overlays[i]) && (res = mbtiles_open(g_overlays[i], 0)) != 0)
+				errx(1, "Cannot open overlay %s: %s", g_overlays[i], strerror(res));
+
+		if (mbtiles_output && (res = mbtiles_open(g_output, 1)) != 0)
+			errx(1, "Cannot open output %s: %s", g_output, strerror(res));
+
+		if (mbtiles_cache && (res = mbtiles_open(g_cache, 1)) != 0)
+			errx(1, "Cannot open cache %s: %s", g_cache, strerror(res));
+	}
+#endif
+
+	if (g_index) {
+		if ((res = init_presence(g_inputs, g_ninputs, g_min_input_zoom, g_max_input_zoom, PRESENCE_THREADS)) != 0)
+			errx(1, "Cannot index input tiles: %s", strerror(res));
+
+		/* index is only an optimization for following runs */
+		if ((res = save_presence()) != 0)
+			warnx("Cannot save input index: %s\n", strerror(res));
+	}
+
+#ifdef HAVE_PTHREAD
+	if (g_num_jobs > 0 && !g_shared_pool) {
+		warnx("libttip is built without thread support, using single thread\n");
+		g_num_jobs = 0;
+	}
+
+	/* detect it before threads do */
+	ttip_getsimd();
+
+	if (g_num_jobs > 0 && (res = init_workers(g_num_jobs, create_output_context, destroy_output_context)) != 0)
+		errx(1, "Cannot start worker threads: %s", strerror(res));
+
+	if (g_writeback > 0 && (res = init_writeback(g_writeback, WRITEBACK_THREADS, output_written)) != 0)
+		errx(1, "Cannot start writer threads: %s", strerror(res));
+#endif
+
 	if (!has_empty_tile())
 		fprintf(stderr, "Warning: empty tile not specified, process will fail if input tileset is incomplete\n");
 
@@ -377,18 +1185,156 @@ int main(int argc, char** argv) {
 		fprintf(stderr, " Output: %s, zooms %d-%d\n", g_output, g_min_output_zoom, g_max_output_zoom);
 		for (unsigned int i = 0; i < g_noverlays; ++i)
 			fprintf(stderr, "Overlay: %s\n", g_overlays[i]);
+		if (g_cache != NULL)
+			fprintf(stderr, "  Cache: %s\n", g_cache);
 	}
 
 	/* run processing */
-	process_tile(0, 0, 0);
+#ifdef HAVE_PTHREAD
+	if (g_readahead > 0 && (res = init_prefetch(g_readahead, READAHEAD_THREADS, g_inputs, g_ninputs, walk_tree)) != 0)
+		errx(1, "Cannot start read-ahead threads: %s", strerror(res));
+#endif
 
-#ifdef HAVE_FORK
+	ttip_image_t root = NULL;
+#ifdef HAVE_PTHREAD
+	if (g_num_jobs > 0) {
+		subtree_task_t subtree = { { run_subtree_task, 0 }, 0, 0, 0, NULL };
+		run_task(&subtree.task);
+		root = subtree.result;
+	} else
+#endif
+	root = process_tile(g_context, 0, 0, 0);
+
+	ttip_destroy(&root);
+
+#if defined(HAVE_PTHREAD)
+	cleanup_workers();
+	cleanup_prefetch();
+
+	/* flush queued tiles */
+	cleanup_writeback();
+#elif defined(HAVE_FORK)
 	if (g_num_jobs > 0)
 		g_errortiles += wait_all_childs();
 #endif
 
-	if (g_verbose)
-		fprintf(stderr, "Tiles processed: %d, errors: %d\n", g_totaltiles, g_errortiles);
+	/* wait for commands run on written tiles */
+	if (g_postcmd != NULL)
+		g_errortiles += flush_postcmd();
+
+	/* write directory of output archive */
+	if (use_archive && (res = cleanup_archive()) != 0) {
+		warnx("Cannot finish output %s: %s", g_output, ttip_strerror(res));
+		g_errortiles++;
+	}
+
+	/* write metatiles which were not completed */
+	if (use_metatile && (res = cleanup_metatile()) != 0) {
+		warnx("Cannot write output %s: %s", g_output, strerror(res));
+		g_errortiles++;
+	}
+
+#ifdef HAVE_SQLITE3
+	/* commit last batch of tiles */
+	if (use_mbtiles && cleanup_mbtiles() != 0)
+		g_errortiles++;
+#endif
+
+	if (g_verbose) {
+		ttip_pool_stats_t stats;
+		ttip_pool_getstats(g_pool, &stats);
+
+		fprintf(stderr, "Tiles processed: %d, passed through: %d, errors: %d\n", g_totaltiles, g_passedtiles, g_errortiles);
+		fprintf(stderr, "Image pool: %lu hits, %lu misses, %lu bytes peak\n", stats.hits, stats.misses, (unsigned long)stats.peak_bytes);
+
+		tileio_stats_t tileio;
+		tileio_getstats(&tileio);
+
+		fprintf(stderr, "Directory cache: %lu hits, %lu misses, %lu directories created\n", tileio.hits, tileio.misses, tileio.created);
+
+		if (use_archive) {
+			archive_stats_t archive;
+			archive_getstats(&archive);
+
+			fprintf(stderr, "Archive: %lu tiles read, %lu written, %lu of them stored (%lu bytes)\n",
+					archive.reads, archive.writes, archive.unique, (unsigned long)archive.bytes);
+		}
+
+		if (use_metatile) {
+			metatile_stats_t metatile;
+			metatile_getstats(&metatile);
+
+			fprintf(stderr, "Metatiles: %lu tiles read from %lu files, %lu tiles written to %lu files\n",
+					metatile.reads, metatile.loaded, metatile.writes, metatile.written);
+		}
+
+#ifdef HAVE_SQLITE3
+		if (use_mbtiles) {
+			mbtiles_stats_t mbtiles;
+			mbtiles_getstats(&mbtiles);
+
+			fprintf(stderr, "MBTiles: %lu tiles read, %lu written in %lu transactions\n", mbtiles.reads, mbtiles.writes, mbtiles.transactions);
+		}
+#endif
+
+		if (g_index) {
+			presence_stats_t presence;
+			presence_getstats(&presence);
+
+			fprintf(stderr, "Input index: %lu tiles in %lu columns, %lu columns rescanned\n", presence.tiles, presence.columns, presence.rescanned);
+		}
+
+		if (g_expire != NULL) {
+			expire_stats_t expire;
+			expire_getstats(&expire);
+
+			fprintf(stderr, "Expire list: %lu tiles listed, %lu dirty; %d unchanged tiles reused, %d generated again\n",
+					expire.listed, expire.dirty, g_reusedtiles, g_redonetiles);
+		}
+
+		if (g_postcmd != NULL) {
+			postcmd_stats_t postcmd;
+			postcmd_getstats(&postcmd);
+
+			fprintf(stderr, "Postcmd: %lu tiles in %lu invocations, failed on %lu\n", postcmd.tiles, postcmd.invocations, postcmd.failed);
+		}
+
+		if (g_dedup != DEDUP_NONE) {
+			dedup_stats_t stats;
+			dedup_getstats(&stats);
+
+			fprintf(stderr, "Deduplication: %lu of %lu tiles reused (%.1f%%), %lu linked, %lu bytes of png reused, %lu cache evictions\n",
+					stats.hits, stats.lookups, stats.lookups ? 100.0 * stats.hits / stats.lookups : 0.0, stats.linked, (unsigned long)stats.bytes_reused, stats.evicted);
+		}
+
+#ifdef HAVE_PTHREAD
+		if (g_readahead > 0) {
+			prefetch_stats_t prefetch;
+			prefetch_getstats(&prefetch);
+
+			unsigned long reads = prefetch.prefetched + prefetch.missed;
+			fprintf(stderr, "Read-ahead: %lu of %lu tiles read ahead, %lu waited for I/O (%.1f%%)\n",
+					prefetch.prefetched, reads, prefetch.waited, prefetch.prefetched ? 100.0 * prefetch.waited / prefetch.prefetched : 0.0);
+		}
+
+		if (g_writeback > 0) {
+			writeback_stats_t writeback;
+			writeback_getstats(&writeback);
+
+			fprintf(stderr, "Write-behind: %lu tiles written, %lu failed, %lu times queue was full\n",
+					writeback.written, writeback.failed, writeback.waited);
+		}
+#endif
+	}
+
+	cleanup_dedup();
+	cleanup_tileio();
+	cleanup_postcmd();
+	cleanup_presence();
+	cleanup_expire();
+
+	destroy_output_context(g_context);
+	ttip_pool_destroy(&g_pool);
 
 	return g_errortiles != 0;
 }
@@ -0,0 +1,302 @@
+/*
+ * Copyright (C) 2012 Dmitry Marakasov
+ *
+ * This file is part of tiletool.
+ *
+ * tiletool is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * tiletool is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tiletool.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_PTHREAD
+
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "workers.h"
+
+#define INITIAL_DEQUE_SIZE 64
+
+/* Each worker has a deque of spawned tasks. Owner pushes and pops
+ * tasks at the bottom, so it works depth first on its own subtree
+ * with hot caches, while idle workers steal from the top, where the
+ * oldest and thus largest tasks are */
+struct worker {
+	pthread_t thread;
+
+	pthread_mutex_t lock;
+	worker_task_t** tasks;
+	size_t top;
+	size_t bottom;
+	size_t capacity;
+
+	void* context;
+	unsigned int seed;    /* for choosing steal victims */
+};
+
+static struct worker* g_workers = NULL;
+static int g_nworkers = 0;
+
+static pthread_key_t g_self_key;
+
+/* threads with nothing to do sleep until something is queued or
+ * completed, which is tracked by event counter */
+static pthread_mutex_t g_idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_idle_cond = PTHREAD_COND_INITIALIZER;
+static unsigned long g_events = 0;
+static int g_nsleeping = 0;
+static int g_njoining = 0;
+static int g_stopping = 0;
+
+/* separate condition for thread outside the pool waiting for a task,
+ * so it doesn't take wakeups meant for workers */
+static pthread_cond_t g_outside_cond = PTHREAD_COND_INITIALIZER;
+static int g_noutside = 0;
+
+static worker_context_create_t g_create_context = NULL;
+static worker_context_destroy_t g_destroy_context = NULL;
+
+static int is_done(worker_task_t* task) {
+	return __atomic_load_n(&task->done, __ATOMIC_ACQUIRE);
+}
+
+static unsigned long get_events() {
+	pthread_mutex_lock(&g_idle_lock);
+	unsigned long events = g_events;
+	pthread_mutex_unlock(&g_idle_lock);
+	return events;
+}
+
+/* sleep until there's an event after the given one, or task is done */
+static void wait_event(unsigned long seen, worker_task_t* task) {
+	pthread_mutex_lock(&g_idle_lock);
+	while (g_events == seen && !g_stopping && !(task != NULL && is_done(task))) {
+		g_nsleeping++;
+		g_njoining += task != NULL;
+		pthread_cond_wait(&g_idle_cond, &g_idle_lock);
+		g_nsleeping--;
+		g_njoining -= task != NULL;
+	}
+	pthread_mutex_unlock(&g_idle_lock);
+}
+
+static void push_task(struct worker* worker, worker_task_t* task) {
+	pthread_mutex_lock(&worker->lock);
+	if (worker->bottom == worker->capacity) {
+		if (worker->top > 0) {
+			memmove(worker->tasks, worker->tasks + worker->top, (worker->bottom - worker->top) * sizeof(worker_task_t*));
+			worker->bottom -= worker->top;
+			worker->top = 0;
+		} else {
+			size_t capacity = worker->capacity ? worker->capacity * 2 : INITIAL_DEQUE_SIZE;
+			worker_task_t** tasks = realloc(worker->tasks, capacity * sizeof(worker_task_t*));
+			if (tasks == NULL)
+				err(1, "Cannot queue task");
+			worker->tasks = tasks;
+			worker->capacity = capacity;
+		}
+	}
+	worker->tasks[worker->bottom++] = task;
+	pthread_mutex_unlock(&worker->lock);
+
+	/* wake a single thread to steal it */
+	pthread_mutex_lock(&g_idle_lock);
+	g_events++;
+	if (g_nsleeping > 0)
+		pthread_cond_signal(&g_idle_cond);
+	pthread_mutex_unlock(&g_idle_lock);
+}
+
+static worker_task_t* take_task(struct worker* worker, int steal) {
+	worker_task_t* task = NULL;
+
+	pthread_mutex_lock(&worker->lock);
+	if (worker->bottom > worker->top) {
+		task = steal ? worker->tasks[worker->top++] : worker->tasks[--worker->bottom];
+		if (worker->top == worker->bottom)
+			worker->top = worker->bottom = 0;
+	}
+	pthread_mutex_unlock(&worker->lock);
+
+	return task;
+}
+
+static worker_task_t* find_task(struct worker* self) {
+	worker_task_t* task;
+	if ((task = take_task(self, 0)) != NULL)
+		return task;
+
+	/* start from random victim, so thieves don't all fight for the same one */
+	self->seed = self->seed * 1103515245 + 12345;
+	int first = (self->seed >> 16) % g_nworkers;
+
+	for (int i = 0; i < g_nworkers; i++) {
+		struct worker* victim = &g_workers[(first + i) % g_nworkers];
+		if (victim != self && (task = take_task(victim, 1)) != NULL)
+			return task;
+	}
+
+	return NULL;
+}
+
+static void execute_task(struct worker* self, worker_task_t* task) {
+	task->run(task, self->context);
+
+	/* task may be gone once it's marked done */
+	__atomic_store_n(&task->done, 1, __ATOMIC_RELEASE);
+
+	pthread_mutex_lock(&g_idle_lock);
+	g_events++;
+	if (g_njoining > 0)
+		pthread_cond_broadcast(&g_idle_cond);
+	if (g_noutside > 0)
+		pthread_cond_broadcast(&g_outside_cond);
+	pthread_mutex_unlock(&g_idle_lock);
+}
+
+static void* worker_main(void* arg) {
+	struct worker* self = arg;
+
+	pthread_setspecific(g_self_key, self);
+
+	self->context = g_create_context ? g_create_context() : NULL;
+
+	for (;;) {
+		unsigned long seen = get_events();
+
+		worker_task_t* task = find_task(self);
+		if (task != NULL) {
+			execute_task(self, task);
+			continue;
+		}
+
+		pthread_mutex_lock(&g_idle_lock);
+		int stopping = g_stopping;
+		pthread_mutex_unlock(&g_idle_lock);
+
+		if (stopping)
+			break;
+
+		wait_event(seen, NULL);
+	}
+
+	if (g_destroy_context)
+		g_destroy_context(self->context);
+
+	return NULL;
+}
+
+int init_workers(int nworkers, worker_context_create_t create, worker_context_destroy_t destroy) {
+	int ret;
+
+	cleanup_workers();
+
+	if ((g_workers = calloc(nworkers, sizeof(struct worker))) == NULL)
+		return errno;
+
+	if ((ret = pthread_key_create(&g_self_key, NULL)) != 0) {
+		free(g_workers);
+		g_workers = NULL;
+		return ret;
+	}
+
+	g_create_context = create;
+	g_destroy_context = destroy;
+	g_stopping = 0;
+
+	for (int i = 0; i < nworkers; i++) {
+		pthread_mutex_init(&g_workers[i].lock, NULL);
+		g_workers[i].seed = i;
+	}
+
+	/* deques of all workers must be ready before any thread starts stealing */
+	g_nworkers = nworkers;
+
+	for (int i = 0; i < nworkers; i++) {
+		if ((ret = pthread_create(&g_workers[i].thread, NULL, worker_main, &g_workers[i])) != 0) {
+			g_nworkers = i;
+			cleanup_workers();
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+void cleanup_workers() {
+	if (g_workers == NULL)
+		return;
+
+	pthread_mutex_lock(&g_idle_lock);
+	g_stopping = 1;
+	pthread_cond_broadcast(&g_idle_cond);
+	pthread_mutex_unlock(&g_idle_lock);
+
+	for (int i = 0; i < g_nworkers; i++)
+		pthread_join(g_workers[i].thread, NULL);
+
+	for (int i = 0; i < g_nworkers; i++) {
+		pthread_mutex_destroy(&g_workers[i].lock);
+		free(g_workers[i].tasks);
+	}
+
+	pthread_key_delete(g_self_key);
+
+	free(g_workers);
+	g_workers = NULL;
+	g_nworkers = 0;
+}
+
+void run_task(worker_task_t* task) {
+	if (g_workers == NULL)
+		errx(1, "Worker threads are not running");
+
+	task->done = 0;
+	push_task(&g_workers[0], task);
+
+	pthread_mutex_lock(&g_idle_lock);
+	while (!is_done(task)) {
+		g_noutside++;
+		pthread_cond_wait(&g_outside_cond, &g_idle_lock);
+		g_noutside--;
+	}
+	pthread_mutex_unlock(&g_idle_lock);
+}
+
+void spawn_task(worker_task_t* task) {
+	struct worker* self = pthread_getspecific(g_self_key);
+	if (self == NULL)
+		errx(1, "Tasks may only be spawned from worker threads");
+
+	task->done = 0;
+	push_task(self, task);
+}
+
+void join_task(worker_task_t* task) {
+	struct worker* self = pthread_getspecific(g_self_key);
+
+	while (!is_done(task)) {
+		unsigned long seen = get_events();
+
+		/* if not stolen, the task itself is at the bottom of our deque */
+		worker_task_t* other = find_task(self);
+		if (other != NULL)
+			execute_task(self, other);
+		else
+			wait_event(seen, task);
+	}
+}
+
+#endif
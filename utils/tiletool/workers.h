@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2012 Dmitry Marakasov
+ *
+ * This file is part of tiletool.
+ *
+ * tiletool is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * tiletool is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tiletool.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef WORKERS_H
+#define WORKERS_H
+
+#ifdef HAVE_PTHREAD
+
+/* unit of work for the worker threads; it's meant to be the first
+ * member of a structure with actual task data */
+typedef struct worker_task {
+	/* run in a worker thread, with its private context */
+	void (*run)(struct worker_task* task, void* context);
+
+	int done;
+} worker_task_t;
+
+/* context is created and destroyed by each worker thread */
+typedef void* (*worker_context_create_t)();
+typedef void (*worker_context_destroy_t)(void* context);
+
+/* start given number of worker threads; returns 0 or errno */
+int init_workers(int nworkers, worker_context_create_t create, worker_context_destroy_t destroy);
+
+/* stop threads; all tasks must be complete */
+void cleanup_workers();
+
+/* run a task in worker threads and wait for it to complete; must
+ * not be called from a worker thread */
+void run_task(worker_task_t* task);
+
+/* from a running task: make a subtask available to other workers;
+ * it must be joined before the spawning task completes */
+void spawn_task(worker_task_t* task);
+
+/* from a running task: wait for a spawned task. Tasks are joined in
+ * reverse order of spawning, and joining thread runs other tasks
+ * (most likely the task itself) while waiting */
+void join_task(worker_task_t* task);
+
+#endif
+
+#endif
@@ -0,0 +1,187 @@
+/*
+ * Copyright (C) 2012 Dmitry Marakasov
+ *
+ * This file is part of tiletool.
+ *
+ * tiletool is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * tiletool is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tiletool.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_PTHREAD
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "paths.h"
+#include "tileio.h"
+#include "writeback.h"
+
+struct writeback_job {
+	const char* tileset;
+	int x, y, zoom;
+	char* path;
+	ttip_hash_t hash;
+	ttip_buffer_t png;
+
+	struct writeback_job* next;
+};
+
+static pthread_t* g_threads = NULL;
+static int g_nthreads = 0;
+
+static void (*g_done)(const char*, ttip_hash_t, int) = NULL;
+
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_queued_cond = PTHREAD_COND_INITIALIZER;  /* for writers */
+static pthread_cond_t g_space_cond = PTHREAD_COND_INITIALIZER;   /* for submitters */
+
+static struct writeback_job* g_head = NULL;
+static struct writeback_job* g_tail = NULL;
+static int g_queued = 0;
+static int g_queuelen = 0;
+static int g_stopping = 0;
+
+static writeback_stats_t g_stats;
+
+static void* writer_main(void* arg) {
+	(void)arg; /* unused */
+
+	pthread_mutex_lock(&g_lock);
+	for (;;) {
+		while (g_head == NULL && !g_stopping)
+			pthread_cond_wait(&g_queued_cond, &g_lock);
+
+		struct writeback_job* job = g_head;
+		if (job == NULL)
+			break;
+
+		if ((g_head = job->next) == NULL)
+			g_tail = NULL;
+
+		pthread_mutex_unlock(&g_lock);
+
+		int ret = tileio_write(job->tileset, job->x, job->y, job->zoom, job->png.data, job->png.size);
+
+		g_done(job->path, job->hash, ret);
+
+		free(job->path);
+		ttip_buffer_free(&job->png);
+		free(job);
+
+		pthread_mutex_lock(&g_lock);
+		if (ret == 0)
+			g_stats.written++;
+		else
+			g_stats.failed++;
+
+		/* slot is only freed after the tile is written, so queue
+		 * length also limits tiles in flight */
+		g_queued--;
+		pthread_cond_signal(&g_space_cond);
+	}
+	pthread_mutex_unlock(&g_lock);
+
+	return NULL;
+}
+
+int init_writeback(int queuelen, int nthreads, void (*done)(const char* path, ttip_hash_t hash, int error)) {
+	int ret;
+
+	cleanup_writeback();
+
+	if ((g_threads = malloc(nthreads * sizeof(pthread_t))) == NULL)
+		return errno;
+
+	g_queuelen = queuelen;
+	g_done = done;
+	g_stopping = 0;
+	memset(&g_stats, 0, sizeof(g_stats));
+
+	for (g_nthreads = 0; g_nthreads < nthreads; g_nthreads++) {
+		if ((ret = pthread_create(&g_threads[g_nthreads], NULL, writer_main, NULL)) != 0) {
+			cleanup_writeback();
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+void cleanup_writeback() {
+	pthread_mutex_lock(&g_lock);
+	g_stopping = 1;
+	pthread_cond_broadcast(&g_queued_cond);
+	pthread_mutex_unlock(&g_lock);
+
+	/* writers exit when queue is drained */
+	for (int i = 0; i < g_nthreads; i++)
+		pthread_join(g_threads[i], NULL);
+	free(g_threads);
+	g_threads = NULL;
+	g_nthreads = 0;
+}
+
+int writeback_submit(const char* tileset, int x, int y, int zoom, ttip_hash_t hash, ttip_buffer_t* buffer) {
+	char path[FILENAME_MAX];
+	if (get_tile_path_r(path, sizeof(path), tileset, x, y, zoom, ".png") == NULL)
+		return ENAMETOOLONG;
+
+	struct writeback_job* job = malloc(sizeof(struct writeback_job));
+	if (job == NULL)
+		return errno;
+
+	if ((job->path = malloc(strlen(path) + 1)) == NULL) {
+		free(job);
+		return errno;
+	}
+
+	strcpy(job->path, path);
+	job->tileset = tileset;
+	job->x = x;
+	job->y = y;
+	job->zoom = zoom;
+	job->hash = hash;
+	job->png = *buffer;
+	job->next = NULL;
+	ttip_buffer_init(buffer);
+
+	pthread_mutex_lock(&g_lock);
+	if (g_queued >= g_queuelen) {
+		g_stats.waited++;
+		while (g_queued >= g_queuelen)
+			pthread_cond_wait(&g_space_cond, &g_lock);
+	}
+
+	if (g_tail != NULL)
+		g_tail->next = job;
+	else
+		g_head = job;
+	g_tail = job;
+
+	g_queued++;
+	pthread_cond_signal(&g_queued_cond);
+	pthread_mutex_unlock(&g_lock);
+
+	return 0;
+}
+
+void writeback_getstats(writeback_stats_t* stats) {
+	pthread_mutex_lock(&g_lock);
+	*stats = g_stats;
+	pthread_mutex_unlock(&g_lock);
+}
+
+#endif
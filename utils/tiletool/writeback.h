@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2012 Dmitry Marakasov
+ *
+ * This file is part of tiletool.
+ *
+ * tiletool is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * tiletool is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tiletool.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef WRITEBACK_H
+#define WRITEBACK_H
+
+#ifdef HAVE_PTHREAD
+
+#include <ttip.h>
+
+/* Encoded tiles are written to disk by dedicated writer threads, so
+ * traversal and encoding overlap with filesystem work. Queue holds at
+ * most given number of tiles; submitting blocks while it's full */
+
+typedef struct {
+	unsigned long written;
+	unsigned long failed;
+	unsigned long waited;     /* submits which had to wait for free space */
+} writeback_stats_t;
+
+/* done is called from writer thread after each tile, with 0 or errno */
+int init_writeback(int queuelen, int nthreads, void (*done)(const char* path, ttip_hash_t hash, int error));
+
+/* write all queued tiles and stop writer threads */
+void cleanup_writeback();
+
+/* queue png data for writing as a tile of given tileset; buffer
+ * contents are taken over, and buffer is left empty; returns 0 or errno */
+int writeback_submit(const char* tileset, int x, int y, int zoom, ttip_hash_t hash, ttip_buffer_t* buffer);
+
+void writeback_getstats(writeback_stats_t* stats);
+
+#endif
+
+#endif